@@ -0,0 +1,798 @@
+/*
+ * loopbench: file system workload driver for comparing the loopback file
+ * systems with each other and with the backing store they mirror.
+ *
+ * Runs a fixed matrix of workloads in a directory and prints throughput
+ * and latency percentiles for each of them. With -o, the results are also
+ * written to a file, which a later run can compare against with -B, e.g.
+ * a run on the mount point against a run on the backing directory.
+ *
+ * See run.sh for driving all loopback variants.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <mach/mach_time.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#define XATTR_NAME "org.macfuse.loopbench"
+#define MAX_RESULTS 64
+#define MAX_SAMPLES (16 * 1024 * 1024)
+
+struct samples {
+    uint64_t *ns;
+    size_t count;
+    size_t capacity;
+};
+
+struct result {
+    char name[32];
+    uint64_t ops;
+    uint64_t bytes;
+    uint64_t elapsed_ns;
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+};
+
+struct baseline {
+    char name[32];
+    double ops_per_sec;
+};
+
+struct bench;
+
+struct worker {
+    struct bench *bench;
+    unsigned int id;
+    pthread_t thread;
+    struct samples lat;
+    uint64_t ops;
+    uint64_t bytes;
+    int error;
+    uint64_t seed;
+};
+
+struct bench {
+    const char *name;
+    void (*run)(struct worker *w);
+    unsigned int nthreads;
+    size_t bs;
+    bool write;
+    const char *subdir;
+};
+
+static struct {
+    const char *dir;
+    uint64_t file_size;
+    uint32_t files;
+    double duration;
+    unsigned int threads;
+    bool cache;
+    const char *filter;
+    uint64_t deadline;
+    pthread_mutex_t gate_lock;
+    pthread_cond_t gate_cond;
+    unsigned int gate_waiting;  // Workers that reached the start gate
+    bool gate_open;
+    char *zeros;
+    struct result results[MAX_RESULTS];
+    unsigned int nresults;
+    struct baseline baselines[MAX_RESULTS];
+    unsigned int nbaselines;
+    mach_timebase_info_data_t timebase;
+} opts;
+
+static inline uint64_t
+now_ns(void)
+{
+    return mach_absolute_time() * opts.timebase.numer / opts.timebase.denom;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+            "usage: loopbench [options] directory\n"
+            "\n"
+            "    -s MB       size of the data file (default: 256)\n"
+            "    -n files    number of files for the metadata tests "
+            "(default: 10000)\n"
+            "    -d seconds  duration of the timed tests (default: 5)\n"
+            "    -j threads  clients of the parallel tests (default: 8)\n"
+            "    -c          allow the unified buffer cache to serve I/O\n"
+            "    -t pattern  run only the tests whose name contains pattern\n"
+            "    -o file     write the results to file\n"
+            "    -B file     compare against results written with -o\n");
+    exit(2);
+}
+
+static inline uint64_t
+next_random(struct worker *w)
+{
+    // xorshift64*
+    w->seed ^= w->seed >> 12;
+    w->seed ^= w->seed << 25;
+    w->seed ^= w->seed >> 27;
+    return w->seed * 2685821657736338717ULL;
+}
+
+static void
+sample(struct worker *w, uint64_t start)
+{
+    struct samples *s = &w->lat;
+    
+    if (s->count == s->capacity) {
+        size_t capacity = s->capacity ? s->capacity * 2 : 65536;
+        uint64_t *ns;
+        
+        if (capacity > MAX_SAMPLES) {
+            return;
+        }
+        ns = realloc(s->ns, capacity * sizeof(uint64_t));
+        if (ns == NULL) {
+            return;
+        }
+        s->ns = ns;
+        s->capacity = capacity;
+    }
+    s->ns[s->count++] = now_ns() - start;
+}
+
+static void
+fail(struct worker *w, const char *what, const char *path)
+{
+    if (w->error == 0) {
+        w->error = errno;
+        fprintf(stderr, "loopbench: %s: %s %s: %s\n", w->bench->name, what,
+                path, strerror(errno));
+    }
+}
+
+/*
+ * Waits until all workers of the test are set up. Workers that fail to set
+ * up still have to come here, or the others would wait forever. macOS has no
+ * POSIX barriers, so the start gate is a counter under a mutex.
+ */
+static bool
+ready(struct worker *w)
+{
+    pthread_mutex_lock(&opts.gate_lock);
+    opts.gate_waiting++;
+    pthread_cond_broadcast(&opts.gate_cond);
+    while (!opts.gate_open) {
+        pthread_cond_wait(&opts.gate_cond, &opts.gate_lock);
+    }
+    pthread_mutex_unlock(&opts.gate_lock);
+    return w->error == 0;
+}
+
+static inline bool
+running(void)
+{
+    return now_ns() < opts.deadline;
+}
+
+static void
+data_path(char *buf)
+{
+    snprintf(buf, MAXPATHLEN, "%s/loopbench.data", opts.dir);
+}
+
+static void
+files_path(char *buf, const struct worker *w, unsigned int i)
+{
+    snprintf(buf, MAXPATHLEN, "%s/loopbench.%s/t%u/f%u", opts.dir,
+             w->bench->subdir, w->id, i);
+}
+
+static int
+open_data(struct worker *w, int flags)
+{
+    char path[MAXPATHLEN];
+    int fd;
+    
+    data_path(path);
+    fd = open(path, flags, 0644);
+    if (fd == -1) {
+        fail(w, "open", path);
+        return -1;
+    }
+    if (!opts.cache) {
+        fcntl(fd, F_NOCACHE, 1);
+    }
+    return fd;
+}
+
+/*
+ * Workloads
+ */
+
+static void
+run_seq(struct worker *w)
+{
+    size_t bs = w->bench->bs;
+    char *buf = NULL;
+    uint64_t offset;
+    int fd;
+    
+    if (!w->bench->write && posix_memalign((void **)&buf, 4096, bs) != 0) {
+        fail(w, "allocate", "buffer");
+        ready(w);
+        return;
+    }
+    
+    fd = open_data(w, w->bench->write ? O_WRONLY | O_CREAT | O_TRUNC :
+                   O_RDONLY);
+    if (!ready(w)) {
+        close(fd);
+        free(buf);
+        return;
+    }
+    
+    for (offset = 0; offset < opts.file_size; offset += bs) {
+        uint64_t start = now_ns();
+        ssize_t res;
+        
+        if (w->bench->write) {
+            res = write(fd, opts.zeros, bs);
+        } else {
+            res = read(fd, buf, bs);
+        }
+        if (res <= 0) {
+            if (res == -1) {
+                fail(w, w->bench->write ? "write" : "read", "data file");
+            }
+            break;
+        }
+        sample(w, start);
+        w->ops++;
+        w->bytes += res;
+    }
+    
+    if (w->bench->write && fsync(fd) == -1) {
+        fail(w, "fsync", "data file");
+    }
+    
+    close(fd);
+    free(buf);
+}
+
+static void
+run_random(struct worker *w)
+{
+    size_t bs = w->bench->bs;
+    uint64_t blocks = opts.file_size / bs;
+    char *buf = NULL;
+    int fd;
+    
+    if (posix_memalign((void **)&buf, 4096, bs) != 0) {
+        fail(w, "allocate", "buffer");
+        ready(w);
+        return;
+    }
+    
+    fd = open_data(w, w->bench->write ? O_WRONLY : O_RDONLY);
+    if (!ready(w) || blocks == 0) {
+        close(fd);
+        free(buf);
+        return;
+    }
+    
+    while (running()) {
+        off_t offset = (off_t)(next_random(w) % blocks * bs);
+        uint64_t start = now_ns();
+        ssize_t res;
+        
+        if (w->bench->write) {
+            res = pwrite(fd, opts.zeros, bs, offset);
+        } else {
+            res = pread(fd, buf, bs, offset);
+        }
+        if (res == -1) {
+            fail(w, w->bench->write ? "pwrite" : "pread", "data file");
+            break;
+        }
+        sample(w, start);
+        w->ops++;
+        w->bytes += res;
+    }
+    
+    close(fd);
+    free(buf);
+}
+
+static unsigned int
+worker_files(const struct worker *w)
+{
+    unsigned int n = opts.files / w->bench->nthreads;
+    
+    return n > 0 ? n : 1;
+}
+
+static void
+run_create(struct worker *w)
+{
+    char path[MAXPATHLEN];
+    unsigned int i;
+    
+    snprintf(path, sizeof(path), "%s/loopbench.%s", opts.dir, w->bench->subdir);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/loopbench.%s/t%u", opts.dir,
+             w->bench->subdir, w->id);
+    if (mkdir(path, 0755) == -1 && errno != EEXIST) {
+        fail(w, "mkdir", path);
+    }
+    
+    if (!ready(w)) {
+        return;
+    }
+    
+    for (i = 0; i < worker_files(w); i++) {
+        uint64_t start = now_ns();
+        int fd;
+        
+        files_path(path, w, i);
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            fail(w, "create", path);
+            break;
+        }
+        close(fd);
+        sample(w, start);
+        w->ops++;
+    }
+}
+
+static void
+run_stat(struct worker *w)
+{
+    char path[MAXPATHLEN];
+    struct stat st;
+    
+    if (!ready(w)) {
+        return;
+    }
+    
+    while (running()) {
+        uint64_t start;
+        
+        files_path(path, w, (unsigned int)(next_random(w) % worker_files(w)));
+        start = now_ns();
+        if (lstat(path, &st) == -1) {
+            fail(w, "lstat", path);
+            break;
+        }
+        sample(w, start);
+        w->ops++;
+    }
+}
+
+static void
+run_readdir(struct worker *w)
+{
+    char path[MAXPATHLEN];
+    
+    snprintf(path, sizeof(path), "%s/loopbench.%s/t%u", opts.dir,
+             w->bench->subdir, w->id);
+    
+    if (!ready(w)) {
+        return;
+    }
+    
+    while (running()) {
+        uint64_t start = now_ns();
+        struct dirent *entry;
+        struct stat st;
+        DIR *dp;
+        int dfd;
+        
+        // Like ls -l: list, then stat every entry
+        dp = opendir(path);
+        if (dp == NULL) {
+            fail(w, "opendir", path);
+            break;
+        }
+        dfd = dirfd(dp);
+        while ((entry = readdir(dp)) != NULL) {
+            fstatat(dfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW);
+        }
+        closedir(dp);
+        sample(w, start);
+        w->ops++;
+    }
+}
+
+static void
+run_unlink(struct worker *w)
+{
+    char path[MAXPATHLEN];
+    unsigned int i;
+    
+    if (!ready(w)) {
+        return;
+    }
+    
+    for (i = 0; i < worker_files(w); i++) {
+        uint64_t start = now_ns();
+        
+        files_path(path, w, i);
+        if (unlink(path) == -1) {
+            fail(w, "unlink", path);
+            break;
+        }
+        sample(w, start);
+        w->ops++;
+    }
+    
+    snprintf(path, sizeof(path), "%s/loopbench.%s/t%u", opts.dir,
+             w->bench->subdir, w->id);
+    rmdir(path);
+}
+
+static void
+run_xattr(struct worker *w)
+{
+    char path[MAXPATHLEN];
+    char list[1024];
+    char value[256];
+    unsigned int i = 0;
+    
+    snprintf(path, sizeof(path), "%s/loopbench.xattr.%u", opts.dir, w->id);
+    close(open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    
+    if (!ready(w)) {
+        return;
+    }
+    
+    // set, get, list, remove, in turns
+    while (running()) {
+        uint64_t start = now_ns();
+        ssize_t res = 0;
+        
+        switch (i++ % 4) {
+            case 0:
+                res = setxattr(path, XATTR_NAME, opts.zeros, sizeof(value),
+                               0, 0);
+                break;
+            case 1:
+                res = getxattr(path, XATTR_NAME, value, sizeof(value), 0, 0);
+                break;
+            case 2:
+                res = listxattr(path, list, sizeof(list), 0);
+                break;
+            case 3:
+                res = removexattr(path, XATTR_NAME, 0);
+                break;
+        }
+        if (res == -1) {
+            fail(w, "xattr", path);
+            break;
+        }
+        sample(w, start);
+        w->ops++;
+    }
+    
+    unlink(path);
+}
+
+/*
+ * Later tests depend on earlier ones: the read tests read the data file
+ * the write tests wrote, and the metadata tests work on the files of the
+ * create test in the same subdirectory. Parallel tests have a -jN suffix.
+ */
+static struct bench benches[] = {
+    { "seqwrite-4k", run_seq, 1, 4096, true, NULL },
+    { "seqwrite-64k", run_seq, 1, 65536, true, NULL },
+    { "seqwrite-1m", run_seq, 1, 1048576, true, NULL },
+    { "seqread-4k", run_seq, 1, 4096, false, NULL },
+    { "seqread-64k", run_seq, 1, 65536, false, NULL },
+    { "seqread-1m", run_seq, 1, 1048576, false, NULL },
+    { "randread-4k", run_random, 1, 4096, false, NULL },
+    { "randread-64k", run_random, 1, 65536, false, NULL },
+    { "randwrite-4k", run_random, 1, 4096, true, NULL },
+    { "randwrite-64k", run_random, 1, 65536, true, NULL },
+    { "create", run_create, 1, 0, false, "files" },
+    { "stat", run_stat, 1, 0, false, "files" },
+    { "readdir", run_readdir, 1, 0, false, "files" },
+    { "unlink", run_unlink, 1, 0, false, "files" },
+    { "xattr", run_xattr, 1, 0, false, NULL },
+    { "randread-4k", run_random, 0, 4096, false, NULL },
+    { "randwrite-4k", run_random, 0, 4096, true, NULL },
+    { "create", run_create, 0, 0, false, "pfiles" },
+    { "stat", run_stat, 0, 0, false, "pfiles" },
+    { "unlink", run_unlink, 0, 0, false, "pfiles" },
+    { "xattr", run_xattr, 0, 0, false, NULL },
+};
+
+/*
+ * Driver
+ */
+
+static void *
+worker_main(void *arg)
+{
+    struct worker *w = arg;
+    
+    w->bench->run(w);
+    return NULL;
+}
+
+static int
+compare_ns(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    
+    return x < y ? -1 : x > y;
+}
+
+static int
+run_bench(struct bench *bench, const char *name)
+{
+    struct result *r = &opts.results[opts.nresults];
+    struct samples all = { NULL, 0, 0 };
+    struct worker *workers;
+    unsigned int i;
+    uint64_t start;
+    int error = 0;
+    
+    workers = calloc(bench->nthreads, sizeof(struct worker));
+    if (workers == NULL) {
+        fprintf(stderr, "loopbench: cannot start %s\n", name);
+        free(workers);
+        return -1;
+    }
+    
+    opts.gate_waiting = 0;
+    opts.gate_open = false;
+    
+    for (i = 0; i < bench->nthreads; i++) {
+        workers[i].bench = bench;
+        workers[i].id = i;
+        workers[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+        if (pthread_create(&workers[i].thread, NULL, worker_main,
+                           &workers[i]) != 0) {
+            fprintf(stderr, "loopbench: cannot start %s\n", name);
+            exit(1);
+        }
+    }
+    
+    // The deadline is set before the workers are let through
+    pthread_mutex_lock(&opts.gate_lock);
+    while (opts.gate_waiting < bench->nthreads) {
+        pthread_cond_wait(&opts.gate_cond, &opts.gate_lock);
+    }
+    start = now_ns();
+    opts.deadline = start + (uint64_t)(opts.duration * 1e9);
+    opts.gate_open = true;
+    pthread_cond_broadcast(&opts.gate_cond);
+    pthread_mutex_unlock(&opts.gate_lock);
+    
+    for (i = 0; i < bench->nthreads; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    
+    memset(r, 0, sizeof(struct result));
+    strlcpy(r->name, name, sizeof(r->name));
+    r->elapsed_ns = now_ns() - start;
+    
+    for (i = 0; i < bench->nthreads; i++) {
+        struct worker *w = &workers[i];
+        uint64_t *ns;
+        
+        r->ops += w->ops;
+        r->bytes += w->bytes;
+        if (w->error != 0) {
+            error = w->error;
+        }
+        
+        ns = realloc(all.ns, (all.count + w->lat.count) * sizeof(uint64_t));
+        if (ns != NULL && w->lat.count > 0) {
+            all.ns = ns;
+            memcpy(all.ns + all.count, w->lat.ns,
+                   w->lat.count * sizeof(uint64_t));
+            all.count += w->lat.count;
+        }
+        free(w->lat.ns);
+    }
+    
+    if (all.count > 0) {
+        qsort(all.ns, all.count, sizeof(uint64_t), compare_ns);
+        r->p50_ns = all.ns[all.count / 2];
+        r->p99_ns = all.ns[all.count * 99 / 100];
+    }
+    
+    free(all.ns);
+    free(workers);
+    
+    opts.nresults++;
+    return error ? -1 : 0;
+}
+
+static int
+load_baseline(const char *file)
+{
+    char line[256];
+    FILE *in;
+    
+    in = fopen(file, "r");
+    if (in == NULL) {
+        fprintf(stderr, "loopbench: %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+    
+    while (opts.nbaselines < MAX_RESULTS && fgets(line, sizeof(line), in)) {
+        struct baseline *b = &opts.baselines[opts.nbaselines];
+        
+        if (sscanf(line, "%31s %lf", b->name, &b->ops_per_sec) == 2) {
+            opts.nbaselines++;
+        }
+    }
+    
+    fclose(in);
+    return 0;
+}
+
+static const struct baseline *
+find_baseline(const char *name)
+{
+    unsigned int i;
+    
+    for (i = 0; i < opts.nbaselines; i++) {
+        if (strcmp(opts.baselines[i].name, name) == 0) {
+            return &opts.baselines[i];
+        }
+    }
+    return NULL;
+}
+
+static void
+report(FILE *out, bool table)
+{
+    unsigned int i;
+    
+    if (table) {
+        fprintf(out, "%-18s %10s %12s %10s %10s %10s %9s\n", "test", "ops",
+                "ops/s", "MB/s", "p50_us", "p99_us", "slowdown");
+    }
+    
+    for (i = 0; i < opts.nresults; i++) {
+        const struct result *r = &opts.results[i];
+        double secs = r->elapsed_ns / 1e9;
+        double ops_per_sec = secs > 0 ? r->ops / secs : 0;
+        double mb_per_sec = secs > 0 ? r->bytes / secs / 1048576 : 0;
+        const struct baseline *b;
+        
+        if (!table) {
+            fprintf(out, "%s\t%.1f\t%.2f\t%.1f\t%.1f\n", r->name, ops_per_sec,
+                    mb_per_sec, r->p50_ns / 1000.0, r->p99_ns / 1000.0);
+            continue;
+        }
+        
+        fprintf(out, "%-18s %10llu %12.1f %10.2f %10.1f %10.1f", r->name,
+                (unsigned long long)r->ops, ops_per_sec, mb_per_sec,
+                r->p50_ns / 1000.0, r->p99_ns / 1000.0);
+        
+        // How many times slower than the baseline
+        b = find_baseline(r->name);
+        if (b != NULL && ops_per_sec > 0) {
+            fprintf(out, " %8.2fx", b->ops_per_sec / ops_per_sec);
+        }
+        fprintf(out, "\n");
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *output = NULL;
+    char path[MAXPATHLEN];
+    unsigned int i;
+    int failed = 0;
+    int ch;
+    
+    opts.file_size = 256;
+    opts.files = 10000;
+    opts.duration = 5;
+    opts.threads = 8;
+    
+    while ((ch = getopt(argc, argv, "s:n:d:j:ct:o:B:")) != -1) {
+        switch (ch) {
+            case 's':
+                opts.file_size = strtoull(optarg, NULL, 10);
+                break;
+            case 'n':
+                opts.files = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+            case 'd':
+                opts.duration = strtod(optarg, NULL);
+                break;
+            case 'j':
+                opts.threads = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                opts.cache = true;
+                break;
+            case 't':
+                opts.filter = optarg;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'B':
+                if (load_baseline(optarg) == -1) {
+                    return 1;
+                }
+                break;
+            default:
+                usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    
+    if (argc != 1 || opts.file_size == 0 || opts.files == 0 ||
+        opts.duration <= 0 || opts.threads == 0) {
+        usage();
+    }
+    
+    opts.dir = argv[0];
+    opts.file_size *= 1048576;
+    mach_timebase_info(&opts.timebase);
+    pthread_mutex_init(&opts.gate_lock, NULL);
+    pthread_cond_init(&opts.gate_cond, NULL);
+    
+    opts.zeros = calloc(1, 1048576);
+    if (opts.zeros == NULL) {
+        fprintf(stderr, "loopbench: out of memory\n");
+        return 1;
+    }
+    
+    for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        struct bench *bench = &benches[i];
+        char name[32];
+        
+        if (bench->nthreads == 0) {
+            bench->nthreads = opts.threads;
+            snprintf(name, sizeof(name), "%s-j%u", bench->name, opts.threads);
+        } else {
+            strlcpy(name, bench->name, sizeof(name));
+        }
+        
+        if (opts.filter != NULL && strstr(name, opts.filter) == NULL) {
+            continue;
+        }
+        
+        if (run_bench(bench, name) == -1) {
+            failed = 1;
+        }
+    }
+    
+    report(stdout, true);
+    
+    if (output != NULL) {
+        FILE *out = fopen(output, "w");
+        
+        if (out == NULL) {
+            fprintf(stderr, "loopbench: %s: %s\n", output, strerror(errno));
+            return 1;
+        }
+        report(out, false);
+        fclose(out);
+    }
+    
+    data_path(path);
+    unlink(path);
+    
+    return failed;
+}
@@ -0,0 +1,149 @@
+#!/bin/sh
+#
+# Runs loopbench on the backing store and on every loopback variant and
+# prints how much slower each variant is than the backing store.
+#
+# usage: run.sh [-v "raw c objc swift"] [-o options] [-k] directory [-- loopbench options]
+#
+#   -v variants  variants to run, in order (default: raw c objc swift)
+#   -o options   extra mount options for the C loopback, e.g. -o threads=8
+#   -k           keep the build and results directory
+#
+# Every variant runs in its own subdirectory of directory, which should be
+# on the volume to be measured. The mount points are created in /tmp. The
+# variants are built with xcodebuild unless LOOPBACK_C, LOOPBACK_OBJC or
+# LOOPBACK_SWIFT point to an existing loopback binary or LoopbackFS.app.
+#
+# Results of each variant are written to $BENCH_OUT/<variant>.tsv, which
+# defaults to a new temporary directory. raw always runs first when
+# selected, the other variants are compared against it.
+
+set -e
+
+variants="raw c objc swift"
+c_options=""
+keep=0
+
+while getopts "v:o:k" ch; do
+    case "$ch" in
+        v) variants="$OPTARG" ;;
+        o) c_options="$c_options -o$OPTARG" ;;
+        k) keep=1 ;;
+        *) sed -n '6,10s/^# \{0,1\}//p' "$0" >&2; exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -lt 1 ]; then
+    sed -n '6,10s/^# \{0,1\}//p' "$0" >&2
+    exit 2
+fi
+
+directory="$1"
+shift
+if [ "$1" = "--" ]; then
+    shift
+fi
+
+benchmarks="$(cd "$(dirname "$0")" && pwd)"
+repo="$(dirname "$benchmarks")"
+out="${BENCH_OUT:-$(mktemp -d /tmp/loopbench.XXXXXX)}"
+mkdir -p "$out"
+
+cc -O2 -Wall -o "$out/loopbench" "$benchmarks/loopbench.c"
+
+build() {
+    project="$1"
+    target="$2"
+    xcodebuild -quiet -project "$repo/$project" -target "$target" \
+        -configuration Release SYMROOT="$out/build/$target-$3" >&2
+    echo "$out/build/$target-$3/Release"
+}
+
+wait_mounted() {
+    i=0
+    while ! mount | grep -q " on $1 (macfuse"; do
+        i=$((i + 1))
+        if [ $i -gt 100 ]; then
+            echo "run.sh: $1 did not mount" >&2
+            return 1
+        fi
+        sleep 0.1
+    done
+}
+
+wait_unmounted() {
+    i=0
+    while mount | grep -q " on $1 (macfuse"; do
+        i=$((i + 1))
+        if [ $i -gt 100 ]; then
+            echo "run.sh: $1 did not unmount" >&2
+            return 1
+        fi
+        sleep 0.1
+    done
+}
+
+# Mounts variant $1 of $2 at $3
+mount_variant() {
+    case "$1" in
+        c)
+            binary="${LOOPBACK_C:-$(build LoopbackFS-C/loopback.xcodeproj loopback c)/loopback}"
+            # shellcheck disable=SC2086
+            "$binary" "$3" -oroot="$2" -ovolname=loopbench-c $c_options
+            ;;
+        objc|swift)
+            if [ "$1" = objc ]; then
+                app="${LOOPBACK_OBJC:-$(build LoopbackFS-ObjC/LoopbackFS.xcodeproj LoopbackFS objc)/LoopbackFS.app}"
+            else
+                app="${LOOPBACK_SWIFT:-$(build LoopbackFS-Swift/LoopbackFS.xcodeproj LoopbackFS swift)/LoopbackFS.app}"
+            fi
+            open -n -g "$app" --args -rootPath "$2" -mountPath "$3"
+            ;;
+        *)
+            echo "run.sh: unknown variant $1" >&2
+            return 1
+            ;;
+    esac
+    wait_mounted "$3"
+}
+
+baseline=""
+
+for variant in $variants; do
+    root="$directory/loopbench-$variant"
+    rm -rf "$root"
+    mkdir -p "$root"
+
+    echo "== $variant"
+
+    if [ "$variant" = raw ]; then
+        "$out/loopbench" -o "$out/raw.tsv" "$@" "$root"
+        baseline="-B $out/raw.tsv"
+    else
+        mountpoint="/tmp/loopbench-$variant.mnt"
+        mkdir -p "$mountpoint"
+        mount_variant "$variant" "$root" "$mountpoint"
+
+        status=""
+        # shellcheck disable=SC2086
+        "$out/loopbench" -o "$out/$variant.tsv" $baseline "$@" "$mountpoint" ||
+            status=$?
+
+        umount "$mountpoint"
+        wait_unmounted "$mountpoint"
+        rmdir "$mountpoint"
+
+        if [ -n "$status" ]; then
+            exit "$status"
+        fi
+    fi
+
+    rm -rf "$root"
+done
+
+if [ $keep -eq 0 ] && [ -z "$BENCH_OUT" ]; then
+    rm -rf "$out"
+else
+    echo "Results are in $out"
+fi
@@ -22,23 +22,38 @@
 
 #define _GNU_SOURCE
 
+#include <CoreFoundation/CoreFoundation.h>
+#include <CoreServices/CoreServices.h>
+#include <copyfile.h>
 #include <dirent.h>
+#include <dispatch/dispatch.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <fuse.h>
+#include <limits.h>
+#include <mach/mach_time.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/attr.h>
+#include <sys/clonefile.h>
+#include <sys/mman.h>
 #include <sys/mount.h>
 #include <sys/param.h>
+#include <sys/resource.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/vnode.h>
 #include <sys/xattr.h>
 #include <unistd.h>
 
+#include "loopback_trace.h"
+
 #if defined(_POSIX_C_SOURCE)
 typedef unsigned char  u_char;
 typedef unsigned short u_short;
@@ -53,927 +68,11174 @@ typedef unsigned long  u_long;
 #define XATTR_APPLE_PREFIX             "com.apple."
 
 struct loopback {
+    char *root;
+    size_t root_len;
+    int root_fd;
+    char *lower;
+    uint32_t dirfd_cache;
     uint32_t blocksize;
     bool case_insensitive;
+    uint32_t attr_cache;
+    uint32_t attr_ttl;
+    uint32_t neg_cache;
+    uint32_t neg_ttl;
+    bool readdir_bulk;
+    uint32_t dir_cache;
+    uint32_t fd_cache;
+    uint32_t readahead;
+    uint32_t readahead_pool;
+    uint32_t block_cache;
+    uint32_t writeback;
+    uint32_t writeback_ms;
+    bool nocache;
+    uint32_t nocache_size;
+    char *nocache_match;
+    uint32_t blksize_large;
+    uint32_t blksize_threshold;
+    char *blksize_match;
+    bool clone;
+    char *fsync;
+    uint32_t fsync_group;
+    uint32_t xattr_cache;
+    uint32_t statfs_ttl;
+    uint32_t threads;
+    uint32_t data_threads;
+    uint32_t sync_threads;
+    bool stats;
+    char *trace;
+    uint32_t trace_buffer;
+    bool autotune;
+    char *warm_index;
+    bool watch;
+    uint32_t watch_latency;
 };
 
 static struct loopback loopback;
 
-static int
-loopback_getattr(const char *path, struct stat *stbuf)
+static mach_timebase_info_data_t loopback_timebase;
+
+// Monotonic time in nanoseconds
+static inline uint64_t
+loopback_now(void)
 {
-    int res;
-    
-    res = lstat(path, stbuf);
+    return mach_absolute_time() * loopback_timebase.numer /
+           loopback_timebase.denom;
+}
+
+/*
+ * On file systems with coarse timestamps, an object can change twice within
+ * the same tick. Caches that tell changes by timestamps do not keep what they
+ * read from objects modified less than LOOPBACK_RACY_SECONDS ago.
+ */
+#define LOOPBACK_RACY_SECONDS 2
+
+static inline bool
+loopback_racy(const struct timespec *ts)
+{
+    struct timeval now;
     
-    /*
-     * The optimal I/O size can be set on a per-file basis. Setting st_blksize
-     * to zero will cause the kernel extension to fall back on the global I/O
-     * size which can be specified at mount-time (option iosize).
-     */
-    stbuf->st_blksize = 0;
+    gettimeofday(&now, NULL);
+    return now.tv_sec - ts->tv_sec < LOOPBACK_RACY_SECONDS;
+}
+
+static uint64_t
+loopback_hash_n(const char *path, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
     
-    if (res == -1) {
-        return -errno;
+    while (len-- > 0) {
+        hash ^= (unsigned char)*path++;
+        hash *= 0x100000001b3ULL;
     }
-    
-    return 0;
+    return hash;
 }
 
-static int
-loopback_fgetattr(const char *path, struct stat *stbuf,
-                  struct fuse_file_info *fi)
+static inline uint64_t
+loopback_hash(const char *path)
 {
-    int res;
+    return loopback_hash_n(path, strlen(path));
+}
+
+// Length of the parent directory part of path, "/" for top-level entries
+static inline size_t
+loopback_parent_len(const char *path)
+{
+    const char *slash = strrchr(path, '/');
     
-    (void)path;
+    if (slash == NULL) {
+        return 0;
+    }
+    if (slash == path) {
+        return 1;
+    }
+    return slash - path;
+}
+
+/*
+ * Backing root
+ *
+ * All operations are performed relative to a descriptor for the backing root
+ * (mount option root=PATH, "/" by default) with the *at() variants of the
+ * system calls, so paths are never concatenated.
+ *
+ * With the dirfd_cache=N mount option, descriptors for up to N parent
+ * directories are kept open as well. An operation in such a directory then
+ * only has to resolve the last path component. Cached descriptors follow
+ * their directory when it is renamed, so rename and rmdir drop the
+ * descriptors for the affected tree. Renames made directly on the backing
+ * store are not noticed; do not use the cache if the tree is modified
+ * behind the mount's back.
+ */
+
+#define DIRFD_CACHE_SHARDS 16
+
+struct dirfd_entry {
+    struct dirfd_entry *hash_next;
+    struct dirfd_entry *lru_prev;
+    struct dirfd_entry *lru_next;
+    uint64_t hash;
+    int fd;
+    int refs;
+    size_t len;
+    char path[];
+};
+
+struct dirfd_shard {
+    pthread_mutex_t lock;
+    struct dirfd_entry **table;
+    size_t mask;
+    struct dirfd_entry lru;
+    size_t count;
+    size_t max;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+static struct {
+    bool enabled;
+    uint64_t epoch;
+    struct dirfd_shard shards[DIRFD_CACHE_SHARDS];
+} dirfd_cache;
+
+struct loopback_at {
+    int dirfd;
+    const char *name;
+    struct dirfd_entry *ref;
+};
+
+static void
+dirfd_cache_init(uint32_t entries)
+{
+    size_t per_shard;
+    size_t nbuckets = 1;
+    int i;
     
-    res = fstat(fi->fh, stbuf);
+    if (entries == 0) {
+        return;
+    }
     
-    // Fall back to global I/O size. See loopback_getattr().
-    stbuf->st_blksize = 0;
+    per_shard = (entries + DIRFD_CACHE_SHARDS - 1) / DIRFD_CACHE_SHARDS;
+    while (nbuckets < per_shard) {
+        nbuckets <<= 1;
+    }
     
-    if (res == -1) {
-        return -errno;
+    for (i = 0; i < DIRFD_CACHE_SHARDS; i++) {
+        struct dirfd_shard *shard = &dirfd_cache.shards[i];
+        
+        shard->table = calloc(nbuckets, sizeof(struct dirfd_entry *));
+        if (shard->table == NULL) {
+            fprintf(stderr, "loopback: cannot allocate dirfd cache\n");
+            exit(1);
+        }
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->mask = nbuckets - 1;
+        shard->lru.lru_prev = &shard->lru;
+        shard->lru.lru_next = &shard->lru;
+        shard->max = per_shard;
     }
     
-    return 0;
+    dirfd_cache.enabled = true;
 }
 
-static int
-loopback_readlink(const char *path, char *buf, size_t size)
+static inline struct dirfd_shard *
+dirfd_cache_shard(uint64_t hash)
 {
-    int res;
+    return &dirfd_cache.shards[hash % DIRFD_CACHE_SHARDS];
+}
+
+// Must be called with the shard lock held
+static void
+dirfd_entry_release_locked(struct dirfd_entry *e)
+{
+    if (--e->refs == 0) {
+        close(e->fd);
+        free(e);
+    }
+}
+
+// Must be called with the shard lock held
+static void
+dirfd_entry_remove_locked(struct dirfd_shard *shard, struct dirfd_entry *e)
+{
+    struct dirfd_entry **pp = &shard->table[e->hash & shard->mask];
     
-    res = readlink(path, buf, size - 1);
-    if (res == -1) {
-        return -errno;
+    while (*pp != e) {
+        pp = &(*pp)->hash_next;
     }
+    *pp = e->hash_next;
     
-    buf[res] = '\0';
+    e->lru_prev->lru_next = e->lru_next;
+    e->lru_next->lru_prev = e->lru_prev;
+    shard->count--;
     
-    return 0;
+    dirfd_entry_release_locked(e);
 }
 
-struct loopback_dirp {
-    DIR *dp;
-    struct dirent *entry;
-    off_t offset;
-};
-
+/*
+ * Returns a referenced descriptor for the directory made up of the first
+ * len characters of path.
+ */
 static int
-loopback_opendir(const char *path, struct fuse_file_info *fi)
+dirfd_cache_get(const char *path, size_t len, struct dirfd_entry **ep)
 {
+    uint64_t hash = loopback_hash_n(path, len);
+    struct dirfd_shard *shard = dirfd_cache_shard(hash);
+    char rel[MAXPATHLEN];
+    struct dirfd_entry *e;
+    uint64_t ticket;
     int res;
     
-    struct loopback_dirp *d = malloc(sizeof(struct loopback_dirp));
-    if (d == NULL) {
+    pthread_mutex_lock(&shard->lock);
+    
+    for (e = shard->table[hash & shard->mask]; e != NULL; e = e->hash_next) {
+        if (e->hash == hash && e->len == len &&
+            memcmp(e->path, path, len) == 0) {
+            
+            e->lru_prev->lru_next = e->lru_next;
+            e->lru_next->lru_prev = e->lru_prev;
+            e->lru_next = shard->lru.lru_next;
+            e->lru_prev = &shard->lru;
+            shard->lru.lru_next->lru_prev = e;
+            shard->lru.lru_next = e;
+            
+            e->refs++;
+            shard->hits++;
+            pthread_mutex_unlock(&shard->lock);
+            *ep = e;
+            return 0;
+        }
+    }
+    
+    shard->misses++;
+    pthread_mutex_unlock(&shard->lock);
+    
+    if (len >= sizeof(rel)) {
+        return -ENAMETOOLONG;
+    }
+    
+    // Skip the leading slash, the path is relative to the root descriptor
+    memcpy(rel, path + 1, len - 1);
+    rel[len - 1] = '\0';
+    
+    e = malloc(sizeof(struct dirfd_entry) + len);
+    if (e == NULL) {
         return -ENOMEM;
     }
     
-    d->dp = opendir(path);
-    if (d->dp == NULL) {
+    ticket = __atomic_load_n(&dirfd_cache.epoch, __ATOMIC_ACQUIRE);
+    
+    e->fd = openat(loopback.root_fd, rel, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (e->fd == -1) {
         res = -errno;
-        free(d);
+        free(e);
         return res;
     }
     
-    d->offset = 0;
-    d->entry = NULL;
+    e->hash = hash;
+    e->len = len;
+    e->refs = 1;
+    memcpy(e->path, path, len);
     
-    fi->fh = (unsigned long)d;
+    pthread_mutex_lock(&shard->lock);
+    
+    /*
+     * Only cache the descriptor if the directory was not renamed while it
+     * was being opened. It is still good for the operation at hand.
+     */
+    if (__atomic_load_n(&dirfd_cache.epoch, __ATOMIC_ACQUIRE) == ticket) {
+        struct dirfd_entry *other;
+        
+        for (other = shard->table[hash & shard->mask]; other != NULL;
+             other = other->hash_next) {
+            if (other->hash == hash && other->len == len &&
+                memcmp(other->path, path, len) == 0) {
+                break;
+            }
+        }
+        
+        if (other == NULL) {
+            while (shard->count >= shard->max) {
+                dirfd_entry_remove_locked(shard, shard->lru.lru_prev);
+            }
+            
+            e->refs++;
+            e->hash_next = shard->table[hash & shard->mask];
+            shard->table[hash & shard->mask] = e;
+            e->lru_next = shard->lru.lru_next;
+            e->lru_prev = &shard->lru;
+            shard->lru.lru_next->lru_prev = e;
+            shard->lru.lru_next = e;
+            shard->count++;
+        }
+    }
     
+    pthread_mutex_unlock(&shard->lock);
+    
+    *ep = e;
     return 0;
 }
 
-static inline struct loopback_dirp *
-get_dirp(struct fuse_file_info *fi)
-{
-    return (struct loopback_dirp *)(uintptr_t)fi->fh;
-}
-
-static int
-loopback_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                 off_t offset, struct fuse_file_info *fi)
+// Drops the descriptors for path and all directories below it
+static void
+dirfd_cache_invalidate_tree(const char *path)
 {
-    struct loopback_dirp *d = get_dirp(fi);
-    
-    (void)path;
+    size_t len;
+    int i;
     
-    if (offset == 0) {
-        rewinddir(d->dp);
-        d->entry = NULL;
-        d->offset = 0;
-    } else if (offset != d->offset) {
-        // Subtract the one that we add when calling telldir() below
-        seekdir(d->dp, offset - 1);
-        d->entry = NULL;
-        d->offset = offset;
+    if (!dirfd_cache.enabled) {
+        return;
     }
     
-    while (1) {
-        struct stat st;
-        off_t nextoff;
-        
-        if (!d->entry) {
-            d->entry = readdir(d->dp);
-            if (!d->entry) {
-                break;
-            }
-        }
-        
-        memset(&st, 0, sizeof(st));
-        st.st_ino = d->entry->d_ino;
-        st.st_mode = d->entry->d_type << 12;
+    __atomic_fetch_add(&dirfd_cache.epoch, 1, __ATOMIC_ACQ_REL);
+    
+    len = strlen(path);
+    
+    for (i = 0; i < DIRFD_CACHE_SHARDS; i++) {
+        struct dirfd_shard *shard = &dirfd_cache.shards[i];
+        struct dirfd_entry *e;
+        struct dirfd_entry *next;
         
-        /*
-         * Under macOS, telldir() may return 0 the first time it is called.
-         * But for libfuse, an offset of zero means that offsets are not
-         * supported, so we shift everything by one.
-         */
-        nextoff = telldir(d->dp) + 1;
+        pthread_mutex_lock(&shard->lock);
         
-        if (filler(buf, d->entry->d_name, &st, nextoff)) {
-            break;
+        for (e = shard->lru.lru_next; e != &shard->lru; e = next) {
+            next = e->lru_next;
+            if (e->len >= len && memcmp(e->path, path, len) == 0 &&
+                (e->len == len || e->path[len] == '/')) {
+                dirfd_entry_remove_locked(shard, e);
+            }
         }
         
-        d->entry = NULL;
-        d->offset = nextoff;
+        pthread_mutex_unlock(&shard->lock);
     }
-    
-    return 0;
 }
 
-static int
-loopback_releasedir(const char *path, struct fuse_file_info *fi)
+static void
+dirfd_cache_report(FILE *out)
 {
-    struct loopback_dirp *d = get_dirp(fi);
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    size_t count = 0;
+    int i;
     
-    (void)path;
+    if (!dirfd_cache.enabled) {
+        return;
+    }
     
-    closedir(d->dp);
-    free(d);
+    for (i = 0; i < DIRFD_CACHE_SHARDS; i++) {
+        struct dirfd_shard *shard = &dirfd_cache.shards[i];
+        
+        pthread_mutex_lock(&shard->lock);
+        hits += shard->hits;
+        misses += shard->misses;
+        count += shard->count;
+        pthread_mutex_unlock(&shard->lock);
+    }
     
-    return 0;
+    fprintf(out, "loopback: directory descriptor cache: %llu hits, "
+            "%llu misses, %zu descriptors\n",
+            (unsigned long long)hits, (unsigned long long)misses, count);
 }
 
+/*
+ * Translates a path on the mount into a directory descriptor and a name
+ * relative to it. Every successful call must be balanced by a call to
+ * loopback_at_put().
+ */
 static int
-loopback_mknod(const char *path, mode_t mode, dev_t rdev)
+loopback_at_get(const char *path, struct loopback_at *at)
 {
+    size_t len;
     int res;
     
-    if (S_ISFIFO(mode)) {
-        res = mkfifo(path, mode);
-    } else {
-        res = mknod(path, mode, rdev);
+    at->dirfd = loopback.root_fd;
+    at->ref = NULL;
+    
+    if (path[1] == '\0') {
+        at->name = ".";
+        return 0;
     }
     
-    if (res == -1) {
-        return -errno;
+    len = loopback_parent_len(path);
+    if (!dirfd_cache.enabled || len <= 1) {
+        at->name = path + 1;
+        return 0;
     }
     
+    res = dirfd_cache_get(path, len, &at->ref);
+    if (res != 0) {
+        return res;
+    }
+    
+    at->dirfd = at->ref->fd;
+    at->name = path + len + 1;
     return 0;
 }
 
-static int
-loopback_mkdir(const char *path, mode_t mode)
+// Preserves errno so that it can be called right after the system call
+static void
+loopback_at_put(struct loopback_at *at)
 {
-    int res;
+    struct dirfd_shard *shard;
+    int saved_errno;
     
-    res = mkdir(path, mode);
-    if (res == -1) {
-        return -errno;
+    if (at->ref == NULL) {
+        return;
     }
     
-    return 0;
+    saved_errno = errno;
+    
+    shard = dirfd_cache_shard(at->ref->hash);
+    pthread_mutex_lock(&shard->lock);
+    dirfd_entry_release_locked(at->ref);
+    pthread_mutex_unlock(&shard->lock);
+    
+    at->ref = NULL;
+    errno = saved_errno;
 }
 
 static int
-loopback_unlink(const char *path)
+loopback_lstat(const char *path, struct stat *stbuf)
 {
+    struct loopback_at at;
     int res;
     
-    res = unlink(path);
-    if (res == -1) {
-        return -errno;
+    res = loopback_at_get(path, &at);
+    if (res != 0) {
+        errno = -res;
+        return -1;
     }
     
-    return 0;
+    res = fstatat(at.dirfd, at.name, stbuf, AT_SYMLINK_NOFOLLOW);
+    loopback_at_put(&at);
+    
+    return res;
 }
 
 static int
-loopback_rmdir(const char *path)
+loopback_openat(const char *path, int flags, mode_t mode)
 {
+    struct loopback_at at;
     int res;
     
-    res = rmdir(path);
-    if (res == -1) {
-        return -errno;
+    res = loopback_at_get(path, &at);
+    if (res != 0) {
+        errno = -res;
+        return -1;
     }
     
-    return 0;
+    res = openat(at.dirfd, at.name, flags, mode);
+    loopback_at_put(&at);
+    
+    return res;
 }
 
-static int
-loopback_symlink(const char *from, const char *to)
+static DIR *
+loopback_opendirat(const char *path)
 {
-    int res;
+    DIR *dp;
+    int fd;
     
-    res = symlink(from, to);
-    if (res == -1) {
-        return -errno;
+    fd = loopback_openat(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+    if (fd == -1) {
+        return NULL;
     }
     
-    return 0;
+    dp = fdopendir(fd);
+    if (dp == NULL) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+    }
+    return dp;
 }
 
-static int
-loopback_rename(const char *from, const char *to)
+/*
+ * The extended attribute calls and a few others have no *at() variants.
+ * They use the path on the backing store instead, which is just path if the
+ * root is "/".
+ */
+static const char *
+loopback_real_path(const char *path, char *buf, size_t size)
 {
-    int res;
-    
-    res = rename(from, to);
-    if (res == -1) {
-        return -errno;
+    if (loopback.root_len == 0) {
+        return path;
     }
-    
-    return 0;
+    if (snprintf(buf, size, "%s%s", loopback.root, path) >= size) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    return buf;
 }
 
-#if HAVE_EXCHANGE
+/*
+ * Inode generations
+ *
+ * Operations on open files only know the file descriptor, not the path, so
+ * they cannot find the cache entries describing the file. Instead, they bump
+ * the generation of the file's inode slot. Cache entries remember the slot
+ * generation at insertion time and are ignored once it changes; unrelated
+ * inodes sharing a slot only cause a spurious miss.
+ */
 
-static int
-loopback_exchange(const char *path1, const char *path2, unsigned long options)
-{
-    int res;
+#define INODE_GEN_SLOTS 4096
 
-    res = exchangedata(path1, path2, options);
-    if (res == -1) {
-        return -errno;
-    }
+static uint32_t inode_gen[INODE_GEN_SLOTS];
 
-    return 0;
+static inline size_t
+inode_slot(dev_t dev, ino_t ino)
+{
+    uint64_t key = ((uint64_t)dev << 32) ^ (uint64_t)ino;
+    
+    key *= 0x9e3779b97f4a7c15ULL;
+    return (key >> 32) % INODE_GEN_SLOTS;
 }
 
-#endif /* HAVE_EXCHANGE */
+static inline uint32_t *
+inode_gen_slot(dev_t dev, ino_t ino)
+{
+    return &inode_gen[inode_slot(dev, ino)];
+}
 
-static int
-loopback_link(const char *from, const char *to)
+static inline uint32_t
+inode_gen_get(dev_t dev, ino_t ino)
 {
-    int res;
-    
-    res = link(from, to);
-    if (res == -1) {
-        return -errno;
-    }
-    
-    return 0;
+    return __atomic_load_n(inode_gen_slot(dev, ino), __ATOMIC_ACQUIRE);
 }
 
-static int
-loopback_fsetattr_x(const char *path, struct setattr_x *attr,
-                    struct fuse_file_info *fi)
+static inline void
+inode_gen_bump(dev_t dev, ino_t ino)
 {
-    int res;
-    uid_t uid = -1;
-    gid_t gid = -1;
-    
-    if (SETATTR_WANTS_MODE(attr)) {
-        res = fchmod(fi->fh, attr->mode);
-        if (res == -1) {
-            return -errno;
-        }
-    }
-    
-    if (SETATTR_WANTS_UID(attr)) {
-        uid = attr->uid;
-    }
+    __atomic_fetch_add(inode_gen_slot(dev, ino), 1, __ATOMIC_ACQ_REL);
+}
+
+/*
+ * Attribute cache
+ *
+ * Optional (mount option attr_cache=N), size-bounded cache of lstat() results
+ * keyed by path. Entries expire after attr_ttl milliseconds and are dropped by
+ * every operation that changes the attributes of an object or its parent
+ * directory. The cache is split into shards, each with its own lock, hash
+ * table and LRU list.
+ *
+ * To avoid caching a result that was already stale when lstat() returned,
+ * every invalidation bumps attr_cache.epoch before dropping entries. A lookup
+ * miss hands out the current epoch as a ticket and the result is only
+ * inserted if no invalidation happened in the meantime.
+ */
+
+#define ATTR_CACHE_SHARDS 16
+
+struct attr_entry {
+    struct attr_entry *hash_next;
+    struct attr_entry *lru_prev;
+    struct attr_entry *lru_next;
+    uint64_t hash;
+    uint64_t expires;
+    uint32_t gen;
+    bool has_bkuptime;
+    struct timespec bkuptime;
+    struct stat st;
+    char path[];
+};
+
+struct attr_shard {
+    pthread_mutex_t lock;
+    struct attr_entry **table;
+    size_t mask;
+    struct attr_entry lru;
+    size_t count;
+    size_t max;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t invalidations;
+    uint64_t evictions;
+};
+
+static struct {
+    bool enabled;
+    uint64_t ttl;
+    uint64_t epoch;
+    struct attr_shard shards[ATTR_CACHE_SHARDS];
+} attr_cache;
+
+static inline struct attr_shard *
+attr_cache_shard(uint64_t hash)
+{
+    return &attr_cache.shards[hash % ATTR_CACHE_SHARDS];
+}
+
+static void
+attr_cache_init(uint32_t entries, uint32_t ttl)
+{
+    size_t per_shard = (entries + ATTR_CACHE_SHARDS - 1) / ATTR_CACHE_SHARDS;
+    size_t nbuckets = 1;
+    int i;
     
-    if (SETATTR_WANTS_GID(attr)) {
-        gid = attr->gid;
+    if (entries == 0) {
+        return;
     }
     
-    if ((uid != -1) || (gid != -1)) {
-        res = fchown(fi->fh, uid, gid);
-        if (res == -1) {
-            return -errno;
-        }
+    while (nbuckets < per_shard) {
+        nbuckets <<= 1;
     }
     
-    if (SETATTR_WANTS_SIZE(attr)) {
-        res = ftruncate(fi->fh, attr->size);
-        if (res == -1) {
-            return -errno;
+    for (i = 0; i < ATTR_CACHE_SHARDS; i++) {
+        struct attr_shard *shard = &attr_cache.shards[i];
+        
+        shard->table = calloc(nbuckets, sizeof(struct attr_entry *));
+        if (shard->table == NULL) {
+            fprintf(stderr, "loopback: cannot allocate attribute cache\n");
+            exit(1);
         }
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->mask = nbuckets - 1;
+        shard->lru.lru_prev = &shard->lru;
+        shard->lru.lru_next = &shard->lru;
+        shard->max = per_shard;
     }
     
-    if (SETATTR_WANTS_MODTIME(attr)) {
-        struct timeval tv[2];
-        if (!SETATTR_WANTS_ACCTIME(attr)) {
-            gettimeofday(&tv[0], NULL);
-        } else {
-            tv[0].tv_sec = attr->acctime.tv_sec;
-            tv[0].tv_usec = attr->acctime.tv_nsec / 1000;
-        }
-        tv[1].tv_sec = attr->modtime.tv_sec;
-        tv[1].tv_usec = attr->modtime.tv_nsec / 1000;
-        res = futimes(fi->fh, tv);
-        if (res == -1) {
-            return -errno;
-        }
-    }
+    attr_cache.ttl = (uint64_t)ttl * 1000000;
+    attr_cache.enabled = true;
+}
+
+static void
+attr_entry_unlink(struct attr_shard *shard, struct attr_entry *e)
+{
+    struct attr_entry **pp = &shard->table[e->hash & shard->mask];
     
-    if (SETATTR_WANTS_CRTIME(attr)) {
-        struct attrlist attributes;
-        
-        attributes.bitmapcount = ATTR_BIT_MAP_COUNT;
-        attributes.reserved = 0;
-        attributes.commonattr = ATTR_CMN_CRTIME;
-        attributes.dirattr = 0;
-        attributes.fileattr = 0;
-        attributes.forkattr = 0;
-        attributes.volattr = 0;
-        
-        res = fsetattrlist(fi->fh, &attributes, &attr->crtime,
-                           sizeof(struct timespec), FSOPT_NOFOLLOW);
-        
-        if (res == -1) {
-            return -errno;
-        }
+    while (*pp != e) {
+        pp = &(*pp)->hash_next;
     }
+    *pp = e->hash_next;
     
-    if (SETATTR_WANTS_CHGTIME(attr)) {
-        struct attrlist attributes;
-        
-        attributes.bitmapcount = ATTR_BIT_MAP_COUNT;
-        attributes.reserved = 0;
-        attributes.commonattr = ATTR_CMN_CHGTIME;
-        attributes.dirattr = 0;
-        attributes.fileattr = 0;
-        attributes.forkattr = 0;
-        attributes.volattr = 0;
-        
-        res = fsetattrlist(fi->fh, &attributes, &attr->chgtime,
-                           sizeof(struct timespec), FSOPT_NOFOLLOW);
-        
-        if (res == -1) {
-            return -errno;
-        }
-    }
+    e->lru_prev->lru_next = e->lru_next;
+    e->lru_next->lru_prev = e->lru_prev;
+    shard->count--;
+}
+
+static struct attr_entry *
+attr_entry_find(struct attr_shard *shard, uint64_t hash, const char *path)
+{
+    struct attr_entry *e = shard->table[hash & shard->mask];
     
-    if (SETATTR_WANTS_BKUPTIME(attr)) {
-        struct attrlist attributes;
-        
-        attributes.bitmapcount = ATTR_BIT_MAP_COUNT;
-        attributes.reserved = 0;
-        attributes.commonattr = ATTR_CMN_BKUPTIME;
-        attributes.dirattr = 0;
-        attributes.fileattr = 0;
-        attributes.forkattr = 0;
-        attributes.volattr = 0;
-        
-        res = fsetattrlist(fi->fh, &attributes, &attr->bkuptime,
-                           sizeof(struct timespec), FSOPT_NOFOLLOW);
-        
-        if (res == -1) {
-            return -errno;
+    while (e != NULL) {
+        if (e->hash == hash && strcmp(e->path, path) == 0) {
+            return e;
         }
+        e = e->hash_next;
     }
+    return NULL;
+}
+
+/*
+ * Looks up the attributes of path. On a miss, *ticket receives the value to
+ * pass to attr_cache_insert() once the attributes have been fetched.
+ */
+static bool
+attr_cache_lookup(const char *path, struct stat *stbuf, uint64_t *ticket)
+{
+    uint64_t hash = loopback_hash(path);
+    struct attr_shard *shard = attr_cache_shard(hash);
+    struct attr_entry *e;
     
-    if (SETATTR_WANTS_FLAGS(attr)) {
-        res = fchflags(fi->fh, attr->flags);
-        if (res == -1) {
-            return -errno;
+    *ticket = __atomic_load_n(&attr_cache.epoch, __ATOMIC_ACQUIRE);
+    
+    pthread_mutex_lock(&shard->lock);
+    
+    e = attr_entry_find(shard, hash, path);
+    if (e != NULL) {
+        if (e->expires > loopback_now() &&
+            e->gen == inode_gen_get(e->st.st_dev, e->st.st_ino)) {
+            
+            *stbuf = e->st;
+            
+            // Move to the head of the LRU list
+            e->lru_prev->lru_next = e->lru_next;
+            e->lru_next->lru_prev = e->lru_prev;
+            e->lru_next = shard->lru.lru_next;
+            e->lru_prev = &shard->lru;
+            shard->lru.lru_next->lru_prev = e;
+            shard->lru.lru_next = e;
+            
+            shard->hits++;
+            pthread_mutex_unlock(&shard->lock);
+            return true;
         }
+        
+        attr_entry_unlink(shard, e);
+        free(e);
     }
     
-    return 0;
+    shard->misses++;
+    pthread_mutex_unlock(&shard->lock);
+    return false;
 }
 
-static int
-loopback_setattr_x(const char *path, struct setattr_x *attr)
+static void
+attr_cache_insert(const char *path, const struct stat *stbuf, uint64_t ticket)
 {
-    int res;
-    uid_t uid = -1;
-    gid_t gid = -1;
+    uint64_t hash = loopback_hash(path);
+    struct attr_shard *shard = attr_cache_shard(hash);
+    size_t len = strlen(path) + 1;
+    struct attr_entry *e;
     
-    if (SETATTR_WANTS_MODE(attr)) {
-        res = lchmod(path, attr->mode);
-        if (res == -1) {
-            return -errno;
-        }
+    e = malloc(sizeof(struct attr_entry) + len);
+    if (e == NULL) {
+        return;
     }
     
-    if (SETATTR_WANTS_UID(attr)) {
-        uid = attr->uid;
-    }
+    e->hash = hash;
+    e->expires = loopback_now() + attr_cache.ttl;
+    e->has_bkuptime = false;
+    e->st = *stbuf;
+    memcpy(e->path, path, len);
     
-    if (SETATTR_WANTS_GID(attr)) {
-        gid = attr->gid;
-    }
+    pthread_mutex_lock(&shard->lock);
     
-    if ((uid != -1) || (gid != -1)) {
-        res = lchown(path, uid, gid);
-        if (res == -1) {
-            return -errno;
-        }
+    if (__atomic_load_n(&attr_cache.epoch, __ATOMIC_ACQUIRE) != ticket) {
+        pthread_mutex_unlock(&shard->lock);
+        free(e);
+        return;
     }
     
-    if (SETATTR_WANTS_SIZE(attr)) {
-        res = truncate(path, attr->size);
-        if (res == -1) {
-            return -errno;
-        }
-    }
+    e->gen = inode_gen_get(stbuf->st_dev, stbuf->st_ino);
     
-    if (SETATTR_WANTS_MODTIME(attr)) {
-        struct timeval tv[2];
-        if (!SETATTR_WANTS_ACCTIME(attr)) {
-            gettimeofday(&tv[0], NULL);
-        } else {
-            tv[0].tv_sec = attr->acctime.tv_sec;
-            tv[0].tv_usec = attr->acctime.tv_nsec / 1000;
-        }
-        tv[1].tv_sec = attr->modtime.tv_sec;
-        tv[1].tv_usec = attr->modtime.tv_nsec / 1000;
-        res = lutimes(path, tv);
-        if (res == -1) {
-            return -errno;
-        }
+    struct attr_entry *old = attr_entry_find(shard, hash, path);
+    if (old != NULL) {
+        attr_entry_unlink(shard, old);
+        free(old);
     }
     
-    if (SETATTR_WANTS_CRTIME(attr)) {
-        struct attrlist attributes;
-        
-        attributes.bitmapcount = ATTR_BIT_MAP_COUNT;
-        attributes.reserved = 0;
-        attributes.commonattr = ATTR_CMN_CRTIME;
-        attributes.dirattr = 0;
-        attributes.fileattr = 0;
-        attributes.forkattr = 0;
-        attributes.volattr = 0;
-        
-        res = setattrlist(path, &attributes, &attr->crtime,
-                          sizeof(struct timespec), FSOPT_NOFOLLOW);
+    while (shard->count >= shard->max) {
+        struct attr_entry *victim = shard->lru.lru_prev;
         
-        if (res == -1) {
-            return -errno;
-        }
+        attr_entry_unlink(shard, victim);
+        free(victim);
+        shard->evictions++;
     }
     
-    if (SETATTR_WANTS_CHGTIME(attr)) {
-        struct attrlist attributes;
-        
-        attributes.bitmapcount = ATTR_BIT_MAP_COUNT;
-        attributes.reserved = 0;
-        attributes.commonattr = ATTR_CMN_CHGTIME;
-        attributes.dirattr = 0;
-        attributes.fileattr = 0;
-        attributes.forkattr = 0;
-        attributes.volattr = 0;
-        
-        res = setattrlist(path, &attributes, &attr->chgtime,
-                          sizeof(struct timespec), FSOPT_NOFOLLOW);
-        
-        if (res == -1) {
-            return -errno;
-        }
-    }
+    e->hash_next = shard->table[hash & shard->mask];
+    shard->table[hash & shard->mask] = e;
+    e->lru_next = shard->lru.lru_next;
+    e->lru_prev = &shard->lru;
+    shard->lru.lru_next->lru_prev = e;
+    shard->lru.lru_next = e;
+    shard->count++;
     
-    if (SETATTR_WANTS_BKUPTIME(attr)) {
-        struct attrlist attributes;
-        
-        attributes.bitmapcount = ATTR_BIT_MAP_COUNT;
-        attributes.reserved = 0;
-        attributes.commonattr = ATTR_CMN_BKUPTIME;
-        attributes.dirattr = 0;
-        attributes.fileattr = 0;
-        attributes.forkattr = 0;
-        attributes.volattr = 0;
-        
-        res = setattrlist(path, &attributes, &attr->bkuptime,
-                          sizeof(struct timespec), FSOPT_NOFOLLOW);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+ * The backup time is not part of struct stat. It is attached to an existing
+ * entry the first time loopback_getxtimes() asks for it.
+ */
+static bool
+attr_cache_lookup_bkuptime(const char *path, struct timespec *bkuptime,
+                           struct timespec *crtime)
+{
+    uint64_t hash = loopback_hash(path);
+    struct attr_shard *shard = attr_cache_shard(hash);
+    struct attr_entry *e;
+    bool found = false;
+    
+    pthread_mutex_lock(&shard->lock);
+    
+    e = attr_entry_find(shard, hash, path);
+    if (e != NULL && e->has_bkuptime && e->expires > loopback_now() &&
+        e->gen == inode_gen_get(e->st.st_dev, e->st.st_ino)) {
         
-        if (res == -1) {
-            return -errno;
-        }
+        *bkuptime = e->bkuptime;
+        *crtime = e->st.st_birthtimespec;
+        shard->hits++;
+        found = true;
+    } else {
+        shard->misses++;
     }
     
-    if (SETATTR_WANTS_FLAGS(attr)) {
-        res = lchflags(path, attr->flags);
-        if (res == -1) {
-            return -errno;
+    pthread_mutex_unlock(&shard->lock);
+    return found;
+}
+
+static void
+attr_cache_set_bkuptime(const char *path, const struct timespec *bkuptime,
+                        uint64_t ticket)
+{
+    uint64_t hash = loopback_hash(path);
+    struct attr_shard *shard = attr_cache_shard(hash);
+    struct attr_entry *e;
+    
+    pthread_mutex_lock(&shard->lock);
+    
+    if (__atomic_load_n(&attr_cache.epoch, __ATOMIC_ACQUIRE) == ticket) {
+        e = attr_entry_find(shard, hash, path);
+        if (e != NULL) {
+            e->bkuptime = *bkuptime;
+            e->has_bkuptime = true;
         }
     }
     
-    return 0;
+    pthread_mutex_unlock(&shard->lock);
 }
 
-static int
-loopback_getxtimes(const char *path, struct timespec *bkuptime,
-                   struct timespec *crtime)
+static inline void
+attr_cache_bump_epoch(void)
 {
-    int res = 0;
-    struct attrlist attributes;
-    
-    attributes.bitmapcount = ATTR_BIT_MAP_COUNT;
-    attributes.reserved    = 0;
-    attributes.commonattr  = 0;
-    attributes.dirattr     = 0;
-    attributes.fileattr    = 0;
-    attributes.forkattr    = 0;
-    attributes.volattr     = 0;
-    
+    __atomic_fetch_add(&attr_cache.epoch, 1, __ATOMIC_ACQ_REL);
+}
+
+/*
+ * Drops the entry for path and bumps the inode generation, so that other hard
+ * links to the same file are not served from the cache either. If path is not
+ * cached, its inode is taken from an lstat(), which is only needed for files
+ * with more than one link. Files that were unlinked are handled by the caller,
+ * see loopback_unlink().
+ */
+static void
+attr_cache_invalidate(const char *path)
+{
+    uint64_t hash;
+    struct attr_shard *shard;
+    struct attr_entry *e;
+    struct stat st;
     
+    if (!attr_cache.enabled || path == NULL) {
+        return;
+    }
     
-    struct xtimeattrbuf {
-        uint32_t size;
-        struct timespec xtime;
-    } __attribute__ ((packed));
+    attr_cache_bump_epoch();
     
+    hash = loopback_hash(path);
+    shard = attr_cache_shard(hash);
     
-    struct xtimeattrbuf buf;
+    pthread_mutex_lock(&shard->lock);
     
-    attributes.commonattr = ATTR_CMN_BKUPTIME;
-    res = getattrlist(path, &attributes, &buf, sizeof(buf), FSOPT_NOFOLLOW);
-    if (res == 0) {
-        (void)memcpy(bkuptime, &(buf.xtime), sizeof(struct timespec));
-    } else {
-        (void)memset(bkuptime, 0, sizeof(struct timespec));
+    e = attr_entry_find(shard, hash, path);
+    if (e != NULL) {
+        inode_gen_bump(e->st.st_dev, e->st.st_ino);
+        attr_entry_unlink(shard, e);
+        free(e);
+        shard->invalidations++;
     }
     
-    attributes.commonattr = ATTR_CMN_CRTIME;
-    res = getattrlist(path, &attributes, &buf, sizeof(buf), FSOPT_NOFOLLOW);
-    if (res == 0) {
-        (void)memcpy(crtime, &(buf.xtime), sizeof(struct timespec));
-    } else {
-        (void)memset(crtime, 0, sizeof(struct timespec));
-    }
+    pthread_mutex_unlock(&shard->lock);
     
-    return 0;
+    if (e == NULL && loopback_lstat(path, &st) == 0 &&
+        !S_ISDIR(st.st_mode) && st.st_nlink > 1) {
+        inode_gen_bump(st.st_dev, st.st_ino);
+    }
 }
 
-static int
-loopback_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+static void
+attr_cache_invalidate_inode(dev_t dev, ino_t ino)
 {
-    int fd;
-    
-    fd = open(path, fi->flags, mode);
-    if (fd == -1) {
-        return -errno;
+    if (!attr_cache.enabled) {
+        return;
     }
     
-    fi->fh = fd;
-    return 0;
+    attr_cache_bump_epoch();
+    inode_gen_bump(dev, ino);
 }
 
-static int
-loopback_open(const char *path, struct fuse_file_info *fi)
+/*
+ * Drops all entries below the directory path. Renaming a directory changes
+ * the path of everything inside it.
+ */
+static void
+attr_cache_invalidate_tree(const char *path)
 {
-    int fd;
+    size_t len;
+    int i;
     
-    fd = open(path, fi->flags);
-    if (fd == -1) {
-        return -errno;
+    if (!attr_cache.enabled) {
+        return;
     }
     
-    fi->fh = fd;
-    return 0;
-}
-
-static int
-loopback_read(const char *path, char *buf, size_t size, off_t offset,
-              struct fuse_file_info *fi)
-{
-    int res;
+    attr_cache_bump_epoch();
     
-    (void)path;
-    res = pread(fi->fh, buf, size, offset);
-    if (res == -1) {
-        res = -errno;
+    len = strlen(path);
+    if (len > 0 && path[len - 1] == '/') {
+        len--;
     }
     
-    return res;
+    for (i = 0; i < ATTR_CACHE_SHARDS; i++) {
+        struct attr_shard *shard = &attr_cache.shards[i];
+        struct attr_entry *e;
+        struct attr_entry *next;
+        
+        pthread_mutex_lock(&shard->lock);
+        
+        for (e = shard->lru.lru_next; e != &shard->lru; e = next) {
+            next = e->lru_next;
+            if (strncmp(e->path, path, len) == 0 && e->path[len] == '/') {
+                attr_entry_unlink(shard, e);
+                free(e);
+                shard->invalidations++;
+            }
+        }
+        
+        pthread_mutex_unlock(&shard->lock);
+    }
 }
 
-static int
-loopback_write(const char *path, const char *buf, size_t size,
-               off_t offset, struct fuse_file_info *fi)
+/*
+ * Invalidates path and its parent directory, whose modification time and
+ * link count change when an entry is added or removed.
+ */
+static void
+attr_cache_invalidate_entry(const char *path)
 {
-    int res;
+    char parent[MAXPATHLEN];
+    size_t len;
     
-    (void)path;
-    
-    res = pwrite(fi->fh, buf, size, offset);
-    if (res == -1) {
-        res = -errno;
+    if (!attr_cache.enabled) {
+        return;
     }
     
-    return res;
+    attr_cache_invalidate(path);
+    
+    len = loopback_parent_len(path);
+    if (len > 0 && len < sizeof(parent)) {
+        memcpy(parent, path, len);
+        parent[len] = '\0';
+        attr_cache_invalidate(parent);
+    }
 }
 
-static int
-loopback_flush(const char *path, struct fuse_file_info *fi)
+static void
+attr_cache_report(FILE *out)
 {
-    int res;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t invalidations = 0;
+    uint64_t evictions = 0;
+    size_t count = 0;
+    int i;
     
-    (void)path;
+    if (!attr_cache.enabled) {
+        return;
+    }
     
-    res = close(dup(fi->fh));
-    if (res == -1) {
-        return -errno;
+    for (i = 0; i < ATTR_CACHE_SHARDS; i++) {
+        struct attr_shard *shard = &attr_cache.shards[i];
+        
+        pthread_mutex_lock(&shard->lock);
+        hits += shard->hits;
+        misses += shard->misses;
+        invalidations += shard->invalidations;
+        evictions += shard->evictions;
+        count += shard->count;
+        pthread_mutex_unlock(&shard->lock);
     }
     
-    return 0;
+    fprintf(out, "loopback: attribute cache: %llu hits, %llu misses, "
+            "%llu invalidations, %llu evictions, %zu entries\n",
+            (unsigned long long)hits, (unsigned long long)misses,
+            (unsigned long long)invalidations, (unsigned long long)evictions,
+            count);
 }
 
-static int
-loopback_release(const char *path, struct fuse_file_info *fi)
+/*
+ * Negative lookup cache
+ *
+ * Optional (mount option neg_cache=N), size-bounded cache of paths for which
+ * lstat() failed with ENOENT, with its own TTL (neg_ttl=ms). Entries are
+ * grouped by parent directory and a directory's group always lives in the
+ * same shard, so creating an entry only has to look at the group of its
+ * parent and, for a new directory, the group of the directory itself.
+ * Only operations that make a whole populated tree appear at once (renaming
+ * a directory, creating a symbolic link) have to scan for groups further
+ * down.
+ *
+ * The same epoch scheme as in the attribute cache keeps a lookup that raced
+ * with a create from inserting a stale entry.
+ */
+
+#define NEG_CACHE_SHARDS 16
+
+struct neg_dir;
+
+struct neg_entry {
+    struct neg_entry *hash_next;
+    struct neg_entry *lru_prev;
+    struct neg_entry *lru_next;
+    struct neg_entry *dir_next;
+    struct neg_entry **dir_pprev;
+    struct neg_dir *dir;
+    uint64_t hash;
+    uint64_t expires;
+    char path[];
+};
+
+struct neg_dir {
+    struct neg_dir *hash_next;
+    struct neg_entry *entries;
+    uint64_t hash;
+    size_t len;
+    char path[];
+};
+
+struct neg_shard {
+    pthread_mutex_t lock;
+    struct neg_entry **table;
+    struct neg_dir **dirs;
+    size_t mask;
+    struct neg_entry lru;
+    size_t count;
+    size_t max;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t invalidations;
+    uint64_t evictions;
+};
+
+static struct {
+    bool enabled;
+    uint64_t ttl;
+    uint64_t epoch;
+    struct neg_shard shards[NEG_CACHE_SHARDS];
+} neg_cache;
+
+static inline struct neg_shard *
+neg_cache_shard(uint64_t dir_hash)
 {
-    (void)path;
-    
-    close(fi->fh);
-    
-    return 0;
+    return &neg_cache.shards[dir_hash % NEG_CACHE_SHARDS];
 }
 
-static int
-loopback_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
+static void
+neg_cache_init(uint32_t entries, uint32_t ttl)
 {
-    int res;
+    size_t per_shard = (entries + NEG_CACHE_SHARDS - 1) / NEG_CACHE_SHARDS;
+    size_t nbuckets = 1;
+    int i;
     
-    (void)path;
+    if (entries == 0) {
+        return;
+    }
     
-    (void)isdatasync;
+    while (nbuckets < per_shard) {
+        nbuckets <<= 1;
+    }
     
-    res = fsync(fi->fh);
-    if (res == -1) {
-        return -errno;
+    for (i = 0; i < NEG_CACHE_SHARDS; i++) {
+        struct neg_shard *shard = &neg_cache.shards[i];
+        
+        shard->table = calloc(nbuckets, sizeof(struct neg_entry *));
+        shard->dirs = calloc(nbuckets, sizeof(struct neg_dir *));
+        if (shard->table == NULL || shard->dirs == NULL) {
+            fprintf(stderr, "loopback: cannot allocate negative cache\n");
+            exit(1);
+        }
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->mask = nbuckets - 1;
+        shard->lru.lru_prev = &shard->lru;
+        shard->lru.lru_next = &shard->lru;
+        shard->max = per_shard;
     }
     
-    return 0;
+    neg_cache.ttl = (uint64_t)ttl * 1000000;
+    neg_cache.enabled = true;
 }
 
-static int
-loopback_setxattr(const char *path, const char *name, const char *value,
-                  size_t size, int flags, uint32_t position)
+static struct neg_dir *
+neg_dir_find(struct neg_shard *shard, uint64_t hash, const char *path,
+             size_t len)
 {
-    int res;
+    struct neg_dir *d = shard->dirs[hash & shard->mask];
     
-    if (!strncmp(name, XATTR_APPLE_PREFIX, sizeof(XATTR_APPLE_PREFIX) - 1)) {
-        flags &= ~(XATTR_NOSECURITY);
+    while (d != NULL) {
+        if (d->hash == hash && d->len == len &&
+            memcmp(d->path, path, len) == 0) {
+            return d;
+        }
+        d = d->hash_next;
     }
+    return NULL;
+}
+
+static void
+neg_dir_free(struct neg_shard *shard, struct neg_dir *d)
+{
+    struct neg_dir **pp = &shard->dirs[d->hash & shard->mask];
     
-    if (!strcmp(name, A_KAUTH_FILESEC_XATTR)) {
+    while (*pp != d) {
+        pp = &(*pp)->hash_next;
+    }
+    *pp = d->hash_next;
+    free(d);
+}
+
+static void
+neg_entry_free(struct neg_shard *shard, struct neg_entry *e)
+{
+    struct neg_entry **pp = &shard->table[e->hash & shard->mask];
+    
+    while (*pp != e) {
+        pp = &(*pp)->hash_next;
+    }
+    *pp = e->hash_next;
+    
+    e->lru_prev->lru_next = e->lru_next;
+    e->lru_next->lru_prev = e->lru_prev;
+    
+    *e->dir_pprev = e->dir_next;
+    if (e->dir_next != NULL) {
+        e->dir_next->dir_pprev = e->dir_pprev;
+    }
+    if (e->dir->entries == NULL) {
+        neg_dir_free(shard, e->dir);
+    }
+    
+    shard->count--;
+    free(e);
+}
+
+static struct neg_entry *
+neg_entry_find(struct neg_shard *shard, uint64_t hash, const char *path)
+{
+    struct neg_entry *e = shard->table[hash & shard->mask];
+    
+    while (e != NULL) {
+        if (e->hash == hash && strcmp(e->path, path) == 0) {
+            return e;
+        }
+        e = e->hash_next;
+    }
+    return NULL;
+}
+
+static bool
+neg_cache_lookup(const char *path, uint64_t *ticket)
+{
+    size_t dir_len = loopback_parent_len(path);
+    struct neg_shard *shard = neg_cache_shard(loopback_hash_n(path, dir_len));
+    struct neg_entry *e;
+    
+    *ticket = __atomic_load_n(&neg_cache.epoch, __ATOMIC_ACQUIRE);
+    
+    pthread_mutex_lock(&shard->lock);
+    
+    e = neg_entry_find(shard, loopback_hash(path), path);
+    if (e != NULL) {
+        if (e->expires > loopback_now()) {
+            shard->hits++;
+            pthread_mutex_unlock(&shard->lock);
+            return true;
+        }
+        neg_entry_free(shard, e);
+    }
+    
+    shard->misses++;
+    pthread_mutex_unlock(&shard->lock);
+    return false;
+}
+
+static void
+neg_cache_insert(const char *path, uint64_t ticket)
+{
+    size_t dir_len = loopback_parent_len(path);
+    uint64_t dir_hash = loopback_hash_n(path, dir_len);
+    uint64_t hash = loopback_hash(path);
+    struct neg_shard *shard = neg_cache_shard(dir_hash);
+    size_t len = strlen(path) + 1;
+    struct neg_entry *e;
+    struct neg_dir *d;
+    
+    e = malloc(sizeof(struct neg_entry) + len);
+    if (e == NULL) {
+        return;
+    }
+    
+    e->hash = hash;
+    e->expires = loopback_now() + neg_cache.ttl;
+    memcpy(e->path, path, len);
+    
+    pthread_mutex_lock(&shard->lock);
+    
+    if (__atomic_load_n(&neg_cache.epoch, __ATOMIC_ACQUIRE) != ticket ||
+        neg_entry_find(shard, hash, path) != NULL) {
+        pthread_mutex_unlock(&shard->lock);
+        free(e);
+        return;
+    }
+    
+    while (shard->count >= shard->max) {
+        neg_entry_free(shard, shard->lru.lru_prev);
+        shard->evictions++;
+    }
+    
+    d = neg_dir_find(shard, dir_hash, path, dir_len);
+    if (d == NULL) {
+        d = malloc(sizeof(struct neg_dir) + dir_len);
+        if (d == NULL) {
+            pthread_mutex_unlock(&shard->lock);
+            free(e);
+            return;
+        }
+        d->hash = dir_hash;
+        d->len = dir_len;
+        d->entries = NULL;
+        memcpy(d->path, path, dir_len);
+        d->hash_next = shard->dirs[dir_hash & shard->mask];
+        shard->dirs[dir_hash & shard->mask] = d;
+    }
+    
+    e->dir = d;
+    e->dir_next = d->entries;
+    e->dir_pprev = &d->entries;
+    if (d->entries != NULL) {
+        d->entries->dir_pprev = &e->dir_next;
+    }
+    d->entries = e;
+    
+    e->hash_next = shard->table[hash & shard->mask];
+    shard->table[hash & shard->mask] = e;
+    e->lru_next = shard->lru.lru_next;
+    e->lru_prev = &shard->lru;
+    shard->lru.lru_next->lru_prev = e;
+    shard->lru.lru_next = e;
+    shard->count++;
+    
+    pthread_mutex_unlock(&shard->lock);
+}
+
+static void
+neg_dir_invalidate(struct neg_shard *shard, struct neg_dir *d)
+{
+    // Freeing the last entry frees the group itself
+    while (d->entries->dir_next != NULL) {
+        neg_entry_free(shard, d->entries->dir_next);
+        shard->invalidations++;
+    }
+    neg_entry_free(shard, d->entries);
+    shard->invalidations++;
+}
+
+/*
+ * Called after an object has been created at path. Drops the entry for path
+ * itself and the group of entries below path, which are now ENOTDIR if path
+ * is not a directory. If the new object may bring a whole tree with it
+ * (rename, symbolic link), all groups below path are dropped as well.
+ */
+static void
+neg_cache_invalidate(const char *path, bool tree)
+{
+    size_t dir_len;
+    size_t len;
+    uint64_t hash;
+    struct neg_shard *shard;
+    struct neg_entry *e;
+    struct neg_dir *d;
+    int i;
+    
+    if (!neg_cache.enabled) {
+        return;
+    }
+    
+    __atomic_fetch_add(&neg_cache.epoch, 1, __ATOMIC_ACQ_REL);
+    
+    dir_len = loopback_parent_len(path);
+    shard = neg_cache_shard(loopback_hash_n(path, dir_len));
+    
+    pthread_mutex_lock(&shard->lock);
+    e = neg_entry_find(shard, loopback_hash(path), path);
+    if (e != NULL) {
+        neg_entry_free(shard, e);
+        shard->invalidations++;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    
+    len = strlen(path);
+    hash = loopback_hash_n(path, len);
+    shard = neg_cache_shard(hash);
+    
+    pthread_mutex_lock(&shard->lock);
+    d = neg_dir_find(shard, hash, path, len);
+    if (d != NULL) {
+        neg_dir_invalidate(shard, d);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    
+    if (!tree) {
+        return;
+    }
+    
+    for (i = 0; i < NEG_CACHE_SHARDS; i++) {
+        size_t bucket;
         
-        char new_name[MAXPATHLEN];
+        shard = &neg_cache.shards[i];
+        pthread_mutex_lock(&shard->lock);
         
-        memcpy(new_name, A_KAUTH_FILESEC_XATTR, sizeof(A_KAUTH_FILESEC_XATTR));
-        memcpy(new_name, G_PREFIX, sizeof(G_PREFIX) - 1);
+        for (bucket = 0; bucket <= shard->mask; bucket++) {
+            struct neg_dir *next;
+            
+            for (d = shard->dirs[bucket]; d != NULL; d = next) {
+                next = d->hash_next;
+                if (d->len > len && memcmp(d->path, path, len) == 0 &&
+                    d->path[len] == '/') {
+                    neg_dir_invalidate(shard, d);
+                }
+            }
+        }
+        
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+static void
+neg_cache_report(FILE *out)
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t invalidations = 0;
+    uint64_t evictions = 0;
+    size_t count = 0;
+    int i;
+    
+    if (!neg_cache.enabled) {
+        return;
+    }
+    
+    for (i = 0; i < NEG_CACHE_SHARDS; i++) {
+        struct neg_shard *shard = &neg_cache.shards[i];
+        
+        pthread_mutex_lock(&shard->lock);
+        hits += shard->hits;
+        misses += shard->misses;
+        invalidations += shard->invalidations;
+        evictions += shard->evictions;
+        count += shard->count;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    
+    fprintf(out, "loopback: negative cache: %llu hits, %llu misses, "
+            "%llu invalidations, %llu evictions, %zu entries\n",
+            (unsigned long long)hits, (unsigned long long)misses,
+            (unsigned long long)invalidations, (unsigned long long)evictions,
+            count);
+}
+
+/*
+ * Renaming a directory moves everything below it. Only scan the caches for
+ * such entries if the renamed object actually is a directory.
+ */
+static void
+cache_invalidate_rename(const char *from, const char *to, bool swap)
+{
+    struct stat st;
+    bool tree;
+    
+    if (!attr_cache.enabled && !neg_cache.enabled && !dirfd_cache.enabled) {
+        return;
+    }
+    
+    tree = loopback_lstat(to, &st) == -1 || S_ISDIR(st.st_mode) ||
+           (swap && (loopback_lstat(from, &st) == -1 ||
+                     S_ISDIR(st.st_mode)));
+    
+    attr_cache_invalidate_entry(from);
+    attr_cache_invalidate_entry(to);
+    if (tree) {
+        attr_cache_invalidate_tree(from);
+        attr_cache_invalidate_tree(to);
+    }
+    
+    neg_cache_invalidate(to, tree);
+    if (swap) {
+        neg_cache_invalidate(from, tree);
+    }
+    
+    if (tree) {
+        dirfd_cache_invalidate_tree(from);
+        dirfd_cache_invalidate_tree(to);
+    }
+}
+
+/*
+ * Open file cache
+ *
+ * With the fd_cache=N mount option, descriptors of files opened read-only are
+ * kept open after release, keyed by device, inode and open flags, and reused
+ * by the next open of the same file with the same flags. The attributes of
+ * the path are compared with those the descriptor was cached with, and a
+ * descriptor for a file whose size, mtime or ctime changed is not reused.
+ *
+ * A cached descriptor can serve any number of open handles at a time. Only
+ * idle descriptors are on the LRU list and subject to eviction. N is capped
+ * at half of RLIMIT_NOFILE, so that the cache cannot starve other opens.
+ * Unlinking the last link of a file, or renaming over it, drops its
+ * descriptors, which would otherwise keep the file's storage allocated.
+ */
+
+#define FD_CACHE_SHARDS 16
+
+struct fd_entry {
+    struct fd_entry *hash_next;
+    struct fd_entry *lru_prev;
+    struct fd_entry *lru_next;
+    dev_t dev;
+    ino_t ino;
+    int flags;
+    int fd;
+    int refs;
+    bool stale;             // No longer in the table, close on last release
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+};
+
+struct fd_shard {
+    pthread_mutex_t lock;
+    struct fd_entry **table;
+    size_t mask;
+    struct fd_entry lru;
+    size_t count;
+    size_t max;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t invalidations;
+    uint64_t evictions;
+};
+
+static struct {
+    bool enabled;
+    struct fd_shard shards[FD_CACHE_SHARDS];
+} fd_cache;
+
+static inline uint64_t
+fd_cache_key(dev_t dev, ino_t ino)
+{
+    uint64_t key = ((uint64_t)dev << 32) ^ (uint64_t)ino;
+    
+    return key * 0x9e3779b97f4a7c15ULL;
+}
+
+static inline struct fd_shard *
+fd_cache_shard(uint64_t key)
+{
+    return &fd_cache.shards[(key >> 32) % FD_CACHE_SHARDS];
+}
+
+static void
+fd_cache_init(uint32_t entries)
+{
+    struct rlimit rl;
+    size_t per_shard;
+    size_t nbuckets = 1;
+    int i;
+    
+    if (entries == 0) {
+        return;
+    }
+    
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = MIN(rl.rlim_max, OPEN_MAX);
+        setrlimit(RLIMIT_NOFILE, &rl);
+        getrlimit(RLIMIT_NOFILE, &rl);
         
-        res = setxattr(path, new_name, value, size, position, XATTR_NOFOLLOW);
+        if (entries > rl.rlim_cur / 2) {
+            entries = (uint32_t)(rl.rlim_cur / 2);
+            fprintf(stderr, "loopback: fd_cache limited to %u descriptors "
+                    "by RLIMIT_NOFILE\n", entries);
+        }
+    }
+    
+    per_shard = (entries + FD_CACHE_SHARDS - 1) / FD_CACHE_SHARDS;
+    while (nbuckets < per_shard) {
+        nbuckets <<= 1;
+    }
+    
+    for (i = 0; i < FD_CACHE_SHARDS; i++) {
+        struct fd_shard *shard = &fd_cache.shards[i];
         
+        shard->table = calloc(nbuckets, sizeof(struct fd_entry *));
+        if (shard->table == NULL) {
+            fprintf(stderr, "loopback: cannot allocate open file cache\n");
+            exit(1);
+        }
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->mask = nbuckets - 1;
+        shard->lru.lru_prev = &shard->lru;
+        shard->lru.lru_next = &shard->lru;
+        shard->max = per_shard;
+    }
+    
+    fd_cache.enabled = true;
+}
+
+static inline bool
+fd_cache_eligible(int flags)
+{
+    return (flags & O_ACCMODE) == O_RDONLY &&
+           !(flags & (O_CREAT | O_TRUNC | O_EXCL | O_EXLOCK | O_SHLOCK));
+}
+
+static inline bool
+fd_entry_matches(const struct fd_entry *e, const struct stat *st)
+{
+    return e->size == st->st_size &&
+           e->mtime.tv_sec == st->st_mtimespec.tv_sec &&
+           e->mtime.tv_nsec == st->st_mtimespec.tv_nsec &&
+           e->ctime.tv_sec == st->st_ctimespec.tv_sec &&
+           e->ctime.tv_nsec == st->st_ctimespec.tv_nsec;
+}
+
+// Must be called with the shard lock held
+static void
+fd_entry_lru_remove(struct fd_entry *e)
+{
+    e->lru_prev->lru_next = e->lru_next;
+    e->lru_next->lru_prev = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+/*
+ * Takes e out of the table. Idle descriptors are closed right away, busy ones
+ * by their last release. Must be called with the shard lock held.
+ */
+static void
+fd_entry_remove_locked(struct fd_shard *shard, struct fd_entry *e)
+{
+    uint64_t key = fd_cache_key(e->dev, e->ino);
+    struct fd_entry **pp = &shard->table[key & shard->mask];
+    
+    while (*pp != e) {
+        pp = &(*pp)->hash_next;
+    }
+    *pp = e->hash_next;
+    shard->count--;
+    
+    if (e->refs == 0) {
+        fd_entry_lru_remove(e);
+        close(e->fd);
+        free(e);
     } else {
-        res = setxattr(path, name, value, size, position, XATTR_NOFOLLOW);
+        e->stale = true;
     }
+}
+
+/*
+ * Returns a referenced cached descriptor for the file that st describes, as
+ * opened with flags, or NULL on a miss.
+ */
+static struct fd_entry *
+fd_cache_lookup(const struct stat *st, int flags)
+{
+    uint64_t key = fd_cache_key(st->st_dev, st->st_ino);
+    struct fd_shard *shard = fd_cache_shard(key);
+    struct fd_entry *e;
     
-    if (res == -1) {
-        return -errno;
+    pthread_mutex_lock(&shard->lock);
+    
+    for (e = shard->table[key & shard->mask]; e != NULL; e = e->hash_next) {
+        if (e->dev == st->st_dev && e->ino == st->st_ino &&
+            e->flags == flags) {
+            break;
+        }
+    }
+    
+    if (e != NULL && !fd_entry_matches(e, st)) {
+        fd_entry_remove_locked(shard, e);
+        shard->invalidations++;
+        e = NULL;
+    }
+    
+    if (e == NULL) {
+        shard->misses++;
+        pthread_mutex_unlock(&shard->lock);
+        return NULL;
+    }
+    
+    if (e->refs++ == 0) {
+        fd_entry_lru_remove(e);
+    }
+    shard->hits++;
+    
+    pthread_mutex_unlock(&shard->lock);
+    
+    return e;
+}
+
+/*
+ * Adds fd, just opened with flags for the file that st describes, to the
+ * cache. Returns the referenced entry, or NULL if fd could not be cached; the
+ * caller still owns fd in that case.
+ */
+static struct fd_entry *
+fd_cache_insert(int fd, const struct stat *st, int flags)
+{
+    uint64_t key = fd_cache_key(st->st_dev, st->st_ino);
+    struct fd_shard *shard = fd_cache_shard(key);
+    struct fd_entry *e;
+    
+    pthread_mutex_lock(&shard->lock);
+    
+    for (e = shard->table[key & shard->mask]; e != NULL; e = e->hash_next) {
+        if (e->dev == st->st_dev && e->ino == st->st_ino &&
+            e->flags == flags) {
+            // Another open got there first
+            pthread_mutex_unlock(&shard->lock);
+            return NULL;
+        }
+    }
+    
+    if (shard->count >= shard->max) {
+        struct fd_entry *victim = shard->lru.lru_prev;
+        
+        // Descriptors in use cannot be evicted
+        if (victim == &shard->lru) {
+            pthread_mutex_unlock(&shard->lock);
+            return NULL;
+        }
+        fd_entry_remove_locked(shard, victim);
+        shard->evictions++;
+    }
+    
+    e = malloc(sizeof(struct fd_entry));
+    if (e == NULL) {
+        pthread_mutex_unlock(&shard->lock);
+        return NULL;
+    }
+    
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->flags = flags;
+    e->fd = fd;
+    e->refs = 1;
+    e->stale = false;
+    e->size = st->st_size;
+    e->mtime = st->st_mtimespec;
+    e->ctime = st->st_ctimespec;
+    e->lru_prev = e->lru_next = NULL;
+    e->hash_next = shard->table[key & shard->mask];
+    shard->table[key & shard->mask] = e;
+    shard->count++;
+    
+    pthread_mutex_unlock(&shard->lock);
+    
+    return e;
+}
+
+static void
+fd_cache_release(struct fd_entry *e)
+{
+    struct fd_shard *shard = fd_cache_shard(fd_cache_key(e->dev, e->ino));
+    
+    pthread_mutex_lock(&shard->lock);
+    
+    if (--e->refs == 0) {
+        if (e->stale) {
+            close(e->fd);
+            free(e);
+        } else {
+            e->lru_next = shard->lru.lru_next;
+            e->lru_prev = &shard->lru;
+            e->lru_next->lru_prev = e;
+            shard->lru.lru_next = e;
+        }
+    }
+    
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/*
+ * Called before path is unlinked or replaced. Drops the descriptors of the
+ * file at path if this removes its last link.
+ */
+static void
+fd_cache_forget(const char *path)
+{
+    struct fd_shard *shard;
+    struct fd_entry *e;
+    struct fd_entry *next;
+    struct stat st;
+    uint64_t key;
+    
+    if (!fd_cache.enabled || loopback_lstat(path, &st) == -1 ||
+        !S_ISREG(st.st_mode) || st.st_nlink > 1) {
+        return;
+    }
+    
+    key = fd_cache_key(st.st_dev, st.st_ino);
+    shard = fd_cache_shard(key);
+    
+    pthread_mutex_lock(&shard->lock);
+    
+    for (e = shard->table[key & shard->mask]; e != NULL; e = next) {
+        next = e->hash_next;
+        if (e->dev == st.st_dev && e->ino == st.st_ino) {
+            fd_entry_remove_locked(shard, e);
+            shard->invalidations++;
+        }
+    }
+    
+    pthread_mutex_unlock(&shard->lock);
+}
+
+static void
+fd_cache_report(FILE *out)
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t invalidations = 0;
+    uint64_t evictions = 0;
+    size_t count = 0;
+    int i;
+    
+    if (!fd_cache.enabled) {
+        return;
+    }
+    
+    for (i = 0; i < FD_CACHE_SHARDS; i++) {
+        struct fd_shard *shard = &fd_cache.shards[i];
+        
+        pthread_mutex_lock(&shard->lock);
+        hits += shard->hits;
+        misses += shard->misses;
+        invalidations += shard->invalidations;
+        evictions += shard->evictions;
+        count += shard->count;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    
+    fprintf(out, "loopback: open file cache: %llu hits, %llu misses, "
+            "%llu invalidations, %llu evictions, %zu descriptors\n",
+            (unsigned long long)hits, (unsigned long long)misses,
+            (unsigned long long)invalidations, (unsigned long long)evictions,
+            count);
+}
+
+/*
+ * Read-ahead
+ *
+ * With the readahead=N mount option, reads that continue where the previous
+ * read on the same handle ended are detected as a sequential stream. Once a
+ * stream is established, background threads read up to N KiB ahead of the
+ * reader into buffers from a shared pool of readahead_pool=M MiB, and later
+ * reads are copied from those buffers. The window starts at two chunks and
+ * doubles with every chunk consumed. When the pool is exhausted, the range is
+ * passed to the backing store as an F_RDADVISE hint instead.
+ *
+ * Any read outside the prefetched range ends the stream and drops its
+ * buffers, so random access costs one comparison per read. Changes made
+ * through the mount bump the inode generation (see above), and buffers read
+ * before the change are discarded.
+ */
+
+#define RA_CHUNK_SIZE   (128 * 1024)
+#define RA_TRIGGER      2
+#define RA_THREADS      2
+
+enum {
+    RA_PENDING,
+    RA_READY
+};
+
+struct ra_stream;
+
+struct ra_chunk {
+    struct ra_chunk *next;      // In the stream, by offset
+    struct ra_chunk *job_next;
+    struct ra_stream *stream;
+    off_t offset;
+    ssize_t res;
+    int state;
+    uint32_t gen;
+    bool orphan;                // Dropped while pending, freed when done
+    char *buf;
+};
+
+struct ra_stream {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    off_t next;                 // Where a sequential read would start
+    off_t start;                // Prefetched range
+    off_t end;
+    unsigned int seq;
+    size_t window;
+    struct ra_chunk *chunks;
+    unsigned int pending;
+};
+
+static struct {
+    bool enabled;
+    size_t max_window;
+    pthread_once_t once;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *free_buffers;
+    size_t buffers;
+    size_t max_buffers;
+    struct ra_chunk *jobs;
+    struct ra_chunk **jobs_tail;
+    uint64_t served;
+    uint64_t fetched;
+    uint64_t wasted;
+    uint64_t advised;
+} readahead = { .once = PTHREAD_ONCE_INIT };
+
+static void
+readahead_init(uint32_t window_kb, uint32_t pool_mb)
+{
+    if (window_kb == 0) {
+        return;
+    }
+    
+    readahead.max_window = MAX((size_t)window_kb * 1024, 2 * RA_CHUNK_SIZE);
+    readahead.max_buffers = MAX((size_t)pool_mb * 1024 * 1024 / RA_CHUNK_SIZE,
+                                1);
+    pthread_mutex_init(&readahead.lock, NULL);
+    pthread_cond_init(&readahead.cond, NULL);
+    readahead.jobs_tail = &readahead.jobs;
+    readahead.enabled = true;
+}
+
+static char *
+ra_buffer_get(void)
+{
+    char *buf = NULL;
+    
+    pthread_mutex_lock(&readahead.lock);
+    if (readahead.free_buffers != NULL) {
+        buf = readahead.free_buffers;
+        readahead.free_buffers = *(char **)buf;
+    } else if (readahead.buffers < readahead.max_buffers) {
+        buf = malloc(RA_CHUNK_SIZE);
+        if (buf != NULL) {
+            readahead.buffers++;
+        }
+    }
+    pthread_mutex_unlock(&readahead.lock);
+    
+    return buf;
+}
+
+static void
+ra_chunk_free(struct ra_chunk *c)
+{
+    pthread_mutex_lock(&readahead.lock);
+    *(char **)c->buf = readahead.free_buffers;
+    readahead.free_buffers = c->buf;
+    pthread_mutex_unlock(&readahead.lock);
+    free(c);
+}
+
+static void *
+ra_worker(void *arg)
+{
+    (void)arg;
+    
+    while (1) {
+        struct ra_stream *s;
+        struct ra_chunk *c;
+        ssize_t res;
+        bool skip;
+        
+        pthread_mutex_lock(&readahead.lock);
+        while (readahead.jobs == NULL) {
+            pthread_cond_wait(&readahead.cond, &readahead.lock);
+        }
+        c = readahead.jobs;
+        readahead.jobs = c->job_next;
+        if (readahead.jobs == NULL) {
+            readahead.jobs_tail = &readahead.jobs;
+        }
+        pthread_mutex_unlock(&readahead.lock);
+        
+        s = c->stream;
+        
+        // Skip the read if the stream already moved on
+        pthread_mutex_lock(&s->lock);
+        skip = c->orphan;
+        pthread_mutex_unlock(&s->lock);
+        
+        res = skip ? 0 : pread(s->fd, c->buf, RA_CHUNK_SIZE, c->offset);
+        
+        pthread_mutex_lock(&s->lock);
+        c->res = res == -1 ? -errno : res;
+        c->state = RA_READY;
+        s->pending--;
+        if (c->orphan) {
+            ra_chunk_free(c);
+        } else {
+            __atomic_fetch_add(&readahead.fetched, 1, __ATOMIC_RELAXED);
+        }
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+    }
+    
+    return NULL;
+}
+
+// Started on first use, after libfuse has daemonized
+static void
+ra_start(void)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    int i;
+    
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (i = 0; i < RA_THREADS; i++) {
+        if (pthread_create(&thread, &attr, ra_worker, NULL) != 0) {
+            fprintf(stderr, "loopback: cannot start read-ahead thread\n");
+        }
+    }
+    pthread_attr_destroy(&attr);
+}
+
+static struct ra_stream *
+ra_stream_new(int fd, dev_t dev, ino_t ino)
+{
+    struct ra_stream *s = calloc(1, sizeof(struct ra_stream));
+    
+    if (s == NULL) {
+        return NULL;
+    }
+    
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    s->fd = fd;
+    s->dev = dev;
+    s->ino = ino;
+    s->next = -1;
+    return s;
+}
+
+// Must be called with the stream lock held
+static void
+ra_chunk_drop_locked(struct ra_stream *s, struct ra_chunk *c, bool wasted)
+{
+    if (wasted) {
+        __atomic_fetch_add(&readahead.wasted, 1, __ATOMIC_RELAXED);
+    }
+    if (c->state == RA_PENDING) {
+        c->orphan = true;
+    } else {
+        ra_chunk_free(c);
+    }
+}
+
+// Must be called with the stream lock held
+static void
+ra_stream_reset_locked(struct ra_stream *s)
+{
+    struct ra_chunk *c;
+    
+    while ((c = s->chunks) != NULL) {
+        s->chunks = c->next;
+        ra_chunk_drop_locked(s, c, true);
+    }
+    s->seq = 0;
+    s->window = 2 * RA_CHUNK_SIZE;
+    s->start = s->end = 0;
+}
+
+static void
+ra_stream_free(struct ra_stream *s)
+{
+    if (s == NULL) {
+        return;
+    }
+    
+    pthread_mutex_lock(&s->lock);
+    ra_stream_reset_locked(s);
+    
+    // Orphaned chunks still refer to the stream
+    while (s->pending > 0) {
+        pthread_cond_wait(&s->cond, &s->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+    
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+    free(s);
+}
+
+/*
+ * Queues chunks until the window ahead of the reader position pos is covered.
+ * Must be called with the stream lock held.
+ */
+static void
+ra_prefetch_locked(struct ra_stream *s, off_t pos)
+{
+    struct ra_chunk **tail = &s->chunks;
+    struct ra_chunk *c;
+    off_t until = pos + s->window;
+    
+    while (*tail != NULL) {
+        tail = &(*tail)->next;
+    }
+    
+    if (s->chunks == NULL) {
+        s->start = s->end = pos - pos % RA_CHUNK_SIZE;
+    }
+    
+    while (s->end < until) {
+        char *buf = ra_buffer_get();
+        
+        if (buf == NULL) {
+            struct radvisory ra;
+            
+            // Out of buffers, let the backing store read ahead instead
+            ra.ra_offset = s->end;
+            ra.ra_count = (int)(until - s->end);
+            fcntl(s->fd, F_RDADVISE, &ra);
+            __atomic_fetch_add(&readahead.advised, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        
+        c = calloc(1, sizeof(struct ra_chunk));
+        if (c == NULL) {
+            pthread_mutex_lock(&readahead.lock);
+            *(char **)buf = readahead.free_buffers;
+            readahead.free_buffers = buf;
+            pthread_mutex_unlock(&readahead.lock);
+            return;
+        }
+        
+        c->stream = s;
+        c->offset = s->end;
+        c->state = RA_PENDING;
+        c->gen = inode_gen_get(s->dev, s->ino);
+        c->buf = buf;
+        *tail = c;
+        tail = &c->next;
+        s->end += RA_CHUNK_SIZE;
+        s->pending++;
+        
+        pthread_mutex_lock(&readahead.lock);
+        *readahead.jobs_tail = c;
+        readahead.jobs_tail = &c->job_next;
+        pthread_cond_signal(&readahead.cond);
+        pthread_mutex_unlock(&readahead.lock);
+    }
+}
+
+/*
+ * Serves as much of the read as possible from prefetched chunks and moves
+ * the window. Returns the number of bytes copied; *eof is set if the chunks
+ * show that the file ends inside the requested range.
+ */
+static size_t
+ra_read(struct ra_stream *s, char *buf, size_t size, off_t offset, bool *eof)
+{
+    size_t copied = 0;
+    struct ra_chunk *c;
+    
+    *eof = false;
+    
+    pthread_mutex_lock(&s->lock);
+    
+    if (offset == s->next || (offset >= s->start && offset < s->end)) {
+        s->seq++;
+        s->next = MAX(s->next, (off_t)(offset + size));
+    } else {
+        ra_stream_reset_locked(s);
+        s->next = offset + size;
+    }
+    
+    if (s->seq < RA_TRIGGER) {
+        pthread_mutex_unlock(&s->lock);
+        return 0;
+    }
+    
+    pthread_once(&readahead.once, ra_start);
+    
+    while (copied < size) {
+        off_t pos = offset + copied;
+        uint32_t gen = inode_gen_get(s->dev, s->ino);
+        off_t avail;
+        size_t n;
+        
+        for (c = s->chunks; c != NULL; c = c->next) {
+            if (pos >= c->offset && pos < c->offset + RA_CHUNK_SIZE) {
+                break;
+            }
+        }
+        if (c == NULL) {
+            break;
+        }
+        
+        if (c->state == RA_PENDING) {
+            // The chunk may be dropped while we wait, start over
+            pthread_cond_wait(&s->cond, &s->lock);
+            continue;
+        }
+        
+        if (c->res < 0 || c->gen != gen) {
+            ra_stream_reset_locked(s);
+            break;
+        }
+        
+        avail = c->offset + c->res - pos;
+        if (avail <= 0) {
+            *eof = true;
+            break;
+        }
+        
+        n = MIN((size_t)avail, size - copied);
+        memcpy(buf + copied, c->buf + (pos - c->offset), n);
+        copied += n;
+        
+        if (c->res < RA_CHUNK_SIZE && copied < size) {
+            *eof = true;
+            break;
+        }
+    }
+    
+    // Drop the chunks that have been read completely
+    while ((c = s->chunks) != NULL && c->state == RA_READY &&
+           c->offset + RA_CHUNK_SIZE <= (off_t)(offset + copied)) {
+        s->chunks = c->next;
+        s->start = c->offset + RA_CHUNK_SIZE;
+        s->window = MIN(s->window * 2, readahead.max_window);
+        ra_chunk_drop_locked(s, c, false);
+    }
+    
+    if (!*eof) {
+        ra_prefetch_locked(s, offset + size);
+    }
+    
+    pthread_mutex_unlock(&s->lock);
+    
+    __atomic_fetch_add(&readahead.served, copied, __ATOMIC_RELAXED);
+    
+    return copied;
+}
+
+static void
+readahead_report(FILE *out)
+{
+    if (!readahead.enabled) {
+        return;
+    }
+    
+    fprintf(out, "loopback: read-ahead: %llu bytes served, %llu chunks "
+            "fetched, %llu wasted, %llu advisories, %zu buffers\n",
+            (unsigned long long)readahead.served,
+            (unsigned long long)readahead.fetched,
+            (unsigned long long)readahead.wasted,
+            (unsigned long long)readahead.advised, readahead.buffers);
+}
+
+/*
+ * Write-back
+ *
+ * With the writeback=N mount option, writes through a handle opened for
+ * writing are collected in a per-handle buffer of N KiB instead of being
+ * written one by one. Writes that continue or overwrite a buffered extent are
+ * merged into it, and every extent goes to the backing store as a single
+ * pwritev() of the buffered pieces. The buffer is written out when it is
+ * full, when its oldest write is writeback_ms milliseconds old (100 by
+ * default), on flush, fsync and release, and before anything that has to see
+ * the data: reads, getattr, truncation and fallocate of the same inode,
+ * through any handle.
+ *
+ * Errors of buffered writes are returned by the next write, flush or fsync
+ * of the handle, like on NFS. Before a write is buffered, the writes other
+ * handles buffered for the same file are written out, so that overlapping
+ * writes reach the backing store in order. Handles opened with O_APPEND are
+ * not buffered.
+ */
+
+#define WB_MAX_EXTENTS 32
+#define WB_MAX_PIECES  64
+
+struct wb_extent {
+    off_t offset;
+    size_t len;
+    int npieces;
+    struct iovec pieces[WB_MAX_PIECES];
+};
+
+struct wb_buffer {
+    pthread_mutex_t lock;
+    struct wb_buffer *dirty_prev;   // On writeback.dirty while not empty
+    struct wb_buffer *dirty_next;
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    char *data;
+    size_t used;
+    uint64_t since;
+    int error;
+    int nextents;
+    struct wb_extent *extents;      // By offset, never overlapping
+};
+
+static struct {
+    bool enabled;
+    size_t size;
+    uint64_t delay;
+    pthread_once_t once;
+    pthread_mutex_t lock;
+    struct wb_buffer dirty;
+    uint16_t dirty_inodes[INODE_GEN_SLOTS];
+    uint64_t buffered;
+    uint64_t flushes;
+    uint64_t syscalls;
+} writeback = { .once = PTHREAD_ONCE_INIT };
+
+static void
+writeback_init(uint32_t size_kb, uint32_t delay_ms)
+{
+    if (size_kb == 0) {
+        return;
+    }
+    
+    writeback.size = (size_t)size_kb * 1024;
+    writeback.delay = (uint64_t)delay_ms * 1000000;
+    pthread_mutex_init(&writeback.lock, NULL);
+    writeback.dirty.dirty_prev = &writeback.dirty;
+    writeback.dirty.dirty_next = &writeback.dirty;
+    writeback.enabled = true;
+}
+
+static struct wb_buffer *
+wb_buffer_new(int fd, dev_t dev, ino_t ino)
+{
+    struct wb_buffer *wb = calloc(1, sizeof(struct wb_buffer));
+    
+    if (wb == NULL) {
+        return NULL;
+    }
+    
+    pthread_mutex_init(&wb->lock, NULL);
+    wb->fd = fd;
+    wb->dev = dev;
+    wb->ino = ino;
+    return wb;
+}
+
+// Whether any handle has buffered writes for the inode, or a slot neighbour
+static inline bool
+wb_inode_dirty(dev_t dev, ino_t ino)
+{
+    return writeback.enabled &&
+           __atomic_load_n(&writeback.dirty_inodes[inode_slot(dev, ino)],
+                           __ATOMIC_ACQUIRE) > 0;
+}
+
+static ssize_t
+wb_pwritev(int fd, struct iovec *iov, int iovcnt, off_t offset)
+{
+    if (__builtin_available(macOS 11.0, *)) {
+        return pwritev(fd, iov, iovcnt, offset);
+    } else {
+        ssize_t total = 0;
+        int i;
+        
+        for (i = 0; i < iovcnt; i++) {
+            ssize_t res = pwrite(fd, iov[i].iov_base, iov[i].iov_len,
+                                 offset + total);
+            
+            if (res == -1) {
+                return total > 0 ? total : -1;
+            }
+            total += res;
+            if ((size_t)res < iov[i].iov_len) {
+                break;
+            }
+        }
+        return total;
+    }
+}
+
+static int
+wb_write_extent(int fd, struct wb_extent *e)
+{
+    struct iovec *iov = e->pieces;
+    int iovcnt = e->npieces;
+    off_t offset = e->offset;
+    
+    while (iovcnt > 0) {
+        ssize_t res = wb_pwritev(fd, iov, MIN(iovcnt, IOV_MAX), offset);
+        
+        __atomic_fetch_add(&writeback.syscalls, 1, __ATOMIC_RELAXED);
+        
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (res == 0) {
+            return -EIO;
+        }
+        
+        // Skip what was written, short writes end in the middle of a piece
+        offset += res;
+        while (iovcnt > 0 && (size_t)res >= iov->iov_len) {
+            res -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + res;
+            iov->iov_len -= res;
+        }
+    }
+    
+    return 0;
+}
+
+/*
+ * Writes out and empties the buffer. Returns the first error of this or an
+ * earlier deferred write. Must be called with the buffer lock held.
+ */
+static int
+wb_flush_locked(struct wb_buffer *wb)
+{
+    int res;
+    int i;
+    
+    if (wb->nextents > 0) {
+        for (i = 0; i < wb->nextents; i++) {
+            res = wb_write_extent(wb->fd, &wb->extents[i]);
+            if (res != 0 && wb->error == 0) {
+                wb->error = res;
+            }
+        }
+        wb->nextents = 0;
+        wb->used = 0;
+        __atomic_fetch_add(&writeback.flushes, 1, __ATOMIC_RELAXED);
+        
+        // The file changed now, not when the writes were accepted
+        if (attr_cache.enabled) {
+            attr_cache_invalidate_inode(wb->dev, wb->ino);
+        } else {
+            inode_gen_bump(wb->dev, wb->ino);
+        }
+        
+        pthread_mutex_lock(&writeback.lock);
+        wb->dirty_prev->dirty_next = wb->dirty_next;
+        wb->dirty_next->dirty_prev = wb->dirty_prev;
+        wb->dirty_prev = wb->dirty_next = NULL;
+        __atomic_fetch_sub(&writeback.dirty_inodes[inode_slot(wb->dev,
+                                                              wb->ino)],
+                           1, __ATOMIC_ACQ_REL);
+        pthread_mutex_unlock(&writeback.lock);
+    }
+    
+    res = wb->error;
+    wb->error = 0;
+    return res;
+}
+
+static int
+wb_flush(struct wb_buffer *wb)
+{
+    int res;
+    
+    pthread_mutex_lock(&wb->lock);
+    res = wb_flush_locked(wb);
+    pthread_mutex_unlock(&wb->lock);
+    
+    return res;
+}
+
+/*
+ * Writes out buffers on the dirty list. With inode, these are all buffers of
+ * dev and ino, waiting for those that are busy. Otherwise they are the
+ * buffers whose oldest write was accepted before older_than. except, if not
+ * NULL, is never written out. Buffers only ever leave the list with their own
+ * lock held, and a buffer on the list has not been freed, so trylock under
+ * the list lock is safe.
+ */
+static void
+wb_flush_dirty(bool inode, dev_t dev, ino_t ino, uint64_t older_than,
+               const struct wb_buffer *except)
+{
+    while (1) {
+        struct wb_buffer *wb;
+        bool busy = false;
+        
+        pthread_mutex_lock(&writeback.lock);
+        for (wb = writeback.dirty.dirty_next; wb != &writeback.dirty;
+             wb = wb->dirty_next) {
+            if (wb == except) {
+                continue;
+            }
+            if (inode ? (wb->dev == dev && wb->ino == ino) :
+                wb->since < older_than) {
+                if (pthread_mutex_trylock(&wb->lock) == 0) {
+                    break;
+                }
+                busy = true;
+            }
+        }
+        pthread_mutex_unlock(&writeback.lock);
+        
+        if (wb != &writeback.dirty) {
+            // Keep the error for the handle's next flush
+            wb->error = wb_flush_locked(wb);
+            pthread_mutex_unlock(&wb->lock);
+            continue;
+        }
+        
+        // Readers have to wait for buffers that are being written to
+        if (!inode || !busy) {
+            return;
+        }
+        sched_yield();
+    }
+}
+
+static inline void
+wb_flush_inode(dev_t dev, ino_t ino)
+{
+    if (wb_inode_dirty(dev, ino)) {
+        wb_flush_dirty(true, dev, ino, 0, NULL);
+    }
+}
+
+static void *
+wb_flusher(void *arg)
+{
+    (void)arg;
+    
+    while (1) {
+        usleep((useconds_t)MAX(writeback.delay / 2000, 1000));
+        wb_flush_dirty(false, 0, 0, loopback_now() - writeback.delay, NULL);
+    }
+    
+    return NULL;
+}
+
+// Started on first use, after libfuse has daemonized
+static void
+wb_start(void)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, wb_flusher, NULL) != 0) {
+        fprintf(stderr, "loopback: cannot start write-back thread\n");
+    }
+    pthread_attr_destroy(&attr);
+}
+
+// Copies buf over the buffered bytes of e from offset on
+static void
+wb_extent_overwrite(struct wb_extent *e, const char *buf, size_t size,
+                    off_t offset)
+{
+    off_t pos = e->offset;
+    int i;
+    
+    for (i = 0; i < e->npieces && size > 0; i++) {
+        struct iovec *piece = &e->pieces[i];
+        off_t end = pos + piece->iov_len;
+        
+        if (offset < end) {
+            size_t n = MIN(size, (size_t)(end - offset));
+            
+            memcpy((char *)piece->iov_base + (offset - pos), buf, n);
+            buf += n;
+            size -= n;
+            offset += n;
+        }
+        pos = end;
+    }
+}
+
+/*
+ * Buffers a write. Returns 0 if the write was buffered, 1 if the caller has
+ * to write it itself, or a negative errno from writing out the buffer.
+ */
+static int
+wb_write(struct wb_buffer *wb, const char *buf, size_t size, off_t offset)
+{
+    struct wb_extent *e = NULL;
+    off_t end = offset + size;
+    uint64_t now;
+    int res;
+    int i;
+    
+    // Report the failure of a write-out by another thread right away
+    pthread_mutex_lock(&wb->lock);
+    res = wb->error;
+    wb->error = 0;
+    pthread_mutex_unlock(&wb->lock);
+    if (res != 0) {
+        return res;
+    }
+    
+    /*
+     * Writes buffered by other handles of the file must reach the backing
+     * store first, or a later flush of theirs would overwrite this write.
+     */
+    if (wb_inode_dirty(wb->dev, wb->ino)) {
+        wb_flush_dirty(true, wb->dev, wb->ino, 0, wb);
+    }
+    
+    // Large writes gain nothing from the buffer
+    if (size > writeback.size / 4) {
+        wb_flush_inode(wb->dev, wb->ino);
+        return 1;
+    }
+    
+    pthread_once(&writeback.once, wb_start);
+    
+    pthread_mutex_lock(&wb->lock);
+    
+    if (wb->data == NULL) {
+        wb->data = malloc(writeback.size);
+        wb->extents = malloc(WB_MAX_EXTENTS * sizeof(struct wb_extent));
+        if (wb->data == NULL || wb->extents == NULL) {
+            free(wb->data);
+            free(wb->extents);
+            wb->data = NULL;
+            wb->extents = NULL;
+            pthread_mutex_unlock(&wb->lock);
+            return 1;
+        }
+    }
+    
+    while (1) {
+        int at = wb->nextents;
+        
+        /*
+         * Find the extent that the write continues or overwrites, and make
+         * sure that it does not reach into the next one.
+         */
+        e = NULL;
+        for (i = 0; i < wb->nextents; i++) {
+            struct wb_extent *x = &wb->extents[i];
+            
+            if (end <= x->offset) {
+                at = i;
+                break;
+            }
+            if (offset >= x->offset && offset <= x->offset + (off_t)x->len) {
+                e = x;
+                if (i + 1 < wb->nextents && end > wb->extents[i + 1].offset) {
+                    e = NULL;
+                    at = -1;
+                }
+                break;
+            }
+            if (offset < x->offset) {
+                // Starts before x and reaches into it
+                at = -1;
+                break;
+            }
+        }
+        
+        if (at != -1 && wb->used + size <= writeback.size &&
+            (e != NULL ? e->npieces < WB_MAX_PIECES :
+             wb->nextents < WB_MAX_EXTENTS)) {
+            if (e == NULL) {
+                memmove(&wb->extents[at + 1], &wb->extents[at],
+                        (wb->nextents - at) * sizeof(struct wb_extent));
+                e = &wb->extents[at];
+                e->offset = offset;
+                e->len = 0;
+                e->npieces = 0;
+                wb->nextents++;
+            }
+            break;
+        }
+        
+        // Does not fit or the extents would have to be merged, start over
+        res = wb_flush_locked(wb);
+        if (res != 0) {
+            pthread_mutex_unlock(&wb->lock);
+            return res;
+        }
+    }
+    
+    // The part inside the extent is overwritten, the rest appended
+    if (offset < e->offset + (off_t)e->len) {
+        size_t n = MIN(size, (size_t)(e->offset + e->len - offset));
+        
+        wb_extent_overwrite(e, buf, n, offset);
+        buf += n;
+        size -= n;
+    }
+    if (size > 0) {
+        struct iovec *last = e->npieces > 0 ? &e->pieces[e->npieces - 1] :
+                             NULL;
+        char *dst = wb->data + wb->used;
+        
+        memcpy(dst, buf, size);
+        wb->used += size;
+        e->len += size;
+        
+        // Appends to the newest piece just extend it
+        if (last != NULL && (char *)last->iov_base + last->iov_len == dst) {
+            last->iov_len += size;
+        } else {
+            e->pieces[e->npieces].iov_base = dst;
+            e->pieces[e->npieces].iov_len = size;
+            e->npieces++;
+        }
+    }
+    
+    now = loopback_now();
+    if (wb->dirty_next == NULL) {
+        wb->since = now;
+        pthread_mutex_lock(&writeback.lock);
+        wb->dirty_next = &writeback.dirty;
+        wb->dirty_prev = writeback.dirty.dirty_prev;
+        wb->dirty_prev->dirty_next = wb;
+        writeback.dirty.dirty_prev = wb;
+        __atomic_fetch_add(&writeback.dirty_inodes[inode_slot(wb->dev,
+                                                              wb->ino)],
+                           1, __ATOMIC_ACQ_REL);
+        pthread_mutex_unlock(&writeback.lock);
+    }
+    __atomic_fetch_add(&writeback.buffered, 1, __ATOMIC_RELAXED);
+    
+    pthread_mutex_unlock(&wb->lock);
+    
+    return 0;
+}
+
+static void
+wb_buffer_free(struct wb_buffer *wb)
+{
+    int res;
+    
+    if (wb == NULL) {
+        return;
+    }
+    
+    res = wb_flush(wb);
+    if (res != 0) {
+        fprintf(stderr, "loopback: write-back failed on release: %s\n",
+                strerror(-res));
+    }
+    
+    pthread_mutex_destroy(&wb->lock);
+    free(wb->data);
+    free(wb->extents);
+    free(wb);
+}
+
+static void
+writeback_report(FILE *out)
+{
+    if (!writeback.enabled) {
+        return;
+    }
+    
+    fprintf(out, "loopback: write-back: %llu writes buffered, %llu flushes, "
+            "%llu system calls\n",
+            (unsigned long long)writeback.buffered,
+            (unsigned long long)writeback.flushes,
+            (unsigned long long)writeback.syscalls);
+}
+
+/*
+ * Pattern lists
+ *
+ * Mount options that select files by name take a list of fnmatch() patterns
+ * separated by colons. Patterns are matched against the whole path in the
+ * volume, "*" also matches "/".
+ */
+
+struct pattern_list {
+    char **patterns;
+    size_t npatterns;
+};
+
+static void
+pattern_list_parse(struct pattern_list *list, const char *spec)
+{
+    char *copy;
+    char *pattern;
+    char *next;
+    
+    if (spec == NULL || *spec == '\0') {
+        return;
+    }
+    
+    copy = strdup(spec);
+    list->patterns = calloc(strlen(spec) / 2 + 1, sizeof(char *));
+    if (copy == NULL || list->patterns == NULL) {
+        fprintf(stderr, "loopback: cannot allocate patterns\n");
+        exit(1);
+    }
+    
+    for (next = copy; (pattern = strsep(&next, ":")) != NULL;) {
+        if (*pattern != '\0') {
+            list->patterns[list->npatterns++] = pattern;
+        }
+    }
+}
+
+static bool
+pattern_list_match(const struct pattern_list *list, const char *path)
+{
+    size_t i;
+    
+    for (i = 0; i < list->npatterns; i++) {
+        if (fnmatch(list->patterns[i], path, 0) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Uncached I/O
+ *
+ * Streaming a large file through the mount caches its data twice, once in the
+ * macFUSE vnode and once in the vnode of the backing file. With the nocache
+ * mount option, or for files of at least nocache_size=N MiB, or for paths
+ * matching one of the patterns in nocache_match=P1:P2:..., handles are opened
+ * with direct_io, so reads and writes go straight to loopback, and the backing
+ * descriptor gets F_NOCACHE.
+ *
+ * Like every direct_io file, such files cannot be mapped into memory.
+ */
+
+static struct {
+    bool enabled;
+    bool all;
+    off_t size;
+    struct pattern_list patterns;
+    uint64_t handles;
+} nocache;
+
+static void
+nocache_init(bool all, uint32_t size_mb, const char *match)
+{
+    nocache.all = all;
+    nocache.size = (off_t)size_mb * 1024 * 1024;
+    pattern_list_parse(&nocache.patterns, match);
+    
+    nocache.enabled = nocache.all || nocache.size > 0 ||
+                      nocache.patterns.npatterns > 0;
+}
+
+/*
+ * Whether a handle of path should bypass caching. st is the attributes of the
+ * file, or NULL to fstat() fd if the size is needed.
+ */
+static bool
+nocache_wanted(const char *path, int fd, const struct stat *st)
+{
+    struct stat fst;
+    
+    if (nocache.all || pattern_list_match(&nocache.patterns, path)) {
+        return true;
+    }
+    
+    if (nocache.size > 0) {
+        if (st == NULL && fstat(fd, &fst) == 0) {
+            st = &fst;
+        }
+        if (st != NULL && S_ISREG(st->st_mode) && st->st_size >= nocache.size) {
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+static void
+nocache_apply(const char *path, int fd, struct fuse_file_info *fi)
+{
+    if (!nocache_wanted(path, fd, NULL)) {
+        return;
+    }
+    
+    fcntl(fd, F_NOCACHE, 1);
+    fi->direct_io = 1;
+    __atomic_fetch_add(&nocache.handles, 1, __ATOMIC_RELAXED);
+}
+
+static void
+nocache_report(FILE *out)
+{
+    if (!nocache.enabled) {
+        return;
+    }
+    
+    fprintf(out, "loopback: uncached I/O: %llu handles\n",
+            (unsigned long long)nocache.handles);
+}
+
+/*
+ * Optimal I/O size
+ *
+ * st_blksize tells the kernel extension how large the transfers for a file
+ * should be, zero makes it use the iosize mount option for every file. With
+ * blksize_large=N, regular files of at least blksize_threshold=M KiB (1024 by
+ * default) and files matching one of the patterns in blksize_match=P1:P2:...
+ * report N KiB, so that large media files are read and written in large
+ * transfers. All other regular files report the block size of the backing
+ * file system, so that small files are not over-read.
+ */
+
+static struct {
+    bool enabled;
+    blksize_t large;
+    blksize_t small;
+    off_t threshold;
+    struct pattern_list patterns;
+} blksize;
+
+static void
+blksize_init(uint32_t large_kb, uint32_t threshold_kb, const char *match)
+{
+    struct statfs sfs;
+    blksize_t large = 4096;
+    
+    if (large_kb == 0) {
+        return;
+    }
+    
+    // The kernel extension expects a power of two, at most 32 MiB
+    while (large * 2 <= (blksize_t)MIN(large_kb, 32768U) * 1024) {
+        large *= 2;
+    }
+    blksize.large = large;
+    
+    blksize.small = 4096;
+    if (fstatfs(loopback.root_fd, &sfs) == 0 && sfs.f_bsize > 0) {
+        blksize.small = (blksize_t)MIN(sfs.f_bsize, (uint32_t)large);
+    }
+    
+    blksize.threshold = (off_t)threshold_kb * 1024;
+    pattern_list_parse(&blksize.patterns, match);
+    blksize.enabled = true;
+}
+
+/*
+ * Returns the st_blksize to report for st. path may be NULL for open files,
+ * their patterns are then not checked. Open files remember the outcome of the
+ * check at open instead, see loopback_fgetattr().
+ */
+static blksize_t
+loopback_blksize(const char *path, const struct stat *st)
+{
+    if (!blksize.enabled || !S_ISREG(st->st_mode)) {
+        return 0;
+    }
+    
+    if (st->st_size >= blksize.threshold ||
+        (path != NULL && pattern_list_match(&blksize.patterns, path))) {
+        return blksize.large;
+    }
+    return blksize.small;
+}
+
+/*
+ * Volume statistics cache
+ *
+ * With the statfs_ttl=N mount option, the statistics of the backing volume
+ * are reused for N milliseconds instead of calling statfs() for every request.
+ * Unlinks, renames, truncation, preallocation, clones and every 16 MiB written
+ * through the volume expire them right away, so that the free space follows
+ * large changes. Only the statistics of the root are cached, which is what
+ * the kernel extension asks for.
+ */
+
+#define STATFS_DIRTY_BYTES (16 * 1024 * 1024)
+
+static struct {
+    bool enabled;
+    uint64_t ttl;
+    pthread_mutex_t lock;
+    uint64_t epoch;
+    uint64_t expires;       // Zero if there are no statistics
+    struct statfs sfs;
+    uint64_t written;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t expirations;
+} statfs_cache;
+
+static void
+statfs_cache_init(uint32_t ttl)
+{
+    if (ttl == 0) {
+        return;
+    }
+    
+    statfs_cache.ttl = (uint64_t)ttl * 1000000;
+    pthread_mutex_init(&statfs_cache.lock, NULL);
+    statfs_cache.enabled = true;
+}
+
+/*
+ * Returns the cached statistics in stbuf. On a miss, *ticket receives the
+ * value to pass to statfs_cache_insert() once they have been fetched.
+ */
+static bool
+statfs_cache_lookup(struct statfs *stbuf, uint64_t *ticket)
+{
+    bool hit;
+    
+    pthread_mutex_lock(&statfs_cache.lock);
+    hit = statfs_cache.expires > loopback_now();
+    if (hit) {
+        *stbuf = statfs_cache.sfs;
+        statfs_cache.hits++;
+    } else {
+        *ticket = statfs_cache.epoch;
+        statfs_cache.misses++;
+    }
+    pthread_mutex_unlock(&statfs_cache.lock);
+    
+    return hit;
+}
+
+static void
+statfs_cache_insert(const struct statfs *stbuf, uint64_t ticket)
+{
+    pthread_mutex_lock(&statfs_cache.lock);
+    // Statistics fetched before an invalidation are not cached
+    if (statfs_cache.epoch == ticket) {
+        statfs_cache.sfs = *stbuf;
+        statfs_cache.expires = loopback_now() + statfs_cache.ttl;
+        __atomic_store_n(&statfs_cache.written, 0, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&statfs_cache.lock);
+}
+
+// Called after changes that can free or take up a lot of space
+static void
+statfs_cache_invalidate(void)
+{
+    if (!statfs_cache.enabled) {
+        return;
+    }
+    
+    pthread_mutex_lock(&statfs_cache.lock);
+    if (statfs_cache.expires > loopback_now()) {
+        statfs_cache.expirations++;
+    }
+    statfs_cache.expires = 0;
+    statfs_cache.epoch++;
+    pthread_mutex_unlock(&statfs_cache.lock);
+}
+
+static inline void
+statfs_cache_wrote(size_t size)
+{
+    if (statfs_cache.enabled &&
+        __atomic_add_fetch(&statfs_cache.written, size, __ATOMIC_RELAXED) >=
+        STATFS_DIRTY_BYTES) {
+        __atomic_store_n(&statfs_cache.written, 0, __ATOMIC_RELAXED);
+        statfs_cache_invalidate();
+    }
+}
+
+static void
+statfs_cache_report(FILE *out)
+{
+    if (!statfs_cache.enabled) {
+        return;
+    }
+    
+    pthread_mutex_lock(&statfs_cache.lock);
+    fprintf(out, "loopback: statfs cache: %llu hits, %llu misses, "
+            "%llu expirations\n",
+            (unsigned long long)statfs_cache.hits,
+            (unsigned long long)statfs_cache.misses,
+            (unsigned long long)statfs_cache.expirations);
+    pthread_mutex_unlock(&statfs_cache.lock);
+}
+
+/*
+ * Durability
+ *
+ * The fsync=MODE mount option selects what an fsync request does:
+ *
+ *   fast      fsync(), the default. On macOS this hands the data to the drive
+ *             but does not flush the drive's cache.
+ *   datasync  fdatasync() if the request asks for the data only, fsync()
+ *             otherwise.
+ *   full      fcntl(F_FULLFSYNC), which also flushes the drive's cache, so the
+ *             data survives a power loss.
+ *   barrier   fcntl(F_BARRIERFSYNC), which keeps the drive from reordering
+ *             the data behind later writes, without waiting for it to be
+ *             stored.
+ *
+ * full and barrier fall back to fsync() on file systems that support neither.
+ *
+ * A full flush takes milliseconds and covers the whole drive, so with full a
+ * stream of fsyncs is bound by the flush rate. With the fsync_group=N mount
+ * option, full requests commit in groups instead. Every request calls fsync()
+ * for its own data, then waits for a full flush of its backing volume that
+ * starts after that. The first one to wait leads: it sleeps N microseconds to
+ * let others join and issues one F_FULLFSYNC for all of them. Requests that
+ * arrive during a flush are covered by the next. If a flush fails, the
+ * requests it would have covered retry with their own flushes.
+ *
+ * Requests can only be grouped if they are handled concurrently. With
+ * threads=N, raise sync_threads accordingly.
+ */
+
+enum {
+    FSYNC_FAST,
+    FSYNC_DATASYNC,
+    FSYNC_FULL,
+    FSYNC_BARRIER,
+    FSYNC_MODE_COUNT
+};
+
+static const char *const fsync_mode_names[FSYNC_MODE_COUNT] = {
+    [FSYNC_FAST]     = "fast",
+    [FSYNC_DATASYNC] = "datasync",
+    [FSYNC_FULL]     = "full",
+    [FSYNC_BARRIER]  = "barrier",
+};
+
+// Tickets are handed out in arrival order, committed counts the covered ones
+struct fsync_group {
+    struct fsync_group *next;
+    dev_t dev;
+    pthread_cond_t cond;
+    uint64_t requested;
+    uint64_t committed;
+    bool flushing;
+};
+
+static struct {
+    int mode;
+    bool grouped;
+    useconds_t window;
+    pthread_mutex_t lock;
+    struct fsync_group *groups;
+    uint64_t requests;
+    uint64_t flushes;
+    uint64_t fallbacks;
+} durability;
+
+static void
+durability_init(const char *mode, uint32_t group)
+{
+    durability.mode = FSYNC_FAST;
+    if (mode != NULL) {
+        while (durability.mode < FSYNC_MODE_COUNT &&
+               strcmp(mode, fsync_mode_names[durability.mode]) != 0) {
+            durability.mode++;
+        }
+        if (durability.mode == FSYNC_MODE_COUNT) {
+            fprintf(stderr, "loopback: invalid fsync mode: %s\n", mode);
+            exit(1);
+        }
+    }
+    
+    pthread_mutex_init(&durability.lock, NULL);
+    if (durability.mode == FSYNC_FULL && group > 0) {
+        durability.window = group;
+        durability.grouped = true;
+    }
+}
+
+// fcntl() command for mode, fsync() if the file system does not support it
+static int
+durability_fcntl(int fd, int cmd)
+{
+    if (fcntl(fd, cmd) != -1) {
+        return 0;
+    }
+    if (errno != ENOTSUP && errno != EINVAL && errno != ENOTTY) {
+        return -errno;
+    }
+    
+    __atomic_add_fetch(&durability.fallbacks, 1, __ATOMIC_RELAXED);
+    return fsync(fd) == -1 ? -errno : 0;
+}
+
+static struct fsync_group *
+durability_group(dev_t dev)
+{
+    struct fsync_group *group;
+    
+    for (group = durability.groups; group != NULL; group = group->next) {
+        if (group->dev == dev) {
+            return group;
+        }
+    }
+    
+    group = calloc(1, sizeof(*group));
+    if (group != NULL) {
+        group->dev = dev;
+        pthread_cond_init(&group->cond, NULL);
+        group->next = durability.groups;
+        durability.groups = group;
+    }
+    return group;
+}
+
+// Waits for a full flush of the volume dev that covers the data of fd
+static int
+durability_group_commit(int fd, dev_t dev)
+{
+    struct fsync_group *group;
+    uint64_t ticket;
+    uint64_t target;
+    int res;
+    
+    if (fsync(fd) == -1) {
+        return -errno;
+    }
+    
+    pthread_mutex_lock(&durability.lock);
+    group = durability_group(dev);
+    if (group == NULL) {
+        pthread_mutex_unlock(&durability.lock);
+        return durability_fcntl(fd, F_FULLFSYNC);
+    }
+    
+    ticket = ++group->requested;
+    while (group->committed < ticket) {
+        if (group->flushing) {
+            pthread_cond_wait(&group->cond, &durability.lock);
+            continue;
+        }
+        
+        group->flushing = true;
+        pthread_mutex_unlock(&durability.lock);
+        
+        // Lets concurrent requests join before the flush
+        usleep(durability.window);
+        
+        pthread_mutex_lock(&durability.lock);
+        target = group->requested;
+        pthread_mutex_unlock(&durability.lock);
+        
+        res = durability_fcntl(fd, F_FULLFSYNC);
+        
+        __atomic_add_fetch(&durability.flushes, 1, __ATOMIC_RELAXED);
+        
+        pthread_mutex_lock(&durability.lock);
+        group->flushing = false;
+        if (res == 0 && group->committed < target) {
+            group->committed = target;
+        }
+        pthread_cond_broadcast(&group->cond);
+        if (res != 0) {
+            pthread_mutex_unlock(&durability.lock);
+            return res;
+        }
+    }
+    pthread_mutex_unlock(&durability.lock);
+    
+    return 0;
+}
+
+// Makes the data of fd, on the volume dev, as durable as the mode promises
+static int
+durability_sync(int fd, dev_t dev, int isdatasync)
+{
+    __atomic_add_fetch(&durability.requests, 1, __ATOMIC_RELAXED);
+    
+    switch (durability.mode) {
+    case FSYNC_DATASYNC:
+        if (isdatasync) {
+            return fdatasync(fd) == -1 ? -errno : 0;
+        }
+        break;
+    case FSYNC_FULL:
+        if (durability.grouped) {
+            return durability_group_commit(fd, dev);
+        }
+        __atomic_add_fetch(&durability.flushes, 1, __ATOMIC_RELAXED);
+        return durability_fcntl(fd, F_FULLFSYNC);
+    case FSYNC_BARRIER:
+        return durability_fcntl(fd, F_BARRIERFSYNC);
+    }
+    
+    return fsync(fd) == -1 ? -errno : 0;
+}
+
+static void
+durability_report(FILE *out)
+{
+    if (durability.mode == FSYNC_FAST) {
+        return;
+    }
+    
+    fprintf(out, "loopback: fsync %s: %llu requests, %llu full flushes, "
+            "%llu fallbacks to fsync\n",
+            fsync_mode_names[durability.mode],
+            (unsigned long long)__atomic_load_n(&durability.requests,
+                                                __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&durability.flushes,
+                                                __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&durability.fallbacks,
+                                                __ATOMIC_RELAXED));
+}
+
+struct loopback_file {
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    struct fd_entry *cached;
+    struct ra_stream *ra;
+    struct wb_buffer *wb;
+    char *lower_path;       // Set for files opened from the lower branch
+    bool written;
+    struct timespec mtime;  // Version of the backing file at open
+    off_t size;
+    bool blksize_match;     // Path matched a blksize_match pattern at open
+};
+
+static inline struct loopback_file *
+get_file(struct fuse_file_info *fi)
+{
+    return (struct loopback_file *)(uintptr_t)fi->fh;
+}
+
+/*
+ * Block cache
+ *
+ * With the block_cache=N mount option, data read from regular files is kept
+ * in blocks of BC_BLOCK_SIZE bytes that all handles share, using at most
+ * N MiB for the whole mount. Blocks are keyed by the device, inode and block
+ * number of the backing file, so separate opens of the same file find the
+ * data read by earlier ones without another round trip to the backing store.
+ * Handles opened for uncached I/O bypass the cache.
+ *
+ * Eviction follows 2Q. A block read for the first time goes to a FIFO that
+ * may hold a quarter of the budget. When it falls out, its key is remembered
+ * in a ghost list, and a block that is read again while its key is there goes
+ * to an LRU list holding the rest. A single pass over a large file therefore
+ * cannot push out blocks that are read over and over. The cache is split
+ * into shards, each with its own lock, hash table and an equal share of the
+ * budget.
+ *
+ * A block remembers the inode generation (see above) and the mtime and size
+ * the backing file had when its handle was opened. Changes made through the
+ * mount bump the generation, which drops the blocks read before. A handle
+ * only uses blocks tagged with the version of the file it saw at open, so
+ * changes made behind the mount's back are seen by the next open, like on
+ * NFS. Files modified less than LOOPBACK_RACY_SECONDS ago are read without
+ * caching, since a second change within the same tick would go unnoticed.
+ */
+
+#define BC_BLOCK_SIZE   (128 * 1024)
+#define BC_SHARDS       16
+
+enum {
+    BC_A1IN,                    // Read once, FIFO
+    BC_AM,                      // Read again, LRU
+    BC_A1OUT,                   // Evicted from A1IN, key only
+    BC_QUEUES
+};
+
+struct bc_block {
+    struct bc_block *hash_next;
+    struct bc_block *prev;      // In its queue
+    struct bc_block *next;
+    uint64_t hash;
+    dev_t dev;
+    ino_t ino;
+    off_t index;
+    uint32_t gen;
+    struct timespec mtime;
+    off_t size;
+    int queue;
+    size_t len;                 // Short for the last block of the file
+    char *data;                 // NULL in BC_A1OUT
+};
+
+struct bc_shard {
+    pthread_mutex_t lock;
+    struct bc_block **table;
+    struct bc_block queues[BC_QUEUES];
+    size_t counts[BC_QUEUES];
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t promotions;
+    uint64_t evictions;
+    uint64_t stale;
+};
+
+static struct {
+    bool enabled;
+    size_t max_blocks;          // Per shard
+    size_t max_a1in;
+    size_t max_ghosts;
+    size_t mask;
+    struct bc_shard shards[BC_SHARDS];
+} block_cache;
+
+static void
+block_cache_init(uint32_t size_mb)
+{
+    size_t nbuckets = 1;
+    int i, q;
+    
+    if (size_mb == 0) {
+        return;
+    }
+    
+    // Budgets below one block per shard are rounded up
+    block_cache.max_blocks = MAX((size_t)size_mb * 1024 * 1024 /
+                                 BC_BLOCK_SIZE / BC_SHARDS, 1);
+    block_cache.max_a1in = MAX(block_cache.max_blocks / 4, 1);
+    block_cache.max_ghosts = MAX(block_cache.max_blocks / 2, 1);
+    
+    while (nbuckets < block_cache.max_blocks + block_cache.max_ghosts) {
+        nbuckets <<= 1;
+    }
+    block_cache.mask = nbuckets - 1;
+    
+    for (i = 0; i < BC_SHARDS; i++) {
+        struct bc_shard *s = &block_cache.shards[i];
+        
+        s->table = calloc(nbuckets, sizeof(struct bc_block *));
+        if (s->table == NULL) {
+            fprintf(stderr, "loopback: cannot allocate block cache\n");
+            exit(1);
+        }
+        pthread_mutex_init(&s->lock, NULL);
+        for (q = 0; q < BC_QUEUES; q++) {
+            s->queues[q].prev = &s->queues[q];
+            s->queues[q].next = &s->queues[q];
+        }
+    }
+    
+    block_cache.enabled = true;
+}
+
+static inline uint64_t
+bc_hash(dev_t dev, ino_t ino, off_t index)
+{
+    uint64_t key = ((uint64_t)dev << 32) ^ (uint64_t)ino;
+    
+    key *= 0x9e3779b97f4a7c15ULL;
+    key ^= (uint64_t)index;
+    key *= 0x9e3779b97f4a7c15ULL;
+    return key ^ (key >> 29);
+}
+
+static inline struct bc_shard *
+bc_shard_of(uint64_t hash)
+{
+    return &block_cache.shards[hash % BC_SHARDS];
+}
+
+static struct bc_block **
+bc_find(struct bc_shard *s, uint64_t hash, dev_t dev, ino_t ino, off_t index)
+{
+    struct bc_block **bp = &s->table[(hash / BC_SHARDS) & block_cache.mask];
+    
+    while (*bp != NULL) {
+        struct bc_block *b = *bp;
+        
+        if (b->hash == hash && b->index == index && b->ino == ino &&
+            b->dev == dev) {
+            break;
+        }
+        bp = &b->hash_next;
+    }
+    return bp;
+}
+
+static void
+bc_queue_remove(struct bc_shard *s, struct bc_block *b)
+{
+    b->prev->next = b->next;
+    b->next->prev = b->prev;
+    s->counts[b->queue]--;
+}
+
+static void
+bc_queue_push(struct bc_shard *s, struct bc_block *b, int queue)
+{
+    struct bc_block *head = &s->queues[queue];
+    
+    b->queue = queue;
+    b->prev = head;
+    b->next = head->next;
+    head->next->prev = b;
+    head->next = b;
+    s->counts[queue]++;
+}
+
+static void
+bc_drop(struct bc_shard *s, struct bc_block *b)
+{
+    struct bc_block **bp = bc_find(s, b->hash, b->dev, b->ino, b->index);
+    
+    *bp = b->hash_next;
+    bc_queue_remove(s, b);
+    free(b->data);
+    free(b);
+}
+
+// Makes room for one more block in the shard
+static void
+bc_reclaim_locked(struct bc_shard *s)
+{
+    while (s->counts[BC_A1IN] + s->counts[BC_AM] >= block_cache.max_blocks) {
+        struct bc_block *b;
+        
+        if (s->counts[BC_A1IN] > block_cache.max_a1in ||
+            s->counts[BC_AM] == 0) {
+            b = s->queues[BC_A1IN].prev;
+            bc_queue_remove(s, b);
+            free(b->data);
+            b->data = NULL;
+            bc_queue_push(s, b, BC_A1OUT);
+            if (s->counts[BC_A1OUT] > block_cache.max_ghosts) {
+                bc_drop(s, s->queues[BC_A1OUT].prev);
+            }
+        } else {
+            bc_drop(s, s->queues[BC_AM].prev);
+        }
+        s->evictions++;
+    }
+}
+
+static inline bool
+bc_version_matches(const struct bc_block *b, const struct loopback_file *f)
+{
+    return b->mtime.tv_sec == f->mtime.tv_sec &&
+           b->mtime.tv_nsec == f->mtime.tv_nsec &&
+           b->size == f->size;
+}
+
+/*
+ * Copies up to want bytes from offset skip in the block into buf. Returns the
+ * number of bytes copied, which is short at the end of the file, or -1 if the
+ * block is not cached for the version of the file that f has open.
+ */
+static ssize_t
+bc_lookup(struct loopback_file *f, off_t index, char *buf, size_t skip,
+          size_t want)
+{
+    uint64_t hash = bc_hash(f->dev, f->ino, index);
+    struct bc_shard *s = bc_shard_of(hash);
+    struct bc_block *b;
+    ssize_t res = -1;
+    
+    pthread_mutex_lock(&s->lock);
+    b = *bc_find(s, hash, f->dev, f->ino, index);
+    if (b != NULL && b->data != NULL &&
+        b->gen != inode_gen_get(f->dev, f->ino)) {
+        bc_drop(s, b);
+        s->stale++;
+    } else if (b != NULL && b->data != NULL && bc_version_matches(b, f)) {
+        if (b->queue == BC_AM) {
+            bc_queue_remove(s, b);
+            bc_queue_push(s, b, BC_AM);
+        }
+        res = b->len > skip ? (ssize_t)MIN(b->len - skip, want) : 0;
+        memcpy(buf, b->data + skip, (size_t)res);
+        s->hits++;
+    }
+    if (res < 0) {
+        s->misses++;
+    }
+    pthread_mutex_unlock(&s->lock);
+    
+    return res;
+}
+
+// Takes over data, which was read while the inode generation was gen
+static void
+bc_insert(struct loopback_file *f, off_t index, uint32_t gen, char *data,
+          size_t len)
+{
+    uint64_t hash = bc_hash(f->dev, f->ino, index);
+    struct bc_shard *s = bc_shard_of(hash);
+    struct bc_block **bp;
+    struct bc_block *b;
+    int queue = BC_A1IN;
+    
+    pthread_mutex_lock(&s->lock);
+    bp = bc_find(s, hash, f->dev, f->ino, index);
+    b = *bp;
+    if (b != NULL && b->data != NULL) {
+        // Read by another handle in the meantime, or stale
+        free(b->data);
+    } else {
+        if (b != NULL) {
+            // Read again soon after it was evicted
+            *bp = b->hash_next;
+            bc_queue_remove(s, b);
+            queue = BC_AM;
+            s->promotions++;
+        } else {
+            b = malloc(sizeof(struct bc_block));
+            if (b == NULL) {
+                pthread_mutex_unlock(&s->lock);
+                free(data);
+                return;
+            }
+            b->hash = hash;
+            b->dev = f->dev;
+            b->ino = f->ino;
+            b->index = index;
+        }
+        
+        bc_reclaim_locked(s);
+        bp = &s->table[(hash / BC_SHARDS) & block_cache.mask];
+        b->hash_next = *bp;
+        *bp = b;
+        bc_queue_push(s, b, queue);
+    }
+    b->gen = gen;
+    b->mtime = f->mtime;
+    b->size = f->size;
+    b->len = len;
+    b->data = data;
+    pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * Reads from the backing file, through the read-ahead buffers if the handle
+ * has any.
+ */
+static int
+loopback_read_backing(struct loopback_file *f, char *buf, size_t size,
+                      off_t offset)
+{
+    size_t copied = 0;
+    bool eof = false;
+    ssize_t res;
+    
+    if (f->ra != NULL) {
+        copied = ra_read(f->ra, buf, size, offset, &eof);
+        if (copied == size || eof) {
+            return (int)copied;
+        }
+    }
+    
+    res = pread(f->fd, buf + copied, size - copied, offset + copied);
+    if (res == -1) {
+        return copied > 0 ? (int)copied : -errno;
+    }
+    
+    return (int)(copied + res);
+}
+
+/*
+ * Reads the whole block from the backing file, copies the requested part
+ * into buf and caches the block. Only complete blocks and blocks that end at
+ * the end of the file are cached, and only if the file is still the version
+ * f was opened with and was not modified too recently to tell (see above).
+ */
+static ssize_t
+bc_fill(struct loopback_file *f, off_t index, char *buf, size_t skip,
+        size_t want)
+{
+    off_t start = index * BC_BLOCK_SIZE;
+    uint32_t gen = inode_gen_get(f->dev, f->ino);
+    char *data = malloc(BC_BLOCK_SIZE);
+    struct stat st;
+    size_t len = 0;
+    size_t n;
+    int res = 0;
+    
+    if (data == NULL) {
+        return loopback_read_backing(f, buf, want, start + skip);
+    }
+    
+    while (len < BC_BLOCK_SIZE) {
+        res = loopback_read_backing(f, data + len, BC_BLOCK_SIZE - len,
+                                    start + len);
+        if (res <= 0) {
+            break;
+        }
+        len += res;
+    }
+    
+    if (res < 0 && len <= skip) {
+        free(data);
+        return res;
+    }
+    
+    n = len > skip ? MIN(len - skip, want) : 0;
+    memcpy(buf, data + skip, n);
+    
+    if (res < 0 || len == 0 || fstat(f->fd, &st) == -1 ||
+        st.st_mtimespec.tv_sec != f->mtime.tv_sec ||
+        st.st_mtimespec.tv_nsec != f->mtime.tv_nsec ||
+        st.st_size != f->size || loopback_racy(&st.st_mtimespec)) {
+        free(data);
+        return n;
+    }
+    
+    // Tail blocks only keep what was read
+    if (len < BC_BLOCK_SIZE) {
+        char *tail = realloc(data, len);
+        
+        if (tail != NULL) {
+            data = tail;
+        }
+    }
+    bc_insert(f, index, gen, data, len);
+    return n;
+}
+
+static int
+block_cache_read(struct loopback_file *f, char *buf, size_t size, off_t offset)
+{
+    size_t copied = 0;
+    
+    while (copied < size) {
+        off_t pos = offset + copied;
+        off_t index = pos / BC_BLOCK_SIZE;
+        size_t skip = (size_t)(pos % BC_BLOCK_SIZE);
+        size_t want = MIN(size - copied, BC_BLOCK_SIZE - skip);
+        ssize_t res;
+        
+        res = bc_lookup(f, index, buf + copied, skip, want);
+        if (res < 0) {
+            res = bc_fill(f, index, buf + copied, skip, want);
+            if (res < 0) {
+                return copied > 0 ? (int)copied : (int)res;
+            }
+        }
+        
+        copied += res;
+        if ((size_t)res < want) {
+            break;              // End of file
+        }
+    }
+    
+    return (int)copied;
+}
+
+static void
+block_cache_report(FILE *out)
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t promotions = 0;
+    uint64_t evictions = 0;
+    uint64_t stale = 0;
+    size_t blocks = 0;
+    int i;
+    
+    if (!block_cache.enabled) {
+        return;
+    }
+    
+    for (i = 0; i < BC_SHARDS; i++) {
+        struct bc_shard *s = &block_cache.shards[i];
+        
+        pthread_mutex_lock(&s->lock);
+        hits += s->hits;
+        misses += s->misses;
+        promotions += s->promotions;
+        evictions += s->evictions;
+        stale += s->stale;
+        blocks += s->counts[BC_A1IN] + s->counts[BC_AM];
+        pthread_mutex_unlock(&s->lock);
+    }
+    
+    fprintf(out, "loopback: block cache: %llu hits, %llu misses, "
+            "%llu promotions, %llu evictions, %llu stale, %zu of %zu "
+            "blocks\n",
+            (unsigned long long)hits, (unsigned long long)misses,
+            (unsigned long long)promotions, (unsigned long long)evictions,
+            (unsigned long long)stale, blocks,
+            block_cache.max_blocks * BC_SHARDS);
+}
+
+static int
+loopback_file_new(const char *path, int fd, struct fuse_file_info *fi)
+{
+    struct loopback_file *f = malloc(sizeof(struct loopback_file));
+    if (f == NULL) {
+        return -ENOMEM;
+    }
+    
+    f->fd = fd;
+    f->dev = 0;
+    f->ino = 0;
+    f->cached = NULL;
+    f->ra = NULL;
+    f->wb = NULL;
+    f->lower_path = NULL;
+    f->written = false;
+    f->mtime.tv_sec = 0;
+    f->mtime.tv_nsec = 0;
+    f->size = 0;
+    f->blksize_match = blksize.enabled &&
+                       pattern_list_match(&blksize.patterns, path);
+    
+    /*
+     * Writes through this file need its inode to invalidate the attribute
+     * cache, read-ahead buffers and cached blocks, and to find buffered
+     * writes. Group commit needs its volume, the block cache its version.
+     * Only pay for the fstat() if any of those is enabled.
+     */
+    if (attr_cache.enabled || readahead.enabled || writeback.enabled ||
+        durability.grouped || block_cache.enabled) {
+        struct stat st;
+        
+        if (fstat(fd, &st) == 0) {
+            f->dev = st.st_dev;
+            f->ino = st.st_ino;
+            f->mtime = st.st_mtimespec;
+            f->size = st.st_size;
+        }
+    }
+    
+    if (readahead.enabled && (fi->flags & O_ACCMODE) != O_WRONLY) {
+        f->ra = ra_stream_new(fd, f->dev, f->ino);
+    }
+    if (writeback.enabled && (fi->flags & O_ACCMODE) != O_RDONLY &&
+        !(fi->flags & O_APPEND)) {
+        f->wb = wb_buffer_new(fd, f->dev, f->ino);
+    }
+    
+    fi->fh = (uintptr_t)f;
+    return 0;
+}
+
+// Called after every change made through f
+static inline void
+loopback_file_invalidate(struct loopback_file *f)
+{
+    f->written = true;
+    if (attr_cache.enabled) {
+        attr_cache_invalidate_inode(f->dev, f->ino);
+    } else if (readahead.enabled || block_cache.enabled) {
+        inode_gen_bump(f->dev, f->ino);
+    }
+}
+
+static int
+loopback_getattr(const char *path, struct stat *stbuf)
+{
+    int res;
+    uint64_t ticket = 0;
+    
+    uint64_t neg_ticket = 0;
+    
+    if (attr_cache.enabled && attr_cache_lookup(path, stbuf, &ticket)) {
+        return 0;
+    }
+    if (neg_cache.enabled && neg_cache_lookup(path, &neg_ticket)) {
+        return -ENOENT;
+    }
+    
+    res = loopback_lstat(path, stbuf);
+    
+    // The size and times have to include buffered writes
+    if (res == 0 && wb_inode_dirty(stbuf->st_dev, stbuf->st_ino)) {
+        wb_flush_inode(stbuf->st_dev, stbuf->st_ino);
+        res = loopback_lstat(path, stbuf);
+    }
+    
+    if (res == -1) {
+        res = -errno;
+        if (res == -ENOENT && neg_cache.enabled) {
+            neg_cache_insert(path, neg_ticket);
+        }
+        return res;
+    }
+    
+    /*
+     * The optimal I/O size can be set on a per-file basis. Setting st_blksize
+     * to zero will cause the kernel extension to fall back on the global I/O
+     * size which can be specified at mount-time (option iosize).
+     */
+    stbuf->st_blksize = loopback_blksize(path, stbuf);
+    
+    if (attr_cache.enabled) {
+        attr_cache_insert(path, stbuf, ticket);
+    }
+    
+    return 0;
+}
+
+static int
+loopback_fgetattr(const char *path, struct stat *stbuf,
+                  struct fuse_file_info *fi)
+{
+    int res;
+    
+    (void)path;
+    
+    if (writeback.enabled) {
+        wb_flush_inode(get_file(fi)->dev, get_file(fi)->ino);
+    }
+    
+    res = fstat(get_file(fi)->fd, stbuf);
+    if (res == -1) {
+        return -errno;
+    }
+    
+    // See loopback_getattr(), path is NULL for files that were unlinked
+    if (get_file(fi)->blksize_match && S_ISREG(stbuf->st_mode)) {
+        stbuf->st_blksize = blksize.large;
+    } else {
+        stbuf->st_blksize = loopback_blksize(NULL, stbuf);
+    }
+    
+    return 0;
+}
+
+static int
+loopback_readlink(const char *path, char *buf, size_t size)
+{
+    struct loopback_at at;
+    int res;
+    
+    res = loopback_at_get(path, &at);
+    if (res != 0) {
+        return res;
+    }
+    
+    res = readlinkat(at.dirfd, at.name, buf, size - 1);
+    loopback_at_put(&at);
+    if (res == -1) {
+        return -errno;
+    }
+    
+    buf[res] = '\0';
+    
+    return 0;
+}
+
+/*
+ * With the readdir_bulk mount option, directories are enumerated with
+ * getattrlistbulk() instead of readdir(). This returns the names together
+ * with the full set of attributes in large batches, so every entry can be
+ * passed to the filler with a complete struct stat and, if the attribute
+ * cache is enabled, seeded into the cache for the lookups that follow.
+ *
+ * getattrlistbulk() has no seek offsets of its own. Entries are numbered in
+ * enumeration order instead and a seek to any other offset restarts the
+ * enumeration and skips ahead.
+ */
+
+#define BULK_BUFFER_SIZE (256 * 1024)
+
+#define BULK_COMMON_ATTRS (ATTR_CMN_RETURNED_ATTRS | ATTR_CMN_NAME | \
+                           ATTR_CMN_DEVID | ATTR_CMN_OBJTYPE | \
+                           ATTR_CMN_CRTIME | ATTR_CMN_MODTIME | \
+                           ATTR_CMN_CHGTIME | ATTR_CMN_ACCTIME | \
+                           ATTR_CMN_BKUPTIME | ATTR_CMN_OWNERID | \
+                           ATTR_CMN_GRPID | ATTR_CMN_ACCESSMASK | \
+                           ATTR_CMN_FLAGS | ATTR_CMN_FILEID | \
+                           ATTR_CMN_ERROR)
+#define BULK_DIR_ATTRS    (ATTR_DIR_LINKCOUNT | ATTR_DIR_ALLOCSIZE | \
+                           ATTR_DIR_DATALENGTH)
+#define BULK_FILE_ATTRS   (ATTR_FILE_LINKCOUNT | ATTR_FILE_DEVTYPE | \
+                           ATTR_FILE_DATALENGTH | ATTR_FILE_DATAALLOCSIZE)
+
+// Attributes that have to be returned for an entry to be cached
+#define BULK_REQUIRED_COMMON_ATTRS (BULK_COMMON_ATTRS & ~ATTR_CMN_ERROR)
+
+/*
+ * Directory snapshot cache
+ *
+ * With the dir_cache=N mount option, the entries of up to N directories are
+ * kept in memory after they have been listed. A snapshot stores inode, type
+ * and name of every entry back to back in a single arena, plus an index that
+ * maps the (stable) offset handed to the filler to the entry. It is valid
+ * for as long as the directory's inode, modification time and status change
+ * time are unchanged, which loopback_opendir checks with a single lstat().
+ *
+ * Snapshots of directories modified less than LOOPBACK_RACY_SECONDS ago
+ * are never cached (see above).
+ */
+
+struct dir_snap_entry {
+    uint64_t ino;
+    uint8_t type;
+    char name[];
+};
+
+struct dir_snapshot {
+    struct dir_snapshot *hash_next;
+    struct dir_snapshot *lru_prev;
+    struct dir_snapshot *lru_next;
+    uint64_t hash;
+    int refs;
+    bool cached;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    struct timespec ctime;
+    uint32_t count;
+    uint32_t *index;
+    char *arena;
+    size_t arena_size;
+    size_t arena_used;
+    char path[];
+};
+
+static struct {
+    bool enabled;
+    pthread_mutex_t lock;
+    struct dir_snapshot **table;
+    size_t mask;
+    struct dir_snapshot lru;
+    size_t count;
+    size_t max;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} dir_cache;
+
+static void
+dir_cache_init(uint32_t entries)
+{
+    size_t nbuckets = 1;
+    
+    if (entries == 0) {
+        return;
+    }
+    
+    while (nbuckets < entries) {
+        nbuckets <<= 1;
+    }
+    
+    dir_cache.table = calloc(nbuckets, sizeof(struct dir_snapshot *));
+    if (dir_cache.table == NULL) {
+        fprintf(stderr, "loopback: cannot allocate directory cache\n");
+        exit(1);
+    }
+    pthread_mutex_init(&dir_cache.lock, NULL);
+    dir_cache.mask = nbuckets - 1;
+    dir_cache.lru.lru_prev = &dir_cache.lru;
+    dir_cache.lru.lru_next = &dir_cache.lru;
+    dir_cache.max = entries;
+    dir_cache.enabled = true;
+}
+
+static void
+dir_snapshot_free(struct dir_snapshot *snap)
+{
+    free(snap->index);
+    free(snap->arena);
+    free(snap);
+}
+
+// Must be called with dir_cache.lock held
+static void
+dir_snapshot_release_locked(struct dir_snapshot *snap)
+{
+    if (--snap->refs == 0) {
+        dir_snapshot_free(snap);
+    }
+}
+
+static void
+dir_snapshot_release(struct dir_snapshot *snap)
+{
+    // Without the cache, a snapshot belongs to a single listing
+    if (!dir_cache.enabled) {
+        dir_snapshot_free(snap);
+        return;
+    }
+    
+    pthread_mutex_lock(&dir_cache.lock);
+    dir_snapshot_release_locked(snap);
+    pthread_mutex_unlock(&dir_cache.lock);
+}
+
+// Must be called with dir_cache.lock held
+static void
+dir_cache_remove_locked(struct dir_snapshot *snap)
+{
+    struct dir_snapshot **pp = &dir_cache.table[snap->hash & dir_cache.mask];
+    
+    while (*pp != snap) {
+        pp = &(*pp)->hash_next;
+    }
+    *pp = snap->hash_next;
+    
+    snap->lru_prev->lru_next = snap->lru_next;
+    snap->lru_next->lru_prev = snap->lru_prev;
+    snap->cached = false;
+    dir_cache.count--;
+    
+    dir_snapshot_release_locked(snap);
+}
+
+static inline bool
+dir_snapshot_matches(const struct dir_snapshot *snap, const struct stat *st)
+{
+    return snap->dev == st->st_dev && snap->ino == st->st_ino &&
+           snap->mtime.tv_sec == st->st_mtimespec.tv_sec &&
+           snap->mtime.tv_nsec == st->st_mtimespec.tv_nsec &&
+           snap->ctime.tv_sec == st->st_ctimespec.tv_sec &&
+           snap->ctime.tv_nsec == st->st_ctimespec.tv_nsec;
+}
+
+// Returns a referenced snapshot of path that matches st, or NULL
+static struct dir_snapshot *
+dir_cache_lookup(const char *path, const struct stat *st)
+{
+    uint64_t hash = loopback_hash(path);
+    struct dir_snapshot *snap;
+    
+    pthread_mutex_lock(&dir_cache.lock);
+    
+    for (snap = dir_cache.table[hash & dir_cache.mask]; snap != NULL;
+         snap = snap->hash_next) {
+        if (snap->hash == hash && strcmp(snap->path, path) == 0) {
+            break;
+        }
+    }
+    
+    if (snap != NULL) {
+        if (dir_snapshot_matches(snap, st)) {
+            snap->lru_prev->lru_next = snap->lru_next;
+            snap->lru_next->lru_prev = snap->lru_prev;
+            snap->lru_next = dir_cache.lru.lru_next;
+            snap->lru_prev = &dir_cache.lru;
+            dir_cache.lru.lru_next->lru_prev = snap;
+            dir_cache.lru.lru_next = snap;
+            
+            snap->refs++;
+            dir_cache.hits++;
+            pthread_mutex_unlock(&dir_cache.lock);
+            return snap;
+        }
+        dir_cache_remove_locked(snap);
+    }
+    
+    dir_cache.misses++;
+    pthread_mutex_unlock(&dir_cache.lock);
+    return NULL;
+}
+
+static void
+dir_cache_insert(struct dir_snapshot *snap)
+{
+    struct dir_snapshot *old;
+    
+    pthread_mutex_lock(&dir_cache.lock);
+    
+    for (old = dir_cache.table[snap->hash & dir_cache.mask]; old != NULL;
+         old = old->hash_next) {
+        if (old->hash == snap->hash && strcmp(old->path, snap->path) == 0) {
+            dir_cache_remove_locked(old);
+            break;
+        }
+    }
+    
+    while (dir_cache.count >= dir_cache.max) {
+        dir_cache_remove_locked(dir_cache.lru.lru_prev);
+        dir_cache.evictions++;
+    }
+    
+    snap->refs++;
+    snap->cached = true;
+    snap->hash_next = dir_cache.table[snap->hash & dir_cache.mask];
+    dir_cache.table[snap->hash & dir_cache.mask] = snap;
+    snap->lru_next = dir_cache.lru.lru_next;
+    snap->lru_prev = &dir_cache.lru;
+    dir_cache.lru.lru_next->lru_prev = snap;
+    dir_cache.lru.lru_next = snap;
+    dir_cache.count++;
+    
+    pthread_mutex_unlock(&dir_cache.lock);
+}
+
+static int
+dir_snapshot_add(struct dir_snapshot *snap, const struct dirent *entry)
+{
+    size_t namelen = strlen(entry->d_name) + 1;
+    size_t size = offsetof(struct dir_snap_entry, name) + namelen;
+    struct dir_snap_entry *e;
+    
+    // Keep entries 8-byte aligned
+    size = (size + 7) & ~(size_t)7;
+    
+    if (snap->arena_used + size > snap->arena_size) {
+        size_t arena_size = snap->arena_size * 2;
+        char *arena;
+        
+        while (snap->arena_used + size > arena_size) {
+            arena_size *= 2;
+        }
+        arena = realloc(snap->arena, arena_size);
+        if (arena == NULL) {
+            return -ENOMEM;
+        }
+        snap->arena = arena;
+        snap->arena_size = arena_size;
+    }
+    
+    if ((snap->count & (snap->count - 1)) == 0 && snap->count >= 64) {
+        uint32_t *index = realloc(snap->index,
+                                  2 * snap->count * sizeof(uint32_t));
+        if (index == NULL) {
+            return -ENOMEM;
+        }
+        snap->index = index;
+    }
+    
+    e = (struct dir_snap_entry *)(snap->arena + snap->arena_used);
+    e->ino = entry->d_ino;
+    e->type = entry->d_type;
+    memcpy(e->name, entry->d_name, namelen);
+    
+    snap->index[snap->count++] = (uint32_t)snap->arena_used;
+    snap->arena_used += size;
+    
+    return 0;
+}
+
+// Returns a new, empty snapshot of the directory at path that st describes
+static struct dir_snapshot *
+dir_snapshot_new(const char *path, const struct stat *st)
+{
+    size_t len = strlen(path) + 1;
+    struct dir_snapshot *snap;
+    
+    snap = calloc(1, sizeof(struct dir_snapshot) + len);
+    if (snap == NULL) {
+        return NULL;
+    }
+    
+    snap->hash = loopback_hash(path);
+    snap->refs = 1;
+    snap->dev = st->st_dev;
+    snap->ino = st->st_ino;
+    snap->mtime = st->st_mtimespec;
+    snap->ctime = st->st_ctimespec;
+    memcpy(snap->path, path, len);
+    
+    snap->arena_size = 4096;
+    snap->arena = malloc(snap->arena_size);
+    snap->index = malloc(64 * sizeof(uint32_t));
+    if (snap->arena == NULL || snap->index == NULL) {
+        dir_snapshot_free(snap);
+        return NULL;
+    }
+    
+    return snap;
+}
+
+/*
+ * Reads the whole directory into a new snapshot. The directory is stat'ed
+ * again afterwards; if it changed while it was being read, the snapshot is
+ * still good enough for this listing but must not be cached.
+ */
+static int
+dir_snapshot_build(const char *path, const struct stat *st,
+                   struct dir_snapshot **snapp)
+{
+    struct dir_snapshot *snap;
+    struct dirent *entry;
+    struct stat after;
+    DIR *dp;
+    int res = 0;
+    
+    snap = dir_snapshot_new(path, st);
+    if (snap == NULL) {
+        return -ENOMEM;
+    }
+    
+    dp = loopback_opendirat(path);
+    if (dp == NULL) {
+        res = -errno;
+        dir_snapshot_free(snap);
+        return res;
+    }
+    
+    while ((entry = readdir(dp)) != NULL) {
+        res = dir_snapshot_add(snap, entry);
+        if (res != 0) {
+            closedir(dp);
+            dir_snapshot_free(snap);
+            return res;
+        }
+    }
+    
+    closedir(dp);
+    
+    if (loopback_lstat(path, &after) == 0 && dir_snapshot_matches(snap, &after) &&
+        !loopback_racy(&snap->mtime) && !loopback_racy(&snap->ctime)) {
+        dir_cache_insert(snap);
+    }
+    
+    *snapp = snap;
+    return 0;
+}
+
+/*
+ * Warm start index
+ *
+ * With the warm_index=FILE mount option, the directory snapshot cache
+ * survives a remount. loopback_destroy() writes the cached snapshots to FILE,
+ * most recently used first, and loopback_init() maps it. When a directory
+ * misses the cache, its path is looked up in the mapping, and a snapshot found
+ * there is used if the directory's inode, modification time and status change
+ * time still match. This is the same lstat() check that every cached snapshot
+ * passes. Nothing is read or parsed at mount: the pages of the index are
+ * faulted in as directories are looked up, and only the snapshots that are
+ * used are copied out of it.
+ *
+ * An index written for another root or by another version is ignored.
+ * Attributes are not saved, since checking them would take the lstat() it
+ * takes to fetch them. Requires dir_cache.
+ */
+
+#define WARM_MAGIC   "LBWARM1"
+#define WARM_VERSION 1
+
+#define WARM_ALIGN(n) (((uint64_t)(n) + 7) & ~(uint64_t)7)
+
+// Followed by the hash table, an offset per slot and zero for empty slots
+struct warm_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;         // Directories
+    uint64_t buckets;       // Slots, a power of two
+    uint64_t root_dev;
+    uint64_t root_ino;
+    uint64_t size;          // Of the whole file
+};
+
+// Followed by the path, the index and the arena of the snapshot, 8-byte aligned
+struct warm_dir {
+    uint64_t hash;
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+    uint32_t count;
+    uint32_t path_len;      // With the NUL
+    uint64_t arena_size;
+};
+
+static struct {
+    bool enabled;
+    char *path;
+    const char *map;        // NULL if there is no usable index
+    size_t size;
+    uint64_t loaded;
+    uint64_t stale;
+    uint64_t saved;
+} warm_index;
+
+static void
+warm_index_init(const char *path)
+{
+    char cwd[MAXPATHLEN];
+    
+    if (path == NULL) {
+        return;
+    }
+    if (!dir_cache.enabled) {
+        fprintf(stderr, "loopback: warm_index requires dir_cache\n");
+        exit(1);
+    }
+    
+    // libfuse changes to "/" when it daemonizes
+    if (path[0] == '/') {
+        warm_index.path = strdup(path);
+    } else if (getcwd(cwd, sizeof(cwd)) != NULL) {
+        asprintf(&warm_index.path, "%s/%s", cwd, path);
+    }
+    if (warm_index.path == NULL) {
+        fprintf(stderr, "loopback: invalid warm index path\n");
+        exit(1);
+    }
+    
+    warm_index.enabled = true;
+}
+
+static inline uint64_t
+warm_dir_size(const struct warm_dir *d)
+{
+    return sizeof(*d) + WARM_ALIGN(d->path_len) +
+           WARM_ALIGN((uint64_t)d->count * sizeof(uint32_t)) + d->arena_size;
+}
+
+// Maps the index saved by the previous mount, if it fits this root
+static void
+warm_index_load(void)
+{
+    const struct warm_header *header;
+    struct stat st;
+    struct stat root;
+    void *map;
+    int fd;
+    
+    if (!warm_index.enabled) {
+        return;
+    }
+    
+    fd = open(warm_index.path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(*header) ||
+        fstat(loopback.root_fd, &root) == -1) {
+        close(fd);
+        return;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return;
+    }
+    
+    header = map;
+    if (memcmp(header->magic, WARM_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != WARM_VERSION ||
+        header->size != (uint64_t)st.st_size ||
+        header->buckets == 0 ||
+        (header->buckets & (header->buckets - 1)) != 0 ||
+        header->buckets > (header->size - sizeof(*header)) / sizeof(uint64_t) ||
+        header->root_dev != (uint64_t)root.st_dev ||
+        header->root_ino != (uint64_t)root.st_ino) {
+        munmap(map, st.st_size);
+        return;
+    }
+    
+    warm_index.map = map;
+    warm_index.size = st.st_size;
+}
+
+// Returns a new snapshot of path from the index if it still matches st
+static struct dir_snapshot *
+warm_index_lookup(const char *path, const struct stat *st)
+{
+    const struct warm_header *header;
+    const uint64_t *table;
+    const struct warm_dir *d = NULL;
+    const uint32_t *index;
+    const char *arena;
+    struct dir_snapshot *snap;
+    uint64_t hash;
+    uint64_t slot;
+    uint64_t i;
+    
+    if (warm_index.map == NULL) {
+        return NULL;
+    }
+    
+    header = (const struct warm_header *)warm_index.map;
+    table = (const uint64_t *)(header + 1);
+    hash = loopback_hash(path);
+    for (i = 0; i < header->buckets; i++) {
+        uint64_t offset;
+        
+        slot = (hash + i) & (header->buckets - 1);
+        offset = table[slot];
+        if (offset == 0 || offset > warm_index.size - sizeof(*d)) {
+            return NULL;
+        }
+        
+        d = (const struct warm_dir *)(warm_index.map + offset);
+        if (warm_dir_size(d) > warm_index.size - offset) {
+            return NULL;
+        }
+        if (d->hash == hash && d->path_len > 0 &&
+            ((const char *)(d + 1))[d->path_len - 1] == '\0' &&
+            strcmp((const char *)(d + 1), path) == 0) {
+            break;
+        }
+        d = NULL;
+    }
+    if (d == NULL) {
+        return NULL;
+    }
+    
+    if (d->dev != (uint64_t)st->st_dev || d->ino != (uint64_t)st->st_ino ||
+        d->mtime_sec != st->st_mtimespec.tv_sec ||
+        d->mtime_nsec != st->st_mtimespec.tv_nsec ||
+        d->ctime_sec != st->st_ctimespec.tv_sec ||
+        d->ctime_nsec != st->st_ctimespec.tv_nsec) {
+        __atomic_add_fetch(&warm_index.stale, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    
+    index = (const uint32_t *)((const char *)(d + 1) +
+                               WARM_ALIGN(d->path_len));
+    arena = (const char *)index +
+            WARM_ALIGN((uint64_t)d->count * sizeof(uint32_t));
+    // Names are read with the string functions, they must end in the arena
+    if (d->arena_size > 0 && arena[d->arena_size - 1] != '\0') {
+        return NULL;
+    }
+    for (i = 0; i < d->count; i++) {
+        if (d->arena_size < sizeof(struct dir_snap_entry) ||
+            index[i] > d->arena_size - sizeof(struct dir_snap_entry)) {
+            return NULL;
+        }
+    }
+    
+    snap = dir_snapshot_new(path, st);
+    if (snap == NULL) {
+        return NULL;
+    }
+    
+    // A snapshot from the index is complete, nothing is added to it later
+    free(snap->arena);
+    free(snap->index);
+    snap->arena = malloc(MAX(d->arena_size, 1));
+    snap->index = malloc(MAX(d->count, 1) * sizeof(uint32_t));
+    if (snap->arena == NULL || snap->index == NULL) {
+        dir_snapshot_free(snap);
+        return NULL;
+    }
+    memcpy(snap->arena, arena, d->arena_size);
+    memcpy(snap->index, index, d->count * sizeof(uint32_t));
+    snap->arena_size = d->arena_size;
+    snap->arena_used = d->arena_size;
+    snap->count = d->count;
+    
+    __atomic_add_fetch(&warm_index.loaded, 1, __ATOMIC_RELAXED);
+    return snap;
+}
+
+static int
+warm_index_write(const char *buf, size_t size)
+{
+    char *tmp;
+    int fd;
+    int res = 0;
+    
+    if (asprintf(&tmp, "%s.tmp", warm_index.path) == -1) {
+        return ENOMEM;
+    }
+    
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        res = errno;
+    } else {
+        while (size > 0) {
+            ssize_t n = write(fd, buf, size);
+            
+            if (n == -1) {
+                res = errno;
+                break;
+            }
+            buf += n;
+            size -= n;
+        }
+        if (close(fd) == -1 && res == 0) {
+            res = errno;
+        }
+    }
+    
+    // Replaced in one step, so that the next mount sees all of it or none
+    if (res == 0 && rename(tmp, warm_index.path) == -1) {
+        res = errno;
+    }
+    if (res != 0) {
+        unlink(tmp);
+    }
+    free(tmp);
+    return res;
+}
+
+// Writes the cached snapshots to the index for the next mount
+static void
+warm_index_save(void)
+{
+    struct warm_header *header;
+    struct dir_snapshot *snap;
+    struct stat root;
+    uint64_t *table;
+    uint64_t buckets = 16;
+    uint64_t size;
+    char *buf;
+    int res;
+    
+    if (!warm_index.enabled || fstat(loopback.root_fd, &root) == -1) {
+        return;
+    }
+    
+    pthread_mutex_lock(&dir_cache.lock);
+    
+    // At most half full, so that probes end quickly
+    while (buckets < 2 * (uint64_t)dir_cache.count) {
+        buckets <<= 1;
+    }
+    size = sizeof(*header) + buckets * sizeof(uint64_t);
+    for (snap = dir_cache.lru.lru_next; snap != &dir_cache.lru;
+         snap = snap->lru_next) {
+        size += sizeof(struct warm_dir) + WARM_ALIGN(strlen(snap->path) + 1) +
+                WARM_ALIGN((uint64_t)snap->count * sizeof(uint32_t)) +
+                WARM_ALIGN(snap->arena_used);
+    }
+    
+    buf = calloc(1, size);
+    if (buf == NULL) {
+        pthread_mutex_unlock(&dir_cache.lock);
+        fprintf(stderr, "loopback: cannot allocate warm index\n");
+        return;
+    }
+    
+    header = (struct warm_header *)buf;
+    memcpy(header->magic, WARM_MAGIC, sizeof(header->magic));
+    header->version = WARM_VERSION;
+    header->buckets = buckets;
+    header->root_dev = root.st_dev;
+    header->root_ino = root.st_ino;
+    header->size = size;
+    table = (uint64_t *)(header + 1);
+    
+    size = sizeof(*header) + buckets * sizeof(uint64_t);
+    for (snap = dir_cache.lru.lru_next; snap != &dir_cache.lru;
+         snap = snap->lru_next) {
+        struct warm_dir *d = (struct warm_dir *)(buf + size);
+        char *p = (char *)(d + 1);
+        uint64_t slot = snap->hash & (buckets - 1);
+        
+        d->hash = snap->hash;
+        d->dev = snap->dev;
+        d->ino = snap->ino;
+        d->mtime_sec = snap->mtime.tv_sec;
+        d->mtime_nsec = snap->mtime.tv_nsec;
+        d->ctime_sec = snap->ctime.tv_sec;
+        d->ctime_nsec = snap->ctime.tv_nsec;
+        d->count = snap->count;
+        d->path_len = (uint32_t)strlen(snap->path) + 1;
+        d->arena_size = WARM_ALIGN(snap->arena_used);
+        
+        memcpy(p, snap->path, d->path_len);
+        p += WARM_ALIGN(d->path_len);
+        memcpy(p, snap->index, snap->count * sizeof(uint32_t));
+        p += WARM_ALIGN((uint64_t)snap->count * sizeof(uint32_t));
+        memcpy(p, snap->arena, snap->arena_used);
+        
+        while (table[slot] != 0) {
+            slot = (slot + 1) & (buckets - 1);
+        }
+        table[slot] = size;
+        
+        size += warm_dir_size(d);
+        header->count++;
+    }
+    
+    pthread_mutex_unlock(&dir_cache.lock);
+    
+    res = warm_index_write(buf, size);
+    if (res != 0) {
+        fprintf(stderr, "loopback: cannot write warm index: %s\n",
+                strerror(res));
+    } else {
+        warm_index.saved = header->count;
+    }
+    free(buf);
+}
+
+static void
+warm_index_report(FILE *out)
+{
+    if (!warm_index.enabled) {
+        return;
+    }
+    
+    fprintf(out, "loopback: warm index: %llu snapshots loaded, %llu stale, "
+            "%llu saved\n",
+            (unsigned long long)__atomic_load_n(&warm_index.loaded,
+                                                __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&warm_index.stale,
+                                                __ATOMIC_RELAXED),
+            (unsigned long long)warm_index.saved);
+}
+
+static int
+dir_cache_open(const char *path, struct dir_snapshot **snapp)
+{
+    struct stat st;
+    
+    if (loopback_lstat(path, &st) == -1) {
+        return -errno;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        return -ENOTDIR;
+    }
+    
+    *snapp = dir_cache_lookup(path, &st);
+    if (*snapp != NULL) {
+        return 0;
+    }
+    
+    *snapp = warm_index_lookup(path, &st);
+    if (*snapp != NULL) {
+        dir_cache_insert(*snapp);
+        return 0;
+    }
+    
+    return dir_snapshot_build(path, &st, snapp);
+}
+
+static void
+dir_cache_report(FILE *out)
+{
+    if (!dir_cache.enabled) {
+        return;
+    }
+    
+    pthread_mutex_lock(&dir_cache.lock);
+    fprintf(out, "loopback: directory cache: %llu hits, %llu misses, "
+            "%llu evictions, %zu directories\n",
+            (unsigned long long)dir_cache.hits,
+            (unsigned long long)dir_cache.misses,
+            (unsigned long long)dir_cache.evictions, dir_cache.count);
+    pthread_mutex_unlock(&dir_cache.lock);
+}
+
+struct loopback_dirp {
+    DIR *dp;
+    struct dirent *entry;
+    off_t offset;
+    
+    // Snapshot from the directory cache, dp is NULL in this mode
+    struct dir_snapshot *snap;
+    
+    // getattrlistbulk() state, dp is NULL in this mode
+    int fd;
+    char *buf;
+    char *next;
+    int remaining;
+    uint64_t ticket;
+    char *path;
+};
+
+static int
+loopback_opendir(const char *path, struct fuse_file_info *fi)
+{
+    int res;
+    
+    struct loopback_dirp *d = malloc(sizeof(struct loopback_dirp));
+    if (d == NULL) {
+        return -ENOMEM;
+    }
+    
+    d->dp = NULL;
+    d->snap = NULL;
+    d->fd = -1;
+    d->buf = NULL;
+    d->next = NULL;
+    d->remaining = 0;
+    d->ticket = 0;
+    d->path = NULL;
+    
+    if (dir_cache.enabled) {
+        res = dir_cache_open(path, &d->snap);
+        if (res != 0) {
+            free(d);
+            return res;
+        }
+    } else if (loopback.readdir_bulk) {
+        d->fd = loopback_openat(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+        if (d->fd == -1) {
+            res = -errno;
+            free(d);
+            return res;
+        }
+        
+        d->buf = malloc(BULK_BUFFER_SIZE);
+        
+        // The path is only needed to seed the attribute cache
+        if (attr_cache.enabled) {
+            d->path = strdup(path);
+        }
+        
+        if (d->buf == NULL || (attr_cache.enabled && d->path == NULL)) {
+            close(d->fd);
+            free(d->buf);
+            free(d->path);
+            free(d);
+            return -ENOMEM;
+        }
+    } else {
+        d->dp = loopback_opendirat(path);
+        if (d->dp == NULL) {
+            res = -errno;
+            free(d);
+            return res;
+        }
+    }
+    
+    d->offset = 0;
+    d->entry = NULL;
+    
+    fi->fh = (unsigned long)d;
+    
+    return 0;
+}
+
+static inline struct loopback_dirp *
+get_dirp(struct fuse_file_info *fi)
+{
+    return (struct loopback_dirp *)(uintptr_t)fi->fh;
+}
+
+#define BULK_GET(p, value) \
+    do { memcpy(&(value), (p), sizeof(value)); (p) += sizeof(value); } while (0)
+
+/*
+ * Decodes one getattrlistbulk() entry. Returns true if all attributes needed
+ * for a complete struct stat were returned.
+ */
+static bool
+loopback_bulk_parse(char *entry, const char **name, struct stat *st,
+                    struct timespec *bkuptime)
+{
+    char *p = entry + sizeof(uint32_t);
+    attribute_set_t returned;
+    attrreference_t name_ref;
+    fsobj_type_t type = VNON;
+    uint32_t u32;
+    uint64_t u64;
+    bool complete;
+    
+    memset(st, 0, sizeof(struct stat));
+    memset(bkuptime, 0, sizeof(struct timespec));
+    
+    BULK_GET(p, returned);
+    
+    // The error, if any, precedes all other attributes
+    if (returned.commonattr & ATTR_CMN_ERROR) {
+        BULK_GET(p, u32);
+    } else {
+        u32 = 0;
+    }
+    
+    BULK_GET(p, name_ref);
+    *name = (const char *)(p - sizeof(name_ref)) + name_ref.attr_dataoffset;
+    
+    if (u32 != 0) {
+        return false;
+    }
+    
+    complete = (returned.commonattr & BULK_REQUIRED_COMMON_ATTRS) ==
+               BULK_REQUIRED_COMMON_ATTRS;
+    
+    if (returned.commonattr & ATTR_CMN_DEVID) {
+        BULK_GET(p, u32);
+        st->st_dev = u32;
+    }
+    if (returned.commonattr & ATTR_CMN_OBJTYPE) {
+        BULK_GET(p, type);
+    }
+    if (returned.commonattr & ATTR_CMN_CRTIME) {
+        BULK_GET(p, st->st_birthtimespec);
+    }
+    if (returned.commonattr & ATTR_CMN_MODTIME) {
+        BULK_GET(p, st->st_mtimespec);
+    }
+    if (returned.commonattr & ATTR_CMN_CHGTIME) {
+        BULK_GET(p, st->st_ctimespec);
+    }
+    if (returned.commonattr & ATTR_CMN_ACCTIME) {
+        BULK_GET(p, st->st_atimespec);
+    }
+    if (returned.commonattr & ATTR_CMN_BKUPTIME) {
+        BULK_GET(p, *bkuptime);
+    }
+    if (returned.commonattr & ATTR_CMN_OWNERID) {
+        BULK_GET(p, u32);
+        st->st_uid = u32;
+    }
+    if (returned.commonattr & ATTR_CMN_GRPID) {
+        BULK_GET(p, u32);
+        st->st_gid = u32;
+    }
+    if (returned.commonattr & ATTR_CMN_ACCESSMASK) {
+        BULK_GET(p, u32);
+        st->st_mode = u32 & ~S_IFMT;
+    }
+    if (returned.commonattr & ATTR_CMN_FLAGS) {
+        BULK_GET(p, u32);
+        st->st_flags = u32;
+    }
+    if (returned.commonattr & ATTR_CMN_FILEID) {
+        BULK_GET(p, u64);
+        st->st_ino = u64;
+    }
+    
+    switch (type) {
+        case VREG:  st->st_mode |= S_IFREG;  break;
+        case VDIR:  st->st_mode |= S_IFDIR;  break;
+        case VBLK:  st->st_mode |= S_IFBLK;  break;
+        case VCHR:  st->st_mode |= S_IFCHR;  break;
+        case VLNK:  st->st_mode |= S_IFLNK;  break;
+        case VSOCK: st->st_mode |= S_IFSOCK; break;
+        case VFIFO: st->st_mode |= S_IFIFO;  break;
+        default:    complete = false;        break;
+    }
+    
+    if (type == VDIR) {
+        off_t allocsize = 0;
+        
+        if (returned.dirattr & ATTR_DIR_LINKCOUNT) {
+            BULK_GET(p, u32);
+            st->st_nlink = u32;
+        }
+        if (returned.dirattr & ATTR_DIR_ALLOCSIZE) {
+            BULK_GET(p, allocsize);
+            st->st_blocks = allocsize / 512;
+        }
+        if (returned.dirattr & ATTR_DIR_DATALENGTH) {
+            BULK_GET(p, st->st_size);
+        }
+        complete = complete && returned.dirattr == BULK_DIR_ATTRS;
+    } else {
+        off_t allocsize = 0;
+        
+        if (returned.fileattr & ATTR_FILE_LINKCOUNT) {
+            BULK_GET(p, u32);
+            st->st_nlink = u32;
+        }
+        if (returned.fileattr & ATTR_FILE_DEVTYPE) {
+            BULK_GET(p, u32);
+            st->st_rdev = u32;
+        }
+        if (returned.fileattr & ATTR_FILE_DATALENGTH) {
+            BULK_GET(p, st->st_size);
+        }
+        if (returned.fileattr & ATTR_FILE_DATAALLOCSIZE) {
+            BULK_GET(p, allocsize);
+            st->st_blocks = allocsize / 512;
+        }
+        complete = complete && returned.fileattr == BULK_FILE_ATTRS;
+    }
+    
+    // Set by loopback_bulk_seed(), which knows the path
+    st->st_blksize = 0;
+    
+    return complete;
+}
+
+// Fetches the next batch of entries, returns 0 at the end of the directory
+static int
+loopback_bulk_fill(struct loopback_dirp *d)
+{
+    struct attrlist attributes;
+    int count;
+    
+    memset(&attributes, 0, sizeof(attributes));
+    attributes.bitmapcount = ATTR_BIT_MAP_COUNT;
+    attributes.commonattr = BULK_COMMON_ATTRS;
+    attributes.dirattr = BULK_DIR_ATTRS;
+    attributes.fileattr = BULK_FILE_ATTRS;
+    
+    if (attr_cache.enabled) {
+        d->ticket = __atomic_load_n(&attr_cache.epoch, __ATOMIC_ACQUIRE);
+    }
+    
+    count = getattrlistbulk(d->fd, &attributes, d->buf, BULK_BUFFER_SIZE, 0);
+    if (count == -1) {
+        return -errno;
+    }
+    
+    d->next = d->buf;
+    d->remaining = count;
+    
+    return count;
+}
+
+static inline void
+loopback_bulk_advance(struct loopback_dirp *d)
+{
+    uint32_t length;
+    
+    memcpy(&length, d->next, sizeof(length));
+    d->next += length;
+    d->remaining--;
+    d->offset++;
+}
+
+static void
+loopback_bulk_seed(struct loopback_dirp *d, const char *name,
+                   const struct stat *st, const struct timespec *bkuptime)
+{
+    char path[MAXPATHLEN];
+    struct stat seeded;
+    int len;
+    
+    if (strcmp(d->path, "/") == 0) {
+        len = snprintf(path, sizeof(path), "/%s", name);
+    } else {
+        len = snprintf(path, sizeof(path), "%s/%s", d->path, name);
+    }
+    if (len >= sizeof(path)) {
+        return;
+    }
+    
+    seeded = *st;
+    seeded.st_blksize = loopback_blksize(path, &seeded);
+    
+    attr_cache_insert(path, &seeded, d->ticket);
+    attr_cache_set_bkuptime(path, bkuptime, d->ticket);
+}
+
+static int
+loopback_readdir_bulk(struct loopback_dirp *d, void *buf,
+                      fuse_fill_dir_t filler, off_t offset)
+{
+    int res;
+    
+    /*
+     * Offsets 1 and 2 are "." and "..", which getattrlistbulk() does not
+     * return. Entry n of the enumeration has offset n + 2.
+     */
+    if (offset != d->offset) {
+        if (lseek(d->fd, 0, SEEK_SET) == -1) {
+            return -errno;
+        }
+        d->remaining = 0;
+        d->offset = 0;
+        
+        while (d->offset < offset && d->offset < 2) {
+            d->offset++;
+        }
+        while (d->offset < offset) {
+            if (d->remaining == 0) {
+                res = loopback_bulk_fill(d);
+                if (res <= 0) {
+                    return res;
+                }
+            }
+            loopback_bulk_advance(d);
+        }
+    }
+    
+    while (1) {
+        struct stat st;
+        struct timespec bkuptime;
+        const char *name;
+        bool complete;
+        
+        if (d->offset < 2) {
+            memset(&st, 0, sizeof(st));
+            st.st_mode = S_IFDIR;
+            
+            if (filler(buf, d->offset == 0 ? "." : "..", &st,
+                       d->offset + 1)) {
+                break;
+            }
+            d->offset++;
+            continue;
+        }
+        
+        if (d->remaining == 0) {
+            res = loopback_bulk_fill(d);
+            if (res < 0) {
+                return res;
+            }
+            if (res == 0) {
+                break;
+            }
+        }
+        
+        complete = loopback_bulk_parse(d->next, &name, &st, &bkuptime);
+        
+        if (filler(buf, name, &st, d->offset + 1)) {
+            break;
+        }
+        
+        if (complete && attr_cache.enabled) {
+            loopback_bulk_seed(d, name, &st, &bkuptime);
+        }
+        
+        loopback_bulk_advance(d);
+    }
+    
+    return 0;
+}
+
+static int
+loopback_readdir_snapshot(struct dir_snapshot *snap, void *buf,
+                          fuse_fill_dir_t filler, off_t offset)
+{
+    uint32_t i;
+    
+    // Entry i of the snapshot has offset i + 1, see loopback_readdir()
+    for (i = offset; i < snap->count; i++) {
+        struct dir_snap_entry *e;
+        struct stat st;
+        
+        e = (struct dir_snap_entry *)(snap->arena + snap->index[i]);
+        
+        memset(&st, 0, sizeof(st));
+        st.st_ino = e->ino;
+        st.st_mode = e->type << 12;
+        
+        if (filler(buf, e->name, &st, i + 1)) {
+            break;
+        }
+    }
+    
+    return 0;
+}
+
+static int
+loopback_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                 off_t offset, struct fuse_file_info *fi)
+{
+    struct loopback_dirp *d = get_dirp(fi);
+    
+    (void)path;
+    
+    if (d->snap != NULL) {
+        return loopback_readdir_snapshot(d->snap, buf, filler, offset);
+    }
+    if (d->dp == NULL) {
+        return loopback_readdir_bulk(d, buf, filler, offset);
+    }
+    
+    if (offset == 0) {
+        rewinddir(d->dp);
+        d->entry = NULL;
+        d->offset = 0;
+    } else if (offset != d->offset) {
+        // Subtract the one that we add when calling telldir() below
+        seekdir(d->dp, offset - 1);
+        d->entry = NULL;
+        d->offset = offset;
+    }
+    
+    while (1) {
+        struct stat st;
+        off_t nextoff;
+        
+        if (!d->entry) {
+            d->entry = readdir(d->dp);
+            if (!d->entry) {
+                break;
+            }
+        }
+        
+        memset(&st, 0, sizeof(st));
+        st.st_ino = d->entry->d_ino;
+        st.st_mode = d->entry->d_type << 12;
+        
+        /*
+         * Under macOS, telldir() may return 0 the first time it is called.
+         * But for libfuse, an offset of zero means that offsets are not
+         * supported, so we shift everything by one.
+         */
+        nextoff = telldir(d->dp) + 1;
+        
+        if (filler(buf, d->entry->d_name, &st, nextoff)) {
+            break;
+        }
+        
+        d->entry = NULL;
+        d->offset = nextoff;
+    }
+    
+    return 0;
+}
+
+static int
+loopback_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    struct loopback_dirp *d = get_dirp(fi);
+    
+    (void)path;
+    
+    if (d->snap != NULL) {
+        dir_snapshot_release(d->snap);
+    } else if (d->dp == NULL) {
+        close(d->fd);
+        free(d->buf);
+        free(d->path);
+    } else {
+        closedir(d->dp);
+    }
+    free(d);
+    
+    return 0;
+}
+
+static int
+loopback_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+    char buf[MAXPATHLEN];
+    const char *real_path;
+    int res;
+    
+    // mkfifoat() and mknodat() are not available before macOS 13
+    real_path = loopback_real_path(path, buf, sizeof(buf));
+    if (real_path == NULL) {
+        return -errno;
+    }
+    
+    if (S_ISFIFO(mode)) {
+        res = mkfifo(real_path, mode);
+    } else {
+        res = mknod(real_path, mode, rdev);
+    }
+    
+    if (res == -1) {
+        return -errno;
+    }
+    
+    attr_cache_invalidate_entry(path);
+    neg_cache_invalidate(path, false);
+    
+    return 0;
+}
+
+static int
+loopback_mkdir(const char *path, mode_t mode)
+{
+    struct loopback_at at;
+    int res;
+    
+    res = loopback_at_get(path, &at);
+    if (res != 0) {
+        return res;
+    }
+    
+    res = mkdirat(at.dirfd, at.name, mode);
+    loopback_at_put(&at);
+    if (res == -1) {
+        return -errno;
+    }
+    
+    attr_cache_invalidate_entry(path);
+    neg_cache_invalidate(path, false);
+    
+    return 0;
+}
+
+static int
+loopback_unlink(const char *path)
+{
+    struct loopback_at at;
+    struct stat st;
+    bool linked;
+    int res;
+    
+    res = loopback_at_get(path, &at);
+    if (res != 0) {
+        return res;
+    }
+    
+    fd_cache_forget(path);
+    
+    // The link count of the other links changes, see attr_cache_invalidate()
+    linked = attr_cache.enabled &&
+             fstatat(at.dirfd, at.name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+             st.st_nlink > 1;
+    
+    res = unlinkat(at.dirfd, at.name, 0);
+    loopback_at_put(&at);
+    if (res == -1) {
+        return -errno;
+    }
+    
+    attr_cache_invalidate_entry(path);
+    if (linked) {
+        attr_cache_invalidate_inode(st.st_dev, st.st_ino);
+    }
+    statfs_cache_invalidate();
+    
+    return 0;
+}
+
+static int
+loopback_rmdir(const char *path)
+{
+    struct loopback_at at;
+    int res;
+    
+    res = loopback_at_get(path, &at);
+    if (res != 0) {
+        return res;
+    }
+    
+    res = unlinkat(at.dirfd, at.name, AT_REMOVEDIR);
+    loopback_at_put(&at);
+    if (res == -1) {
+        return -errno;
+    }
+    
+    attr_cache_invalidate_entry(path);
+    dirfd_cache_invalidate_tree(path);
+    statfs_cache_invalidate();
+    
+    return 0;
+}
+
+static int
+loopback_symlink(const char *from, const char *to)
+{
+    struct loopback_at at;
+    int res;
+    
+    res = loopback_at_get(to, &at);
+    if (res != 0) {
+        return res;
+    }
+    
+    res = symlinkat(from, at.dirfd, at.name);
+    loopback_at_put(&at);
+    if (res == -1) {
+        return -errno;
+    }
+    
+    attr_cache_invalidate_entry(to);
+    neg_cache_invalidate(to, true);
+    
+    return 0;
+}
+
+static int
+loopback_rename(const char *from, const char *to)
+{
+    struct loopback_at at1;
+    struct loopback_at at2;
+    int res;
+    
+    res = loopback_at_get(from, &at1);
+    if (res != 0) {
+        return res;
+    }
+    res = loopback_at_get(to, &at2);
+    if (res != 0) {
+        loopback_at_put(&at1);
+        return res;
+    }
+    
+    fd_cache_forget(to);
+    
+    res = renameat(at1.dirfd, at1.name, at2.dirfd, at2.name);
+    loopback_at_put(&at2);
+    loopback_at_put(&at1);
+    if (res == -1) {
+        return -errno;
+    }
+    
+    cache_invalidate_rename(from, to, false);
+    // A file that was replaced frees its space
+    statfs_cache_invalidate();
+    
+    return 0;
+}
+
+#if HAVE_EXCHANGE
+
+static int
+loopback_exchange(const char *path1, const char *path2, unsigned long options)
+{
+    char buf1[MAXPATHLEN];
+    char buf2[MAXPATHLEN];
+    const char *real_path1;
+    const char *real_path2;
+    int res;
+    
+    real_path1 = loopback_real_path(path1, buf1, sizeof(buf1));
+    real_path2 = loopback_real_path(path2, buf2, sizeof(buf2));
+    if (real_path1 == NULL || real_path2 == NULL) {
+        return -errno;
+    }
+    
+    res = exchangedata(real_path1, real_path2, options);
+    if (res == -1) {
+        return -errno;
+    }
+    
+    return 0;
+}
+
+#endif /* HAVE_EXCHANGE */
+
+static int
+loopback_link(const char *from, const char *to)
+{
+    struct loopback_at at1;
+    struct loopback_at at2;
+    int res;
+    
+    res = loopback_at_get(from, &at1);
+    if (res != 0) {
+        return res;
+    }
+    res = loopback_at_get(to, &at2);
+    if (res != 0) {
+        loopback_at_put(&at1);
+        return res;
+    }
+    
+    res = linkat(at1.dirfd, at1.name, at2.dirfd, at2.name, 0);
+    loopback_at_put(&at2);
+    loopback_at_put(&at1);
+    if (res == -1) {
+        return -errno;
+    }
+    
+    attr_cache_invalidate(from);
+    attr_cache_invalidate_entry(to);
+    neg_cache_invalidate(to, false);
+    
+    return 0;
+}
+
+#define SETATTR_LIST_MAX (5 * sizeof(struct timespec) + 4 * sizeof(uint32_t))
+
+#define SETATTR_PUT(p, value) \
+    do { memcpy((p), &(value), sizeof(value)); (p) += sizeof(value); } while (0)
+
+/*
+ * Packs everything in attr but the size into an attribute list for a single
+ * setattrlist() call. The values have to be in the order of their bits.
+ * Returns the length of the attribute buffer, zero if there is nothing to set.
+ */
+static size_t
+loopback_setattr_x_pack(const struct setattr_x *attr, struct attrlist *al,
+                        char *buf)
+{
+    char *p = buf;
+    u_int32_t u32;
+    
+    memset(al, 0, sizeof(struct attrlist));
+    al->bitmapcount = ATTR_BIT_MAP_COUNT;
+    
+    if (SETATTR_WANTS_CRTIME(attr)) {
+        al->commonattr |= ATTR_CMN_CRTIME;
+        SETATTR_PUT(p, attr->crtime);
+    }
+    if (SETATTR_WANTS_MODTIME(attr)) {
+        al->commonattr |= ATTR_CMN_MODTIME;
+        SETATTR_PUT(p, attr->modtime);
+    }
+    if (SETATTR_WANTS_CHGTIME(attr)) {
+        al->commonattr |= ATTR_CMN_CHGTIME;
+        SETATTR_PUT(p, attr->chgtime);
+    }
+    if (SETATTR_WANTS_ACCTIME(attr)) {
+        al->commonattr |= ATTR_CMN_ACCTIME;
+        SETATTR_PUT(p, attr->acctime);
+    } else if (SETATTR_WANTS_MODTIME(attr)) {
+        struct timeval tv;
+        struct timespec now;
+        
+        // Like utimes(), which sets both
+        gettimeofday(&tv, NULL);
+        now.tv_sec = tv.tv_sec;
+        now.tv_nsec = tv.tv_usec * 1000;
+        al->commonattr |= ATTR_CMN_ACCTIME;
+        SETATTR_PUT(p, now);
+    }
+    if (SETATTR_WANTS_BKUPTIME(attr)) {
+        al->commonattr |= ATTR_CMN_BKUPTIME;
+        SETATTR_PUT(p, attr->bkuptime);
+    }
+    if (SETATTR_WANTS_UID(attr)) {
+        u32 = attr->uid;
+        al->commonattr |= ATTR_CMN_OWNERID;
+        SETATTR_PUT(p, u32);
+    }
+    if (SETATTR_WANTS_GID(attr)) {
+        u32 = attr->gid;
+        al->commonattr |= ATTR_CMN_GRPID;
+        SETATTR_PUT(p, u32);
+    }
+    if (SETATTR_WANTS_MODE(attr)) {
+        u32 = attr->mode & ~S_IFMT;
+        al->commonattr |= ATTR_CMN_ACCESSMASK;
+        SETATTR_PUT(p, u32);
+    }
+    if (SETATTR_WANTS_FLAGS(attr)) {
+        u32 = attr->flags;
+        al->commonattr |= ATTR_CMN_FLAGS;
+        SETATTR_PUT(p, u32);
+    }
+    
+    return p - buf;
+}
+
+static int
+loopback_fsetattr_x_apply(struct loopback_file *f, struct setattr_x *attr)
+{
+    char buf[SETATTR_LIST_MAX];
+    struct attrlist attributes;
+    size_t len;
+    int res;
+    
+    // Truncation changes the modification time, so it has to come first
+    if (SETATTR_WANTS_SIZE(attr)) {
+        res = ftruncate(f->fd, attr->size);
+        if (res == -1) {
+            return -errno;
+        }
+    }
+    
+    len = loopback_setattr_x_pack(attr, &attributes, buf);
+    if (len == 0) {
+        return 0;
+    }
+    
+    res = fsetattrlist(f->fd, &attributes, buf, len, FSOPT_NOFOLLOW);
+    if (res == -1) {
+        return -errno;
+    }
+    
+    return 0;
+}
+
+static int
+loopback_fsetattr_x(const char *path, struct setattr_x *attr,
+                    struct fuse_file_info *fi)
+{
+    struct loopback_file *f = get_file(fi);
+    int res;
+    
+    (void)path;
+    
+    // Buffered writes must not land after a truncation
+    if (writeback.enabled && SETATTR_WANTS_SIZE(attr)) {
+        wb_flush_inode(f->dev, f->ino);
+    }
+    
+    res = loopback_fsetattr_x_apply(f, attr);
+    
+    // Even a failed call may have changed some of the attributes
+    loopback_file_invalidate(f);
+    if (SETATTR_WANTS_SIZE(attr)) {
+        statfs_cache_invalidate();
+    }
+    
+    return res;
+}
+
+static int
+loopback_setattr_x_at(int dirfd, const char *name, struct setattr_x *attr)
+{
+    char buf[SETATTR_LIST_MAX];
+    struct attrlist attributes;
+    size_t len;
+    int res;
+    
+    // See loopback_fsetattr_x_apply()
+    if (SETATTR_WANTS_SIZE(attr)) {
+        int fd;
+        
+        fd = openat(dirfd, name, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd == -1) {
+            return -errno;
+        }
+        res = ftruncate(fd, attr->size);
+        if (res == -1) {
+            res = -errno;
+            close(fd);
+            return res;
+        }
+        close(fd);
+    }
+    
+    len = loopback_setattr_x_pack(attr, &attributes, buf);
+    if (len == 0) {
+        return 0;
+    }
+    
+    res = setattrlistat(dirfd, name, &attributes, buf, len, FSOPT_NOFOLLOW);
+    if (res == -1) {
+        return -errno;
+    }
+    
+    return 0;
+}
+
+static int
+loopback_setattr_x_apply(const char *path, struct setattr_x *attr)
+{
+    struct loopback_at at;
+    int res;
+    
+    res = loopback_at_get(path, &at);
+    if (res != 0) {
+        return res;
+    }
+    
+    res = loopback_setattr_x_at(at.dirfd, at.name, attr);
+    loopback_at_put(&at);
+    
+    return res;
+}
+
+static int
+loopback_setattr_x(const char *path, struct setattr_x *attr)
+{
+    int res;
+    
+    if (writeback.enabled && SETATTR_WANTS_SIZE(attr)) {
+        struct stat st;
+        
+        if (loopback_lstat(path, &st) == 0) {
+            wb_flush_inode(st.st_dev, st.st_ino);
+        }
+    }
+    
+    res = loopback_setattr_x_apply(path, attr);
+    
+    // Even a failed call may have changed some of the attributes
+    attr_cache_invalidate(path);
+    
+    if (SETATTR_WANTS_SIZE(attr)) {
+        statfs_cache_invalidate();
+    }
+    
+    // Truncation invalidates the read-ahead buffers and cached blocks
+    if ((readahead.enabled || block_cache.enabled) &&
+        SETATTR_WANTS_SIZE(attr)) {
+        struct stat st;
+        
+        if (loopback_lstat(path, &st) == 0) {
+            inode_gen_bump(st.st_dev, st.st_ino);
+        }
+    }
+    
+    return res;
+}
+
+static void
+loopback_getxtimes_at(int dirfd, const char *name, struct timespec *bkuptime,
+                      struct timespec *crtime)
+{
+    int res = 0;
+    struct attrlist attributes;
+    
+    attributes.bitmapcount = ATTR_BIT_MAP_COUNT;
+    attributes.reserved    = 0;
+    attributes.commonattr  = ATTR_CMN_CRTIME | ATTR_CMN_BKUPTIME;
+    attributes.dirattr     = 0;
+    attributes.fileattr    = 0;
+    attributes.forkattr    = 0;
+    attributes.volattr     = 0;
+    
+    // Both times in one call, in the order of their bits
+    struct xtimeattrbuf {
+        uint32_t size;
+        struct timespec crtime;
+        struct timespec bkuptime;
+    } __attribute__ ((packed));
+    
+    struct xtimeattrbuf buf;
+    
+    res = getattrlistat(dirfd, name, &attributes, &buf, sizeof(buf),
+                        FSOPT_NOFOLLOW);
+    if (res == 0) {
+        (void)memcpy(crtime, &(buf.crtime), sizeof(struct timespec));
+        (void)memcpy(bkuptime, &(buf.bkuptime), sizeof(struct timespec));
+    } else {
+        (void)memset(crtime, 0, sizeof(struct timespec));
+        (void)memset(bkuptime, 0, sizeof(struct timespec));
+    }
+}
+
+static int
+loopback_getxtimes(const char *path, struct timespec *bkuptime,
+                   struct timespec *crtime)
+{
+    struct loopback_at at;
+    uint64_t ticket = 0;
+    int res;
+    
+    if (attr_cache.enabled) {
+        if (attr_cache_lookup_bkuptime(path, bkuptime, crtime)) {
+            return 0;
+        }
+        ticket = __atomic_load_n(&attr_cache.epoch, __ATOMIC_ACQUIRE);
+    }
+    
+    res = loopback_at_get(path, &at);
+    if (res != 0) {
+        return res;
+    }
+    
+    loopback_getxtimes_at(at.dirfd, at.name, bkuptime, crtime);
+    loopback_at_put(&at);
+    
+    if (attr_cache.enabled) {
+        attr_cache_set_bkuptime(path, bkuptime, ticket);
+    }
+    
+    return 0;
+}
+
+static int
+loopback_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    int fd;
+    int res;
+    
+    fd = loopback_openat(path, fi->flags, mode);
+    if (fd == -1) {
+        return -errno;
+    }
+    
+    res = loopback_file_new(path, fd, fi);
+    if (res != 0) {
+        close(fd);
+        return res;
+    }
+    
+    if (nocache.enabled) {
+        nocache_apply(path, fd, fi);
+    }
+    
+    attr_cache_invalidate_entry(path);
+    neg_cache_invalidate(path, false);
+    
+    return 0;
+}
+
+static int
+loopback_open(const char *path, struct fuse_file_info *fi)
+{
+    struct fd_entry *cached = NULL;
+    bool cacheable;
+    struct stat st;
+    int fd;
+    int res;
+    
+    cacheable = fd_cache.enabled && fd_cache_eligible(fi->flags);
+    if (cacheable && loopback_lstat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+        // F_NOCACHE would apply to every handle sharing the descriptor
+        if (nocache.enabled && nocache_wanted(path, -1, &st)) {
+            cacheable = false;
+        } else {
+            cached = fd_cache_lookup(&st, fi->flags);
+        }
+    }
+    
+    if (cached != NULL) {
+        fd = cached->fd;
+    } else {
+        fd = loopback_openat(path, fi->flags, 0);
+        if (fd == -1) {
+            return -errno;
+        }
+        
+        // Key by what was opened, the path may have changed since lstat()
+        if (cacheable && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            cached = fd_cache_insert(fd, &st, fi->flags);
+        }
+    }
+    
+    res = loopback_file_new(path, fd, fi);
+    if (res != 0) {
+        if (cached != NULL) {
+            fd_cache_release(cached);
+        } else {
+            close(fd);
+        }
+        return res;
+    }
+    get_file(fi)->cached = cached;
+    
+    if (cached == NULL && nocache.enabled) {
+        nocache_apply(path, fd, fi);
+    }
+    
+    // Opening with O_TRUNC changes the size
+    if (fi->flags & O_TRUNC) {
+        attr_cache_invalidate(path);
+        statfs_cache_invalidate();
+        if (readahead.enabled || block_cache.enabled) {
+            inode_gen_bump(get_file(fi)->dev, get_file(fi)->ino);
+        }
+    }
+    
+    return 0;
+}
+
+static int
+loopback_read(const char *path, char *buf, size_t size, off_t offset,
+              struct fuse_file_info *fi)
+{
+    struct loopback_file *f = get_file(fi);
+    
+    (void)path;
+    
+    // Read your writes, including those buffered by other handles
+    if (writeback.enabled) {
+        wb_flush_inode(f->dev, f->ino);
+    }
+    
+    if (block_cache.enabled && !fi->direct_io && f->ino != 0) {
+        return block_cache_read(f, buf, size, offset);
+    }
+    
+    return loopback_read_backing(f, buf, size, offset);
+}
+
+static int
+loopback_write(const char *path, const char *buf, size_t size,
+               off_t offset, struct fuse_file_info *fi)
+{
+    int res;
+    
+    (void)path;
+    
+    struct loopback_file *f = get_file(fi);
+    
+    statfs_cache_wrote(size);
+    
+    if (f->wb != NULL) {
+        res = wb_write(f->wb, buf, size, offset);
+        if (res <= 0) {
+            if (res == 0) {
+                loopback_file_invalidate(f);
+                res = (int)size;
+            }
+            return res;
+        }
+    } else if (writeback.enabled) {
+        // Buffered writes of other handles must not land after this one
+        wb_flush_inode(f->dev, f->ino);
+    }
+    
+    res = pwrite(f->fd, buf, size, offset);
+    if (res == -1) {
+        res = -errno;
+    }
+    
+    loopback_file_invalidate(f);
+    
+    return res;
+}
+
+static int
+loopback_flush(const char *path, struct fuse_file_info *fi)
+{
+    struct loopback_file *f = get_file(fi);
+    int res;
+    
+    (void)path;
+    
+    if (f->wb != NULL) {
+        res = wb_flush(f->wb);
+        if (res != 0) {
+            return res;
+        }
+    }
+    
+    // Nothing to flush if nothing was written through this handle
+    if (!f->written) {
+        return 0;
+    }
+    
+    res = close(dup(f->fd));
+    if (res == -1) {
+        return -errno;
+    }
+    
+    return 0;
+}
+
+static int
+loopback_release(const char *path, struct fuse_file_info *fi)
+{
+    struct loopback_file *f = get_file(fi);
+    
+    (void)path;
+    
+    // Waits for prefetches that still use the descriptor
+    ra_stream_free(f->ra);
+    wb_buffer_free(f->wb);
+    
+    if (f->cached != NULL) {
+        fd_cache_release(f->cached);
+    } else {
+        close(f->fd);
+    }
+    free(f->lower_path);
+    free(f);
+    
+    return 0;
+}
+
+static int
+loopback_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
+{
+    struct loopback_file *f = get_file(fi);
+    int res;
+    
+    (void)path;
+    
+    if (f->wb != NULL) {
+        res = wb_flush(f->wb);
+        if (res != 0) {
+            return res;
+        }
+    }
+    
+    return durability_sync(f->fd, f->dev, isdatasync);
+}
+
+/*
+ * Extended attribute cache
+ *
+ * With the xattr_cache=N mount option, the extended attributes of up to N
+ * files are kept in memory, keyed by device and inode. The first listxattr()
+ * or getxattr() of a file fetches its names and every value of up to 4 KiB in
+ * one pass, and later calls, including the size probes that precede the data
+ * calls, are served from memory. An entry is only used while the ctime of the
+ * file, which every change of an extended attribute updates, is the one it
+ * was fetched with, and loopback_setxattr() and loopback_removexattr() drop
+ * it right away. Files whose ctime is less than LOOPBACK_RACY_SECONDS old are
+ * passed through, since their next change may not move it.
+ *
+ * Files with more than 64 names or 16 KiB of names and small values are not
+ * cached.
+ * Larger values, reads at an offset and the com.apple.system. names are
+ * passed through.
+ */
+
+#define XATTR_CACHE_SHARDS    16
+#define XATTR_CACHE_VALUE_MAX 4096
+#define XATTR_CACHE_ENTRY_MAX (16 * 1024)
+#define XATTR_CACHE_NAMES_MAX 64
+#define XATTR_SYSTEM_PREFIX   "com.apple.system."
+
+struct xattr_value {
+    const char *name;       // Points into names
+    ssize_t size;           // -1 if the value is not cached
+    const char *data;
+};
+
+struct xattr_entry {
+    struct xattr_entry *hash_next;
+    struct xattr_entry *lru_prev;
+    struct xattr_entry *lru_next;
+    dev_t dev;
+    ino_t ino;
+    struct timespec ctime;
+    size_t names_len;
+    char *names;
+    size_t nvalues;
+    struct xattr_value values[];
+};
+
+struct xattr_shard {
+    pthread_mutex_t lock;
+    struct xattr_entry **table;
+    size_t mask;
+    struct xattr_entry lru;
+    size_t count;
+    size_t max;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t invalidations;
+    uint64_t evictions;
+};
+
+static struct {
+    bool enabled;
+    struct xattr_shard shards[XATTR_CACHE_SHARDS];
+} xattr_cache;
+
+static inline uint64_t
+xattr_cache_key(dev_t dev, ino_t ino)
+{
+    uint64_t key = ((uint64_t)dev << 32) ^ (uint64_t)ino;
+    
+    return key * 0x9e3779b97f4a7c15ULL;
+}
+
+static inline struct xattr_shard *
+xattr_cache_shard(uint64_t key)
+{
+    return &xattr_cache.shards[(key >> 32) % XATTR_CACHE_SHARDS];
+}
+
+static void
+xattr_cache_init(uint32_t entries)
+{
+    size_t per_shard;
+    size_t nbuckets = 1;
+    int i;
+    
+    if (entries == 0) {
+        return;
+    }
+    
+    per_shard = (entries + XATTR_CACHE_SHARDS - 1) / XATTR_CACHE_SHARDS;
+    while (nbuckets < per_shard) {
+        nbuckets <<= 1;
+    }
+    
+    for (i = 0; i < XATTR_CACHE_SHARDS; i++) {
+        struct xattr_shard *shard = &xattr_cache.shards[i];
+        
+        shard->table = calloc(nbuckets, sizeof(struct xattr_entry *));
+        if (shard->table == NULL) {
+            fprintf(stderr, "loopback: cannot allocate xattr cache\n");
+            exit(1);
+        }
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->mask = nbuckets - 1;
+        shard->lru.lru_prev = &shard->lru;
+        shard->lru.lru_next = &shard->lru;
+        shard->max = per_shard;
+    }
+    
+    xattr_cache.enabled = true;
+}
+
+/*
+ * Removes the name the ACL is stored under from the listxattr() result list
+ * of len bytes. Returns the new length.
+ */
+static ssize_t
+loopback_xattr_filter(char *list, ssize_t len)
+{
+    ssize_t off = 0;
+    
+    while (off < len) {
+        ssize_t thislen = strnlen(list + off, len - off) + 1;
+        
+        if (off + thislen > len) {
+            break;
+        }
+        if (strcmp(list + off, G_KAUTH_FILESEC_XATTR) == 0) {
+            memmove(list + off, list + off + thislen, len - off - thislen);
+            return len - thislen;
+        }
+        off += thislen;
+    }
+    return len;
+}
+
+// Whether name has to be passed through to the backing store
+static inline bool
+xattr_cache_bypass(const char *name)
+{
+    return strncmp(name, XATTR_SYSTEM_PREFIX,
+                   sizeof(XATTR_SYSTEM_PREFIX) - 1) == 0 ||
+           strcmp(name, G_KAUTH_FILESEC_XATTR) == 0;
+}
+
+/*
+ * Reads the names and small values of real_path, which st describes, into a
+ * new entry. Returns NULL if they do not fit.
+ */
+static struct xattr_entry *
+xattr_entry_fetch(const char *real_path, const struct stat *st)
+{
+    char arena[XATTR_CACHE_ENTRY_MAX];
+    ssize_t sizes[XATTR_CACHE_NAMES_MAX];
+    size_t offsets[XATTR_CACHE_NAMES_MAX];
+    struct xattr_entry *e;
+    ssize_t names_len;
+    size_t used;
+    size_t nvalues = 0;
+    size_t i;
+    char *name;
+    char *data;
+    
+    names_len = listxattr(real_path, arena, sizeof(arena), XATTR_NOFOLLOW);
+    if (names_len < 0) {
+        return NULL;
+    }
+    names_len = loopback_xattr_filter(arena, names_len);
+    used = names_len;
+    
+    for (name = arena; name < arena + names_len; name += strlen(name) + 1) {
+        size_t avail = MIN(sizeof(arena) - used, XATTR_CACHE_VALUE_MAX);
+        ssize_t size = -1;
+        
+        if (nvalues == XATTR_CACHE_NAMES_MAX) {
+            return NULL;
+        }
+        
+        // A size of zero would only ask for the size
+        if (avail > 0 && !xattr_cache_bypass(name)) {
+            size = getxattr(real_path, name, arena + used, avail, 0,
+                            XATTR_NOFOLLOW);
+        }
+        sizes[nvalues] = size < 0 ? -1 : size;
+        offsets[nvalues] = used;
+        if (size > 0) {
+            used += size;
+        }
+        nvalues++;
+    }
+    
+    e = malloc(sizeof(struct xattr_entry) +
+               nvalues * sizeof(struct xattr_value) + used);
+    if (e == NULL) {
+        return NULL;
+    }
+    
+    data = (char *)&e->values[nvalues];
+    memcpy(data, arena, used);
+    
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->ctime = st->st_ctimespec;
+    e->names = data;
+    e->names_len = names_len;
+    e->nvalues = nvalues;
+    
+    name = data;
+    for (i = 0; i < nvalues; i++) {
+        e->values[i].name = name;
+        e->values[i].size = sizes[i];
+        e->values[i].data = data + offsets[i];
+        name += strlen(name) + 1;
+    }
+    
+    return e;
+}
+
+// Must be called with the shard lock held
+static void
+xattr_entry_remove_locked(struct xattr_shard *shard, struct xattr_entry *e)
+{
+    uint64_t key = xattr_cache_key(e->dev, e->ino);
+    struct xattr_entry **pp = &shard->table[key & shard->mask];
+    
+    while (*pp != e) {
+        pp = &(*pp)->hash_next;
+    }
+    *pp = e->hash_next;
+    e->lru_prev->lru_next = e->lru_next;
+    e->lru_next->lru_prev = e->lru_prev;
+    shard->count--;
+    free(e);
+}
+
+// Must be called with the shard lock held
+static void
+xattr_entry_lru_front(struct xattr_shard *shard, struct xattr_entry *e)
+{
+    e->lru_next = shard->lru.lru_next;
+    e->lru_prev = &shard->lru;
+    e->lru_next->lru_prev = e;
+    shard->lru.lru_next = e;
+}
+
+/*
+ * Returns the entry of the file at path, fetching it from real_path on a miss.
+ * On success, the entry's shard is returned in *shardp, locked, and the caller
+ * has to unlock it when done with the entry. Returns NULL if the file is not
+ * to be cached, the caller then passes the call through.
+ */
+static struct xattr_entry *
+xattr_cache_acquire(const char *path, const char *real_path,
+                    struct xattr_shard **shardp)
+{
+    struct xattr_shard *shard;
+    struct xattr_entry *e;
+    struct xattr_entry *fetched;
+    struct stat st;
+    uint64_t key;
+    
+    if (loopback_getattr(path, &st) != 0) {
+        return NULL;
+    }
+    
+    key = xattr_cache_key(st.st_dev, st.st_ino);
+    shard = xattr_cache_shard(key);
+    
+    pthread_mutex_lock(&shard->lock);
+    
+    for (e = shard->table[key & shard->mask]; e != NULL; e = e->hash_next) {
+        if (e->dev == st.st_dev && e->ino == st.st_ino) {
+            break;
+        }
+    }
+    
+    if (e != NULL) {
+        if (e->ctime.tv_sec == st.st_ctimespec.tv_sec &&
+            e->ctime.tv_nsec == st.st_ctimespec.tv_nsec) {
+            e->lru_prev->lru_next = e->lru_next;
+            e->lru_next->lru_prev = e->lru_prev;
+            xattr_entry_lru_front(shard, e);
+            shard->hits++;
+            *shardp = shard;
+            return e;
+        }
+        xattr_entry_remove_locked(shard, e);
+        shard->invalidations++;
+    }
+    shard->misses++;
+    
+    pthread_mutex_unlock(&shard->lock);
+    
+    // A second change within the same tick would keep the ctime
+    if (loopback_racy(&st.st_ctimespec)) {
+        return NULL;
+    }
+    
+    // The ctime was taken first, so a change from here on is noticed later
+    fetched = xattr_entry_fetch(real_path, &st);
+    if (fetched == NULL) {
+        return NULL;
+    }
+    
+    pthread_mutex_lock(&shard->lock);
+    
+    for (e = shard->table[key & shard->mask]; e != NULL; e = e->hash_next) {
+        if (e->dev == st.st_dev && e->ino == st.st_ino) {
+            // Another thread fetched the same file
+            xattr_entry_remove_locked(shard, e);
+            break;
+        }
+    }
+    
+    if (shard->count >= shard->max) {
+        xattr_entry_remove_locked(shard, shard->lru.lru_prev);
+        shard->evictions++;
+    }
+    
+    fetched->hash_next = shard->table[key & shard->mask];
+    shard->table[key & shard->mask] = fetched;
+    xattr_entry_lru_front(shard, fetched);
+    shard->count++;
+    
+    *shardp = shard;
+    return fetched;
+}
+
+// Called after the extended attributes of path changed
+static void
+xattr_cache_invalidate(const char *path)
+{
+    struct xattr_shard *shard;
+    struct xattr_entry *e;
+    struct stat st;
+    uint64_t key;
+    
+    if (!xattr_cache.enabled || loopback_lstat(path, &st) == -1) {
+        return;
+    }
+    
+    key = xattr_cache_key(st.st_dev, st.st_ino);
+    shard = xattr_cache_shard(key);
+    
+    pthread_mutex_lock(&shard->lock);
+    
+    for (e = shard->table[key & shard->mask]; e != NULL; e = e->hash_next) {
+        if (e->dev == st.st_dev && e->ino == st.st_ino) {
+            xattr_entry_remove_locked(shard, e);
+            shard->invalidations++;
+            break;
+        }
+    }
+    
+    pthread_mutex_unlock(&shard->lock);
+}
+
+static void
+xattr_cache_report(FILE *out)
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t invalidations = 0;
+    uint64_t evictions = 0;
+    size_t count = 0;
+    int i;
+    
+    if (!xattr_cache.enabled) {
+        return;
+    }
+    
+    for (i = 0; i < XATTR_CACHE_SHARDS; i++) {
+        struct xattr_shard *shard = &xattr_cache.shards[i];
+        
+        pthread_mutex_lock(&shard->lock);
+        hits += shard->hits;
+        misses += shard->misses;
+        invalidations += shard->invalidations;
+        evictions += shard->evictions;
+        count += shard->count;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    
+    fprintf(out, "loopback: xattr cache: %llu hits, %llu misses, "
+            "%llu invalidations, %llu evictions, %zu files\n",
+            (unsigned long long)hits, (unsigned long long)misses,
+            (unsigned long long)invalidations, (unsigned long long)evictions,
+            count);
+}
+
+/*
+ * Copy offload
+ *
+ * The FUSE protocol has no request for copying or cloning files, so a copy
+ * within the volume reads every byte through loopback_read() and writes it
+ * back through loopback_write(). With the clone mount option, setting the
+ * extended attribute org.macfuse.loopback.clone of a file or directory to a
+ * path in the volume clones it to that path on the backing store instead:
+ *
+ *     xattr -w org.macfuse.loopback.clone /copy /Volumes/loopback/original
+ *
+ * clonefileat() is used where the backing file system supports it, copyfile()
+ * with COPYFILE_CLONE, which copies the data, everywhere else. The target must
+ * not exist. The attribute itself is never stored.
+ *
+ * The path comes from the user, not from the kernel, so it may not contain
+ * empty, "." or ".." components, and its parent is walked from the root
+ * without following symbolic links. A clone cannot leave the volume.
+ */
+
+#define LOOPBACK_CLONE_XATTR "org.macfuse.loopback.clone"
+
+// The value is a path in the volume, the NUL is optional
+static int
+loopback_clone_target(const char *value, size_t size, char *to, size_t to_size)
+{
+    const char *name;
+    const char *end;
+    
+    while (size > 0 && value[size - 1] == '\0') {
+        size--;
+    }
+    if (size == 0 || size >= to_size || value[0] != '/' ||
+        memchr(value, '\0', size) != NULL) {
+        return -EINVAL;
+    }
+    memcpy(to, value, size);
+    to[size] = '\0';
+    
+    // Every component must name an entry of the directory before it
+    for (name = to + 1; ; name = end + 1) {
+        end = strchr(name, '/');
+        if (end == NULL) {
+            end = name + strlen(name);
+        }
+        if (end == name || (end - name == 1 && name[0] == '.') ||
+            (end - name == 2 && name[0] == '.' && name[1] == '.')) {
+            return -EINVAL;
+        }
+        if (*end == '\0') {
+            break;
+        }
+    }
+    
+    return 0;
+}
+
+// Fails unless the parent of to is a directory reached without symbolic links
+static int
+loopback_clone_check_parent(const char *to)
+{
+    char component[MAXPATHLEN];
+    const char *name = to + 1;
+    const char *end;
+    int dirfd = loopback.root_fd;
+    int fd;
+    
+    while ((end = strchr(name, '/')) != NULL) {
+        memcpy(component, name, end - name);
+        component[end - name] = '\0';
+        
+        fd = openat(dirfd, component,
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (dirfd != loopback.root_fd) {
+            close(dirfd);
+        }
+        if (fd == -1) {
+            return errno == ELOOP ? -EINVAL : -errno;
+        }
+        dirfd = fd;
+        name = end + 1;
+    }
+    
+    if (dirfd != loopback.root_fd) {
+        close(dirfd);
+    }
+    return 0;
+}
+
+static int
+loopback_clone(const char *from, const char *value, size_t size)
+{
+    char to[MAXPATHLEN];
+    char from_buf[MAXPATHLEN];
+    char to_buf[MAXPATHLEN];
+    const char *real_from;
+    const char *real_to;
+    struct loopback_at at1;
+    struct loopback_at at2;
+    struct stat st;
+    int res;
+    
+    res = loopback_clone_target(value, size, to, sizeof(to));
+    if (res == 0) {
+        res = loopback_clone_check_parent(to);
+    }
+    if (res != 0) {
+        return res;
+    }
+    
+    if (loopback_lstat(from, &st) == -1) {
+        return -errno;
+    }
+    
+    // The clone has to include buffered writes
+    if (writeback.enabled) {
+        if (S_ISDIR(st.st_mode)) {
+            wb_flush_dirty(false, 0, 0, UINT64_MAX, NULL);
+        } else {
+            wb_flush_inode(st.st_dev, st.st_ino);
+        }
+    }
+    
+    res = loopback_at_get(from, &at1);
+    if (res != 0) {
+        return res;
+    }
+    res = loopback_at_get(to, &at2);
+    if (res != 0) {
+        loopback_at_put(&at1);
+        return res;
+    }
+    
+    res = clonefileat(at1.dirfd, at1.name, at2.dirfd, at2.name,
+                      CLONE_NOFOLLOW);
+    loopback_at_put(&at2);
+    loopback_at_put(&at1);
+    
+    if (res == -1 && (errno == ENOTSUP || errno == EXDEV)) {
+        real_from = loopback_real_path(from, from_buf, sizeof(from_buf));
+        real_to = loopback_real_path(to, to_buf, sizeof(to_buf));
+        if (real_from == NULL || real_to == NULL) {
+            return -errno;
+        }
+        
+        res = copyfile(real_from, real_to, NULL, COPYFILE_CLONE |
+                       (S_ISDIR(st.st_mode) ? COPYFILE_RECURSIVE : 0));
+    }
+    if (res < 0) {
+        return -errno;
+    }
+    
+    attr_cache_invalidate_entry(to);
+    neg_cache_invalidate(to, true);
+    statfs_cache_invalidate();
+    
+    return 0;
+}
+
+static int
+loopback_setxattr(const char *path, const char *name, const char *value,
+                  size_t size, int flags, uint32_t position)
+{
+    char buf[MAXPATHLEN];
+    const char *real_path;
+    int res;
+    
+    if (loopback.clone && strcmp(name, LOOPBACK_CLONE_XATTR) == 0) {
+        return loopback_clone(path, value, size);
+    }
+    
+    real_path = loopback_real_path(path, buf, sizeof(buf));
+    if (real_path == NULL) {
+        return -errno;
+    }
+    
+    if (!strncmp(name, XATTR_APPLE_PREFIX, sizeof(XATTR_APPLE_PREFIX) - 1)) {
+        flags &= ~(XATTR_NOSECURITY);
+    }
+    
+    if (!strcmp(name, A_KAUTH_FILESEC_XATTR)) {
+        
+        char new_name[MAXPATHLEN];
+        
+        memcpy(new_name, A_KAUTH_FILESEC_XATTR, sizeof(A_KAUTH_FILESEC_XATTR));
+        memcpy(new_name, G_PREFIX, sizeof(G_PREFIX) - 1);
+        
+        res = setxattr(real_path, new_name, value, size, position, XATTR_NOFOLLOW);
+        
+    } else {
+        res = setxattr(real_path, name, value, size, position,
+                       XATTR_NOFOLLOW);
+    }
+    
+    if (res == -1) {
+        return -errno;
+    }
+    
+    // Changes the status change time
+    attr_cache_invalidate(path);
+    xattr_cache_invalidate(path);
+    
+    return 0;
+}
+
+static int
+loopback_getxattr_real(const char *real_path, const char *name, char *value,
+                       size_t size, uint32_t position)
+{
+    int res;
+    
+    if (strcmp(name, A_KAUTH_FILESEC_XATTR) == 0) {
+        
+        char new_name[MAXPATHLEN];
+        
+        memcpy(new_name, A_KAUTH_FILESEC_XATTR, sizeof(A_KAUTH_FILESEC_XATTR));
+        memcpy(new_name, G_PREFIX, sizeof(G_PREFIX) - 1);
+        
+        res = getxattr(real_path, new_name, value, size, position, XATTR_NOFOLLOW);
+        
+    } else {
+        res = getxattr(real_path, name, value, size, position,
+                       XATTR_NOFOLLOW);
+    }
+    
+    if (res == -1) {
+        return -errno;
+    }
+    
+    return res;
+}
+
+static int
+loopback_getxattr(const char *path, const char *name, char *value, size_t size,
+                  uint32_t position)
+{
+    char buf[MAXPATHLEN];
+    const char *real_path;
+    int res;
+    
+    real_path = loopback_real_path(path, buf, sizeof(buf));
+    if (real_path == NULL) {
+        return -errno;
+    }
+    
+    if (xattr_cache.enabled && position == 0 && !xattr_cache_bypass(name)) {
+        struct xattr_shard *shard;
+        struct xattr_entry *e;
+        bool uncached = false;
+        size_t i;
+        
+        e = xattr_cache_acquire(path, real_path, &shard);
+        if (e != NULL) {
+            res = -ENOATTR;
+            for (i = 0; i < e->nvalues; i++) {
+                if (strcmp(e->values[i].name, name) == 0) {
+                    res = (int)e->values[i].size;
+                    uncached = res < 0;
+                    break;
+                }
+            }
+            if (res >= 0 && value != NULL && size > 0) {
+                if (size < (size_t)res) {
+                    res = -ERANGE;
+                } else {
+                    memcpy(value, e->values[i].data, res);
+                }
+            }
+            pthread_mutex_unlock(&shard->lock);
+            
+            // Values too large to cache are read from the backing store
+            if (!uncached) {
+                return res;
+            }
+        }
+    }
+    
+    return loopback_getxattr_real(real_path, name, value, size, position);
+}
+
+static int
+loopback_listxattr_real(const char *real_path, char *list, size_t size)
+{
+    ssize_t res;
+    
+    res = listxattr(real_path, list, size, XATTR_NOFOLLOW);
+    if (res > 0) {
+        if (list) {
+            res = loopback_xattr_filter(list, res);
+        } else {
+            // The size has to leave out the name that is filtered from lists
+            ssize_t res2 = getxattr(real_path, G_KAUTH_FILESEC_XATTR, NULL, 0,
+                                    0, XATTR_NOFOLLOW);
+            if (res2 >= 0) {
+                res -= sizeof(G_KAUTH_FILESEC_XATTR);
+            }
+        }
+    }
+    
+    if (res == -1) {
+        return -errno;
+    }
+    
+    return (int)res;
+}
+
+static int
+loopback_listxattr(const char *path, char *list, size_t size)
+{
+    char buf[MAXPATHLEN];
+    const char *real_path;
+    ssize_t res;
+    
+    real_path = loopback_real_path(path, buf, sizeof(buf));
+    if (real_path == NULL) {
+        return -errno;
+    }
+    
+    if (xattr_cache.enabled) {
+        struct xattr_shard *shard;
+        struct xattr_entry *e;
+        
+        e = xattr_cache_acquire(path, real_path, &shard);
+        if (e != NULL) {
+            res = e->names_len;
+            if (list != NULL && size > 0) {
+                if (size < e->names_len) {
+                    res = -ERANGE;
+                } else {
+                    memcpy(list, e->names, e->names_len);
+                }
+            }
+            pthread_mutex_unlock(&shard->lock);
+            return (int)res;
+        }
+    }
+    
+    return loopback_listxattr_real(real_path, list, size);
+}
+
+static int
+loopback_removexattr(const char *path, const char *name)
+{
+    char buf[MAXPATHLEN];
+    const char *real_path;
+    int res;
+    
+    real_path = loopback_real_path(path, buf, sizeof(buf));
+    if (real_path == NULL) {
+        return -errno;
+    }
+    
+    if (strcmp(name, A_KAUTH_FILESEC_XATTR) == 0) {
+        
+        char new_name[MAXPATHLEN];
+        
+        memcpy(new_name, A_KAUTH_FILESEC_XATTR, sizeof(A_KAUTH_FILESEC_XATTR));
+        memcpy(new_name, G_PREFIX, sizeof(G_PREFIX) - 1);
+        
+        res = removexattr(real_path, new_name, XATTR_NOFOLLOW);
+        
+    } else {
+        res = removexattr(real_path, name, XATTR_NOFOLLOW);
+    }
+    
+    if (res == -1) {
+        return -errno;
+    }
+    
+    attr_cache_invalidate(path);
+    xattr_cache_invalidate(path);
+    
+    return 0;
+}
+
+static int
+loopback_fallocate(const char *path, int mode, off_t offset, off_t length,
+                   struct fuse_file_info *fi)
+{
+    fstore_t fstore;
+    
+    if (!(mode & PREALLOCATE)) {
+        return -ENOTSUP;
+    }
+    
+    fstore.fst_flags = 0;
+    if (mode & ALLOCATECONTIG) {
+        fstore.fst_flags |= F_ALLOCATECONTIG;
+    }
+    if (mode & ALLOCATEALL) {
+        fstore.fst_flags |= F_ALLOCATEALL;
+    }
+    
+    if (mode & ALLOCATEFROMPEOF) {
+        fstore.fst_posmode = F_PEOFPOSMODE;
+    } else if (mode & ALLOCATEFROMVOL) {
+        fstore.fst_posmode = F_VOLPOSMODE;
+    }
+    
+    fstore.fst_offset = offset;
+    fstore.fst_length = length;
+    
+    // Allocation from the physical end of file must see buffered writes
+    if (writeback.enabled) {
+        wb_flush_inode(get_file(fi)->dev, get_file(fi)->ino);
+    }
+    
+    if (fcntl(get_file(fi)->fd, F_PREALLOCATE, &fstore) == -1) {
+        return -errno;
+    } else {
+        loopback_file_invalidate(get_file(fi));
+        statfs_cache_invalidate();
+        return 0;
+    }
+}
+
+static int
+loopback_setvolname(const char *name)
+{
+    return 0;
+}
+
+static int
+loopback_statfs_x(const char *path, struct statfs *stbuf)
+{
+    char buf[MAXPATHLEN];
+    const char *real_path;
+    uint64_t ticket = 0;
+    bool cacheable;
+    int res;
+    
+    cacheable = statfs_cache.enabled && strcmp(path, "/") == 0;
+    if (cacheable && statfs_cache_lookup(stbuf, &ticket)) {
+        return 0;
+    }
+    
+    real_path = loopback_real_path(path, buf, sizeof(buf));
+    if (real_path == NULL) {
+        return -errno;
+    }
+    
+    res = statfs(real_path, stbuf);
+    if (res == -1) {
+        return -errno;
+    }
+    
+    stbuf->f_blocks = stbuf->f_blocks * stbuf->f_bsize / loopback.blocksize;
+    stbuf->f_bavail = stbuf->f_bavail * stbuf->f_bsize / loopback.blocksize;
+    stbuf->f_bfree = stbuf->f_bfree * stbuf->f_bsize / loopback.blocksize;
+    stbuf->f_bsize = loopback.blocksize;
+    
+    if (cacheable) {
+        statfs_cache_insert(stbuf, ticket);
+    }
+    
+    return 0;
+}
+
+#if HAVE_RENAMEX
+
+static int
+loopback_renamex(const char *path1, const char *path2, unsigned int flags)
+{
+    struct loopback_at at1;
+    struct loopback_at at2;
+    int res;
+    
+    res = loopback_at_get(path1, &at1);
+    if (res != 0) {
+        return res;
+    }
+    res = loopback_at_get(path2, &at2);
+    if (res != 0) {
+        loopback_at_put(&at1);
+        return res;
+    }
+    
+    if (!(flags & RENAME_SWAP)) {
+        fd_cache_forget(path2);
+    }
+    
+    res = renameatx_np(at1.dirfd, at1.name, at2.dirfd, at2.name, flags);
+    loopback_at_put(&at2);
+    loopback_at_put(&at1);
+    if (res == -1) {
+        return -errno;
+    }
+    
+    cache_invalidate_rename(path1, path2, flags & RENAME_SWAP);
+    // See loopback_rename()
+    statfs_cache_invalidate();
+    
+    return 0;
+}
+
+#endif /* HAVE_RENAMEX */
+
+/*
+ * Union mode
+ *
+ * With the lower=PATH mount option, the mount shows the tree at PATH merged
+ * below the root, which becomes the writable upper branch. The lower branch
+ * is never modified. Every lookup tries the upper branch first. The first
+ * change to an object that only exists in the lower branch copies it up,
+ * after its parent directories; handles opened before keep reading the lower
+ * file, and hard links between lower files are not preserved.
+ *
+ * Removing an object that exists in the lower branch leaves a whiteout, an
+ * empty file named .wh.<name> in the upper branch, which hides the lower
+ * object and everything below it. A whiteout stays when an object with the
+ * same name is created again, so a new directory does not bring back the
+ * contents of the removed one. Names starting with .wh. are reserved.
+ *
+ * Directories are listed by reading both branches into one snapshot. The
+ * upper names and whiteouts go into a hash set first, so lower entries that
+ * are shadowed or hidden are dropped with one probe each. Directories that
+ * exist in the lower branch cannot be renamed; rename() fails with EXDEV and
+ * callers fall back to copying, just like across volumes.
+ */
+
+#define UNION_WHITEOUT     ".wh."
+#define UNION_WHITEOUT_LEN (sizeof(UNION_WHITEOUT) - 1)
+
+static struct {
+    bool enabled;
+    char *lower;
+    size_t lower_len;
+    int lower_fd;
+    uint32_t seq;
+    uint64_t copyups;
+    uint64_t whiteouts;
+} unionfs;
+
+static void
+union_init(const char *lower)
+{
+    char path[MAXPATHLEN];
+    
+    if (lower == NULL) {
+        return;
+    }
+    
+    if (realpath(lower, path) == NULL) {
+        fprintf(stderr, "loopback: invalid lower root: %s\n", strerror(errno));
+        exit(1);
+    }
+    
+    // Like the root, an empty lower root stands for "/"
+    unionfs.lower_len = strcmp(path, "/") == 0 ? 0 : strlen(path);
+    path[unionfs.lower_len] = '\0';
+    if (strcmp(path, loopback.root) == 0) {
+        fprintf(stderr, "loopback: the lower root must differ from root\n");
+        exit(1);
+    }
+    
+    unionfs.lower = strdup(path);
+    unionfs.lower_fd = open(unionfs.lower_len ? path : "/",
+                            O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (unionfs.lower == NULL || unionfs.lower_fd == -1) {
+        fprintf(stderr, "loopback: cannot open lower root: %s\n",
+                strerror(errno));
+        exit(1);
+    }
+    
+    unionfs.enabled = true;
+}
+
+// Name of path relative to the lower root descriptor
+static inline const char *
+union_rel(const char *path)
+{
+    return path[1] == '\0' ? "." : path + 1;
+}
+
+// See loopback_real_path()
+static const char *
+union_lower_path(const char *path, char *buf, size_t size)
+{
+    if (unionfs.lower_len == 0) {
+        return path;
+    }
+    if (snprintf(buf, size, "%s%s", unionfs.lower, path) >= size) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    return buf;
+}
+
+static inline bool
+union_reserved_name(const char *name)
+{
+    return strncmp(name, UNION_WHITEOUT, UNION_WHITEOUT_LEN) == 0;
+}
+
+static inline bool
+union_reserved(const char *path)
+{
+    return union_reserved_name(strrchr(path, '/') + 1);
+}
+
+// Path of the whiteout for path, in the same directory
+static const char *
+union_whiteout_path(const char *path, char *buf, size_t size)
+{
+    size_t len = loopback_parent_len(path);
+    
+    if (len == 1) {
+        len = 0;
+    }
+    if (snprintf(buf, size, "%.*s/" UNION_WHITEOUT "%s", (int)len, path,
+                 path + len + 1) >= size) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    return buf;
+}
+
+/*
+ * Whether the lower object at path is hidden by a whiteout for it or one of
+ * its parents, or by an upper object that is not a directory. The lookups
+ * go through loopback_getattr(), so they are served by the attribute and
+ * negative caches when those are enabled.
+ */
+static bool
+union_hidden(const char *path)
+{
+    char prefix[MAXPATHLEN];
+    char whiteout[MAXPATHLEN];
+    struct stat st;
+    char *slash;
+    
+    if (strlcpy(prefix, path, sizeof(prefix)) >= sizeof(prefix)) {
+        return true;
+    }
+    
+    while ((slash = strrchr(prefix, '/')) != NULL && slash[1] != '\0') {
+        *slash = '\0';
+        if (snprintf(whiteout, sizeof(whiteout), "%s/" UNION_WHITEOUT "%s",
+                     prefix, slash + 1) >= sizeof(whiteout)) {
+            return true;
+        }
+        
+        // ENOTDIR means that a parent is shadowed by an upper file
+        if (loopback_getattr(whiteout, &st) != -ENOENT) {
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+// Returns 0 if path is visible in the lower branch
+static int
+union_lower_lstat(const char *path, struct stat *stbuf)
+{
+    if (union_reserved(path)) {
+        return -ENOENT;
+    }
+    if (fstatat(unionfs.lower_fd, union_rel(path), stbuf,
+                AT_SYMLINK_NOFOLLOW) == -1) {
+        return -errno;
+    }
+    if (union_hidden(path)) {
+        return -ENOENT;
+    }
+    return 0;
+}
+
+static int union_copy_up(const char *path);
+
+static int
+union_copy_up_parent(const char *path)
+{
+    char parent[MAXPATHLEN];
+    size_t len = loopback_parent_len(path);
+    
+    memcpy(parent, path, len);
+    parent[len] = '\0';
+    
+    return union_copy_up(parent);
+}
+
+/*
+ * Makes sure that path exists in the upper branch, copying it up from the
+ * lower branch if needed. Files are copied to a temporary name and renamed
+ * into place, so that no one sees a partial copy; if another thread copied
+ * the same file up in the meantime, its copy wins.
+ */
+static int
+union_copy_up(const char *path)
+{
+    char lower_buf[MAXPATHLEN];
+    char upper_buf[MAXPATHLEN];
+    char tmp_buf[MAXPATHLEN];
+    char tmp[MAXPATHLEN];
+    const char *lower;
+    const char *upper;
+    const char *real_tmp;
+    struct loopback_at at;
+    struct stat st;
+    size_t len;
+    int res;
+    
+    if (path[1] == '\0' || loopback_lstat(path, &st) == 0) {
+        return 0;
+    }
+    if (errno != ENOENT) {
+        return -errno;
+    }
+    
+    res = union_lower_lstat(path, &st);
+    if (res != 0) {
+        return res;
+    }
+    
+    res = union_copy_up_parent(path);
+    if (res != 0) {
+        return res;
+    }
+    
+    lower = union_lower_path(path, lower_buf, sizeof(lower_buf));
+    upper = loopback_real_path(path, upper_buf, sizeof(upper_buf));
+    if (lower == NULL || upper == NULL) {
+        return -errno;
+    }
+    
+    if (S_ISDIR(st.st_mode)) {
+        res = loopback_at_get(path, &at);
+        if (res != 0) {
+            return res;
+        }
+        res = mkdirat(at.dirfd, at.name, st.st_mode & ALLPERMS);
+        loopback_at_put(&at);
+        if (res == -1) {
+            return errno == EEXIST ? 0 : -errno;
+        }
+        
+        // Owner, times and extended attributes are copied if possible
+        (void)copyfile(lower, upper, NULL,
+                       COPYFILE_METADATA | COPYFILE_NOFOLLOW);
+    } else {
+        len = loopback_parent_len(path);
+        if (snprintf(tmp, sizeof(tmp), "%.*s/" UNION_WHITEOUT UNION_WHITEOUT
+                     "copyup.%d.%u", (int)(len == 1 ? 0 : len), path,
+                     (int)getpid(),
+                     __atomic_add_fetch(&unionfs.seq, 1, __ATOMIC_RELAXED)) >=
+            sizeof(tmp)) {
+            return -ENAMETOOLONG;
+        }
+        real_tmp = loopback_real_path(tmp, tmp_buf, sizeof(tmp_buf));
+        if (real_tmp == NULL) {
+            return -errno;
+        }
+        
+        if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode)) {
+            // Clones when both branches are on the same APFS volume
+            res = copyfile(lower, real_tmp, NULL,
+                           COPYFILE_CLONE | COPYFILE_NOFOLLOW);
+        } else if (S_ISFIFO(st.st_mode)) {
+            res = mkfifo(real_tmp, st.st_mode & ALLPERMS);
+        } else {
+            res = mknod(real_tmp, st.st_mode, st.st_rdev);
+        }
+        if (res < 0) {
+            res = -errno;
+            (void)unlink(real_tmp);
+            return res;
+        }
+        
+        res = renamex_np(real_tmp, upper, RENAME_EXCL);
+        if (res == -1) {
+            res = errno == EEXIST ? 0 : -errno;
+            (void)unlink(real_tmp);
+            return res;
+        }
+    }
+    
+    __atomic_fetch_add(&unionfs.copyups, 1, __ATOMIC_RELAXED);
+    
+    // Drops the lower attributes that were cached for path
+    attr_cache_invalidate_entry(path);
+    neg_cache_invalidate(path, false);
+    
+    return 0;
+}
+
+/*
+ * Hides the lower object at path. Everything below it is hidden as well,
+ * so for directories the cached attributes of the whole tree are dropped.
+ */
+static int
+union_whiteout(const char *path, bool dir)
+{
+    char whiteout[MAXPATHLEN];
+    int fd;
+    int res;
+    
+    if (union_whiteout_path(path, whiteout, sizeof(whiteout)) == NULL) {
+        return -errno;
+    }
+    
+    res = union_copy_up_parent(path);
+    if (res != 0) {
+        return res;
+    }
+    
+    fd = loopback_openat(whiteout, O_WRONLY | O_CREAT | O_CLOEXEC,
+                         S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        return -errno;
+    }
+    close(fd);
+    
+    __atomic_fetch_add(&unionfs.whiteouts, 1, __ATOMIC_RELAXED);
+    
+    attr_cache_invalidate_entry(path);
+    if (dir) {
+        attr_cache_invalidate_tree(path);
+    }
+    neg_cache_invalidate(whiteout, false);
+    
+    return 0;
+}
+
+/*
+ * Prepares the upper branch for creating path: reserved names are refused,
+ * the parent is copied up, and path must not exist in the lower branch.
+ */
+static int
+union_prepare(const char *path)
+{
+    struct stat st;
+    int res;
+    
+    if (union_reserved(path)) {
+        return -EINVAL;
+    }
+    
+    res = union_copy_up_parent(path);
+    if (res != 0) {
+        return res;
+    }
+    
+    if (union_lower_lstat(path, &st) == 0) {
+        return -EEXIST;
+    }
+    
+    return 0;
+}
+
+static int
+union_getattr(const char *path, struct stat *stbuf)
+{
+    uint64_t ticket = 0;
+    int res;
+    
+    if (union_reserved(path)) {
+        return -ENOENT;
+    }
+    
+    // Taken before the upper lookup, see attr_cache_lookup()
+    if (attr_cache.enabled) {
+        ticket = __atomic_load_n(&attr_cache.epoch, __ATOMIC_ACQUIRE);
+    }
+    
+    res = loopback_getattr(path, stbuf);
+    if (res != -ENOENT) {
+        return res;
+    }
+    
+    if (union_lower_lstat(path, stbuf) != 0) {
+        return -ENOENT;
+    }
+    
+    // See loopback_getattr()
+    stbuf->st_blksize = loopback_blksize(path, stbuf);
+    
+    // Cached under path, so that the next lookup stops at the upper branch
+    if (attr_cache.enabled) {
+        attr_cache_insert(path, stbuf, ticket);
+    }
+    
+    return 0;
+}
+
+struct union_name {
+    uint64_t hash;
+    uint32_t ref;       // 0 for a free slot, see union_name_get()
+};
+
+// Entry i of the merged (even refs) or hidden (odd refs) names
+static inline uint32_t
+union_name_ref(uint32_t i, bool hidden)
+{
+    return (i << 1 | hidden) + 1;
+}
+
+static inline const char *
+union_name_get(struct dir_snapshot *const snaps[2], uint32_t ref)
+{
+    const struct dir_snapshot *snap = snaps[(ref - 1) & 1];
+    
+    return ((struct dir_snap_entry *)
+            (snap->arena + snap->index[(ref - 1) >> 1]))->name;
+}
+
+static bool
+union_names_find(const struct union_name *set, size_t mask,
+                 struct dir_snapshot *const snaps[2], const char *name)
+{
+    uint64_t hash = loopback_hash(name);
+    size_t slot;
+    
+    for (slot = hash & mask; set[slot].ref != 0; slot = (slot + 1) & mask) {
+        if (set[slot].hash == hash &&
+            strcmp(union_name_get(snaps, set[slot].ref), name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Reads the upper directory at path into merged, and its whiteouts into hidden
+static int
+union_dir_read_upper(const char *path, struct dir_snapshot *merged,
+                     struct dir_snapshot *hidden)
+{
+    struct dirent *entry;
+    DIR *dp;
+    int res = 0;
+    
+    dp = loopback_opendirat(path);
+    if (dp == NULL) {
+        return errno == ENOENT ? 0 : -errno;
+    }
+    
+    while (res == 0 && (entry = readdir(dp)) != NULL) {
+        struct dirent whiteout;
+        
+        if (!union_reserved_name(entry->d_name)) {
+            res = dir_snapshot_add(merged, entry);
+        } else if (!union_reserved_name(entry->d_name + UNION_WHITEOUT_LEN)) {
+            whiteout = *entry;
+            strlcpy(whiteout.d_name, entry->d_name + UNION_WHITEOUT_LEN,
+                    sizeof(whiteout.d_name));
+            res = dir_snapshot_add(hidden, &whiteout);
+        }
+    }
+    
+    closedir(dp);
+    return res;
+}
+
+/*
+ * Lists the merged directory at path into a new snapshot: the upper entries,
+ * followed by the lower entries that are neither shadowed nor hidden.
+ */
+static int
+union_dir_build(const char *path, struct dir_snapshot **snapp)
+{
+    struct dir_snapshot *snaps[2];
+    struct union_name *set;
+    struct dirent *entry;
+    struct stat st;
+    size_t nslots = 16;
+    uint32_t i;
+    DIR *dp;
+    int fd;
+    int res;
+    
+    res = union_getattr(path, &st);
+    if (res != 0) {
+        return res;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        return -ENOTDIR;
+    }
+    
+    snaps[0] = dir_snapshot_new(path, &st);
+    snaps[1] = dir_snapshot_new(path, &st);
+    if (snaps[0] == NULL || snaps[1] == NULL) {
+        res = -ENOMEM;
+        goto out;
+    }
+    
+    res = union_dir_read_upper(path, snaps[0], snaps[1]);
+    if (res != 0) {
+        goto out;
+    }
+    
+    // A whiteout for the directory itself hides every lower entry
+    fd = -1;
+    if (union_lower_lstat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+        fd = openat(unionfs.lower_fd, union_rel(path),
+                    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (fd == -1) {
+        *snapp = snaps[0];
+        snaps[0] = NULL;
+        goto out;
+    }
+    dp = fdopendir(fd);
+    if (dp == NULL) {
+        res = -errno;
+        close(fd);
+        goto out;
+    }
+    
+    while (nslots < 2 * (snaps[0]->count + snaps[1]->count)) {
+        nslots <<= 1;
+    }
+    set = calloc(nslots, sizeof(struct union_name));
+    if (set == NULL) {
+        res = -ENOMEM;
+        closedir(dp);
+        goto out;
+    }
+    
+    for (i = 0; i < snaps[0]->count + snaps[1]->count; i++) {
+        bool is_hidden = i >= snaps[0]->count;
+        uint32_t ref = union_name_ref(is_hidden ? i - snaps[0]->count : i,
+                                      is_hidden);
+        uint64_t hash = loopback_hash(union_name_get(snaps, ref));
+        size_t slot;
+        
+        for (slot = hash & (nslots - 1); set[slot].ref != 0;
+             slot = (slot + 1) & (nslots - 1)) {
+            continue;
+        }
+        set[slot].hash = hash;
+        set[slot].ref = ref;
+    }
+    
+    while (res == 0 && (entry = readdir(dp)) != NULL) {
+        if (!union_reserved_name(entry->d_name) &&
+            !union_names_find(set, nslots - 1, snaps, entry->d_name)) {
+            res = dir_snapshot_add(snaps[0], entry);
+        }
+    }
+    
+    free(set);
+    closedir(dp);
+    
+    if (res == 0) {
+        *snapp = snaps[0];
+        snaps[0] = NULL;
+    }
+
+out:
+    if (snaps[0] != NULL) {
+        dir_snapshot_free(snaps[0]);
+    }
+    if (snaps[1] != NULL) {
+        dir_snapshot_free(snaps[1]);
+    }
+    return res;
+}
+
+static int
+union_readlink(const char *path, char *buf, size_t size)
+{
+    struct stat st;
+    int res;
+    
+    res = loopback_readlink(path, buf, size);
+    if (res != -ENOENT) {
+        return res;
+    }
+    
+    if (union_lower_lstat(path, &st) != 0) {
+        return -ENOENT;
+    }
+    
+    res = readlinkat(unionfs.lower_fd, union_rel(path), buf, size - 1);
+    if (res == -1) {
+        return -errno;
+    }
+    
+    buf[res] = '\0';
+    
+    return 0;
+}
+
+static int
+union_opendir(const char *path, struct fuse_file_info *fi)
+{
+    struct dir_snapshot *snap;
+    struct loopback_dirp *d;
+    int res;
+    
+    res = union_dir_build(path, &snap);
+    if (res != 0) {
+        return res;
+    }
+    
+    d = calloc(1, sizeof(struct loopback_dirp));
+    if (d == NULL) {
+        dir_snapshot_free(snap);
+        return -ENOMEM;
+    }
+    
+    // Served by loopback_readdir() and loopback_releasedir()
+    d->fd = -1;
+    d->snap = snap;
+    
+    fi->fh = (unsigned long)d;
+    
+    return 0;
+}
+
+static int
+union_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+    int res;
+    
+    res = union_prepare(path);
+    if (res != 0) {
+        return res;
+    }
+    
+    return loopback_mknod(path, mode, rdev);
+}
+
+static int
+union_mkdir(const char *path, mode_t mode)
+{
+    int res;
+    
+    res = union_prepare(path);
+    if (res != 0) {
+        return res;
+    }
+    
+    return loopback_mkdir(path, mode);
+}
+
+static int
+union_unlink(const char *path)
+{
+    struct stat st;
+    int res;
+    
+    res = loopback_unlink(path);
+    if (res != 0 && res != -ENOENT) {
+        return res;
+    }
+    
+    if (union_lower_lstat(path, &st) != 0) {
+        return res;
+    }
+    if (res == -ENOENT && S_ISDIR(st.st_mode)) {
+        return -EPERM;
+    }
+    
+    return union_whiteout(path, S_ISDIR(st.st_mode));
+}
+
+// Removes the whiteouts from the upper directory at path before it is removed
+static int
+union_remove_whiteouts(const char *path)
+{
+    char whiteout[MAXPATHLEN];
+    struct dirent *entry;
+    DIR *dp;
+    int res = 0;
+    
+    dp = loopback_opendirat(path);
+    if (dp == NULL) {
+        return errno == ENOENT ? 0 : -errno;
+    }
+    
+    while ((entry = readdir(dp)) != NULL) {
+        if (!union_reserved_name(entry->d_name)) {
+            continue;
+        }
+        if (unlinkat(dirfd(dp), entry->d_name, 0) == -1) {
+            res = -errno;
+            break;
+        }
+        if (snprintf(whiteout, sizeof(whiteout), "%s/%s",
+                     path[1] == '\0' ? "" : path, entry->d_name) <
+            sizeof(whiteout)) {
+            attr_cache_invalidate(whiteout);
+        }
+    }
+    
+    closedir(dp);
+    return res;
+}
+
+static int
+union_rmdir(const char *path)
+{
+    struct dir_snapshot *snap;
+    struct stat st;
+    bool lower;
+    uint32_t i;
+    int res;
+    
+    res = union_dir_build(path, &snap);
+    if (res != 0) {
+        return res;
+    }
+    
+    for (i = 0; i < snap->count; i++) {
+        const char *name = ((struct dir_snap_entry *)
+                            (snap->arena + snap->index[i]))->name;
+        
+        if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+            res = -ENOTEMPTY;
+            break;
+        }
+    }
+    dir_snapshot_free(snap);
+    if (res != 0) {
+        return res;
+    }
+    
+    lower = union_lower_lstat(path, &st) == 0;
+    
+    res = union_remove_whiteouts(path);
+    if (res != 0) {
+        return res;
+    }
+    
+    res = loopback_rmdir(path);
+    if (res != 0 && !(res == -ENOENT && lower)) {
+        return res;
+    }
+    
+    if (!lower) {
+        return 0;
+    }
+    
+    res = union_whiteout(path, true);
+    if (res == 0) {
+        dirfd_cache_invalidate_tree(path);
+    }
+    
+    return res;
+}
+
+static int
+union_symlink(const char *from, const char *to)
+{
+    int res;
+    
+    res = union_prepare(to);
+    if (res != 0) {
+        return res;
+    }
+    
+    return loopback_symlink(from, to);
+}
+
+static int
+union_rename(const char *from, const char *to)
+{
+    struct stat st;
+    struct stat upper;
+    struct stat from_lower;
+    struct stat to_lower;
+    bool from_in_lower;
+    bool to_in_lower;
+    int res;
+    
+    if (union_reserved(to)) {
+        return -EINVAL;
+    }
+    
+    res = union_getattr(from, &st);
+    if (res != 0) {
+        return res;
+    }
+    
+    from_in_lower = union_lower_lstat(from, &from_lower) == 0;
+    to_in_lower = union_lower_lstat(to, &to_lower) == 0;
+    
+    // Merged directories would have to be copied up as a whole
+    if (S_ISDIR(st.st_mode) &&
+        ((from_in_lower && S_ISDIR(from_lower.st_mode)) ||
+         (to_in_lower && S_ISDIR(to_lower.st_mode)))) {
+        return -EXDEV;
+    }
+    
+    // A lower-only target is replaced, which rename() would check itself
+    if (to_in_lower && loopback_lstat(to, &upper) == -1 &&
+        errno == ENOENT) {
+        if (S_ISDIR(to_lower.st_mode) && !S_ISDIR(st.st_mode)) {
+            return -EISDIR;
+        }
+        if (!S_ISDIR(to_lower.st_mode) && S_ISDIR(st.st_mode)) {
+            return -ENOTDIR;
+        }
+    }
+    
+    res = union_copy_up(from);
+    if (res != 0) {
+        return res;
+    }
+    res = union_copy_up_parent(to);
+    if (res != 0) {
+        return res;
+    }
+    
+    res = loopback_rename(from, to);
+    if (res != 0) {
+        return res;
+    }
+    
+    if (from_in_lower) {
+        res = union_whiteout(from, S_ISDIR(from_lower.st_mode));
+    }
+    
+    return res;
+}
+
+static int
+union_link(const char *from, const char *to)
+{
+    int res;
+    
+    res = union_copy_up(from);
+    if (res != 0) {
+        return res;
+    }
+    res = union_prepare(to);
+    if (res != 0) {
+        return res;
+    }
+    
+    return loopback_link(from, to);
+}
+
+static int
+union_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    int res;
+    
+    // Opening an existing lower file with O_CREAT opens a copy
+    res = union_prepare(path);
+    if (res == -EEXIST && !(fi->flags & O_EXCL)) {
+        res = union_copy_up(path);
+    }
+    if (res != 0) {
+        return res;
+    }
+    
+    return loopback_create(path, mode, fi);
+}
+
+static int
+union_open(const char *path, struct fuse_file_info *fi)
+{
+    struct stat st;
+    char *lower_path;
+    int fd;
+    int res;
+    
+    if ((fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC)) {
+        res = union_copy_up(path);
+        if (res != 0) {
+            return res;
+        }
+        return loopback_open(path, fi);
+    }
+    
+    res = loopback_open(path, fi);
+    if (res != -ENOENT) {
+        return res;
+    }
+    
+    if (union_lower_lstat(path, &st) != 0) {
+        return -ENOENT;
+    }
+    
+    // Kept to copy the file up if it is changed through the handle
+    lower_path = strdup(path);
+    if (lower_path == NULL) {
+        return -ENOMEM;
+    }
+    
+    fd = openat(unionfs.lower_fd, union_rel(path), fi->flags | O_CLOEXEC);
+    if (fd == -1) {
+        res = -errno;
+        free(lower_path);
+        return res;
+    }
+    
+    res = loopback_file_new(path, fd, fi);
+    if (res != 0) {
+        close(fd);
+        free(lower_path);
+        return res;
+    }
+    get_file(fi)->lower_path = lower_path;
+    
+    if (nocache.enabled) {
+        nocache_apply(path, fd, fi);
+    }
+    
+    return 0;
+}
+
+static int
+union_setxattr(const char *path, const char *name, const char *value,
+               size_t size, int flags, uint32_t position)
+{
+    char to[MAXPATHLEN];
+    int res;
+    
+    res = union_copy_up(path);
+    if (res != 0) {
+        return res;
+    }
+    
+    if (loopback.clone && strcmp(name, LOOPBACK_CLONE_XATTR) == 0) {
+        res = loopback_clone_target(value, size, to, sizeof(to));
+        if (res == 0) {
+            res = union_prepare(to);
+        }
+        if (res != 0) {
+            return res;
+        }
+    }
+    
+    return loopback_setxattr(path, name, value, size, flags, position);
+}
+
+static int
+union_getxattr(const char *path, const char *name, char *value, size_t size,
+               uint32_t position)
+{
+    char buf[MAXPATHLEN];
+    const char *real_path;
+    struct stat st;
+    int res;
+    
+    res = loopback_getxattr(path, name, value, size, position);
+    if (res != -ENOENT) {
+        return res;
+    }
+    
+    if (union_lower_lstat(path, &st) != 0) {
+        return -ENOENT;
+    }
+    
+    real_path = union_lower_path(path, buf, sizeof(buf));
+    if (real_path == NULL) {
+        return -errno;
+    }
+    
+    return loopback_getxattr_real(real_path, name, value, size, position);
+}
+
+static int
+union_listxattr(const char *path, char *list, size_t size)
+{
+    char buf[MAXPATHLEN];
+    const char *real_path;
+    struct stat st;
+    int res;
+    
+    res = loopback_listxattr(path, list, size);
+    if (res != -ENOENT) {
+        return res;
+    }
+    
+    if (union_lower_lstat(path, &st) != 0) {
+        return -ENOENT;
+    }
+    
+    real_path = union_lower_path(path, buf, sizeof(buf));
+    if (real_path == NULL) {
+        return -errno;
+    }
+    
+    return loopback_listxattr_real(real_path, list, size);
+}
+
+static int
+union_removexattr(const char *path, const char *name)
+{
+    int res;
+    
+    res = union_copy_up(path);
+    if (res != 0) {
+        return res;
+    }
+    
+    return loopback_removexattr(path, name);
+}
+
+static int
+union_getxtimes(const char *path, struct timespec *bkuptime,
+                struct timespec *crtime)
+{
+    struct stat st;
+    
+    if (loopback_lstat(path, &st) == 0 || errno != ENOENT ||
+        union_lower_lstat(path, &st) != 0) {
+        return loopback_getxtimes(path, bkuptime, crtime);
+    }
+    
+    loopback_getxtimes_at(unionfs.lower_fd, union_rel(path), bkuptime,
+                          crtime);
+    
+    return 0;
+}
+
+static int
+union_setattr_x(const char *path, struct setattr_x *attr)
+{
+    int res;
+    
+    res = union_copy_up(path);
+    if (res != 0) {
+        return res;
+    }
+    
+    return loopback_setattr_x(path, attr);
+}
+
+static int
+union_fsetattr_x(const char *path, struct setattr_x *attr,
+                 struct fuse_file_info *fi)
+{
+    struct loopback_file *f = get_file(fi);
+    int res;
+    
+    if (f->lower_path == NULL) {
+        return loopback_fsetattr_x(path, attr, fi);
+    }
+    
+    // The handle is read-only, change the copy by path instead
+    res = union_copy_up(f->lower_path);
+    if (res != 0) {
+        return res;
+    }
+    
+    return loopback_setattr_x(f->lower_path, attr);
+}
+
+// New data always goes to the upper branch
+static int
+union_statfs_x(const char *path, struct statfs *stbuf)
+{
+    (void)path;
+    
+    return loopback_statfs_x("/", stbuf);
+}
+
+#if HAVE_RENAMEX
+
+static int
+union_renamex(const char *path1, const char *path2, unsigned int flags)
+{
+    struct stat st;
+    
+    // Swapping would have to copy up and white out both sides at once
+    if (flags & RENAME_SWAP) {
+        return -ENOTSUP;
+    }
+    
+    if ((flags & RENAME_EXCL) && union_getattr(path2, &st) == 0) {
+        return -EEXIST;
+    }
+    
+    return union_rename(path1, path2);
+}
+
+#endif /* HAVE_RENAMEX */
+
+static void
+union_report(FILE *out)
+{
+    if (!unionfs.enabled) {
+        return;
+    }
+    
+    fprintf(out, "loopback: union: %llu copy-ups, %llu whiteouts\n",
+            (unsigned long long)__atomic_load_n(&unionfs.copyups,
+                                                __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&unionfs.whiteouts,
+                                                __ATOMIC_RELAXED));
+}
+
+/*
+ * Case folding
+ *
+ * The case_insensitive option makes the kernel extension treat names as
+ * case-insensitive. If the backing store is case-sensitive, the operations
+ * of loopback_casefold_oper translate each path to the spelling of the
+ * objects on the backing store before passing it to casefold_base, the
+ * regular or the union operations.
+ *
+ * Translation uses per-directory indexes from the key of a name, its
+ * decomposed and case-folded form, to the names in the directory with that
+ * key. A directory is only indexed once a name in it was not found as
+ * given, and later lookups in it cost one hash lookup instead of a scan.
+ * Operations that must find an existing object try the path as given
+ * first, so correctly spelled paths cost nothing. Operations that create an
+ * object always translate the path, so that an existing object spelled
+ * differently is reused instead of getting a twin. If a directory has more
+ * than one name with the same key, the one spelled as given is preferred.
+ *
+ * Changes made through the mount update the indexes. A name missing from
+ * an index is looked up again after a scan if the directory was modified
+ * since it was indexed, which picks up names created behind the mount's
+ * back, or if it had been modified less than LOOPBACK_RACY_SECONDS before.
+ * In union mode only the upper branch is indexed. Up to
+ * CASEFOLD_DIRS directories are indexed at a time.
+ */
+
+#define CASEFOLD_DIRS       1024
+#define CASEFOLD_BUCKETS    2048
+#define CASEFOLD_KEY_MAX    (NAME_MAX * 4 + 1)
+
+enum {
+    CASEFOLD_UNKNOWN,           // The directory is not indexed
+    CASEFOLD_MISSING,
+    CASEFOLD_FOUND
+};
+
+struct casefold_name {
+    struct casefold_name *next;
+    uint64_t hash;
+    size_t key_len;
+    size_t name_len;
+    char *name;                 // Points behind the key
+    char key[];
+};
+
+struct casefold_dir {
+    struct casefold_dir *hash_next;
+    struct casefold_dir *lru_prev;
+    struct casefold_dir *lru_next;
+    uint64_t hash;
+    struct timespec mtime;      // When the directory was indexed
+    struct casefold_name **table;
+    size_t mask;
+    size_t count;
+    size_t len;
+    char path[];
+};
+
+static struct {
+    bool enabled;
+    pthread_mutex_t lock;
+    uint64_t epoch;
+    struct casefold_dir *table[CASEFOLD_BUCKETS];
+    struct casefold_dir lru;
+    size_t count;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t scans;
+} casefold;
+
+static const struct fuse_operations *casefold_base;
+
+static void
+casefold_init(bool case_insensitive)
+{
+    if (!case_insensitive) {
+        return;
+    }
+    
+    // Nothing to do if the backing store ignores case itself
+    if (fpathconf(loopback.root_fd, _PC_CASE_SENSITIVE) == 0) {
+        return;
+    }
+    
+    pthread_mutex_init(&casefold.lock, NULL);
+    casefold.lru.lru_prev = &casefold.lru;
+    casefold.lru.lru_next = &casefold.lru;
+    casefold.enabled = true;
+}
+
+/*
+ * Writes the key of the name of len bytes to key, which must have room for
+ * CASEFOLD_KEY_MAX bytes, and returns its length. Spellings of a name that
+ * only differ in case or Unicode normalization have the same key.
+ */
+static size_t
+casefold_key(const char *name, size_t len, char *key)
+{
+    CFStringRef str;
+    CFMutableStringRef folded = NULL;
+    bool done = false;
+    size_t i;
+    
+    for (i = 0; i < len && !(name[i] & 0x80); i++) {
+        key[i] = name[i] >= 'A' && name[i] <= 'Z' ? name[i] + 'a' - 'A'
+                                                  : name[i];
+    }
+    if (i == len) {
+        key[len] = '\0';
+        return len;
+    }
+    
+    str = CFStringCreateWithBytes(kCFAllocatorDefault, (const UInt8 *)name,
+                                  len, kCFStringEncodingUTF8, false);
+    if (str != NULL) {
+        folded = CFStringCreateMutableCopy(kCFAllocatorDefault, 0, str);
+        CFRelease(str);
+    }
+    if (folded != NULL) {
+        CFStringNormalize(folded, kCFStringNormalizationFormD);
+        CFStringFold(folded, kCFCompareCaseInsensitive, NULL);
+        done = CFStringGetCString(folded, key, CASEFOLD_KEY_MAX,
+                                  kCFStringEncodingUTF8);
+        CFRelease(folded);
+    }
+    if (done) {
+        return strlen(key);
+    }
+    
+    // Not UTF-8, only fold the ASCII letters
+    for (; i < len; i++) {
+        key[i] = name[i] >= 'A' && name[i] <= 'Z' ? name[i] + 'a' - 'A'
+                                                  : name[i];
+    }
+    key[len] = '\0';
+    return len;
+}
+
+static struct casefold_name *
+casefold_name_new(const char *name, size_t len)
+{
+    char key[CASEFOLD_KEY_MAX];
+    size_t key_len = casefold_key(name, len, key);
+    struct casefold_name *n;
+    
+    n = malloc(sizeof(struct casefold_name) + key_len + 1 + len + 1);
+    if (n == NULL) {
+        return NULL;
+    }
+    
+    n->hash = loopback_hash_n(key, key_len);
+    n->key_len = key_len;
+    n->name_len = len;
+    memcpy(n->key, key, key_len + 1);
+    n->name = n->key + key_len + 1;
+    memcpy(n->name, name, len);
+    n->name[len] = '\0';
+    return n;
+}
+
+static void
+casefold_dir_free(struct casefold_dir *d)
+{
+    size_t i;
+    
+    for (i = 0; i <= d->mask; i++) {
+        struct casefold_name *n;
+        
+        while ((n = d->table[i]) != NULL) {
+            d->table[i] = n->next;
+            free(n);
+        }
+    }
+    free(d->table);
+    free(d);
+}
+
+// Keeps the chains short, the table is only allocated once it is needed
+static void
+casefold_dir_add(struct casefold_dir *d, struct casefold_name *n)
+{
+    if (d->count >= 2 * (d->mask + 1) || d->table == NULL) {
+        size_t nbuckets = d->table == NULL ? 16 : 2 * (d->mask + 1);
+        struct casefold_name **table;
+        size_t i;
+        
+        while (nbuckets < d->count) {
+            nbuckets <<= 1;
+        }
+        table = calloc(nbuckets, sizeof(struct casefold_name *));
+        if (table != NULL) {
+            for (i = 0; d->table != NULL && i <= d->mask; i++) {
+                struct casefold_name *m;
+                
+                while ((m = d->table[i]) != NULL) {
+                    d->table[i] = m->next;
+                    m->next = table[m->hash & (nbuckets - 1)];
+                    table[m->hash & (nbuckets - 1)] = m;
+                }
+            }
+            free(d->table);
+            d->table = table;
+            d->mask = nbuckets - 1;
+        } else if (d->table == NULL) {
+            free(n);
+            return;
+        }
+    }
+    
+    n->next = d->table[n->hash & d->mask];
+    d->table[n->hash & d->mask] = n;
+    d->count++;
+}
+
+/*
+ * Finds the name in d with the same key as name, preferring one that is
+ * spelled exactly like it.
+ */
+static struct casefold_name *
+casefold_dir_match(struct casefold_dir *d, const char *name, size_t len)
+{
+    char key[CASEFOLD_KEY_MAX];
+    size_t key_len;
+    uint64_t hash;
+    struct casefold_name *match = NULL;
+    struct casefold_name *n;
+    
+    if (d->table == NULL) {
+        return NULL;
+    }
+    
+    key_len = casefold_key(name, len, key);
+    hash = loopback_hash_n(key, key_len);
+    
+    for (n = d->table[hash & d->mask]; n != NULL; n = n->next) {
+        if (n->hash != hash || n->key_len != key_len ||
+            memcmp(n->key, key, key_len) != 0) {
+            continue;
+        }
+        if (n->name_len == len && memcmp(n->name, name, len) == 0) {
+            return n;
+        }
+        if (match == NULL) {
+            match = n;
+        }
+    }
+    return match;
+}
+
+// Must be called with the lock held
+static struct casefold_dir *
+casefold_dir_find_locked(const char *path, size_t len)
+{
+    uint64_t hash = loopback_hash_n(path, len);
+    struct casefold_dir *d;
+    
+    for (d = casefold.table[hash % CASEFOLD_BUCKETS]; d != NULL;
+         d = d->hash_next) {
+        if (d->hash == hash && d->len == len &&
+            memcmp(d->path, path, len) == 0) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+// Must be called with the lock held
+static void
+casefold_dir_remove_locked(struct casefold_dir *d)
+{
+    struct casefold_dir **pp = &casefold.table[d->hash % CASEFOLD_BUCKETS];
+    
+    while (*pp != d) {
+        pp = &(*pp)->hash_next;
+    }
+    *pp = d->hash_next;
+    
+    d->lru_prev->lru_next = d->lru_next;
+    d->lru_next->lru_prev = d->lru_prev;
+    casefold.count--;
+    
+    casefold_dir_free(d);
+}
+
+/*
+ * Looks up the name of len bytes in the index of the directory made up of
+ * the first dir_len characters of dir. Copies the spelling on the backing
+ * store to found, and the modification time the directory was indexed at
+ * to *mtime.
+ */
+static int
+casefold_lookup(const char *dir, size_t dir_len, const char *name,
+                size_t len, char *found, struct timespec *mtime)
+{
+    struct casefold_dir *d;
+    struct casefold_name *n;
+    int res = CASEFOLD_UNKNOWN;
+    
+    pthread_mutex_lock(&casefold.lock);
+    
+    d = casefold_dir_find_locked(dir, dir_len);
+    if (d != NULL) {
+        d->lru_prev->lru_next = d->lru_next;
+        d->lru_next->lru_prev = d->lru_prev;
+        d->lru_next = casefold.lru.lru_next;
+        d->lru_prev = &casefold.lru;
+        casefold.lru.lru_next->lru_prev = d;
+        casefold.lru.lru_next = d;
+        
+        *mtime = d->mtime;
+        n = casefold_dir_match(d, name, len);
+        if (n != NULL) {
+            memcpy(found, n->name, n->name_len + 1);
+            casefold.hits++;
+            res = CASEFOLD_FOUND;
+        } else {
+            res = CASEFOLD_MISSING;
+        }
+    }
+    
+    pthread_mutex_unlock(&casefold.lock);
+    
+    return res;
+}
+
+// Relative path of the directory for the *at() calls, which may be "."
+static const char *
+casefold_rel(const char *dir, size_t dir_len, char *buf)
+{
+    if (dir_len <= 1) {
+        return ".";
+    }
+    memcpy(buf, dir + 1, dir_len - 1);
+    buf[dir_len - 1] = '\0';
+    return buf;
+}
+
+/*
+ * Returns the modification time to index a directory under. A file created
+ * behind the mount in the same tick as the index would not change it, so
+ * directories modified less than LOOPBACK_RACY_SECONDS ago get a time that
+ * never matches, and a name missing from their index is looked for again.
+ */
+static inline struct timespec
+casefold_stamp(const struct timespec *mtime)
+{
+    struct timespec never = { 0, 0 };
+    
+    return loopback_racy(mtime) ? never : *mtime;
+}
+
+static bool
+casefold_dir_changed(const char *dir, size_t dir_len,
+                     const struct timespec *mtime)
+{
+    char rel[MAXPATHLEN];
+    struct stat st;
+    
+    if (fstatat(loopback.root_fd, casefold_rel(dir, dir_len, rel), &st,
+                0) == -1) {
+        return true;
+    }
+    return st.st_mtimespec.tv_sec != mtime->tv_sec ||
+           st.st_mtimespec.tv_nsec != mtime->tv_nsec;
+}
+
+/*
+ * Indexes the directory made up of the first dir_len characters of dir and
+ * looks up the name of len bytes in the new index, like casefold_lookup().
+ */
+static int
+casefold_scan(const char *dir, size_t dir_len, const char *name, size_t len,
+              char *found)
+{
+    char rel[MAXPATHLEN];
+    struct casefold_dir *d;
+    struct casefold_dir *old;
+    struct casefold_name *n;
+    struct dirent *de;
+    struct stat st;
+    uint64_t ticket;
+    DIR *dp;
+    int fd;
+    int res = CASEFOLD_MISSING;
+    
+    ticket = __atomic_load_n(&casefold.epoch, __ATOMIC_ACQUIRE);
+    
+    fd = openat(loopback.root_fd, casefold_rel(dir, dir_len, rel),
+                O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return CASEFOLD_MISSING;
+    }
+    if (fstat(fd, &st) == -1 || (dp = fdopendir(fd)) == NULL) {
+        close(fd);
+        return CASEFOLD_MISSING;
+    }
+    
+    d = calloc(1, sizeof(struct casefold_dir) + dir_len);
+    if (d == NULL) {
+        closedir(dp);
+        return CASEFOLD_MISSING;
+    }
+    d->hash = loopback_hash_n(dir, dir_len);
+    d->mtime = casefold_stamp(&st.st_mtimespec);
+    d->len = dir_len;
+    memcpy(d->path, dir, dir_len);
+    
+    while ((de = readdir(dp)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        n = casefold_name_new(de->d_name, strlen(de->d_name));
+        if (n != NULL) {
+            casefold_dir_add(d, n);
+        }
+    }
+    closedir(dp);
+    
+    n = casefold_dir_match(d, name, len);
+    if (n != NULL) {
+        memcpy(found, n->name, n->name_len + 1);
+        res = CASEFOLD_FOUND;
+    }
+    
+    pthread_mutex_lock(&casefold.lock);
+    
+    casefold.scans++;
+    
+    // Only keep the index if nothing changed the directory while it was read
+    if (__atomic_load_n(&casefold.epoch, __ATOMIC_ACQUIRE) == ticket) {
+        old = casefold_dir_find_locked(dir, dir_len);
+        if (old != NULL) {
+            casefold_dir_remove_locked(old);
+        }
+        while (casefold.count >= CASEFOLD_DIRS) {
+            casefold_dir_remove_locked(casefold.lru.lru_prev);
+        }
+        
+        d->hash_next = casefold.table[d->hash % CASEFOLD_BUCKETS];
+        casefold.table[d->hash % CASEFOLD_BUCKETS] = d;
+        d->lru_next = casefold.lru.lru_next;
+        d->lru_prev = &casefold.lru;
+        casefold.lru.lru_next->lru_prev = d;
+        casefold.lru.lru_next = d;
+        casefold.count++;
+        d = NULL;
+    }
+    
+    pthread_mutex_unlock(&casefold.lock);
+    
+    if (d != NULL) {
+        casefold_dir_free(d);
+    }
+    return res;
+}
+
+/*
+ * Translates path into the spelling on the backing store. A component that
+ * does not exist, and everything after it, is kept as given. Returns 0 or
+ * -ENAMETOOLONG.
+ */
+static int
+casefold_resolve(const char *path, char *out, size_t size)
+{
+    size_t path_len = strlen(path);
+    size_t parent = loopback_parent_len(path);
+    size_t len = 0;
+    const char *p = path;
+    struct stat st;
+    
+    if (path_len >= size) {
+        return -ENAMETOOLONG;
+    }
+    
+    memcpy(out, path, path_len + 1);
+    if (path[1] == '\0' ||
+        fstatat(loopback.root_fd, path + 1, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+        return 0;
+    }
+    
+    // Usually only the last component needs to be looked up
+    if (parent > 1) {
+        out[parent] = '\0';
+        if (fstatat(loopback.root_fd, out + 1, &st, 0) == 0 &&
+            S_ISDIR(st.st_mode)) {
+            len = parent;
+            p = path + parent;
+        }
+    }
+    
+    while (*p == '/') {
+        const char *name = p + 1;
+        size_t name_len = strcspn(name, "/");
+        size_t dir_len = len > 0 ? len : 1;
+        char found[NAME_MAX + 1];
+        struct timespec mtime;
+        int state;
+        
+        if (len == 0) {
+            out[0] = '/';
+        }
+        out[dir_len] = '\0';
+        
+        state = casefold_lookup(out, dir_len, name, name_len, found, &mtime);
+        if (state == CASEFOLD_UNKNOWN) {
+            // Not indexed yet, which is not needed if the name exists as given
+            if (len + name_len + 1 >= size) {
+                return -ENAMETOOLONG;
+            }
+            memcpy(out + len, p, name_len + 1);
+            out[len + name_len + 1] = '\0';
+            if (fstatat(loopback.root_fd, out + 1, &st,
+                        AT_SYMLINK_NOFOLLOW) == 0) {
+                len += name_len + 1;
+                p = name + name_len;
+                continue;
+            }
+            out[dir_len] = '\0';
+        }
+        if (state == CASEFOLD_UNKNOWN ||
+            (state == CASEFOLD_MISSING &&
+             casefold_dir_changed(out, dir_len, &mtime))) {
+            state = casefold_scan(out, dir_len, name, name_len, found);
+        }
+        
+        if (state != CASEFOLD_FOUND) {
+            __atomic_fetch_add(&casefold.misses, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        
+        p = name + name_len;
+        name_len = strlen(found);
+        if (len + 1 + name_len + strlen(p) >= size) {
+            return -ENAMETOOLONG;
+        }
+        out[len] = '/';
+        memcpy(out + len + 1, found, name_len);
+        len += name_len + 1;
+    }
+    
+    // The rest is kept as given
+    if (len + strlen(p) >= size) {
+        return -ENAMETOOLONG;
+    }
+    memcpy(out + len, p, strlen(p) + 1);
+    return 0;
+}
+
+/*
+ * Adds the last component of path, spelled as on the backing store, to the
+ * index of its directory after it was created there.
+ */
+static void
+casefold_added(const char *path)
+{
+    size_t parent = loopback_parent_len(path);
+    const char *name = path + parent + (parent > 1);
+    struct casefold_name *n;
+    struct casefold_dir *d;
+    struct timespec mtime = { 0, 0 };
+    char rel[MAXPATHLEN];
+    struct stat st;
+    
+    if (fstatat(loopback.root_fd, casefold_rel(path, parent, rel), &st,
+                0) == 0) {
+        mtime = casefold_stamp(&st.st_mtimespec);
+    }
+    n = casefold_name_new(name, strlen(name));
+    
+    pthread_mutex_lock(&casefold.lock);
+    __atomic_fetch_add(&casefold.epoch, 1, __ATOMIC_ACQ_REL);
+    d = casefold_dir_find_locked(path, parent);
+    if (d != NULL && n != NULL) {
+        struct casefold_name *m = casefold_dir_match(d, name, strlen(name));
+        
+        d->mtime = mtime;
+        if (m == NULL || strcmp(m->name, name) != 0) {
+            casefold_dir_add(d, n);
+            n = NULL;
+        }
+    } else if (d != NULL) {
+        // Cannot be kept up to date
+        casefold_dir_remove_locked(d);
+    }
+    pthread_mutex_unlock(&casefold.lock);
+    
+    free(n);
+}
+
+// Drops the last component of path from the index of its directory
+static void
+casefold_removed(const char *path)
+{
+    size_t parent = loopback_parent_len(path);
+    const char *name = path + parent + (parent > 1);
+    size_t len = strlen(name);
+    char key[CASEFOLD_KEY_MAX];
+    uint64_t hash = loopback_hash_n(key, casefold_key(name, len, key));
+    struct casefold_dir *d;
+    struct timespec mtime = { 0, 0 };
+    char rel[MAXPATHLEN];
+    struct stat st;
+    
+    if (fstatat(loopback.root_fd, casefold_rel(path, parent, rel), &st,
+                0) == 0) {
+        mtime = casefold_stamp(&st.st_mtimespec);
+    }
+    
+    pthread_mutex_lock(&casefold.lock);
+    __atomic_fetch_add(&casefold.epoch, 1, __ATOMIC_ACQ_REL);
+    d = casefold_dir_find_locked(path, parent);
+    if (d != NULL && d->table != NULL) {
+        struct casefold_name **pp = &d->table[hash & d->mask];
+        
+        while (*pp != NULL && ((*pp)->name_len != len ||
+                               memcmp((*pp)->name, name, len) != 0)) {
+            pp = &(*pp)->next;
+        }
+        if (*pp != NULL) {
+            struct casefold_name *n = *pp;
+            
+            *pp = n->next;
+            free(n);
+            d->count--;
+        }
+        d->mtime = mtime;
+    }
+    pthread_mutex_unlock(&casefold.lock);
+}
+
+/*
+ * Drops the index of the directory made up of the first len characters of
+ * path, and with tree those of all directories below it.
+ */
+static void
+casefold_forget(const char *path, size_t len, bool tree)
+{
+    struct casefold_dir *d;
+    struct casefold_dir *next;
+    
+    pthread_mutex_lock(&casefold.lock);
+    __atomic_fetch_add(&casefold.epoch, 1, __ATOMIC_ACQ_REL);
+    for (d = casefold.lru.lru_next; d != &casefold.lru; d = next) {
+        next = d->lru_next;
+        if (d->len >= len && memcmp(d->path, path, len) == 0 &&
+            (d->len == len || (tree && d->path[len] == '/'))) {
+            casefold_dir_remove_locked(d);
+        }
+    }
+    pthread_mutex_unlock(&casefold.lock);
+}
+
+static void
+casefold_report(FILE *out)
+{
+    if (!casefold.enabled) {
+        return;
+    }
+    
+    pthread_mutex_lock(&casefold.lock);
+    fprintf(out, "loopback: case folding: %llu hits, %llu misses, "
+            "%llu scans, %zu directories\n",
+            (unsigned long long)casefold.hits,
+            (unsigned long long)casefold.misses,
+            (unsigned long long)casefold.scans, casefold.count);
+    pthread_mutex_unlock(&casefold.lock);
+}
+
+/*
+ * For an operation on an existing object that path as given did not find:
+ * translates path to real and returns whether trying again is worthwhile.
+ */
+static bool
+casefold_retry(const char *path, char *real, size_t size)
+{
+    return casefold_resolve(path, real, size) == 0 && strcmp(real, path) != 0;
+}
+
+// The index of a directory on the way to real named an object that is gone
+static int
+casefold_retried(const char *real, int res)
+{
+    if (res == -ENOENT) {
+        casefold_forget(real, loopback_parent_len(real), false);
+    }
+    return res;
+}
+
+/*
+ * Renaming an object to a name that only differs in case translates the new
+ * name to the old one. Gives real the last component of path instead.
+ */
+static int
+casefold_respell(const char *path, char *real, size_t size)
+{
+    const char *name = strrchr(path, '/');
+    char *slash = strrchr(real, '/');
+    
+    if ((size_t)(slash - real) + strlen(name) >= size) {
+        return -ENAMETOOLONG;
+    }
+    memcpy(slash, name, strlen(name) + 1);
+    return 0;
+}
+
+static int
+casefold_getattr(const char *path, struct stat *stbuf)
+{
+    char real[MAXPATHLEN];
+    int res = casefold_base->getattr(path, stbuf);
+    
+    if (res == -ENOENT && casefold_retry(path, real, sizeof(real))) {
+        res = casefold_retried(real, casefold_base->getattr(real, stbuf));
+    }
+    return res;
+}
+
+static int
+casefold_readlink(const char *path, char *buf, size_t size)
+{
+    char real[MAXPATHLEN];
+    int res = casefold_base->readlink(path, buf, size);
+    
+    if (res == -ENOENT && casefold_retry(path, real, sizeof(real))) {
+        res = casefold_retried(real, casefold_base->readlink(real, buf, size));
+    }
+    return res;
+}
+
+static int
+casefold_opendir(const char *path, struct fuse_file_info *fi)
+{
+    char real[MAXPATHLEN];
+    int res = casefold_base->opendir(path, fi);
+    
+    if (res == -ENOENT && casefold_retry(path, real, sizeof(real))) {
+        res = casefold_retried(real, casefold_base->opendir(real, fi));
+    }
+    return res;
+}
+
+static int
+casefold_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+    char real[MAXPATHLEN];
+    int res = casefold_resolve(path, real, sizeof(real));
+    
+    if (res == 0) {
+        res = casefold_base->mknod(real, mode, rdev);
+    }
+    if (res == 0) {
+        casefold_added(real);
+    }
+    return res;
+}
+
+static int
+casefold_mkdir(const char *path, mode_t mode)
+{
+    char real[MAXPATHLEN];
+    int res = casefold_resolve(path, real, sizeof(real));
+    
+    if (res == 0) {
+        res = casefold_base->mkdir(real, mode);
+    }
+    if (res == 0) {
+        casefold_added(real);
+    }
+    return res;
+}
+
+static int
+casefold_symlink(const char *from, const char *to)
+{
+    char real[MAXPATHLEN];
+    int res = casefold_resolve(to, real, sizeof(real));
+    
+    if (res == 0) {
+        res = casefold_base->symlink(from, real);
+    }
+    if (res == 0) {
+        casefold_added(real);
+    }
+    return res;
+}
+
+static int
+casefold_unlink(const char *path)
+{
+    char real[MAXPATHLEN];
+    const char *done = path;
+    int res = casefold_base->unlink(path);
+    
+    if (res == -ENOENT && casefold_retry(path, real, sizeof(real))) {
+        res = casefold_retried(real, casefold_base->unlink(real));
+        done = real;
+    }
+    if (res == 0) {
+        casefold_removed(done);
+    }
+    return res;
+}
+
+static int
+casefold_rmdir(const char *path)
+{
+    char real[MAXPATHLEN];
+    const char *done = path;
+    int res = casefold_base->rmdir(path);
+    
+    if (res == -ENOENT && casefold_retry(path, real, sizeof(real))) {
+        res = casefold_retried(real, casefold_base->rmdir(real));
+        done = real;
+    }
+    if (res == 0) {
+        casefold_removed(done);
+        casefold_forget(done, strlen(done), true);
+    }
+    return res;
+}
+
+static int
+casefold_rename(const char *from, const char *to)
+{
+    char real_from[MAXPATHLEN];
+    char real_to[MAXPATHLEN];
+    int res = casefold_resolve(from, real_from, sizeof(real_from));
+    
+    if (res == 0) {
+        res = casefold_resolve(to, real_to, sizeof(real_to));
+    }
+    if (res == 0 && strcmp(real_from, real_to) == 0) {
+        res = casefold_respell(to, real_to, sizeof(real_to));
+    }
+    if (res == 0) {
+        res = casefold_base->rename(real_from, real_to);
+    }
+    if (res == 0) {
+        casefold_removed(real_from);
+        casefold_forget(real_from, strlen(real_from), true);
+        casefold_added(real_to);
+    }
+    return res;
+}
+
+static int
+casefold_link(const char *from, const char *to)
+{
+    char real_from[MAXPATHLEN];
+    char real_to[MAXPATHLEN];
+    int res = casefold_resolve(from, real_from, sizeof(real_from));
+    
+    if (res == 0) {
+        res = casefold_resolve(to, real_to, sizeof(real_to));
+    }
+    if (res == 0) {
+        res = casefold_base->link(real_from, real_to);
+    }
+    if (res == 0) {
+        casefold_added(real_to);
+    }
+    return res;
+}
+
+static int
+casefold_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    char real[MAXPATHLEN];
+    int res = casefold_resolve(path, real, sizeof(real));
+    
+    if (res == 0) {
+        res = casefold_base->create(real, mode, fi);
+    }
+    if (res == 0) {
+        casefold_added(real);
+    }
+    return res;
+}
+
+static int
+casefold_open(const char *path, struct fuse_file_info *fi)
+{
+    char real[MAXPATHLEN];
+    int res = casefold_base->open(path, fi);
+    
+    if (res == -ENOENT && casefold_retry(path, real, sizeof(real))) {
+        res = casefold_retried(real, casefold_base->open(real, fi));
+    }
+    return res;
+}
+
+static int
+casefold_setxattr(const char *path, const char *name, const char *value,
+                  size_t size, int flags, uint32_t position)
+{
+    char real[MAXPATHLEN];
+    int res = casefold_base->setxattr(path, name, value, size, flags,
+                                      position);
+    
+    if (res == -ENOENT && casefold_retry(path, real, sizeof(real))) {
+        res = casefold_retried(real,
+                               casefold_base->setxattr(real, name, value,
+                                                       size, flags,
+                                                       position));
+    }
+    return res;
+}
+
+static int
+casefold_getxattr(const char *path, const char *name, char *value,
+                  size_t size, uint32_t position)
+{
+    char real[MAXPATHLEN];
+    int res = casefold_base->getxattr(path, name, value, size, position);
+    
+    if (res == -ENOENT && casefold_retry(path, real, sizeof(real))) {
+        res = casefold_retried(real,
+                               casefold_base->getxattr(real, name, value,
+                                                       size, position));
+    }
+    return res;
+}
+
+static int
+casefold_listxattr(const char *path, char *list, size_t size)
+{
+    char real[MAXPATHLEN];
+    int res = casefold_base->listxattr(path, list, size);
+    
+    if (res == -ENOENT && casefold_retry(path, real, sizeof(real))) {
+        res = casefold_retried(real,
+                               casefold_base->listxattr(real, list, size));
+    }
+    return res;
+}
+
+static int
+casefold_removexattr(const char *path, const char *name)
+{
+    char real[MAXPATHLEN];
+    int res = casefold_base->removexattr(path, name);
+    
+    if (res == -ENOENT && casefold_retry(path, real, sizeof(real))) {
+        res = casefold_retried(real, casefold_base->removexattr(real, name));
+    }
+    return res;
+}
+
+#if HAVE_EXCHANGE
+
+static int
+casefold_exchange(const char *path1, const char *path2,
+                  unsigned long options)
+{
+    char real1[MAXPATHLEN];
+    char real2[MAXPATHLEN];
+    int res = casefold_resolve(path1, real1, sizeof(real1));
+    
+    if (res == 0) {
+        res = casefold_resolve(path2, real2, sizeof(real2));
+    }
+    if (res == 0) {
+        res = casefold_base->exchange(real1, real2, options);
+    }
+    return res;
+}
+
+#endif /* HAVE_EXCHANGE */
+
+static int
+casefold_getxtimes(const char *path, struct timespec *bkuptime,
+                   struct timespec *crtime)
+{
+    char real[MAXPATHLEN];
+    int res = casefold_base->getxtimes(path, bkuptime, crtime);
+    
+    if (res == -ENOENT && casefold_retry(path, real, sizeof(real))) {
+        res = casefold_retried(real,
+                               casefold_base->getxtimes(real, bkuptime,
+                                                        crtime));
+    }
+    return res;
+}
+
+static int
+casefold_setattr_x(const char *path, struct setattr_x *attr)
+{
+    char real[MAXPATHLEN];
+    int res = casefold_base->setattr_x(path, attr);
+    
+    if (res == -ENOENT && casefold_retry(path, real, sizeof(real))) {
+        res = casefold_retried(real, casefold_base->setattr_x(real, attr));
+    }
+    return res;
+}
+
+static int
+casefold_fsetattr_x(const char *path, struct setattr_x *attr,
+                    struct fuse_file_info *fi)
+{
+    return casefold_base->fsetattr_x(path, attr, fi);
+}
+
+static int
+casefold_statfs_x(const char *path, struct statfs *stbuf)
+{
+    char real[MAXPATHLEN];
+    int res = casefold_base->statfs_x(path, stbuf);
+    
+    if (res == -ENOENT && casefold_retry(path, real, sizeof(real))) {
+        res = casefold_retried(real, casefold_base->statfs_x(real, stbuf));
+    }
+    return res;
+}
+
+#if HAVE_RENAMEX
+
+static int
+casefold_renamex(const char *path1, const char *path2, unsigned int flags)
+{
+    char real1[MAXPATHLEN];
+    char real2[MAXPATHLEN];
+    int res = casefold_resolve(path1, real1, sizeof(real1));
+    
+    if (res == 0) {
+        res = casefold_resolve(path2, real2, sizeof(real2));
+    }
+    if (res == 0 && !(flags & RENAME_SWAP) && strcmp(real1, real2) == 0) {
+        res = casefold_respell(path2, real2, sizeof(real2));
+    }
+    if (res == 0) {
+        res = casefold_base->renamex(real1, real2, flags);
+    }
+    if (res != 0) {
+        return res;
+    }
+    
+    // Swapped objects keep their names, but directories below them move
+    casefold_forget(real1, strlen(real1), true);
+    casefold_forget(real2, strlen(real2), true);
+    if (!(flags & RENAME_SWAP)) {
+        casefold_removed(real1);
+        casefold_added(real2);
+    }
+    return 0;
+}
+
+#endif /* HAVE_RENAMEX */
+
+/*
+ * External changes
+ *
+ * With the watch mount option, an FSEvents stream on the backing root drops
+ * the cached state of every object that another process changes directly on
+ * the backing store: attributes, negative lookups, descriptors of renamed
+ * directories, extended attributes, name indexes, and the read-ahead
+ * buffers and cached blocks of the file (through its inode generation).
+ * The kernel extension is told to drop the inode of the object as well, if
+ * the FUSE library supports it. Changes made through the mount are ignored,
+ * because the operations making them invalidate the caches themselves. With
+ * the watcher running, the TTLs of the attribute and negative caches can be
+ * raised well above their defaults.
+ *
+ * FSEvents delivers the events of watch_latency=N milliseconds (50 by
+ * default) as one batch, and the events of a batch for the same path are
+ * handled once. A batch of more than WATCH_STORM events, or one reporting
+ * that events were dropped or coalesced into a whole tree, or that the root
+ * itself changed, drops everything instead. The kernel extension cannot be
+ * told about that, its entries expire after their timeouts. Directory
+ * snapshots and cached descriptors of files check the attributes of their
+ * object on every use and need no invalidation. Only the upper branch is
+ * watched in union mode.
+ */
+
+#define WATCH_STORM 4096
+
+#define WATCH_DROPPED (kFSEventStreamEventFlagMustScanSubDirs | \
+                       kFSEventStreamEventFlagUserDropped | \
+                       kFSEventStreamEventFlagKernelDropped | \
+                       kFSEventStreamEventFlagRootChanged)
+
+#define WATCH_MOVED   (kFSEventStreamEventFlagItemCreated | \
+                       kFSEventStreamEventFlagItemRemoved | \
+                       kFSEventStreamEventFlagItemRenamed)
+
+struct watch_change {
+    char *path;                 // On the mount
+    bool tree;                  // Everything below path changed as well
+    bool moved;                 // Created, removed or renamed
+};
+
+static struct {
+    bool enabled;
+    CFTimeInterval latency;
+    FSEventStreamRef stream;
+    dispatch_queue_t queue;
+    struct fuse *fuse;
+    bool notify;
+    uint64_t events;
+    uint64_t batches;
+    uint64_t coalesced;
+    uint64_t full;
+    uint64_t notified;
+} watch;
+
+static void
+watch_init(bool enabled, uint32_t latency_ms)
+{
+    if (!enabled) {
+        return;
+    }
+    
+    watch.latency = latency_ms / 1000.0;
+    watch.notify = true;
+    watch.enabled = true;
+}
+
+static void
+watch_notify(const char *path)
+{
+    int res;
+    
+    if (!watch.notify || watch.fuse == NULL) {
+        return;
+    }
+    
+    res = fuse_invalidate(watch.fuse, path);
+    if (res == -ENOSYS || res == -EINVAL) {
+        fprintf(stderr, "loopback: kernel cache invalidation is not "
+                "supported by the FUSE library\n");
+        watch.notify = false;
+    } else if (res == 0) {
+        watch.notified++;
+    }
+}
+
+static void
+watch_invalidate(const struct watch_change *c)
+{
+    char parent[MAXPATHLEN];
+    size_t len = loopback_parent_len(c->path);
+    struct stat st;
+    
+    if (loopback_lstat(c->path, &st) == 0) {
+        inode_gen_bump(st.st_dev, st.st_ino);
+    }
+    
+    attr_cache_invalidate_entry(c->path);
+    neg_cache_invalidate(c->path, c->tree);
+    xattr_cache_invalidate(c->path);
+    if (c->tree) {
+        attr_cache_invalidate_tree(c->path);
+        dirfd_cache_invalidate_tree(c->path);
+    }
+    if (casefold.enabled) {
+        casefold_forget(c->path, len, false);
+        if (c->tree) {
+            casefold_forget(c->path, strlen(c->path), true);
+        }
+    }
+    
+    watch_notify(c->path);
+    if (c->moved && len < sizeof(parent)) {
+        memcpy(parent, c->path, len);
+        parent[len] = '\0';
+        watch_notify(parent);
+    }
+}
+
+static void
+watch_invalidate_all(void)
+{
+    size_t i;
+    
+    // The empty prefix matches every path
+    attr_cache_invalidate_tree("");
+    neg_cache_invalidate("", true);
+    dirfd_cache_invalidate_tree("");
+    if (casefold.enabled) {
+        casefold_forget("", 0, true);
+    }
+    statfs_cache_invalidate();
+    
+    for (i = 0; i < INODE_GEN_SLOTS; i++) {
+        __atomic_fetch_add(&inode_gen[i], 1, __ATOMIC_ACQ_REL);
+    }
+    
+    watch.full++;
+}
+
+static int
+watch_change_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct watch_change *)a)->path,
+                  ((const struct watch_change *)b)->path);
+}
+
+// Returns the path on the mount of an event path, or NULL if outside the root
+static char *
+watch_mount_path(const char *event_path)
+{
+    size_t len = strlen(event_path);
+    const char *rel;
+    char *path;
+    
+    while (len > 1 && event_path[len - 1] == '/') {
+        len--;
+    }
+    if (len < loopback.root_len ||
+        memcmp(event_path, loopback.root, loopback.root_len) != 0 ||
+        (len > loopback.root_len && event_path[loopback.root_len] != '/')) {
+        return NULL;
+    }
+    
+    rel = event_path + loopback.root_len;
+    len -= loopback.root_len;
+    if (len == 0) {
+        return strdup("/");
+    }
+    
+    path = malloc(len + 1);
+    if (path != NULL) {
+        memcpy(path, rel, len);
+        path[len] = '\0';
+    }
+    return path;
+}
+
+static void
+watch_callback(ConstFSEventStreamRef stream, void *info, size_t count,
+               void *event_paths, const FSEventStreamEventFlags flags[],
+               const FSEventStreamEventId ids[])
+{
+    char **paths = event_paths;
+    struct watch_change *changes = NULL;
+    bool full = count > WATCH_STORM;
+    size_t n = 0;
+    size_t i;
+    
+    (void)stream;
+    (void)info;
+    (void)ids;
+    
+    watch.events += count;
+    watch.batches++;
+    
+    if (!full) {
+        changes = malloc(count * sizeof(struct watch_change));
+        full = changes == NULL;
+    }
+    
+    for (i = 0; i < count && !full; i++) {
+        char *path;
+        
+        // Before the path, which for these may be outside the root
+        if (flags[i] & WATCH_DROPPED) {
+            full = true;
+            break;
+        }
+        
+        path = watch_mount_path(paths[i]);
+        if (path == NULL) {
+            continue;
+        }
+        
+        changes[n].path = path;
+        changes[n].tree = (flags[i] & kFSEventStreamEventFlagItemIsDir) &&
+                          (flags[i] & WATCH_MOVED);
+        changes[n].moved = (flags[i] & WATCH_MOVED) != 0;
+        n++;
+    }
+    
+    if (full) {
+        watch_invalidate_all();
+    } else {
+        qsort(changes, n, sizeof(struct watch_change), watch_change_cmp);
+        
+        for (i = 0; i < n; i++) {
+            // Merge the events for the same path into the last of them
+            if (i + 1 < n &&
+                strcmp(changes[i].path, changes[i + 1].path) == 0) {
+                changes[i + 1].tree |= changes[i].tree;
+                changes[i + 1].moved |= changes[i].moved;
+                watch.coalesced++;
+                continue;
+            }
+            watch_invalidate(&changes[i]);
+        }
+    }
+    
+    for (i = 0; i < n; i++) {
+        free(changes[i].path);
+    }
+    free(changes);
+}
+
+// Called from loopback_init, once the mount is up
+static void
+watch_start(struct fuse *fuse)
+{
+    FSEventStreamCreateFlags create = kFSEventStreamCreateFlagFileEvents |
+                                      kFSEventStreamCreateFlagWatchRoot |
+                                      kFSEventStreamCreateFlagIgnoreSelf;
+    CFStringRef root;
+    CFArrayRef roots;
+    
+    if (!watch.enabled) {
+        return;
+    }
+    
+    watch.fuse = fuse;
+    
+    root = CFStringCreateWithFileSystemRepresentation(kCFAllocatorDefault,
+        loopback.root_len > 0 ? loopback.root : "/");
+    if (root == NULL) {
+        fprintf(stderr, "loopback: cannot watch root\n");
+        return;
+    }
+    roots = CFArrayCreate(kCFAllocatorDefault, (const void **)&root, 1,
+                          &kCFTypeArrayCallBacks);
+    CFRelease(root);
+    if (roots == NULL) {
+        fprintf(stderr, "loopback: cannot watch root\n");
+        return;
+    }
+    
+    watch.stream = FSEventStreamCreate(kCFAllocatorDefault, watch_callback,
+                                       NULL, roots,
+                                       kFSEventStreamEventIdSinceNow,
+                                       watch.latency, create);
+    CFRelease(roots);
+    if (watch.stream == NULL) {
+        fprintf(stderr, "loopback: cannot watch root\n");
+        return;
+    }
+    
+    watch.queue = dispatch_queue_create("io.macfuse.loopback.watch",
+                                        DISPATCH_QUEUE_SERIAL);
+    FSEventStreamSetDispatchQueue(watch.stream, watch.queue);
+    if (!FSEventStreamStart(watch.stream)) {
+        fprintf(stderr, "loopback: cannot watch root\n");
+        FSEventStreamInvalidate(watch.stream);
+        FSEventStreamRelease(watch.stream);
+        watch.stream = NULL;
+    }
+}
+
+// Waits for the batch in progress, if any
+static void
+watch_stop(void)
+{
+    if (watch.stream == NULL) {
+        return;
+    }
+    
+    FSEventStreamStop(watch.stream);
+    FSEventStreamInvalidate(watch.stream);
+    FSEventStreamRelease(watch.stream);
+    watch.stream = NULL;
+    dispatch_release(watch.queue);
+}
+
+static void
+watch_report(FILE *out)
+{
+    if (!watch.enabled) {
+        return;
+    }
+    
+    fprintf(out, "loopback: watcher: %llu events in %llu batches, "
+            "%llu coalesced, %llu full invalidations, "
+            "%llu kernel notifications\n",
+            (unsigned long long)watch.events,
+            (unsigned long long)watch.batches,
+            (unsigned long long)watch.coalesced,
+            (unsigned long long)watch.full,
+            (unsigned long long)watch.notified);
+}
+
+/*
+ * Statistics
+ *
+ * With the stats mount option, every operation goes through a wrapper that
+ * counts calls, errors by errno and bytes moved, and records its latency in
+ * a log-linear histogram: values below 16 ns have a bucket of their own,
+ * and every power of two above that is split into 16 buckets, for a
+ * relative error of at most 6.25%.
+ *
+ * Every thread records into its own shard without locking. Reading merges
+ * the shards, so operations that complete while reading may be counted in
+ * some columns but not in others. The statistics can be read from the
+ * hidden file /.loopback-stats in the root of the mount, and are written to
+ * stderr when the file system is unmounted.
+ */
+
+#define STATS_PATH "/.loopback-stats"
+
+#define STATS_SUB_BITS 4
+#define STATS_SUB_COUNT (1 << STATS_SUB_BITS)
+#define STATS_MAX_BITS 40
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 1) * STATS_SUB_COUNT)
+#define STATS_ERRNO_MAX 128
+
+static const char *stats_op_names[LOOPBACK_OP_COUNT] = {
+#define STATS_OP_NAME(op, name) name,
+    LOOPBACK_OPS(STATS_OP_NAME)
+#undef STATS_OP_NAME
+};
+
+struct stats_op {
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t errnos[STATS_ERRNO_MAX];
+    uint64_t buckets[STATS_BUCKETS];
+};
+
+struct stats_shard {
+    struct stats_shard *next;
+    struct stats_shard *free_next;
+    struct stats_op ops[LOOPBACK_OP_COUNT];
+};
+
+static struct {
+    bool enabled;
+    pthread_key_t key;
+    pthread_mutex_t lock;
+    struct stats_shard *shards;
+    struct stats_shard *free_shards;
+} stats;
+
+// Shards are only ever written by the thread they belong to
+static inline void
+stats_add(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELAXED);
+}
+
+static inline uint64_t
+stats_get(const uint64_t *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static inline unsigned int
+stats_bucket(uint64_t ns)
+{
+    unsigned int msb;
+    
+    if (ns < STATS_SUB_COUNT) {
+        return (unsigned int)ns;
+    }
+    
+    msb = 63 - __builtin_clzll(ns);
+    if (msb >= STATS_MAX_BITS) {
+        return STATS_BUCKETS - 1;
+    }
+    
+    return (msb - STATS_SUB_BITS + 1) * STATS_SUB_COUNT +
+           (unsigned int)((ns >> (msb - STATS_SUB_BITS)) & (STATS_SUB_COUNT - 1));
+}
+
+// Largest value that falls into bucket
+static uint64_t
+stats_bucket_limit(unsigned int bucket)
+{
+    unsigned int msb;
+    uint64_t sub;
+    
+    if (bucket < STATS_SUB_COUNT) {
+        return bucket;
+    }
+    
+    msb = bucket / STATS_SUB_COUNT + STATS_SUB_BITS - 1;
+    sub = bucket % STATS_SUB_COUNT;
+    return ((STATS_SUB_COUNT + sub + 1) << (msb - STATS_SUB_BITS)) - 1;
+}
+
+// Keeps the counts of exited threads around for the next thread
+static void
+stats_shard_release(void *arg)
+{
+    struct stats_shard *shard = arg;
+    
+    pthread_mutex_lock(&stats.lock);
+    shard->free_next = stats.free_shards;
+    stats.free_shards = shard;
+    pthread_mutex_unlock(&stats.lock);
+}
+
+static void
+stats_init(bool enabled)
+{
+    if (!enabled) {
+        return;
+    }
+    
+    pthread_mutex_init(&stats.lock, NULL);
+    if (pthread_key_create(&stats.key, stats_shard_release) != 0) {
+        fprintf(stderr, "loopback: cannot create statistics key\n");
+        exit(1);
+    }
+    
+    stats.enabled = true;
+}
+
+static struct stats_shard *
+stats_thread_shard(void)
+{
+    struct stats_shard *shard = pthread_getspecific(stats.key);
+    
+    if (shard != NULL) {
+        return shard;
+    }
+    
+    pthread_mutex_lock(&stats.lock);
+    shard = stats.free_shards;
+    if (shard != NULL) {
+        stats.free_shards = shard->free_next;
+    }
+    pthread_mutex_unlock(&stats.lock);
+    
+    if (shard == NULL) {
+        shard = calloc(1, sizeof(struct stats_shard));
+        if (shard == NULL) {
+            return NULL;
+        }
+        
+        pthread_mutex_lock(&stats.lock);
+        shard->next = stats.shards;
+        stats.shards = shard;
+        pthread_mutex_unlock(&stats.lock);
+    }
+    
+    pthread_setspecific(stats.key, shard);
+    return shard;
+}
+
+static void
+stats_record(int op, uint64_t start, ssize_t res, bool moves_bytes)
+{
+    struct stats_shard *shard = stats_thread_shard();
+    struct stats_op *s;
+    uint64_t ns;
+    
+    if (shard == NULL) {
+        return;
+    }
+    
+    s = &shard->ops[op];
+    ns = loopback_now() - start;
+    
+    stats_add(&s->calls, 1);
+    stats_add(&s->total_ns, ns);
+    stats_add(&s->buckets[stats_bucket(ns)], 1);
+    if (ns > stats_get(&s->max_ns)) {
+        __atomic_store_n(&s->max_ns, ns, __ATOMIC_RELAXED);
+    }
+    
+    if (res < 0) {
+        stats_add(&s->errors, 1);
+        if (-res < STATS_ERRNO_MAX) {
+            stats_add(&s->errnos[-res], 1);
+        }
+    } else if (moves_bytes) {
+        stats_add(&s->bytes, res);
+    }
+}
+
+static uint64_t
+stats_percentile(const uint64_t *buckets, uint64_t calls, double fraction)
+{
+    uint64_t rank = (uint64_t)(calls * fraction);
+    uint64_t seen = 0;
+    unsigned int i;
+    
+    for (i = 0; i < STATS_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen > rank) {
+            return stats_bucket_limit(i);
+        }
+    }
+    return stats_bucket_limit(STATS_BUCKETS - 1);
+}
+
+static void
+stats_render(FILE *out)
+{
+    struct stats_op *merged;
+    struct stats_shard *shard;
+    int op;
+    
+    merged = calloc(1, sizeof(struct stats_op));
+    if (merged == NULL) {
+        return;
+    }
+    
+    fprintf(out, "%-12s %10s %8s %14s %10s %10s %10s %10s %10s %10s\n",
+            "operation", "calls", "errors", "bytes", "mean_us", "p50_us",
+            "p90_us", "p99_us", "p999_us", "max_us");
+    
+    for (op = 0; op < LOOPBACK_OP_COUNT; op++) {
+        unsigned int i;
+        
+        memset(merged, 0, sizeof(struct stats_op));
+        
+        pthread_mutex_lock(&stats.lock);
+        for (shard = stats.shards; shard != NULL; shard = shard->next) {
+            struct stats_op *s = &shard->ops[op];
+            uint64_t max_ns = stats_get(&s->max_ns);
+            
+            merged->calls += stats_get(&s->calls);
+            merged->errors += stats_get(&s->errors);
+            merged->bytes += stats_get(&s->bytes);
+            merged->total_ns += stats_get(&s->total_ns);
+            if (max_ns > merged->max_ns) {
+                merged->max_ns = max_ns;
+            }
+            for (i = 0; i < STATS_ERRNO_MAX; i++) {
+                merged->errnos[i] += stats_get(&s->errnos[i]);
+            }
+            for (i = 0; i < STATS_BUCKETS; i++) {
+                merged->buckets[i] += stats_get(&s->buckets[i]);
+            }
+        }
+        pthread_mutex_unlock(&stats.lock);
+        
+        if (merged->calls == 0) {
+            continue;
+        }
+        
+        fprintf(out, "%-12s %10llu %8llu %14llu %10.1f %10.1f %10.1f %10.1f "
+                "%10.1f %10.1f\n", stats_op_names[op],
+                (unsigned long long)merged->calls,
+                (unsigned long long)merged->errors,
+                (unsigned long long)merged->bytes,
+                merged->total_ns / 1000.0 / merged->calls,
+                stats_percentile(merged->buckets, merged->calls, 0.5) / 1000.0,
+                stats_percentile(merged->buckets, merged->calls, 0.9) / 1000.0,
+                stats_percentile(merged->buckets, merged->calls, 0.99) / 1000.0,
+                stats_percentile(merged->buckets, merged->calls, 0.999) /
+                1000.0,
+                merged->max_ns / 1000.0);
+        
+        for (i = 1; i < STATS_ERRNO_MAX; i++) {
+            if (merged->errnos[i] > 0) {
+                fprintf(out, "    %s: %llu\n", strerror(i),
+                        (unsigned long long)merged->errnos[i]);
+            }
+        }
+    }
+    
+    free(merged);
+    
+    attr_cache_report(out);
+    neg_cache_report(out);
+    dir_cache_report(out);
+    warm_index_report(out);
+    dirfd_cache_report(out);
+    fd_cache_report(out);
+    readahead_report(out);
+    block_cache_report(out);
+    xattr_cache_report(out);
+    statfs_cache_report(out);
+    durability_report(out);
+    writeback_report(out);
+    nocache_report(out);
+    union_report(out);
+    casefold_report(out);
+    watch_report(out);
+}
+
+/*
+ * The statistics file is rendered when it is opened, so every open sees a
+ * consistent snapshot. Its handle is told apart by a descriptor of -1.
+ */
+struct stats_file {
+    struct loopback_file file;
+    char *text;
+    size_t len;
+};
+
+static inline bool
+stats_is_file(struct fuse_file_info *fi)
+{
+    return get_file(fi)->fd == -1;
+}
+
+static void
+stats_file_attr(struct stat *stbuf)
+{
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_mode = S_IFREG | 0444;
+    stbuf->st_nlink = 1;
+    stbuf->st_uid = getuid();
+    stbuf->st_gid = getgid();
+}
+
+static int
+stats_file_open(struct fuse_file_info *fi)
+{
+    struct stats_file *sf;
+    FILE *out;
+    
+    if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+        return -EACCES;
+    }
+    
+    sf = calloc(1, sizeof(struct stats_file));
+    if (sf == NULL) {
+        return -ENOMEM;
+    }
+    
+    out = open_memstream(&sf->text, &sf->len);
+    if (out == NULL) {
+        free(sf);
+        return -ENOMEM;
+    }
+    stats_render(out);
+    fclose(out);
+    
+    sf->file.fd = -1;
+    fi->fh = (uint64_t)(uintptr_t)sf;
+    
+    // The size of the file is not known up front
+    fi->direct_io = 1;
+    
+    return 0;
+}
+
+static int
+stats_file_read(struct fuse_file_info *fi, char *buf, size_t size,
+                off_t offset)
+{
+    struct stats_file *sf = (struct stats_file *)get_file(fi);
+    
+    if (offset >= sf->len) {
+        return 0;
+    }
+    if (size > sf->len - offset) {
+        size = sf->len - offset;
+    }
+    memcpy(buf, sf->text + offset, size);
+    return (int)size;
+}
+
+static void
+stats_file_release(struct fuse_file_info *fi)
+{
+    struct stats_file *sf = (struct stats_file *)get_file(fi);
+    
+    free(sf->text);
+    free(sf);
+}
+
+/*
+ * Tracing
+ *
+ * With the trace=FILE mount option, every operation is recorded in FILE in
+ * the format described in loopback_trace.h, for loopback_replay. Records go
+ * to a per-thread ring buffer of trace_buffer=N entries (4096 by default)
+ * without locking, from which a background thread appends them to the file
+ * every 100 ms. Records that do not fit into a full ring are dropped and
+ * counted in the header of the file.
+ *
+ * Paths are recorded by hash. The first time a hash is seen, the path goes
+ * to a shared list that the flusher writes out before the operation
+ * records, so that replay can map the hash back to the path.
+ */
+
+#define TRACE_FLUSH_INTERVAL_MS 100
+#define TRACE_SEEN_CACHE 256
+
+struct trace_path {
+    struct trace_path *next;
+    struct loopback_trace_path record;
+    char path[];
+};
+
+struct trace_ring {
+    struct trace_ring *next;
+    struct trace_ring *free_next;
+    uint16_t thread;
+    uint64_t head;          // Written by the owning thread
+    uint64_t tail;          // Written by the flusher
+    uint64_t dropped;
+    uint64_t seen[TRACE_SEEN_CACHE];
+    struct loopback_trace_op records[];
+};
+
+static struct {
+    bool enabled;
+    int fd;
+    uint32_t size;
+    uint64_t start;
+    uint64_t start_sec;
+    pthread_key_t key;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool exiting;
+    bool running;
+    pthread_t flusher;
+    struct trace_ring *rings;
+    struct trace_ring *free_rings;
+    uint16_t nthreads;
+    
+    // Hashes of the paths recorded so far, 0 marks an empty slot
+    uint64_t *seen;
+    size_t seen_mask;
+    size_t seen_count;
+    struct trace_path *paths;
+    struct trace_path **paths_tail;
+    
+    uint64_t records;
+} trace;
+
+static void
+trace_ring_release(void *arg)
+{
+    struct trace_ring *ring = arg;
+    
+    pthread_mutex_lock(&trace.lock);
+    ring->free_next = trace.free_rings;
+    trace.free_rings = ring;
+    pthread_mutex_unlock(&trace.lock);
+}
+
+static void
+trace_init(const char *file, uint32_t size)
+{
+    struct loopback_trace_header header;
+    struct timeval now;
+    
+    if (file == NULL) {
+        return;
+    }
+    
+    // Opened here, before libfuse changes the working directory
+    trace.fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace.fd == -1) {
+        fprintf(stderr, "loopback: cannot open trace file: %s\n",
+                strerror(errno));
+        exit(1);
+    }
+    
+    trace.size = size > 0 ? size : 1;
+    trace.seen_mask = 4095;
+    trace.seen = calloc(trace.seen_mask + 1, sizeof(uint64_t));
+    if (trace.seen == NULL || pthread_key_create(&trace.key,
+                                                 trace_ring_release) != 0) {
+        fprintf(stderr, "loopback: cannot set up tracing\n");
+        exit(1);
+    }
+    pthread_mutex_init(&trace.lock, NULL);
+    pthread_cond_init(&trace.cond, NULL);
+    trace.paths_tail = &trace.paths;
+    
+    gettimeofday(&now, NULL);
+    trace.start = loopback_now();
+    trace.start_sec = now.tv_sec;
+    
+    memset(&header, 0, sizeof(header));
+    header.magic = LOOPBACK_TRACE_MAGIC;
+    header.version = LOOPBACK_TRACE_VERSION;
+    header.start_sec = trace.start_sec;
+    if (write(trace.fd, &header, sizeof(header)) != sizeof(header)) {
+        fprintf(stderr, "loopback: cannot write trace file: %s\n",
+                strerror(errno));
+        exit(1);
+    }
+    
+    trace.enabled = true;
+}
+
+static struct trace_ring *
+trace_thread_ring(void)
+{
+    struct trace_ring *ring = pthread_getspecific(trace.key);
+    
+    if (ring != NULL) {
+        return ring;
+    }
+    
+    pthread_mutex_lock(&trace.lock);
+    ring = trace.free_rings;
+    if (ring != NULL) {
+        trace.free_rings = ring->free_next;
+    }
+    pthread_mutex_unlock(&trace.lock);
+    
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(struct trace_ring) +
+                      trace.size * sizeof(struct loopback_trace_op));
+        if (ring == NULL) {
+            return NULL;
+        }
+        
+        pthread_mutex_lock(&trace.lock);
+        ring->thread = trace.nthreads++;
+        ring->next = trace.rings;
+        trace.rings = ring;
+        pthread_mutex_unlock(&trace.lock);
+    }
+    
+    pthread_setspecific(trace.key, ring);
+    return ring;
+}
+
+static uint64_t
+trace_path(struct trace_ring *ring, const char *path)
+{
+    struct trace_path *p;
+    uint64_t hash;
+    size_t len;
+    size_t i;
+    
+    if (path == NULL) {
+        return 0;
+    }
+    
+    hash = loopback_hash(path);
+    if (hash == 0) {
+        hash = 1;
+    }
+    
+    if (ring->seen[hash % TRACE_SEEN_CACHE] == hash) {
+        return hash;
+    }
+    
+    pthread_mutex_lock(&trace.lock);
+    
+    for (i = hash & trace.seen_mask; trace.seen[i] != 0;
+         i = (i + 1) & trace.seen_mask) {
+        if (trace.seen[i] == hash) {
+            pthread_mutex_unlock(&trace.lock);
+            ring->seen[hash % TRACE_SEEN_CACHE] = hash;
+            return hash;
+        }
+    }
+    
+    // Not marked as seen, so the path is recorded by a later call
+    len = strlen(path);
+    p = malloc(sizeof(struct trace_path) + len);
+    if (p == NULL) {
+        pthread_mutex_unlock(&trace.lock);
+        return hash;
+    }
+    
+    ring->seen[hash % TRACE_SEEN_CACHE] = hash;
+    trace.seen[i] = hash;
+    trace.seen_count++;
+    
+    memset(&p->record, 0, sizeof(p->record));
+    p->record.type = LOOPBACK_TRACE_PATH;
+    p->record.len = (uint16_t)len;
+    p->record.hash = hash;
+    memcpy(p->path, path, len);
+    p->next = NULL;
+    *trace.paths_tail = p;
+    trace.paths_tail = &p->next;
+    
+    // Keep the table at most half full
+    if (trace.seen_count * 2 > trace.seen_mask) {
+        size_t mask = trace.seen_mask * 2 + 1;
+        uint64_t *seen = calloc(mask + 1, sizeof(uint64_t));
+        
+        if (seen != NULL) {
+            for (i = 0; i <= trace.seen_mask; i++) {
+                size_t j;
+                
+                if (trace.seen[i] == 0) {
+                    continue;
+                }
+                for (j = trace.seen[i] & mask; seen[j] != 0;
+                     j = (j + 1) & mask) {
+                }
+                seen[j] = trace.seen[i];
+            }
+            free(trace.seen);
+            trace.seen = seen;
+            trace.seen_mask = mask;
+        }
+    }
+    
+    pthread_mutex_unlock(&trace.lock);
+    
+    return hash;
+}
+
+static void
+trace_record(int op, uint64_t start, int res, const char *path,
+             const char *path2, uint64_t arg1, uint64_t arg2,
+             struct fuse_file_info *fi)
+{
+    struct trace_ring *ring = trace_thread_ring();
+    struct loopback_trace_op *r;
+    uint64_t head;
+    
+    if (ring == NULL) {
+        return;
+    }
+    
+    head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= trace.size) {
+        ring->dropped++;
+        return;
+    }
+    
+    r = &ring->records[head % trace.size];
+    r->type = LOOPBACK_TRACE_OP;
+    r->op = op;
+    r->thread = ring->thread;
+    r->result = res;
+    r->start_ns = start - trace.start;
+    r->duration_ns = loopback_now() - start;
+    r->path = trace_path(ring, path);
+    r->path2 = trace_path(ring, path2);
+    r->handle = fi != NULL ? fi->fh : 0;
+    r->arg1 = arg1;
+    r->arg2 = arg2;
+    
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void
+trace_write(const void *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t res = write(trace.fd, buf, len);
+        
+        if (res == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "loopback: cannot write trace file: %s\n",
+                    strerror(errno));
+            return;
+        }
+        buf = (const char *)buf + res;
+        len -= res;
+    }
+}
+
+static void
+trace_flush(void)
+{
+    struct trace_path *paths;
+    struct trace_ring *ring;
+    
+    pthread_mutex_lock(&trace.lock);
+    paths = trace.paths;
+    trace.paths = NULL;
+    trace.paths_tail = &trace.paths;
+    ring = trace.rings;
+    pthread_mutex_unlock(&trace.lock);
+    
+    // Paths first, the records below may refer to them
+    while (paths != NULL) {
+        struct trace_path *next = paths->next;
+        
+        trace_write(&paths->record, sizeof(paths->record));
+        trace_write(paths->path, paths->record.len);
+        free(paths);
+        paths = next;
+    }
+    
+    // Rings are never removed from the list, so it can be walked unlocked
+    for (; ring != NULL; ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = ring->tail;
+        
+        while (tail != head) {
+            uint64_t first = tail % trace.size;
+            uint64_t count = head - tail;
+            
+            if (first + count > trace.size) {
+                count = trace.size - first;
+            }
+            trace_write(&ring->records[first],
+                        count * sizeof(struct loopback_trace_op));
+            trace.records += count;
+            tail += count;
+        }
+        
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+}
+
+static void *
+trace_flusher(void *arg)
+{
+    pthread_mutex_lock(&trace.lock);
+    while (!trace.exiting) {
+        struct timespec deadline;
+        struct timeval now;
+        
+        gettimeofday(&now, NULL);
+        now.tv_usec += TRACE_FLUSH_INTERVAL_MS * 1000;
+        deadline.tv_sec = now.tv_sec + now.tv_usec / 1000000;
+        deadline.tv_nsec = (now.tv_usec % 1000000) * 1000;
+        pthread_cond_timedwait(&trace.cond, &trace.lock, &deadline);
+        
+        pthread_mutex_unlock(&trace.lock);
+        trace_flush();
+        pthread_mutex_lock(&trace.lock);
+    }
+    pthread_mutex_unlock(&trace.lock);
+    
+    return NULL;
+}
+
+// Threads do not survive libfuse daemonizing, so this is called from init
+static void
+trace_start(void)
+{
+    int res;
+    
+    if (!trace.enabled) {
+        return;
+    }
+    
+    res = pthread_create(&trace.flusher, NULL, trace_flusher, NULL);
+    if (res != 0) {
+        fprintf(stderr, "loopback: cannot start trace flusher: %s\n",
+                strerror(res));
+        return;
+    }
+    trace.running = true;
+}
+
+static void
+trace_stop(void)
+{
+    struct loopback_trace_header header;
+    struct trace_ring *ring;
+    
+    if (!trace.enabled) {
+        return;
+    }
+    
+    if (trace.running) {
+        pthread_mutex_lock(&trace.lock);
+        trace.exiting = true;
+        pthread_cond_signal(&trace.cond);
+        pthread_mutex_unlock(&trace.lock);
+        pthread_join(trace.flusher, NULL);
+    }
+    
+    trace_flush();
+    
+    memset(&header, 0, sizeof(header));
+    header.magic = LOOPBACK_TRACE_MAGIC;
+    header.version = LOOPBACK_TRACE_VERSION;
+    header.start_sec = trace.start_sec;
+    header.records = trace.records;
+    for (ring = trace.rings; ring != NULL; ring = ring->next) {
+        header.dropped += ring->dropped;
+    }
+    
+    if (pwrite(trace.fd, &header, sizeof(header), 0) != sizeof(header)) {
+        fprintf(stderr, "loopback: cannot write trace file: %s\n",
+                strerror(errno));
+    }
+    close(trace.fd);
+    
+    fprintf(stderr, "loopback: trace: %llu records, %llu dropped\n",
+            (unsigned long long)header.records,
+            (unsigned long long)header.dropped);
+}
+
+/*
+ * Wrappers
+ *
+ * The operations of loopback_instrumented_oper record statistics and trace
+ * records around the operations of instrument_base, the regular or the union
+ * operations.
+ */
+
+static const struct fuse_operations *instrument_base;
+
+static inline void
+instrument_record(int op, uint64_t start, int res, bool moves_bytes,
+                  const char *path, const char *path2, uint64_t arg1,
+                  uint64_t arg2, struct fuse_file_info *fi)
+{
+    if (stats.enabled) {
+        stats_record(op, start, res, moves_bytes);
+    }
+    if (trace.enabled) {
+        trace_record(op, start, res, path, path2, arg1, arg2, fi);
+    }
+}
+
+#define INSTRUMENT(op, call, moves_bytes, path, path2, arg1, arg2, fi) \
+    do { \
+        uint64_t start = loopback_now(); \
+        int res = (call); \
+        instrument_record(LOOPBACK_OP_##op, start, res, moves_bytes, path, \
+                          path2, arg1, arg2, fi); \
+        return res; \
+    } while (0)
+
+static int
+instrumented_getattr(const char *path, struct stat *stbuf)
+{
+    if (stats.enabled && strcmp(path, STATS_PATH) == 0) {
+        stats_file_attr(stbuf);
+        return 0;
+    }
+    INSTRUMENT(GETATTR, instrument_base->getattr(path, stbuf),
+               false, path, NULL, 0, 0, NULL);
+}
+
+static int
+instrumented_fgetattr(const char *path, struct stat *stbuf,
+                      struct fuse_file_info *fi)
+{
+    if (stats_is_file(fi)) {
+        stats_file_attr(stbuf);
+        return 0;
+    }
+    INSTRUMENT(FGETATTR, instrument_base->fgetattr(path, stbuf, fi),
+               false, NULL, NULL, 0, 0, fi);
+}
+
+static int
+instrumented_readlink(const char *path, char *buf, size_t size)
+{
+    INSTRUMENT(READLINK, instrument_base->readlink(path, buf, size),
+               false, path, NULL, 0, size, NULL);
+}
+
+static int
+instrumented_opendir(const char *path, struct fuse_file_info *fi)
+{
+    INSTRUMENT(OPENDIR, instrument_base->opendir(path, fi),
+               false, path, NULL, 0, 0, fi);
+}
+
+static int
+instrumented_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                     off_t offset, struct fuse_file_info *fi)
+{
+    INSTRUMENT(READDIR, instrument_base->readdir(path, buf, filler, offset, fi),
+               false, NULL, NULL, offset, 0, fi);
+}
+
+static int
+instrumented_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    INSTRUMENT(RELEASEDIR, instrument_base->releasedir(path, fi),
+               false, NULL, NULL, 0, 0, fi);
+}
+
+static int
+instrumented_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+    INSTRUMENT(MKNOD, instrument_base->mknod(path, mode, rdev),
+               false, path, NULL, mode, rdev, NULL);
+}
+
+static int
+instrumented_mkdir(const char *path, mode_t mode)
+{
+    INSTRUMENT(MKDIR, instrument_base->mkdir(path, mode),
+               false, path, NULL, mode, 0, NULL);
+}
+
+static int
+instrumented_symlink(const char *from, const char *to)
+{
+    INSTRUMENT(SYMLINK, instrument_base->symlink(from, to),
+               false, to, from, 0, 0, NULL);
+}
+
+static int
+instrumented_unlink(const char *path)
+{
+    INSTRUMENT(UNLINK, instrument_base->unlink(path),
+               false, path, NULL, 0, 0, NULL);
+}
+
+static int
+instrumented_rmdir(const char *path)
+{
+    INSTRUMENT(RMDIR, instrument_base->rmdir(path),
+               false, path, NULL, 0, 0, NULL);
+}
+
+static int
+instrumented_rename(const char *from, const char *to)
+{
+    INSTRUMENT(RENAME, instrument_base->rename(from, to),
+               false, from, to, 0, 0, NULL);
+}
+
+static int
+instrumented_link(const char *from, const char *to)
+{
+    INSTRUMENT(LINK, instrument_base->link(from, to),
+               false, from, to, 0, 0, NULL);
+}
+
+static int
+instrumented_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    INSTRUMENT(CREATE, instrument_base->create(path, mode, fi),
+               false, path, NULL, fi->flags, mode, fi);
+}
+
+static int
+instrumented_open(const char *path, struct fuse_file_info *fi)
+{
+    if (stats.enabled && strcmp(path, STATS_PATH) == 0) {
+        return stats_file_open(fi);
+    }
+    INSTRUMENT(OPEN, instrument_base->open(path, fi),
+               false, path, NULL, fi->flags, 0, fi);
+}
+
+static int
+instrumented_read(const char *path, char *buf, size_t size, off_t offset,
+                  struct fuse_file_info *fi)
+{
+    if (stats_is_file(fi)) {
+        return stats_file_read(fi, buf, size, offset);
+    }
+    INSTRUMENT(READ, instrument_base->read(path, buf, size, offset, fi),
+               true, NULL, NULL, offset, size, fi);
+}
+
+static int
+instrumented_write(const char *path, const char *buf, size_t size,
+                   off_t offset, struct fuse_file_info *fi)
+{
+    INSTRUMENT(WRITE, instrument_base->write(path, buf, size, offset, fi),
+               true, NULL, NULL, offset, size, fi);
+}
+
+static int
+instrumented_flush(const char *path, struct fuse_file_info *fi)
+{
+    if (stats_is_file(fi)) {
+        return 0;
+    }
+    INSTRUMENT(FLUSH, instrument_base->flush(path, fi),
+               false, NULL, NULL, 0, 0, fi);
+}
+
+static int
+instrumented_release(const char *path, struct fuse_file_info *fi)
+{
+    if (stats_is_file(fi)) {
+        stats_file_release(fi);
+        return 0;
+    }
+    INSTRUMENT(RELEASE, instrument_base->release(path, fi),
+               false, NULL, NULL, 0, 0, fi);
+}
+
+static int
+instrumented_fsync(const char *path, int isdatasync,
+                   struct fuse_file_info *fi)
+{
+    if (stats_is_file(fi)) {
+        return 0;
+    }
+    INSTRUMENT(FSYNC, instrument_base->fsync(path, isdatasync, fi),
+               false, NULL, NULL, isdatasync, 0, fi);
+}
+
+static int
+instrumented_setxattr(const char *path, const char *name, const char *value,
+                      size_t size, int flags, uint32_t position)
+{
+    INSTRUMENT(SETXATTR,
+               instrument_base->setxattr(path, name, value, size, flags,
+                                         position),
+               false, path, name, flags, size, NULL);
+}
+
+static int
+instrumented_getxattr(const char *path, const char *name, char *value,
+                      size_t size, uint32_t position)
+{
+    INSTRUMENT(GETXATTR,
+               instrument_base->getxattr(path, name, value, size, position),
+               false, path, name, 0, size, NULL);
+}
+
+static int
+instrumented_listxattr(const char *path, char *list, size_t size)
+{
+    INSTRUMENT(LISTXATTR, instrument_base->listxattr(path, list, size),
+               false, path, NULL, 0, size, NULL);
+}
+
+static int
+instrumented_removexattr(const char *path, const char *name)
+{
+    INSTRUMENT(REMOVEXATTR, instrument_base->removexattr(path, name),
+               false, path, name, 0, 0, NULL);
+}
+
+#if HAVE_EXCHANGE
+
+static int
+instrumented_exchange(const char *path1, const char *path2,
+                      unsigned long options)
+{
+    INSTRUMENT(EXCHANGE, instrument_base->exchange(path1, path2, options),
+               false, path1, path2, options, 0, NULL);
+}
+
+#endif /* HAVE_EXCHANGE */
+
+static int
+instrumented_getxtimes(const char *path, struct timespec *bkuptime,
+                       struct timespec *crtime)
+{
+    INSTRUMENT(GETXTIMES, instrument_base->getxtimes(path, bkuptime, crtime),
+               false, path, NULL, 0, 0, NULL);
+}
+
+static int
+instrumented_setattr_x(const char *path, struct setattr_x *attr)
+{
+    INSTRUMENT(SETATTR_X, instrument_base->setattr_x(path, attr),
+               false, path, NULL, attr->valid, attr->size, NULL);
+}
+
+static int
+instrumented_fsetattr_x(const char *path, struct setattr_x *attr,
+                        struct fuse_file_info *fi)
+{
+    if (stats_is_file(fi)) {
+        return -EPERM;
+    }
+    INSTRUMENT(FSETATTR_X, instrument_base->fsetattr_x(path, attr, fi),
+               false, NULL, NULL, attr->valid, attr->size, fi);
+}
+
+static int
+instrumented_fallocate(const char *path, int mode, off_t offset,
+                       off_t length, struct fuse_file_info *fi)
+{
+    if (stats_is_file(fi)) {
+        return -EPERM;
+    }
+    INSTRUMENT(FALLOCATE,
+               instrument_base->fallocate(path, mode, offset, length, fi),
+               false, NULL, NULL, offset, length, fi);
+}
+
+static int
+instrumented_setvolname(const char *name)
+{
+    INSTRUMENT(SETVOLNAME, instrument_base->setvolname(name),
+               false, NULL, NULL, 0, 0, NULL);
+}
+
+static int
+instrumented_statfs_x(const char *path, struct statfs *stbuf)
+{
+    INSTRUMENT(STATFS_X, instrument_base->statfs_x(path, stbuf),
+               false, path, NULL, 0, 0, NULL);
+}
+
+#if HAVE_RENAMEX
+
+static int
+instrumented_renamex(const char *path1, const char *path2, unsigned int flags)
+{
+    INSTRUMENT(RENAMEX, instrument_base->renamex(path1, path2, flags),
+               false, path1, path2, flags, 0, NULL);
+}
+
+#endif /* HAVE_RENAMEX */
+
+void *
+loopback_init(struct fuse_conn_info *conn)
+{
+    conn->want |= FUSE_CAP_VOL_RENAME | FUSE_CAP_XTIMES | FUSE_CAP_NODE_RWLOCK;
+
+#ifdef FUSE_ENABLE_CASE_INSENSITIVE
+    if (loopback.case_insensitive) {
+        conn->want |= FUSE_CAP_CASE_INSENSITIVE;
+    }
+#endif
+    
+    trace_start();
+    warm_index_load();
+    watch_start(fuse_get_context()->fuse);
+    
+    return NULL;
+}
+
+void
+loopback_destroy(void *userdata)
+{
+    watch_stop();
+    trace_stop();
+    warm_index_save();
+    
+    if (stats.enabled) {
+        stats_render(stderr);
+    } else {
+        attr_cache_report(stderr);
+        neg_cache_report(stderr);
+        dir_cache_report(stderr);
+        warm_index_report(stderr);
+        dirfd_cache_report(stderr);
+        fd_cache_report(stderr);
+        readahead_report(stderr);
+        block_cache_report(stderr);
+        xattr_cache_report(stderr);
+        statfs_cache_report(stderr);
+        durability_report(stderr);
+        writeback_report(stderr);
+        nocache_report(stderr);
+        union_report(stderr);
+        casefold_report(stderr);
+        watch_report(stderr);
+    }
+}
+
+static struct fuse_operations loopback_oper = {
+    .init        = loopback_init,
+    .destroy     = loopback_destroy,
+    .getattr     = loopback_getattr,
+    .fgetattr    = loopback_fgetattr,
+/*  .access      = loopback_access, */
+    .readlink    = loopback_readlink,
+    .opendir     = loopback_opendir,
+    .readdir     = loopback_readdir,
+    .releasedir  = loopback_releasedir,
+    .mknod       = loopback_mknod,
+    .mkdir       = loopback_mkdir,
+    .symlink     = loopback_symlink,
+    .unlink      = loopback_unlink,
+    .rmdir       = loopback_rmdir,
+    .rename      = loopback_rename,
+    .link        = loopback_link,
+    .create      = loopback_create,
+    .open        = loopback_open,
+    .read        = loopback_read,
+    .write       = loopback_write,
+    .flush       = loopback_flush,
+    .release     = loopback_release,
+    .fsync       = loopback_fsync,
+    .setxattr    = loopback_setxattr,
+    .getxattr    = loopback_getxattr,
+    .listxattr   = loopback_listxattr,
+    .removexattr = loopback_removexattr,
+#if HAVE_EXCHANGE
+    .exchange    = loopback_exchange,
+#endif
+    .getxtimes   = loopback_getxtimes,
+    .setattr_x   = loopback_setattr_x,
+    .fsetattr_x  = loopback_fsetattr_x,
+    .fallocate   = loopback_fallocate,
+    .setvolname  = loopback_setvolname,
+    .statfs_x    = loopback_statfs_x,
+#if HAVE_RENAMEX
+    .renamex     = loopback_renamex,
+#endif
+    
+    .flag_nullpath_ok = 1,
+    .flag_nopath = 1,
+};
+
+static struct fuse_operations loopback_instrumented_oper = {
+    .init        = loopback_init,
+    .destroy     = loopback_destroy,
+    .getattr     = instrumented_getattr,
+    .fgetattr    = instrumented_fgetattr,
+/*  .access      = loopback_access, */
+    .readlink    = instrumented_readlink,
+    .opendir     = instrumented_opendir,
+    .readdir     = instrumented_readdir,
+    .releasedir  = instrumented_releasedir,
+    .mknod       = instrumented_mknod,
+    .mkdir       = instrumented_mkdir,
+    .symlink     = instrumented_symlink,
+    .unlink      = instrumented_unlink,
+    .rmdir       = instrumented_rmdir,
+    .rename      = instrumented_rename,
+    .link        = instrumented_link,
+    .create      = instrumented_create,
+    .open        = instrumented_open,
+    .read        = instrumented_read,
+    .write       = instrumented_write,
+    .flush       = instrumented_flush,
+    .release     = instrumented_release,
+    .fsync       = instrumented_fsync,
+    .setxattr    = instrumented_setxattr,
+    .getxattr    = instrumented_getxattr,
+    .listxattr   = instrumented_listxattr,
+    .removexattr = instrumented_removexattr,
+#if HAVE_EXCHANGE
+    .exchange    = instrumented_exchange,
+#endif
+    .getxtimes   = instrumented_getxtimes,
+    .setattr_x   = instrumented_setattr_x,
+    .fsetattr_x  = instrumented_fsetattr_x,
+    .fallocate   = instrumented_fallocate,
+    .setvolname  = instrumented_setvolname,
+    .statfs_x    = instrumented_statfs_x,
+#if HAVE_RENAMEX
+    .renamex     = instrumented_renamex,
+#endif
+    
+    .flag_nullpath_ok = 1,
+    .flag_nopath = 1,
+};
+
+static struct fuse_operations loopback_union_oper = {
+    .init        = loopback_init,
+    .destroy     = loopback_destroy,
+    .getattr     = union_getattr,
+    .fgetattr    = loopback_fgetattr,
+    .readlink    = union_readlink,
+    .opendir     = union_opendir,
+    .readdir     = loopback_readdir,
+    .releasedir  = loopback_releasedir,
+    .mknod       = union_mknod,
+    .mkdir       = union_mkdir,
+    .symlink     = union_symlink,
+    .unlink      = union_unlink,
+    .rmdir       = union_rmdir,
+    .rename      = union_rename,
+    .link        = union_link,
+    .create      = union_create,
+    .open        = union_open,
+    .read        = loopback_read,
+    .write       = loopback_write,
+    .flush       = loopback_flush,
+    .release     = loopback_release,
+    .fsync       = loopback_fsync,
+    .setxattr    = union_setxattr,
+    .getxattr    = union_getxattr,
+    .listxattr   = union_listxattr,
+    .removexattr = union_removexattr,
+    .getxtimes   = union_getxtimes,
+    .setattr_x   = union_setattr_x,
+    .fsetattr_x  = union_fsetattr_x,
+    .fallocate   = loopback_fallocate,
+    .setvolname  = loopback_setvolname,
+    .statfs_x    = union_statfs_x,
+#if HAVE_RENAMEX
+    .renamex     = union_renamex,
+#endif
+    
+    .flag_nullpath_ok = 1,
+    .flag_nopath = 1,
+};
+
+static struct fuse_operations loopback_casefold_oper = {
+    .init        = loopback_init,
+    .destroy     = loopback_destroy,
+    .getattr     = casefold_getattr,
+    .fgetattr    = loopback_fgetattr,
+    .readlink    = casefold_readlink,
+    .opendir     = casefold_opendir,
+    .readdir     = loopback_readdir,
+    .releasedir  = loopback_releasedir,
+    .mknod       = casefold_mknod,
+    .mkdir       = casefold_mkdir,
+    .symlink     = casefold_symlink,
+    .unlink      = casefold_unlink,
+    .rmdir       = casefold_rmdir,
+    .rename      = casefold_rename,
+    .link        = casefold_link,
+    .create      = casefold_create,
+    .open        = casefold_open,
+    .read        = loopback_read,
+    .write       = loopback_write,
+    .flush       = loopback_flush,
+    .release     = loopback_release,
+    .fsync       = loopback_fsync,
+    .setxattr    = casefold_setxattr,
+    .getxattr    = casefold_getxattr,
+    .listxattr   = casefold_listxattr,
+    .removexattr = casefold_removexattr,
+#if HAVE_EXCHANGE
+    .exchange    = casefold_exchange,
+#endif
+    .getxtimes   = casefold_getxtimes,
+    .setattr_x   = casefold_setattr_x,
+    .fsetattr_x  = casefold_fsetattr_x,
+    .fallocate   = loopback_fallocate,
+    .setvolname  = loopback_setvolname,
+    .statfs_x    = casefold_statfs_x,
+#if HAVE_RENAMEX
+    .renamex     = casefold_renamex,
+#endif
+    
+    .flag_nullpath_ok = 1,
+    .flag_nopath = 1,
+};
+
+/*
+ * Session loop
+ *
+ * By default the file system is served by the multithreaded loop of libfuse.
+ * With the threads=N mount option, N threads receive and handle requests
+ * instead. Data requests (read, write) and synchronization requests (fsync,
+ * flush) are handed off to their own lanes, served by data_threads=N and
+ * sync_threads=N workers, so that slow I/O on the backing store cannot hold
+ * up metadata requests like getattr, lookup and readdir. A lane with no
+ * workers is handled by the receiving thread itself. When a lane's queue is
+ * full, the receiver waits for room, so that requests are never taken out of
+ * the order in which they arrived.
+ */
+
+#define LANE_QUEUE_DEPTH 64
+
+// From the FUSE kernel interface, which is not part of the public headers
+struct loopback_in_header {
+    uint32_t len;
+    uint32_t opcode;
+    uint64_t unique;
+    uint64_t nodeid;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t pid;
+    uint32_t padding;
+};
+
+#define KERNEL_OP_READ     15
+#define KERNEL_OP_WRITE    16
+#define KERNEL_OP_FSYNC    20
+#define KERNEL_OP_FLUSH    25
+#define KERNEL_OP_FSYNCDIR 30
+
+enum {
+    LANE_META,
+    LANE_DATA,
+    LANE_SYNC,
+    LANE_COUNT
+};
+
+struct loopback_request {
+    struct loopback_request *next;
+    struct fuse_chan *ch;
+    size_t len;
+    char buf[];
+};
+
+struct loopback_lane {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_cond_t room;    // Signalled when a queued request is done
+    struct loopback_request *head;
+    struct loopback_request *tail;
+    size_t depth;
+    bool exiting;
+    unsigned int nthreads;
+    pthread_t *threads;
+};
+
+static struct {
+    struct fuse_session *se;
+    struct loopback_lane lanes[LANE_COUNT];
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool receiver_exited;
+} loopback_loop;
+
+static int
+loopback_request_lane(const char *buf, size_t len)
+{
+    const struct loopback_in_header *in = (const void *)buf;
+    
+    if (len < sizeof(struct loopback_in_header)) {
+        return LANE_META;
+    }
+    
+    switch (in->opcode) {
+        case KERNEL_OP_READ:
+        case KERNEL_OP_WRITE:
+            return LANE_DATA;
+        case KERNEL_OP_FSYNC:
+        case KERNEL_OP_FLUSH:
+        case KERNEL_OP_FSYNCDIR:
+            return LANE_SYNC;
+        default:
+            return LANE_META;
+    }
+}
+
+static void
+loopback_process(const char *buf, size_t len, struct fuse_chan *ch)
+{
+    int oldstate;
+    
+    // Do not get cancelled halfway through a request
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+    fuse_session_process(loopback_loop.se, buf, len, ch);
+    pthread_setcancelstate(oldstate, NULL);
+}
+
+/*
+ * Queues a copy of the request on a lane, waiting for room if its queue is
+ * full. Returns false if the lane has no workers or the copy cannot be made,
+ * and the caller has to handle the request itself.
+ */
+static bool
+loopback_lane_push(struct loopback_lane *lane, const char *buf, size_t len,
+                   struct fuse_chan *ch)
+{
+    struct loopback_request *req;
+    int oldstate;
+    
+    if (lane->nthreads == 0) {
+        return false;
+    }
+    
+    req = malloc(sizeof(struct loopback_request) + len);
+    if (req == NULL) {
+        return false;
+    }
+    
+    // The workers keep running until the receivers are gone, see below
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+    pthread_mutex_lock(&lane->lock);
+    while (lane->depth >= LANE_QUEUE_DEPTH) {
+        pthread_cond_wait(&lane->room, &lane->lock);
+    }
+    lane->depth++;
+    pthread_mutex_unlock(&lane->lock);
+    pthread_setcancelstate(oldstate, NULL);
+    
+    req->next = NULL;
+    req->ch = ch;
+    req->len = len;
+    memcpy(req->buf, buf, len);
+    
+    pthread_mutex_lock(&lane->lock);
+    if (lane->tail != NULL) {
+        lane->tail->next = req;
+    } else {
+        lane->head = req;
     }
+    lane->tail = req;
+    pthread_cond_signal(&lane->cond);
+    pthread_mutex_unlock(&lane->lock);
     
-    return 0;
+    return true;
 }
 
-static int
-loopback_getxattr(const char *path, const char *name, char *value, size_t size,
-                  uint32_t position)
+static void *
+loopback_lane_worker(void *arg)
 {
-    int res;
+    struct loopback_lane *lane = arg;
     
-    if (strcmp(name, A_KAUTH_FILESEC_XATTR) == 0) {
+    while (1) {
+        struct loopback_request *req;
         
-        char new_name[MAXPATHLEN];
+        pthread_mutex_lock(&lane->lock);
+        while (lane->head == NULL && !lane->exiting) {
+            pthread_cond_wait(&lane->cond, &lane->lock);
+        }
+        req = lane->head;
+        if (req == NULL) {
+            pthread_mutex_unlock(&lane->lock);
+            break;
+        }
+        lane->head = req->next;
+        if (lane->head == NULL) {
+            lane->tail = NULL;
+        }
+        pthread_mutex_unlock(&lane->lock);
         
-        memcpy(new_name, A_KAUTH_FILESEC_XATTR, sizeof(A_KAUTH_FILESEC_XATTR));
-        memcpy(new_name, G_PREFIX, sizeof(G_PREFIX) - 1);
+        loopback_process(req->buf, req->len, req->ch);
         
-        res = getxattr(path, new_name, value, size, position, XATTR_NOFOLLOW);
+        pthread_mutex_lock(&lane->lock);
+        lane->depth--;
+        pthread_cond_signal(&lane->room);
+        pthread_mutex_unlock(&lane->lock);
         
-    } else {
-        res = getxattr(path, name, value, size, position, XATTR_NOFOLLOW);
-    }
-    
-    if (res == -1) {
-        return -errno;
+        free(req);
     }
     
-    return res;
+    return NULL;
 }
 
-static int
-loopback_listxattr(const char *path, char *list, size_t size)
+static void *
+loopback_receiver(void *arg)
 {
-    ssize_t res = listxattr(path, list, size, XATTR_NOFOLLOW);
-    if (res > 0) {
-        if (list) {
-            size_t len = 0;
-            char *curr = list;
-            do {
-                size_t thislen = strlen(curr) + 1;
-                if (strcmp(curr, G_KAUTH_FILESEC_XATTR) == 0) {
-                    memmove(curr, curr + thislen, res - len - thislen);
-                    res -= thislen;
-                    break;
-                }
-                curr += thislen;
-                len += thislen;
-            } while (len < res);
-        } else {
-            /*
-            ssize_t res2 = getxattr(path, G_KAUTH_FILESEC_XATTR, NULL, 0, 0,
-                                    XATTR_NOFOLLOW);
-            if (res2 >= 0) {
-                res -= sizeof(G_KAUTH_FILESEC_XATTR);
+    struct fuse_chan *ch = fuse_session_next_chan(loopback_loop.se, NULL);
+    size_t bufsize = fuse_chan_bufsize(ch);
+    char *buf;
+    
+    buf = malloc(bufsize);
+    if (buf == NULL) {
+        fprintf(stderr, "loopback: cannot allocate request buffer\n");
+        fuse_session_exit(loopback_loop.se);
+    }
+    
+    // Receivers are cancelled while they wait in fuse_chan_recv()
+    pthread_cleanup_push(free, buf);
+    
+    while (buf != NULL && !fuse_session_exited(loopback_loop.se)) {
+        struct fuse_chan *tmpch = ch;
+        int res;
+        int lane;
+        
+        res = fuse_chan_recv(&tmpch, buf, bufsize);
+        if (res == -EINTR) {
+            continue;
+        }
+        if (res <= 0) {
+            if (res < 0) {
+                fuse_session_exit(loopback_loop.se);
             }
-            */
+            break;
+        }
+        
+        if (fuse_session_exited(loopback_loop.se)) {
+            break;
+        }
+        
+        lane = loopback_request_lane(buf, res);
+        if (lane == LANE_META ||
+            !loopback_lane_push(&loopback_loop.lanes[lane], buf, res, tmpch)) {
+            loopback_process(buf, res, tmpch);
         }
     }
     
-    if (res == -1) {
-        return -errno;
+    pthread_cleanup_pop(1);
+    
+    pthread_mutex_lock(&loopback_loop.lock);
+    loopback_loop.receiver_exited = true;
+    pthread_cond_signal(&loopback_loop.cond);
+    pthread_mutex_unlock(&loopback_loop.lock);
+    
+    return NULL;
+}
+
+// Returns the number of threads started
+static unsigned int
+loopback_start_threads(pthread_t *threads, unsigned int count,
+                       void *(*func)(void *), void *arg)
+{
+    pthread_attr_t attr;
+    unsigned int i;
+    
+    pthread_attr_init(&attr);
+    
+    for (i = 0; i < count; i++) {
+        int res = pthread_create(&threads[i], &attr, func, arg);
+        if (res != 0) {
+            fprintf(stderr, "loopback: cannot create thread: %s\n",
+                    strerror(res));
+            break;
+        }
     }
     
-    return res;
+    pthread_attr_destroy(&attr);
+    return i;
 }
 
 static int
-loopback_removexattr(const char *path, const char *name)
+loopback_session_loop(struct fuse *fuse, unsigned int nreceivers,
+                      unsigned int ndata, unsigned int nsync)
 {
-    int res;
+    unsigned int counts[LANE_COUNT] = { nreceivers, ndata, nsync };
+    pthread_t *receivers;
+    unsigned int started;
+    unsigned int i;
     
-    if (strcmp(name, A_KAUTH_FILESEC_XATTR) == 0) {
-        
-        char new_name[MAXPATHLEN];
+    loopback_loop.se = fuse_get_session(fuse);
+    pthread_mutex_init(&loopback_loop.lock, NULL);
+    pthread_cond_init(&loopback_loop.cond, NULL);
+    loopback_loop.receiver_exited = false;
+    
+    for (i = LANE_DATA; i < LANE_COUNT; i++) {
+        struct loopback_lane *lane = &loopback_loop.lanes[i];
         
-        memcpy(new_name, A_KAUTH_FILESEC_XATTR, sizeof(A_KAUTH_FILESEC_XATTR));
-        memcpy(new_name, G_PREFIX, sizeof(G_PREFIX) - 1);
+        pthread_mutex_init(&lane->lock, NULL);
+        pthread_cond_init(&lane->cond, NULL);
+        pthread_cond_init(&lane->room, NULL);
+        lane->head = NULL;
+        lane->tail = NULL;
+        lane->depth = 0;
+        lane->exiting = false;
         
-        res = removexattr(path, new_name, XATTR_NOFOLLOW);
+        lane->threads = calloc(counts[i], sizeof(pthread_t));
+        lane->nthreads = lane->threads == NULL ? 0 :
+            loopback_start_threads(lane->threads, counts[i],
+                                   loopback_lane_worker, lane);
+    }
+    
+    receivers = calloc(nreceivers, sizeof(pthread_t));
+    started = receivers == NULL ? 0 :
+        loopback_start_threads(receivers, nreceivers, loopback_receiver, NULL);
+    
+    /*
+     * Wait for a receiver to see the file system being unmounted. The signal
+     * handlers of libfuse only set a flag, so check it now and then.
+     */
+    pthread_mutex_lock(&loopback_loop.lock);
+    while (started > 0 && !loopback_loop.receiver_exited &&
+           !fuse_session_exited(loopback_loop.se)) {
+        struct timespec deadline;
+        struct timeval now;
         
-    } else {
-        res = removexattr(path, name, XATTR_NOFOLLOW);
+        gettimeofday(&now, NULL);
+        deadline.tv_sec = now.tv_sec + 1;
+        deadline.tv_nsec = now.tv_usec * 1000;
+        pthread_cond_timedwait(&loopback_loop.cond, &loopback_loop.lock,
+                               &deadline);
     }
+    pthread_mutex_unlock(&loopback_loop.lock);
     
-    if (res == -1) {
-        return -errno;
+    fuse_session_exit(loopback_loop.se);
+    
+    // Receivers may be blocked reading the device
+    for (i = 0; i < started; i++) {
+        pthread_cancel(receivers[i]);
     }
+    for (i = 0; i < started; i++) {
+        pthread_join(receivers[i], NULL);
+    }
+    free(receivers);
     
-    return 0;
+    // Drain the lanes, queued requests still get their replies
+    for (i = LANE_DATA; i < LANE_COUNT; i++) {
+        struct loopback_lane *lane = &loopback_loop.lanes[i];
+        unsigned int j;
+        
+        pthread_mutex_lock(&lane->lock);
+        lane->exiting = true;
+        pthread_cond_broadcast(&lane->cond);
+        pthread_mutex_unlock(&lane->lock);
+        
+        for (j = 0; j < lane->nthreads; j++) {
+            pthread_join(lane->threads[j], NULL);
+        }
+        free(lane->threads);
+    }
+    
+    fuse_session_reset(loopback_loop.se);
+    return started > 0 ? 0 : -1;
 }
 
+/*
+ * Startup tuning
+ *
+ * With the autotune mount option, the backing volume is measured before the
+ * mount and the following options are chosen to match it:
+ *
+ *   blocksize, iosize      the block and preferred I/O size of the volume
+ *   attr_cache, attr_ttl,  enabled if lookups are slow, e.g. on a network
+ *   neg_cache, neg_ttl,    share, where each one that reaches the backing
+ *   dir_cache, statfs_ttl  store costs a round trip
+ *   readahead              enough to cover the round trip at the measured
+ *                          throughput, or to keep a slow disk streaming
+ *   threads, data_threads  more requests in flight if they mostly wait
+ *
+ * The probe times lookups of names that do not exist, and writes and reads
+ * back an uncached scratch file in the root for sequential throughput. It
+ * takes about AUTOTUNE_BUDGET_MS, and a read-only root only gets the lookups.
+ * Options given explicitly are never changed. The measurements and the
+ * chosen options are printed to stderr.
+ */
+
+#define AUTOTUNE_BUDGET_MS    300
+#define AUTOTUNE_LOOKUPS      64
+#define AUTOTUNE_CHUNK        (1024 * 1024)
+#define AUTOTUNE_MAX_SIZE     (64 * 1024 * 1024)
+
+// Slower lookups than this are not served from the page cache of a local disk
+#define AUTOTUNE_SLOW_LOOKUP  200000      // ns
+// Slower sequential reads than this are taken for a spinning or USB disk
+#define AUTOTUNE_SLOW_DISK    (300ULL * 1000 * 1000)
+
+static struct {
+    struct statfs sfs;
+    uint64_t lookup;        // Median lookup latency in ns
+    uint64_t write;         // Sequential throughput in bytes/s, 0 if unknown
+    uint64_t read;
+    char chosen[256];
+} autotune;
+
 static int
-loopback_fallocate(const char *path, int mode, off_t offset, off_t length,
-                   struct fuse_file_info *fi)
+autotune_compare(const void *a, const void *b)
 {
-    fstore_t fstore;
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
     
-    if (!(mode & PREALLOCATE)) {
-        return -ENOTSUP;
-    }
+    return x < y ? -1 : x > y;
+}
+
+static void
+autotune_probe_lookups(uint64_t deadline)
+{
+    uint64_t samples[AUTOTUNE_LOOKUPS];
+    char name[64];
+    struct stat st;
+    int n;
     
-    fstore.fst_flags = 0;
-    if (mode & ALLOCATECONTIG) {
-        fstore.fst_flags |= F_ALLOCATECONTIG;
-    }
-    if (mode & ALLOCATEALL) {
-        fstore.fst_flags |= F_ALLOCATEALL;
+    // Fresh names every time, so that no negative cache can answer them
+    for (n = 0; n < AUTOTUNE_LOOKUPS && loopback_now() < deadline; n++) {
+        uint64_t start = loopback_now();
+        
+        snprintf(name, sizeof(name), ".loopback-autotune-%d-%d",
+                 (int)getpid(), n);
+        (void)fstatat(loopback.root_fd, name, &st, AT_SYMLINK_NOFOLLOW);
+        samples[n] = loopback_now() - start;
     }
     
-    if (mode & ALLOCATEFROMPEOF) {
-        fstore.fst_posmode = F_PEOFPOSMODE;
-    } else if (mode & ALLOCATEFROMVOL) {
-        fstore.fst_posmode = F_VOLPOSMODE;
+    if (n == 0) {
+        return;
     }
+    qsort(samples, n, sizeof(samples[0]), autotune_compare);
+    autotune.lookup = samples[n / 2];
+}
+
+// Bytes per second of sequential transfers of buf, 0 if there were too few
+static uint64_t
+autotune_transfer(int fd, char *buf, bool write, off_t limit,
+                  uint64_t deadline)
+{
+    uint64_t start = loopback_now();
+    uint64_t elapsed;
+    off_t offset = 0;
     
-    fstore.fst_offset = offset;
-    fstore.fst_length = length;
+    while (offset < limit && loopback_now() < deadline) {
+        ssize_t res = write ? pwrite(fd, buf, AUTOTUNE_CHUNK, offset)
+                            : pread(fd, buf, AUTOTUNE_CHUNK, offset);
+        
+        if (res <= 0) {
+            break;
+        }
+        offset += res;
+    }
+    if (write && fsync(fd) == -1) {
+        return 0;
+    }
     
-    if (fcntl(fi->fh, F_PREALLOCATE, &fstore) == -1) {
-        return -errno;
-    } else {
+    elapsed = loopback_now() - start;
+    if (offset < 4 * AUTOTUNE_CHUNK || elapsed == 0) {
         return 0;
     }
+    return (uint64_t)offset * 1000000000 / elapsed;
 }
 
-static int
-loopback_setvolname(const char *name)
-{
-    return 0;
-}
-
-static int
-loopback_statfs_x(const char *path, struct statfs *stbuf)
+static void
+autotune_probe_throughput(uint64_t deadline)
 {
-    int res;
+    char name[64];
+    uint64_t now = loopback_now();
+    char *buf;
+    int fd;
+    struct stat st;
     
-    res = statfs(path, stbuf);
-    if (res == -1) {
-        return -errno;
+    if (autotune.sfs.f_flags & MNT_RDONLY) {
+        return;
     }
     
-    stbuf->f_blocks = stbuf->f_blocks * stbuf->f_bsize / loopback.blocksize;
-    stbuf->f_bavail = stbuf->f_bavail * stbuf->f_bsize / loopback.blocksize;
-    stbuf->f_bfree = stbuf->f_bfree * stbuf->f_bsize / loopback.blocksize;
-    stbuf->f_bsize = loopback.blocksize;
-
-    return 0;
+    buf = malloc(AUTOTUNE_CHUNK);
+    if (buf == NULL) {
+        return;
+    }
+    // Not zeroes, which some volumes compress or skip
+    arc4random_buf(buf, AUTOTUNE_CHUNK);
+    
+    snprintf(name, sizeof(name), ".loopback-autotune-%d", (int)getpid());
+    fd = openat(loopback.root_fd, name,
+                O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd != -1) {
+        (void)unlinkat(loopback.root_fd, name, 0);
+        fcntl(fd, F_NOCACHE, 1);
+        
+        // Two thirds of the time for writing, the rest for reading back
+        autotune.write = autotune_transfer(fd, buf, true, AUTOTUNE_MAX_SIZE,
+                                           now + (deadline - now) * 2 / 3);
+        if (fstat(fd, &st) == 0) {
+            autotune.read = autotune_transfer(fd, buf, false, st.st_size,
+                                              deadline);
+        }
+        close(fd);
+    }
+    free(buf);
 }
 
-#if HAVE_RENAMEX
-
-static int
-loopback_renamex(const char *path1, const char *path2, unsigned int flags)
+// Whether -o name or -o name=value is among the arguments
+static bool
+autotune_given(int argc, char *argv[], const char *name)
 {
-    int res;
-
-    res = renamex_np(path1, path2, flags);
-    if (res == -1) {
-        return -errno;
+    size_t len = strlen(name);
+    int i;
+    
+    for (i = 1; i < argc; i++) {
+        const char *opts;
+        
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            opts = argv[++i];
+        } else if (strncmp(argv[i], "-o", 2) == 0) {
+            opts = argv[i] + 2;
+        } else {
+            continue;
+        }
+        
+        while (opts != NULL) {
+            if (strncmp(opts, name, len) == 0 &&
+                (opts[len] == '\0' || opts[len] == '=' || opts[len] == ',')) {
+                return true;
+            }
+            opts = strchr(opts, ',');
+            if (opts != NULL) {
+                opts++;
+            }
+        }
     }
-
-    return 0;
+    return false;
 }
 
-#endif /* HAVE_RENAMEX */
-
-void *
-loopback_init(struct fuse_conn_info *conn)
+static void
+autotune_set(int argc, char *argv[], const char *name, uint32_t *option,
+             uint32_t value)
 {
-    conn->want |= FUSE_CAP_VOL_RENAME | FUSE_CAP_XTIMES | FUSE_CAP_NODE_RWLOCK;
-
-#ifdef FUSE_ENABLE_CASE_INSENSITIVE
-    if (loopback.case_insensitive) {
-        conn->want |= FUSE_CAP_CASE_INSENSITIVE;
+    size_t len = strlen(autotune.chosen);
+    
+    if (autotune_given(argc, argv, name)) {
+        return;
     }
-#endif
-
-    return NULL;
+    
+    *option = value;
+    snprintf(autotune.chosen + len, sizeof(autotune.chosen) - len, " %s=%u",
+             name, value);
 }
 
-void
-loopback_destroy(void *userdata)
+static inline uint32_t
+autotune_pow2(uint64_t value, uint32_t min, uint32_t max)
 {
-    /* nothing */
+    uint32_t pow2 = min;
+    
+    while (pow2 < max && (uint64_t)pow2 * 2 <= value) {
+        pow2 *= 2;
+    }
+    return pow2;
 }
 
-static struct fuse_operations loopback_oper = {
-    .init        = loopback_init,
-    .destroy     = loopback_destroy,
-    .getattr     = loopback_getattr,
-    .fgetattr    = loopback_fgetattr,
-/*  .access      = loopback_access, */
-    .readlink    = loopback_readlink,
-    .opendir     = loopback_opendir,
-    .readdir     = loopback_readdir,
-    .releasedir  = loopback_releasedir,
-    .mknod       = loopback_mknod,
-    .mkdir       = loopback_mkdir,
-    .symlink     = loopback_symlink,
-    .unlink      = loopback_unlink,
-    .rmdir       = loopback_rmdir,
-    .rename      = loopback_rename,
-    .link        = loopback_link,
-    .create      = loopback_create,
-    .open        = loopback_open,
-    .read        = loopback_read,
-    .write       = loopback_write,
-    .flush       = loopback_flush,
-    .release     = loopback_release,
-    .fsync       = loopback_fsync,
-    .setxattr    = loopback_setxattr,
-    .getxattr    = loopback_getxattr,
-    .listxattr   = loopback_listxattr,
-    .removexattr = loopback_removexattr,
-#if HAVE_EXCHANGE
-    .exchange    = loopback_exchange,
-#endif
-    .getxtimes   = loopback_getxtimes,
-    .setattr_x   = loopback_setattr_x,
-    .fsetattr_x  = loopback_fsetattr_x,
-    .fallocate   = loopback_fallocate,
-    .setvolname  = loopback_setvolname,
-    .statfs_x    = loopback_statfs_x,
-#if HAVE_RENAMEX
-    .renamex     = loopback_renamex,
-#endif
+/*
+ * Measures the backing volume and chooses the options it did not get on the
+ * command line. The iosize option goes to the kernel extension, so it is added
+ * to args.
+ */
+static void
+autotune_run(int argc, char *argv[], struct fuse_args *args)
+{
+    uint64_t deadline = loopback_now() + AUTOTUNE_BUDGET_MS * 1000000ULL;
+    uint64_t rate;
+    bool slow_lookups;
+    bool slow_disk;
+    uint32_t iosize;
     
-    .flag_nullpath_ok = 1,
-    .flag_nopath = 1,
-};
+    if (fstatfs(loopback.root_fd, &autotune.sfs) == -1) {
+        fprintf(stderr, "loopback: autotune: cannot get volume statistics: "
+                "%s\n", strerror(errno));
+        return;
+    }
+    
+    autotune_probe_lookups(loopback_now() + AUTOTUNE_BUDGET_MS * 1000000ULL /
+                           6);
+    autotune_probe_throughput(deadline);
+    rate = autotune.read != 0 ? autotune.read : autotune.write;
+    
+    slow_lookups = autotune.lookup > AUTOTUNE_SLOW_LOOKUP ||
+                   !(autotune.sfs.f_flags & MNT_LOCAL);
+    slow_disk = !slow_lookups && rate != 0 && rate < AUTOTUNE_SLOW_DISK;
+    
+    autotune_set(argc, argv, "blocksize", &loopback.blocksize,
+                 autotune_pow2(autotune.sfs.f_bsize, 512, 65536));
+    
+    iosize = autotune_pow2(autotune.sfs.f_iosize, 4096, 16 * 1024 * 1024);
+    if (!autotune_given(argc, argv, "iosize")) {
+        char arg[32];
+        size_t len = strlen(autotune.chosen);
+        
+        snprintf(arg, sizeof(arg), "-oiosize=%u", iosize);
+        if (fuse_opt_add_arg(args, arg) == 0) {
+            snprintf(autotune.chosen + len, sizeof(autotune.chosen) - len,
+                     " iosize=%u", iosize);
+        }
+    }
+    
+    if (slow_lookups) {
+        // Enough time in flight for the round trips to overlap
+        uint64_t window = rate / 1000 * autotune.lookup / 1000000 * 4 / 1024;
+        
+        autotune_set(argc, argv, "attr_cache", &loopback.attr_cache, 65536);
+        autotune_set(argc, argv, "attr_ttl", &loopback.attr_ttl, 1000);
+        autotune_set(argc, argv, "neg_cache", &loopback.neg_cache, 16384);
+        autotune_set(argc, argv, "neg_ttl", &loopback.neg_ttl, 1000);
+        autotune_set(argc, argv, "dir_cache", &loopback.dir_cache, 1024);
+        autotune_set(argc, argv, "statfs_ttl", &loopback.statfs_ttl, 2000);
+        autotune_set(argc, argv, "readahead", &loopback.readahead,
+                     (uint32_t)MIN(MAX(window, 1024), 16384));
+        autotune_set(argc, argv, "threads", &loopback.threads, 16);
+        autotune_set(argc, argv, "data_threads", &loopback.data_threads, 8);
+    } else if (slow_disk) {
+        // Long sequential runs, and few of them at a time to limit seeking
+        autotune_set(argc, argv, "statfs_ttl", &loopback.statfs_ttl, 1000);
+        autotune_set(argc, argv, "readahead", &loopback.readahead, 4096);
+        autotune_set(argc, argv, "threads", &loopback.threads, 8);
+        autotune_set(argc, argv, "data_threads", &loopback.data_threads, 2);
+    } else {
+        autotune_set(argc, argv, "statfs_ttl", &loopback.statfs_ttl, 1000);
+    }
+    
+    fprintf(stderr, "loopback: autotune: %s, %s%s, iosize %d, "
+            "lookups %llu us, write %llu MB/s, read %llu MB/s, "
+            "%s profile:%s\n",
+            autotune.sfs.f_fstypename,
+            autotune.sfs.f_flags & MNT_LOCAL ? "local" : "remote",
+            autotune.sfs.f_flags & MNT_RDONLY ? " read-only" : "",
+            (int)autotune.sfs.f_iosize,
+            (unsigned long long)(autotune.lookup / 1000),
+            (unsigned long long)(autotune.write / 1000000),
+            (unsigned long long)(autotune.read / 1000000),
+            slow_lookups ? "high latency" : slow_disk ? "slow disk" : "fast",
+            autotune.chosen[0] != '\0' ? autotune.chosen : " no changes");
+}
 
 static const struct fuse_opt loopback_opts[] = {
+    { "root=%s", offsetof(struct loopback, root), 0 },
+    { "lower=%s", offsetof(struct loopback, lower), 0 },
+    { "dirfd_cache=%u", offsetof(struct loopback, dirfd_cache), 0 },
     { "blocksize=%u", offsetof(struct loopback, blocksize), 0 },
     { "case_insensitive", offsetof(struct loopback, case_insensitive), true },
+    { "attr_cache=%u", offsetof(struct loopback, attr_cache), 0 },
+    { "attr_ttl=%u", offsetof(struct loopback, attr_ttl), 0 },
+    { "neg_cache=%u", offsetof(struct loopback, neg_cache), 0 },
+    { "neg_ttl=%u", offsetof(struct loopback, neg_ttl), 0 },
+    { "readdir_bulk", offsetof(struct loopback, readdir_bulk), true },
+    { "dir_cache=%u", offsetof(struct loopback, dir_cache), 0 },
+    { "fd_cache=%u", offsetof(struct loopback, fd_cache), 0 },
+    { "readahead=%u", offsetof(struct loopback, readahead), 0 },
+    { "readahead_pool=%u", offsetof(struct loopback, readahead_pool), 0 },
+    { "block_cache=%u", offsetof(struct loopback, block_cache), 0 },
+    { "writeback=%u", offsetof(struct loopback, writeback), 0 },
+    { "writeback_ms=%u", offsetof(struct loopback, writeback_ms), 0 },
+    { "nocache", offsetof(struct loopback, nocache), true },
+    { "nocache_size=%u", offsetof(struct loopback, nocache_size), 0 },
+    { "nocache_match=%s", offsetof(struct loopback, nocache_match), 0 },
+    { "blksize_large=%u", offsetof(struct loopback, blksize_large), 0 },
+    { "blksize_threshold=%u", offsetof(struct loopback, blksize_threshold), 0 },
+    { "blksize_match=%s", offsetof(struct loopback, blksize_match), 0 },
+    { "clone", offsetof(struct loopback, clone), true },
+    { "fsync=%s", offsetof(struct loopback, fsync), 0 },
+    { "fsync_group=%u", offsetof(struct loopback, fsync_group), 0 },
+    { "xattr_cache=%u", offsetof(struct loopback, xattr_cache), 0 },
+    { "statfs_ttl=%u", offsetof(struct loopback, statfs_ttl), 0 },
+    { "threads=%u", offsetof(struct loopback, threads), 0 },
+    { "data_threads=%u", offsetof(struct loopback, data_threads), 0 },
+    { "sync_threads=%u", offsetof(struct loopback, sync_threads), 0 },
+    { "stats", offsetof(struct loopback, stats), true },
+    { "trace=%s", offsetof(struct loopback, trace), 0 },
+    { "trace_buffer=%u", offsetof(struct loopback, trace_buffer), 0 },
+    { "autotune", offsetof(struct loopback, autotune), true },
+    { "warm_index=%s", offsetof(struct loopback, warm_index), 0 },
+    { "watch", offsetof(struct loopback, watch), true },
+    { "watch_latency=%u", offsetof(struct loopback, watch_latency), 0 },
     FUSE_OPT_END
 };
 
@@ -982,15 +11244,130 @@ main(int argc, char *argv[])
 {
     int res = 0;
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    const struct fuse_operations *oper;
+    char root[MAXPATHLEN];
     
+    loopback.root = NULL;
+    loopback.lower = NULL;
+    loopback.dirfd_cache = 0;
     loopback.blocksize = 4096;
     loopback.case_insensitive = 0;
+    loopback.attr_cache = 0;
+    loopback.attr_ttl = 1000;
+    loopback.neg_cache = 0;
+    loopback.neg_ttl = 1000;
+    loopback.readdir_bulk = false;
+    loopback.dir_cache = 0;
+    loopback.fd_cache = 0;
+    loopback.readahead = 0;
+    loopback.readahead_pool = 64;
+    loopback.block_cache = 0;
+    loopback.writeback = 0;
+    loopback.writeback_ms = 100;
+    loopback.nocache = false;
+    loopback.nocache_size = 0;
+    loopback.nocache_match = NULL;
+    loopback.blksize_large = 0;
+    loopback.blksize_threshold = 1024;
+    loopback.blksize_match = NULL;
+    loopback.clone = false;
+    loopback.fsync = NULL;
+    loopback.fsync_group = 0;
+    loopback.xattr_cache = 0;
+    loopback.statfs_ttl = 0;
+    loopback.threads = 0;
+    loopback.data_threads = 4;
+    loopback.sync_threads = 2;
+    loopback.stats = false;
+    loopback.trace = NULL;
+    loopback.trace_buffer = 4096;
+    loopback.autotune = false;
+    loopback.warm_index = NULL;
+    loopback.watch = false;
+    loopback.watch_latency = 50;
     if (fuse_opt_parse(&args, &loopback, loopback_opts, NULL) == -1) {
         exit(1);
     }
     
+    if (realpath(loopback.root ? loopback.root : "/", root) == NULL) {
+        fprintf(stderr, "loopback: invalid root: %s\n", strerror(errno));
+        exit(1);
+    }
+    free(loopback.root);
+    
+    // An empty root stands for "/", so that paths can be used unchanged
+    loopback.root_len = strcmp(root, "/") == 0 ? 0 : strlen(root);
+    root[loopback.root_len] = '\0';
+    loopback.root = strdup(root);
+    
+    loopback.root_fd = open(loopback.root_len ? loopback.root : "/",
+                            O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (loopback.root == NULL || loopback.root_fd == -1) {
+        fprintf(stderr, "loopback: cannot open root: %s\n", strerror(errno));
+        exit(1);
+    }
+    
+    mach_timebase_info(&loopback_timebase);
+    if (loopback.autotune) {
+        autotune_run(argc, argv, &args);
+    }
+    attr_cache_init(loopback.attr_cache, loopback.attr_ttl);
+    neg_cache_init(loopback.neg_cache, loopback.neg_ttl);
+    dir_cache_init(loopback.dir_cache);
+    warm_index_init(loopback.warm_index);
+    dirfd_cache_init(loopback.dirfd_cache);
+    fd_cache_init(loopback.fd_cache);
+    readahead_init(loopback.readahead, loopback.readahead_pool);
+    block_cache_init(loopback.block_cache);
+    xattr_cache_init(loopback.xattr_cache);
+    statfs_cache_init(loopback.statfs_ttl);
+    durability_init(loopback.fsync, loopback.fsync_group);
+    writeback_init(loopback.writeback, loopback.writeback_ms);
+    nocache_init(loopback.nocache, loopback.nocache_size,
+                 loopback.nocache_match);
+    blksize_init(loopback.blksize_large, loopback.blksize_threshold,
+                 loopback.blksize_match);
+    stats_init(loopback.stats);
+    trace_init(loopback.trace, loopback.trace_buffer);
+    union_init(loopback.lower);
+    casefold_init(loopback.case_insensitive);
+    watch_init(loopback.watch, loopback.watch_latency);
+    
+    oper = unionfs.enabled ? &loopback_union_oper : &loopback_oper;
+    if (casefold.enabled) {
+        casefold_base = oper;
+        oper = &loopback_casefold_oper;
+    }
+    if (loopback.stats || loopback.trace != NULL) {
+        instrument_base = oper;
+        oper = &loopback_instrumented_oper;
+    }
+    
     umask(0);
-    res = fuse_main(args.argc, args.argv, &loopback_oper, NULL);
+    
+    if (loopback.threads == 0) {
+        res = fuse_main(args.argc, args.argv, oper, NULL);
+    } else {
+        struct fuse *fuse;
+        char *mountpoint;
+        int multithreaded;
+        
+        fuse = fuse_setup(args.argc, args.argv, oper, sizeof(*oper),
+                          &mountpoint, &multithreaded, NULL);
+        if (fuse == NULL) {
+            res = 1;
+        } else {
+            if (multithreaded) {
+                res = loopback_session_loop(fuse, loopback.threads,
+                                            loopback.data_threads,
+                                            loopback.sync_threads);
+            } else {
+                res = fuse_loop(fuse);
+            }
+            fuse_teardown(fuse, mountpoint);
+            res = res == -1 ? 1 : 0;
+        }
+    }
     
     fuse_opt_free_args(&args);
     return res;
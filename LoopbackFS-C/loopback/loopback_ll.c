@@ -0,0 +1,1694 @@
+/*
+ FUSE: Filesystem in Userspace
+ Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+
+ This program can be distributed under the terms of the GNU GPL.
+ See the file LICENSE.txt.
+
+ */
+
+/*
+ * Loopback macFUSE file system in C. Uses the low-level FUSE API.
+ * Based on the passthrough_ll.c example from the Linux FUSE distribution.
+ *
+ * Unlike loopback.c, libfuse does not keep a path table for this file system.
+ * The kernel refers to files by node id, and every node id maps to an entry
+ * in our own inode table, see below.
+ */
+
+#include <AvailabilityMacros.h>
+
+#define HAVE_RENAMEX 1
+
+#define FUSE_USE_VERSION 26
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/attr.h>
+#include <sys/param.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/time.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#if defined(_POSIX_C_SOURCE)
+typedef unsigned char  u_char;
+typedef unsigned short u_short;
+typedef unsigned int   u_int;
+typedef unsigned long  u_long;
+#endif
+
+#define G_PREFIX                       "org"
+#define G_KAUTH_FILESEC_XATTR G_PREFIX ".apple.system.Security"
+#define A_PREFIX                       "com"
+#define A_KAUTH_FILESEC_XATTR A_PREFIX ".apple.system.Security"
+#define XATTR_APPLE_PREFIX             "com.apple."
+
+/*
+ * Inode table
+ *
+ * Every node id handed to the kernel is the address of a struct
+ * loopback_inode, except for the root, which is FUSE_ROOT_ID. Inodes are
+ * also hashed by (dev, ino) of the backing file, so that looking up a file
+ * that the kernel already knows, e.g. through a hard link, returns the same
+ * node id.
+ *
+ * Directories keep a descriptor open, which the *at() system calls use to
+ * resolve their entries. Other files have no descriptor of their own and
+ * are reached through the directory and name they were last looked up by.
+ * That binding is updated by lookup, rename and link, and cleared when the
+ * name it refers to is removed or replaced through the mount. A file whose
+ * name is changed directly on the backing store is stale until it is looked
+ * up again.
+ *
+ * An inode is freed once the kernel has forgotten all of its lookups and no
+ * other inode or request references it.
+ */
+
+struct loopback_inode {
+    struct loopback_inode *hash_next;
+    dev_t dev;
+    ino_t ino;
+    int fd;
+    uint64_t nlookup;
+    uint64_t refs;
+    struct loopback_inode *parent;
+    char *name;
+};
+
+struct loopback {
+    char *root_path;
+    uint32_t blocksize;
+    bool case_insensitive;
+    double timeout;
+
+    pthread_mutex_t lock;
+    struct loopback_inode root;
+    struct loopback_inode **table;
+    size_t mask;
+    size_t count;
+};
+
+static struct loopback loopback;
+
+struct loopback_at {
+    int dirfd;
+    const char *name;
+    struct loopback_inode *parent;
+    char buf[MAXPATHLEN];
+};
+
+static inline struct loopback_inode *
+get_inode(fuse_ino_t ino)
+{
+    if (ino == FUSE_ROOT_ID) {
+        return &loopback.root;
+    }
+    return (struct loopback_inode *)(uintptr_t)ino;
+}
+
+static inline fuse_ino_t
+get_nodeid(struct loopback_inode *inode)
+{
+    if (inode == &loopback.root) {
+        return FUSE_ROOT_ID;
+    }
+    return (uintptr_t)inode;
+}
+
+static inline size_t
+loopback_inode_hash(dev_t dev, ino_t ino)
+{
+    uint64_t hash = ((uint64_t)dev << 32) ^ (uint64_t)ino;
+    
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return (size_t)hash;
+}
+
+// Must be called with the table lock held
+static struct loopback_inode *
+loopback_inode_find_locked(dev_t dev, ino_t ino)
+{
+    struct loopback_inode *inode;
+    
+    if (dev == loopback.root.dev && ino == loopback.root.ino) {
+        return &loopback.root;
+    }
+    
+    inode = loopback.table[loopback_inode_hash(dev, ino) & loopback.mask];
+    for (; inode != NULL; inode = inode->hash_next) {
+        if (inode->dev == dev && inode->ino == ino) {
+            break;
+        }
+    }
+    return inode;
+}
+
+// Must be called with the table lock held
+static void
+loopback_inode_insert_locked(struct loopback_inode *inode)
+{
+    size_t bucket;
+    
+    if (loopback.count >= loopback.mask + 1) {
+        size_t nbuckets = (loopback.mask + 1) * 2;
+        struct loopback_inode **table;
+    
+        table = calloc(nbuckets, sizeof(struct loopback_inode *));
+        if (table != NULL) {
+            size_t i;
+    
+            for (i = 0; i <= loopback.mask; i++) {
+                struct loopback_inode *e = loopback.table[i];
+    
+                while (e != NULL) {
+                    struct loopback_inode *next = e->hash_next;
+    
+                    bucket = loopback_inode_hash(e->dev, e->ino) &
+                             (nbuckets - 1);
+                    e->hash_next = table[bucket];
+                    table[bucket] = e;
+                    e = next;
+                }
+            }
+    
+            free(loopback.table);
+            loopback.table = table;
+            loopback.mask = nbuckets - 1;
+        }
+        // Otherwise keep going with longer chains
+    }
+    
+    bucket = loopback_inode_hash(inode->dev, inode->ino) & loopback.mask;
+    inode->hash_next = loopback.table[bucket];
+    loopback.table[bucket] = inode;
+    loopback.count++;
+}
+
+// Must be called with the table lock held
+static void
+loopback_inode_put_locked(struct loopback_inode *inode, uint64_t nlookup,
+                          uint64_t refs)
+{
+    while (inode != &loopback.root) {
+        struct loopback_inode **pp;
+        struct loopback_inode *parent;
+    
+        inode->nlookup -= nlookup;
+        inode->refs -= refs;
+        if (inode->nlookup > 0 || inode->refs > 0) {
+            return;
+        }
+    
+        pp = &loopback.table[loopback_inode_hash(inode->dev, inode->ino) &
+                             loopback.mask];
+        while (*pp != inode) {
+            pp = &(*pp)->hash_next;
+        }
+        *pp = inode->hash_next;
+        loopback.count--;
+    
+        parent = inode->parent;
+        if (inode->fd != -1) {
+            close(inode->fd);
+        }
+        free(inode->name);
+        free(inode);
+    
+        if (parent == NULL) {
+            return;
+        }
+    
+        // Drop the reference the inode held on its parent
+        inode = parent;
+        nlookup = 0;
+        refs = 1;
+    }
+}
+
+/*
+ * Binds a file that has no descriptor of its own to a name in parent. Must be
+ * called with the table lock held, name is given up to the inode.
+ */
+static void
+loopback_inode_bind_locked(struct loopback_inode *inode,
+                           struct loopback_inode *parent, char *name)
+{
+    struct loopback_inode *old_parent = inode->parent;
+    
+    parent->refs++;
+    inode->parent = parent;
+    free(inode->name);
+    inode->name = name;
+    
+    if (old_parent != NULL) {
+        loopback_inode_put_locked(old_parent, 0, 1);
+    }
+}
+
+// Must be called with the table lock held
+static void
+loopback_inode_unbind_locked(struct loopback_inode *inode)
+{
+    struct loopback_inode *old_parent = inode->parent;
+    
+    inode->parent = NULL;
+    free(inode->name);
+    inode->name = NULL;
+    
+    if (old_parent != NULL) {
+        loopback_inode_put_locked(old_parent, 0, 1);
+    }
+}
+
+/*
+ * Translates an inode into a directory descriptor and a name relative to it.
+ * Directories resolve to themselves ("."). Every successful call must be
+ * balanced by a call to loopback_at_put().
+ */
+static int
+loopback_at_get(struct loopback_inode *inode, struct loopback_at *at)
+{
+    at->parent = NULL;
+    
+    if (inode->fd != -1) {
+        at->dirfd = inode->fd;
+        at->name = ".";
+        return 0;
+    }
+    
+    pthread_mutex_lock(&loopback.lock);
+    
+    if (inode->parent == NULL) {
+        pthread_mutex_unlock(&loopback.lock);
+        return ESTALE;
+    }
+    
+    // Names are limited to NAME_MAX UTF-16 code units, so this always fits
+    strlcpy(at->buf, inode->name, sizeof(at->buf));
+    at->parent = inode->parent;
+    at->parent->refs++;
+    
+    pthread_mutex_unlock(&loopback.lock);
+    
+    at->dirfd = at->parent->fd;
+    at->name = at->buf;
+    return 0;
+}
+
+// Preserves errno so that it can be called right after the system call
+static void
+loopback_at_put(struct loopback_at *at)
+{
+    int saved_errno;
+    
+    if (at->parent == NULL) {
+        return;
+    }
+    
+    saved_errno = errno;
+    
+    pthread_mutex_lock(&loopback.lock);
+    loopback_inode_put_locked(at->parent, 0, 1);
+    pthread_mutex_unlock(&loopback.lock);
+    
+    at->parent = NULL;
+    errno = saved_errno;
+}
+
+/*
+ * The extended attribute calls and a few others have no *at() variants. They
+ * use the path of the directory descriptor on the backing store instead.
+ */
+static int
+loopback_at_path(struct loopback_at *at, char *buf)
+{
+    size_t len;
+    
+    if (fcntl(at->dirfd, F_GETPATH, buf) == -1) {
+        return errno;
+    }
+    
+    if (strcmp(at->name, ".") == 0) {
+        return 0;
+    }
+    
+    len = strlen(buf);
+    if (snprintf(buf + len, MAXPATHLEN - len, "%s%s",
+                 len > 1 ? "/" : "", at->name) >= MAXPATHLEN - len) {
+        return ENAMETOOLONG;
+    }
+    return 0;
+}
+
+// Returns the descriptor of a directory inode, the kernel makes sure it is one
+static inline int
+loopback_dirfd(struct loopback_inode *inode)
+{
+    return inode->fd;
+}
+
+static int
+loopback_do_lookup(fuse_ino_t parent, const char *name,
+                   struct fuse_entry_param *e)
+{
+    struct loopback_inode *dir = get_inode(parent);
+    struct loopback_inode *inode;
+    struct loopback_inode *other;
+    char *binding = NULL;
+    int res;
+    
+    memset(e, 0, sizeof(*e));
+    e->attr_timeout = loopback.timeout;
+    e->entry_timeout = loopback.timeout;
+    
+    res = fstatat(loopback_dirfd(dir), name, &e->attr, AT_SYMLINK_NOFOLLOW);
+    if (res == -1) {
+        return errno;
+    }
+    
+    if (!S_ISDIR(e->attr.st_mode)) {
+        binding = strdup(name);
+        if (binding == NULL) {
+            return ENOMEM;
+        }
+    }
+    
+    pthread_mutex_lock(&loopback.lock);
+    
+    inode = loopback_inode_find_locked(e->attr.st_dev, e->attr.st_ino);
+    if (inode != NULL) {
+        inode->nlookup++;
+        if (binding != NULL && inode->fd == -1) {
+            loopback_inode_bind_locked(inode, dir, binding);
+            binding = NULL;
+        }
+    }
+    
+    pthread_mutex_unlock(&loopback.lock);
+    
+    if (inode != NULL) {
+        free(binding);
+        e->ino = get_nodeid(inode);
+        return 0;
+    }
+    
+    inode = calloc(1, sizeof(struct loopback_inode));
+    if (inode == NULL) {
+        free(binding);
+        return ENOMEM;
+    }
+    
+    inode->dev = e->attr.st_dev;
+    inode->ino = e->attr.st_ino;
+    inode->fd = -1;
+    inode->nlookup = 1;
+    
+    if (S_ISDIR(e->attr.st_mode)) {
+        inode->fd = openat(loopback_dirfd(dir), name,
+                           O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (inode->fd == -1) {
+            res = errno;
+            free(inode);
+            return res;
+        }
+    }
+    
+    pthread_mutex_lock(&loopback.lock);
+    
+    // Somebody else may have looked up the same file in the meantime
+    other = loopback_inode_find_locked(inode->dev, inode->ino);
+    if (other != NULL) {
+        other->nlookup++;
+        if (binding != NULL && other->fd == -1) {
+            loopback_inode_bind_locked(other, dir, binding);
+            binding = NULL;
+        }
+    } else {
+        if (binding != NULL) {
+            loopback_inode_bind_locked(inode, dir, binding);
+            binding = NULL;
+        }
+        loopback_inode_insert_locked(inode);
+    }
+    
+    pthread_mutex_unlock(&loopback.lock);
+    
+    if (other != NULL) {
+        if (inode->fd != -1) {
+            close(inode->fd);
+        }
+        free(binding);
+        free(inode);
+        inode = other;
+    }
+    
+    e->ino = get_nodeid(inode);
+    return 0;
+}
+
+// Updates the binding of a file that was renamed or linked through the mount
+static void
+loopback_rebind(int dirfd, fuse_ino_t parent, const char *name)
+{
+    struct loopback_inode *inode;
+    struct stat st;
+    char *binding;
+    
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+        S_ISDIR(st.st_mode)) {
+        return;
+    }
+    
+    binding = strdup(name);
+    if (binding == NULL) {
+        return;
+    }
+    
+    pthread_mutex_lock(&loopback.lock);
+    
+    inode = loopback_inode_find_locked(st.st_dev, st.st_ino);
+    if (inode != NULL && inode->fd == -1) {
+        loopback_inode_bind_locked(inode, get_inode(parent), binding);
+        binding = NULL;
+    }
+    
+    pthread_mutex_unlock(&loopback.lock);
+    
+    free(binding);
+}
+
+/*
+ * Clears the binding of the file st describes if it is bound to name in
+ * parent, which was removed or replaced through the mount. A later lookup
+ * through another link binds it again.
+ */
+static void
+loopback_unbind(const struct stat *st, fuse_ino_t parent, const char *name)
+{
+    struct loopback_inode *inode;
+    
+    pthread_mutex_lock(&loopback.lock);
+    
+    inode = loopback_inode_find_locked(st->st_dev, st->st_ino);
+    if (inode != NULL && inode->fd == -1 &&
+        inode->parent == get_inode(parent) && inode->name != NULL &&
+        strcmp(inode->name, name) == 0) {
+        loopback_inode_unbind_locked(inode);
+    }
+    
+    pthread_mutex_unlock(&loopback.lock);
+}
+
+static void
+loopback_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+    conn->want |= FUSE_CAP_VOL_RENAME | FUSE_CAP_XTIMES;
+    
+#ifdef FUSE_ENABLE_CASE_INSENSITIVE
+    if (loopback.case_insensitive) {
+        conn->want |= FUSE_CAP_CASE_INSENSITIVE;
+    }
+#endif
+}
+
+static void
+loopback_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct fuse_entry_param e;
+    int res;
+    
+    res = loopback_do_lookup(parent, name, &e);
+    if (res != 0) {
+        fuse_reply_err(req, res);
+    } else {
+        fuse_reply_entry(req, &e);
+    }
+}
+
+static void
+loopback_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    pthread_mutex_lock(&loopback.lock);
+    loopback_inode_put_locked(get_inode(ino), nlookup, 0);
+    pthread_mutex_unlock(&loopback.lock);
+    
+    fuse_reply_none(req);
+}
+
+static void
+loopback_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct loopback_at at;
+    struct stat st;
+    int res;
+    
+    if (fi != NULL) {
+        res = fstat(fi->fh, &st);
+    } else {
+        res = loopback_at_get(get_inode(ino), &at);
+        if (res != 0) {
+            fuse_reply_err(req, res);
+            return;
+        }
+    
+        res = fstatat(at.dirfd, at.name, &st, AT_SYMLINK_NOFOLLOW);
+        loopback_at_put(&at);
+    }
+    
+    if (res == -1) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+    
+    fuse_reply_attr(req, &st, loopback.timeout);
+}
+
+static int
+loopback_setattr_at(int fd, int dirfd, const char *name, struct stat *attr,
+                    int to_set)
+{
+    int res;
+    
+    if (to_set & FUSE_SET_ATTR_MODE) {
+        if (fd != -1) {
+            res = fchmod(fd, attr->st_mode);
+        } else {
+            res = fchmodat(dirfd, name, attr->st_mode, AT_SYMLINK_NOFOLLOW);
+        }
+        if (res == -1) {
+            return errno;
+        }
+    }
+    
+    if (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+        uid_t uid = (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : -1;
+        gid_t gid = (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : -1;
+    
+        if (fd != -1) {
+            res = fchown(fd, uid, gid);
+        } else {
+            res = fchownat(dirfd, name, uid, gid, AT_SYMLINK_NOFOLLOW);
+        }
+        if (res == -1) {
+            return errno;
+        }
+    }
+    
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        if (fd != -1) {
+            res = ftruncate(fd, attr->st_size);
+        } else {
+            int tfd = openat(dirfd, name, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    
+            if (tfd == -1) {
+                return errno;
+            }
+            res = ftruncate(tfd, attr->st_size);
+            if (res == -1) {
+                res = errno;
+                close(tfd);
+                return res;
+            }
+            close(tfd);
+        }
+        if (res == -1) {
+            return errno;
+        }
+    }
+    
+    if (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+        struct timespec ts[2];
+    
+        ts[0].tv_sec = 0;
+        ts[0].tv_nsec = UTIME_OMIT;
+        ts[1].tv_sec = 0;
+        ts[1].tv_nsec = UTIME_OMIT;
+    
+        if (to_set & FUSE_SET_ATTR_ATIME_NOW) {
+            ts[0].tv_nsec = UTIME_NOW;
+        } else if (to_set & FUSE_SET_ATTR_ATIME) {
+            ts[0] = attr->st_atimespec;
+        }
+    
+        if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+            ts[1].tv_nsec = UTIME_NOW;
+        } else if (to_set & FUSE_SET_ATTR_MTIME) {
+            ts[1] = attr->st_mtimespec;
+        }
+    
+        if (fd != -1) {
+            res = futimens(fd, ts);
+        } else {
+            res = utimensat(dirfd, name, ts, AT_SYMLINK_NOFOLLOW);
+        }
+        if (res == -1) {
+            return errno;
+        }
+    }
+    
+#ifdef FUSE_SET_ATTR_CRTIME
+    if (to_set & FUSE_SET_ATTR_CRTIME) {
+        struct attrlist attributes;
+    
+        attributes.bitmapcount = ATTR_BIT_MAP_COUNT;
+        attributes.reserved = 0;
+        attributes.commonattr = ATTR_CMN_CRTIME;
+        attributes.dirattr = 0;
+        attributes.fileattr = 0;
+        attributes.forkattr = 0;
+        attributes.volattr = 0;
+    
+        if (fd != -1) {
+            res = fsetattrlist(fd, &attributes, &attr->st_birthtimespec,
+                               sizeof(struct timespec), 0);
+        } else {
+            res = setattrlistat(dirfd, name, &attributes, &attr->st_birthtimespec,
+                                sizeof(struct timespec), FSOPT_NOFOLLOW);
+        }
+    
+        if (res == -1) {
+            return errno;
+        }
+    }
+#endif
+    
+#ifdef FUSE_SET_ATTR_CHGTIME
+    if (to_set & FUSE_SET_ATTR_CHGTIME) {
+        struct attrlist attributes;
+    
+        attributes.bitmapcount = ATTR_BIT_MAP_COUNT;
+        attributes.reserved = 0;
+        attributes.commonattr = ATTR_CMN_CHGTIME;
+        attributes.dirattr = 0;
+        attributes.fileattr = 0;
+        attributes.forkattr = 0;
+        attributes.volattr = 0;
+    
+        if (fd != -1) {
+            res = fsetattrlist(fd, &attributes, &attr->st_ctimespec,
+                               sizeof(struct timespec), 0);
+        } else {
+            res = setattrlistat(dirfd, name, &attributes, &attr->st_ctimespec,
+                                sizeof(struct timespec), FSOPT_NOFOLLOW);
+        }
+    
+        if (res == -1) {
+            return errno;
+        }
+    }
+#endif
+    
+#ifdef FUSE_SET_ATTR_FLAGS
+    if (to_set & FUSE_SET_ATTR_FLAGS) {
+        if (fd != -1) {
+            res = fchflags(fd, attr->st_flags);
+        } else {
+            struct attrlist attributes;
+            u_int32_t flags = attr->st_flags;
+    
+            attributes.bitmapcount = ATTR_BIT_MAP_COUNT;
+            attributes.reserved = 0;
+            attributes.commonattr = ATTR_CMN_FLAGS;
+            attributes.dirattr = 0;
+            attributes.fileattr = 0;
+            attributes.forkattr = 0;
+            attributes.volattr = 0;
+    
+            res = setattrlistat(dirfd, name, &attributes, &flags,
+                                sizeof(flags), FSOPT_NOFOLLOW);
+        }
+        if (res == -1) {
+            return errno;
+        }
+    }
+#endif
+    
+    return 0;
+}
+
+static void
+loopback_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                    int to_set, struct fuse_file_info *fi)
+{
+    struct loopback_at at;
+    struct stat st;
+    int res;
+    
+    // Open files may have been unlinked, so use the descriptor if there is one
+    if (fi != NULL) {
+        res = loopback_setattr_at(fi->fh, -1, NULL, attr, to_set);
+        if (res == 0 && fstat(fi->fh, &st) == -1) {
+            res = errno;
+        }
+    } else {
+        res = loopback_at_get(get_inode(ino), &at);
+        if (res != 0) {
+            fuse_reply_err(req, res);
+            return;
+        }
+    
+        res = loopback_setattr_at(-1, at.dirfd, at.name, attr, to_set);
+        if (res == 0 &&
+            fstatat(at.dirfd, at.name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+            res = errno;
+        }
+    
+        loopback_at_put(&at);
+    }
+    
+    if (res != 0) {
+        fuse_reply_err(req, res);
+    } else {
+        fuse_reply_attr(req, &st, loopback.timeout);
+    }
+}
+
+static void
+loopback_ll_getxtimes(fuse_req_t req, fuse_ino_t ino,
+                      struct fuse_file_info *fi)
+{
+    struct timespec bkuptime;
+    struct timespec crtime;
+    struct attrlist attributes;
+    struct loopback_at at;
+    int res;
+    
+    struct xtimeattrbuf {
+        uint32_t size;
+        struct timespec xtime;
+    } __attribute__ ((packed));
+    
+    struct xtimeattrbuf buf;
+    
+    attributes.bitmapcount = ATTR_BIT_MAP_COUNT;
+    attributes.reserved    = 0;
+    attributes.commonattr  = 0;
+    attributes.dirattr     = 0;
+    attributes.fileattr    = 0;
+    attributes.forkattr    = 0;
+    attributes.volattr     = 0;
+    
+    res = loopback_at_get(get_inode(ino), &at);
+    if (res != 0) {
+        fuse_reply_err(req, res);
+        return;
+    }
+    
+    attributes.commonattr = ATTR_CMN_BKUPTIME;
+    res = getattrlistat(at.dirfd, at.name, &attributes, &buf, sizeof(buf),
+                        FSOPT_NOFOLLOW);
+    if (res == 0) {
+        (void)memcpy(&bkuptime, &(buf.xtime), sizeof(struct timespec));
+    } else {
+        (void)memset(&bkuptime, 0, sizeof(struct timespec));
+    }
+    
+    attributes.commonattr = ATTR_CMN_CRTIME;
+    res = getattrlistat(at.dirfd, at.name, &attributes, &buf, sizeof(buf),
+                        FSOPT_NOFOLLOW);
+    if (res == 0) {
+        (void)memcpy(&crtime, &(buf.xtime), sizeof(struct timespec));
+    } else {
+        (void)memset(&crtime, 0, sizeof(struct timespec));
+    }
+    
+    loopback_at_put(&at);
+    
+    fuse_reply_xtimes(req, &bkuptime, &crtime);
+}
+
+static void
+loopback_ll_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+    char buf[MAXPATHLEN + 1];
+    struct loopback_at at;
+    ssize_t res;
+    
+    res = loopback_at_get(get_inode(ino), &at);
+    if (res != 0) {
+        fuse_reply_err(req, (int)res);
+        return;
+    }
+    
+    res = readlinkat(at.dirfd, at.name, buf, sizeof(buf) - 1);
+    loopback_at_put(&at);
+    if (res == -1) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+    
+    buf[res] = '\0';
+    fuse_reply_readlink(req, buf);
+}
+
+static void
+loopback_reply_entry(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct fuse_entry_param e;
+    int res;
+    
+    res = loopback_do_lookup(parent, name, &e);
+    if (res != 0) {
+        fuse_reply_err(req, res);
+    } else {
+        fuse_reply_entry(req, &e);
+    }
+}
+
+static void
+loopback_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                  mode_t mode, dev_t rdev)
+{
+    char path[MAXPATHLEN];
+    struct loopback_at at;
+    int res;
+    
+    at.dirfd = loopback_dirfd(get_inode(parent));
+    at.name = name;
+    
+    // mkfifoat() and mknodat() are not available before macOS 13
+    res = loopback_at_path(&at, path);
+    if (res != 0) {
+        fuse_reply_err(req, res);
+        return;
+    }
+    
+    if (S_ISFIFO(mode)) {
+        res = mkfifo(path, mode);
+    } else {
+        res = mknod(path, mode, rdev);
+    }
+    
+    if (res == -1) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+    
+    loopback_reply_entry(req, parent, name);
+}
+
+static void
+loopback_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                  mode_t mode)
+{
+    int res;
+    
+    res = mkdirat(loopback_dirfd(get_inode(parent)), name, mode);
+    if (res == -1) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+    
+    loopback_reply_entry(req, parent, name);
+}
+
+static void
+loopback_ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+                    const char *name)
+{
+    int res;
+    
+    res = symlinkat(link, loopback_dirfd(get_inode(parent)), name);
+    if (res == -1) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+    
+    loopback_reply_entry(req, parent, name);
+}
+
+static void
+loopback_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+                 const char *newname)
+{
+    struct loopback_at at;
+    int res;
+    
+    res = loopback_at_get(get_inode(ino), &at);
+    if (res != 0) {
+        fuse_reply_err(req, res);
+        return;
+    }
+    
+    res = linkat(at.dirfd, at.name, loopback_dirfd(get_inode(newparent)),
+                 newname, 0);
+    loopback_at_put(&at);
+    if (res == -1) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+    
+    loopback_reply_entry(req, newparent, newname);
+}
+
+static void
+loopback_do_unlink(fuse_req_t req, fuse_ino_t parent, const char *name,
+                   int flags)
+{
+    int dirfd = loopback_dirfd(get_inode(parent));
+    struct stat st;
+    bool known;
+    int res;
+    
+    // Look at the file first, so that its binding can be cleared afterwards
+    known = (flags & AT_REMOVEDIR) == 0 &&
+            fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+    
+    res = unlinkat(dirfd, name, flags);
+    if (res == -1) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+    
+    if (known) {
+        loopback_unbind(&st, parent, name);
+    }
+    
+    fuse_reply_err(req, 0);
+}
+
+static void
+loopback_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    loopback_do_unlink(req, parent, name, 0);
+}
+
+static void
+loopback_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    loopback_do_unlink(req, parent, name, AT_REMOVEDIR);
+}
+
+static void
+loopback_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                   fuse_ino_t newparent, const char *newname)
+{
+    int dirfd = loopback_dirfd(get_inode(parent));
+    int newdirfd = loopback_dirfd(get_inode(newparent));
+    struct stat st;
+    bool replaced;
+    int res;
+    
+    // A file that is replaced must not stay bound to its old name
+    replaced = fstatat(newdirfd, newname, &st, AT_SYMLINK_NOFOLLOW) == 0;
+    
+    res = renameat(dirfd, name, newdirfd, newname);
+    if (res == -1) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+    
+    if (replaced) {
+        loopback_unbind(&st, newparent, newname);
+    }
+    loopback_rebind(newdirfd, newparent, newname);
+    
+    fuse_reply_err(req, 0);
+}
+
+#if HAVE_RENAMEX
+
+static void
+loopback_ll_renamex(fuse_req_t req, fuse_ino_t parent, const char *name,
+                    fuse_ino_t newparent, const char *newname,
+                    unsigned int flags)
+{
+    int dirfd = loopback_dirfd(get_inode(parent));
+    int newdirfd = loopback_dirfd(get_inode(newparent));
+    struct stat st;
+    bool replaced;
+    int res;
+    
+    // See loopback_ll_rename(), swapped files are both rebound below
+    replaced = !(flags & RENAME_SWAP) &&
+               fstatat(newdirfd, newname, &st, AT_SYMLINK_NOFOLLOW) == 0;
+    
+    res = renameatx_np(dirfd, name, newdirfd, newname, flags);
+    if (res == -1) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+    
+    if (replaced) {
+        loopback_unbind(&st, newparent, newname);
+    }
+    loopback_rebind(newdirfd, newparent, newname);
+    if (flags & RENAME_SWAP) {
+        loopback_rebind(dirfd, parent, name);
+    }
+    
+    fuse_reply_err(req, 0);
+}
+
+#endif /* HAVE_RENAMEX */
+
+static void
+loopback_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                   mode_t mode, struct fuse_file_info *fi)
+{
+    struct fuse_entry_param e;
+    int fd;
+    int res;
+    
+    fd = openat(loopback_dirfd(get_inode(parent)), name,
+                fi->flags | O_CREAT | O_CLOEXEC, mode);
+    if (fd == -1) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+    
+    res = loopback_do_lookup(parent, name, &e);
+    if (res != 0) {
+        close(fd);
+        fuse_reply_err(req, res);
+        return;
+    }
+    
+    fi->fh = fd;
+    if (fuse_reply_create(req, &e, fi) == -ENOENT) {
+        // The request was interrupted, the kernel will not forget the lookup
+        close(fd);
+        pthread_mutex_lock(&loopback.lock);
+        loopback_inode_put_locked(get_inode(e.ino), 1, 0);
+        pthread_mutex_unlock(&loopback.lock);
+    }
+}
+
+static void
+loopback_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct loopback_at at;
+    int fd;
+    int res;
+    
+    res = loopback_at_get(get_inode(ino), &at);
+    if (res != 0) {
+        fuse_reply_err(req, res);
+        return;
+    }
+    
+    fd = openat(at.dirfd, at.name, fi->flags | O_CLOEXEC);
+    loopback_at_put(&at);
+    if (fd == -1) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+    
+    fi->fh = fd;
+    if (fuse_reply_open(req, fi) == -ENOENT) {
+        close(fd);
+    }
+}
+
+static void
+loopback_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                 struct fuse_file_info *fi)
+{
+    char *buf;
+    ssize_t res;
+    
+    buf = malloc(size);
+    if (buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    
+    res = pread(fi->fh, buf, size, offset);
+    if (res == -1) {
+        fuse_reply_err(req, errno);
+    } else {
+        fuse_reply_buf(req, buf, res);
+    }
+    
+    free(buf);
+}
+
+static void
+loopback_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                  size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    ssize_t res;
+    
+    res = pwrite(fi->fh, buf, size, offset);
+    if (res == -1) {
+        fuse_reply_err(req, errno);
+    } else {
+        fuse_reply_write(req, res);
+    }
+}
+
+static void
+loopback_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    int res;
+    
+    res = close(dup(fi->fh));
+    fuse_reply_err(req, res == -1 ? errno : 0);
+}
+
+static void
+loopback_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    close(fi->fh);
+    fuse_reply_err(req, 0);
+}
+
+static void
+loopback_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                  struct fuse_file_info *fi)
+{
+    int res;
+    
+    (void)datasync;
+    
+    res = fsync(fi->fh);
+    fuse_reply_err(req, res == -1 ? errno : 0);
+}
+
+static void
+loopback_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset,
+                      off_t length, struct fuse_file_info *fi)
+{
+    fstore_t fstore;
+    
+    if (!(mode & PREALLOCATE)) {
+        fuse_reply_err(req, ENOTSUP);
+        return;
+    }
+    
+    fstore.fst_flags = 0;
+    if (mode & ALLOCATECONTIG) {
+        fstore.fst_flags |= F_ALLOCATECONTIG;
+    }
+    if (mode & ALLOCATEALL) {
+        fstore.fst_flags |= F_ALLOCATEALL;
+    }
+    
+    if (mode & ALLOCATEFROMPEOF) {
+        fstore.fst_posmode = F_PEOFPOSMODE;
+    } else if (mode & ALLOCATEFROMVOL) {
+        fstore.fst_posmode = F_VOLPOSMODE;
+    }
+    
+    fstore.fst_offset = offset;
+    fstore.fst_length = length;
+    
+    if (fcntl(fi->fh, F_PREALLOCATE, &fstore) == -1) {
+        fuse_reply_err(req, errno);
+    } else {
+        fuse_reply_err(req, 0);
+    }
+}
+
+struct loopback_dirp {
+    DIR *dp;
+    struct dirent *entry;
+    off_t offset;
+};
+
+static inline struct loopback_dirp *
+get_dirp(struct fuse_file_info *fi)
+{
+    return (struct loopback_dirp *)(uintptr_t)fi->fh;
+}
+
+static void
+loopback_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct loopback_dirp *d;
+    int fd;
+    int res;
+    
+    d = malloc(sizeof(struct loopback_dirp));
+    if (d == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    
+    fd = openat(loopback_dirfd(get_inode(ino)), ".",
+                O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        res = errno;
+        free(d);
+        fuse_reply_err(req, res);
+        return;
+    }
+    
+    d->dp = fdopendir(fd);
+    if (d->dp == NULL) {
+        res = errno;
+        close(fd);
+        free(d);
+        fuse_reply_err(req, res);
+        return;
+    }
+    
+    d->offset = 0;
+    d->entry = NULL;
+    
+    fi->fh = (uintptr_t)d;
+    if (fuse_reply_open(req, fi) == -ENOENT) {
+        closedir(d->dp);
+        free(d);
+    }
+}
+
+static void
+loopback_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                    struct fuse_file_info *fi)
+{
+    struct loopback_dirp *d = get_dirp(fi);
+    size_t pos = 0;
+    char *buf;
+    
+    buf = malloc(size);
+    if (buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    
+    if (offset == 0) {
+        rewinddir(d->dp);
+        d->entry = NULL;
+        d->offset = 0;
+    } else if (offset != d->offset) {
+        // Subtract the one that we add when calling telldir() below
+        seekdir(d->dp, offset - 1);
+        d->entry = NULL;
+        d->offset = offset;
+    }
+    
+    while (1) {
+        struct stat st;
+        off_t nextoff;
+        size_t entsize;
+    
+        if (!d->entry) {
+            errno = 0;
+            d->entry = readdir(d->dp);
+            if (!d->entry) {
+                if (errno != 0 && pos == 0) {
+                    int res = errno;
+                    free(buf);
+                    fuse_reply_err(req, res);
+                    return;
+                }
+                break;
+            }
+        }
+    
+        memset(&st, 0, sizeof(st));
+        st.st_ino = d->entry->d_ino;
+        st.st_mode = d->entry->d_type << 12;
+    
+        /*
+         * Under macOS, telldir() may return 0 the first time it is called.
+         * But for libfuse, an offset of zero means that offsets are not
+         * supported, so we shift everything by one.
+         */
+        nextoff = telldir(d->dp) + 1;
+    
+        entsize = fuse_add_direntry(req, buf + pos, size - pos,
+                                    d->entry->d_name, &st, nextoff);
+        if (entsize > size - pos) {
+            break;
+        }
+    
+        pos += entsize;
+        d->entry = NULL;
+        d->offset = nextoff;
+    }
+    
+    fuse_reply_buf(req, buf, pos);
+    free(buf);
+}
+
+static void
+loopback_ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+                       struct fuse_file_info *fi)
+{
+    struct loopback_dirp *d = get_dirp(fi);
+    
+    closedir(d->dp);
+    free(d);
+    fuse_reply_err(req, 0);
+}
+
+static void
+loopback_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+    struct loopback_at at;
+    struct statvfs stbuf;
+    int res;
+    
+    res = loopback_at_get(get_inode(ino), &at);
+    if (res != 0) {
+        fuse_reply_err(req, res);
+        return;
+    }
+    
+    res = fstatvfs(at.dirfd, &stbuf);
+    loopback_at_put(&at);
+    if (res == -1) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+    
+    stbuf.f_blocks = stbuf.f_blocks * stbuf.f_frsize / loopback.blocksize;
+    stbuf.f_bavail = stbuf.f_bavail * stbuf.f_frsize / loopback.blocksize;
+    stbuf.f_bfree = stbuf.f_bfree * stbuf.f_frsize / loopback.blocksize;
+    stbuf.f_frsize = loopback.blocksize;
+    stbuf.f_bsize = loopback.blocksize;
+    
+    fuse_reply_statfs(req, &stbuf);
+}
+
+static void
+loopback_ll_setvolname(fuse_req_t req, const char *name)
+{
+    fuse_reply_err(req, 0);
+}
+
+static void
+loopback_ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                     const char *value, size_t size, int flags,
+                     uint32_t position)
+{
+    char path[MAXPATHLEN];
+    struct loopback_at at;
+    int res;
+    
+    res = loopback_at_get(get_inode(ino), &at);
+    if (res == 0) {
+        res = loopback_at_path(&at, path);
+        loopback_at_put(&at);
+    }
+    if (res != 0) {
+        fuse_reply_err(req, res);
+        return;
+    }
+    
+    if (!strncmp(name, XATTR_APPLE_PREFIX, sizeof(XATTR_APPLE_PREFIX) - 1)) {
+        flags &= ~(XATTR_NOSECURITY);
+    }
+    
+    if (!strcmp(name, A_KAUTH_FILESEC_XATTR)) {
+    
+        char new_name[MAXPATHLEN];
+    
+        memcpy(new_name, A_KAUTH_FILESEC_XATTR, sizeof(A_KAUTH_FILESEC_XATTR));
+        memcpy(new_name, G_PREFIX, sizeof(G_PREFIX) - 1);
+    
+        res = setxattr(path, new_name, value, size, position, XATTR_NOFOLLOW);
+    
+    } else {
+        res = setxattr(path, name, value, size, position, XATTR_NOFOLLOW);
+    }
+    
+    fuse_reply_err(req, res == -1 ? errno : 0);
+}
+
+static void
+loopback_ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                     size_t size, uint32_t position)
+{
+    char path[MAXPATHLEN];
+    struct loopback_at at;
+    char *value = NULL;
+    ssize_t res;
+    
+    res = loopback_at_get(get_inode(ino), &at);
+    if (res == 0) {
+        res = loopback_at_path(&at, path);
+        loopback_at_put(&at);
+    }
+    if (res != 0) {
+        fuse_reply_err(req, (int)res);
+        return;
+    }
+    
+    if (size > 0) {
+        value = malloc(size);
+        if (value == NULL) {
+            fuse_reply_err(req, ENOMEM);
+            return;
+        }
+    }
+    
+    if (strcmp(name, A_KAUTH_FILESEC_XATTR) == 0) {
+    
+        char new_name[MAXPATHLEN];
+    
+        memcpy(new_name, A_KAUTH_FILESEC_XATTR, sizeof(A_KAUTH_FILESEC_XATTR));
+        memcpy(new_name, G_PREFIX, sizeof(G_PREFIX) - 1);
+    
+        res = getxattr(path, new_name, value, size, position, XATTR_NOFOLLOW);
+    
+    } else {
+        res = getxattr(path, name, value, size, position, XATTR_NOFOLLOW);
+    }
+    
+    if (res == -1) {
+        fuse_reply_err(req, errno);
+    } else if (size == 0) {
+        fuse_reply_xattr(req, res);
+    } else {
+        fuse_reply_buf(req, value, res);
+    }
+    
+    free(value);
+}
+
+static void
+loopback_ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+    char path[MAXPATHLEN];
+    struct loopback_at at;
+    char *list = NULL;
+    ssize_t res;
+    
+    res = loopback_at_get(get_inode(ino), &at);
+    if (res == 0) {
+        res = loopback_at_path(&at, path);
+        loopback_at_put(&at);
+    }
+    if (res != 0) {
+        fuse_reply_err(req, (int)res);
+        return;
+    }
+    
+    if (size > 0) {
+        list = malloc(size);
+        if (list == NULL) {
+            fuse_reply_err(req, ENOMEM);
+            return;
+        }
+    }
+    
+    res = listxattr(path, list, size, XATTR_NOFOLLOW);
+    if (res > 0 && list) {
+        size_t len = 0;
+        char *curr = list;
+        do {
+            size_t thislen = strlen(curr) + 1;
+            if (strcmp(curr, G_KAUTH_FILESEC_XATTR) == 0) {
+                memmove(curr, curr + thislen, res - len - thislen);
+                res -= thislen;
+                break;
+            }
+            curr += thislen;
+            len += thislen;
+        } while (len < res);
+    }
+    
+    if (res == -1) {
+        fuse_reply_err(req, errno);
+    } else if (size == 0) {
+        fuse_reply_xattr(req, res);
+    } else {
+        fuse_reply_buf(req, list, res);
+    }
+    
+    free(list);
+}
+
+static void
+loopback_ll_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name)
+{
+    char path[MAXPATHLEN];
+    struct loopback_at at;
+    int res;
+    
+    res = loopback_at_get(get_inode(ino), &at);
+    if (res == 0) {
+        res = loopback_at_path(&at, path);
+        loopback_at_put(&at);
+    }
+    if (res != 0) {
+        fuse_reply_err(req, res);
+        return;
+    }
+    
+    if (strcmp(name, A_KAUTH_FILESEC_XATTR) == 0) {
+    
+        char new_name[MAXPATHLEN];
+    
+        memcpy(new_name, A_KAUTH_FILESEC_XATTR, sizeof(A_KAUTH_FILESEC_XATTR));
+        memcpy(new_name, G_PREFIX, sizeof(G_PREFIX) - 1);
+    
+        res = removexattr(path, new_name, XATTR_NOFOLLOW);
+    
+    } else {
+        res = removexattr(path, name, XATTR_NOFOLLOW);
+    }
+    
+    fuse_reply_err(req, res == -1 ? errno : 0);
+}
+
+static struct fuse_lowlevel_ops loopback_ll_oper = {
+    .init        = loopback_ll_init,
+    .lookup      = loopback_ll_lookup,
+    .forget      = loopback_ll_forget,
+    .getattr     = loopback_ll_getattr,
+    .setattr     = loopback_ll_setattr,
+    .readlink    = loopback_ll_readlink,
+    .mknod       = loopback_ll_mknod,
+    .mkdir       = loopback_ll_mkdir,
+    .symlink     = loopback_ll_symlink,
+    .unlink      = loopback_ll_unlink,
+    .rmdir       = loopback_ll_rmdir,
+    .rename      = loopback_ll_rename,
+    .link        = loopback_ll_link,
+    .create      = loopback_ll_create,
+    .open        = loopback_ll_open,
+    .read        = loopback_ll_read,
+    .write       = loopback_ll_write,
+    .flush       = loopback_ll_flush,
+    .release     = loopback_ll_release,
+    .fsync       = loopback_ll_fsync,
+    .fallocate   = loopback_ll_fallocate,
+    .opendir     = loopback_ll_opendir,
+    .readdir     = loopback_ll_readdir,
+    .releasedir  = loopback_ll_releasedir,
+    .statfs      = loopback_ll_statfs,
+    .setxattr    = loopback_ll_setxattr,
+    .getxattr    = loopback_ll_getxattr,
+    .listxattr   = loopback_ll_listxattr,
+    .removexattr = loopback_ll_removexattr,
+    .setvolname  = loopback_ll_setvolname,
+    .getxtimes   = loopback_ll_getxtimes,
+#if HAVE_RENAMEX
+    .renamex     = loopback_ll_renamex,
+#endif
+};
+
+static const struct fuse_opt loopback_opts[] = {
+    { "root=%s", offsetof(struct loopback, root_path), 0 },
+    { "timeout=%lf", offsetof(struct loopback, timeout), 0 },
+    { "blocksize=%u", offsetof(struct loopback, blocksize), 0 },
+    { "case_insensitive", offsetof(struct loopback, case_insensitive), true },
+    FUSE_OPT_END
+};
+
+static int
+loopback_root_init(void)
+{
+    const char *root = loopback.root_path ? loopback.root_path : "/";
+    struct stat st;
+    
+    loopback.root.fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (loopback.root.fd == -1 || fstat(loopback.root.fd, &st) == -1) {
+        fprintf(stderr, "loopback: cannot open root: %s\n", strerror(errno));
+        return -1;
+    }
+    
+    loopback.root.dev = st.st_dev;
+    loopback.root.ino = st.st_ino;
+    loopback.root.nlookup = 2;
+    
+    pthread_mutex_init(&loopback.lock, NULL);
+    loopback.mask = 1023;
+    loopback.table = calloc(loopback.mask + 1, sizeof(struct loopback_inode *));
+    if (loopback.table == NULL) {
+        fprintf(stderr, "loopback: cannot allocate inode table\n");
+        return -1;
+    }
+    
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int res = -1;
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_chan *ch;
+    char *mountpoint;
+    int multithreaded;
+    int foreground;
+    struct rlimit rl;
+    
+    loopback.root_path = NULL;
+    loopback.timeout = 1.0;
+    loopback.blocksize = 4096;
+    loopback.case_insensitive = 0;
+    if (fuse_opt_parse(&args, &loopback, loopback_opts, NULL) == -1) {
+        exit(1);
+    }
+    
+    if (loopback_root_init() == -1) {
+        exit(1);
+    }
+    
+    // Every directory known to the kernel holds a descriptor
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = MIN(rl.rlim_max, OPEN_MAX);
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    
+    umask(0);
+    
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded,
+                           &foreground) != -1 &&
+        (ch = fuse_mount(mountpoint, &args)) != NULL) {
+        struct fuse_session *se;
+    
+        se = fuse_lowlevel_new(&args, &loopback_ll_oper,
+                               sizeof(loopback_ll_oper), NULL);
+        if (se != NULL) {
+            if (fuse_set_signal_handlers(se) != -1) {
+                fuse_session_add_chan(se, ch);
+                fuse_daemonize(foreground);
+                if (multithreaded) {
+                    res = fuse_session_loop_mt(se);
+                } else {
+                    res = fuse_session_loop(se);
+                }
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
+        free(mountpoint);
+    }
+    
+    fuse_opt_free_args(&args);
+    return res ? 1 : 0;
+}
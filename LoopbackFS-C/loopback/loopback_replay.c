@@ -0,0 +1,813 @@
+/*
+ FUSE: Filesystem in Userspace
+ Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+
+ This program can be distributed under the terms of the GNU GPL.
+ See the file LICENSE.txt.
+
+ */
+
+/*
+ * Replays a trace recorded by the loopback file system (mount option
+ * trace=FILE) against a directory, which can be a loopback mount or the
+ * backing store itself, and reports how long the operations took.
+ *
+ * Operations are issued one at a time in the order in which they began
+ * when the trace was recorded. Data written is zeros, and extended
+ * attribute values are zeros of the recorded size. setattr_x is replayed
+ * as a plain lstat(), since the trace does not carry the new attributes.
+ * The replay modifies the directory just like the traced workload did.
+ *
+ * Handles are the addresses of the loopback's file objects, which are
+ * reused once a file is released. Every open gets a handle of its own for
+ * the replay, and an operation on a handle belongs to the open of that
+ * handle that completed last before the operation began.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <mach/mach_time.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/attr.h>
+#include <sys/mount.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "loopback_trace.h"
+
+static const char *op_names[LOOPBACK_OP_COUNT] = {
+#define OP_NAME(op, name) name,
+    LOOPBACK_OPS(OP_NAME)
+#undef OP_NAME
+};
+
+struct path_entry {
+    struct path_entry *next;
+    uint64_t hash;
+    char path[];
+};
+
+// Open files and directories of the trace, by handle
+struct handle_entry {
+    struct handle_entry *next;
+    uint64_t handle;
+    int fd;
+    DIR *dp;
+};
+
+// A successful open, in the order of handle and completion
+struct handle_owner {
+    uint64_t handle;
+    uint64_t end_ns;
+    uint64_t id;
+};
+
+struct op_stats {
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t diverged;
+    uint64_t skipped;
+    uint64_t total_ns;
+    uint64_t traced_ns;
+};
+
+#define PATH_BUCKETS 65536
+#define HANDLE_BUCKETS 4096
+
+static struct {
+    int dirfd;
+    const char *dir;
+    struct path_entry *paths[PATH_BUCKETS];
+    struct handle_entry *handles[HANDLE_BUCKETS];
+    struct loopback_trace_op *ops;
+    size_t nops;
+    char *buf;
+    size_t bufsize;
+    struct op_stats stats[LOOPBACK_OP_COUNT];
+    mach_timebase_info_data_t timebase;
+} replay;
+
+static inline uint64_t
+now_ns(void)
+{
+    return mach_absolute_time() * replay.timebase.numer /
+           replay.timebase.denom;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+            "usage: loopback_replay [-t] [-s speed] trace directory\n"
+            "\n"
+            "    -t        keep the timing of the trace\n"
+            "    -s speed  with -t, replay speed times faster\n");
+    exit(2);
+}
+
+static const char *
+path_lookup(uint64_t hash)
+{
+    struct path_entry *e;
+    
+    for (e = replay.paths[hash % PATH_BUCKETS]; e != NULL; e = e->next) {
+        if (e->hash == hash) {
+            return e->path;
+        }
+    }
+    return NULL;
+}
+
+// Path relative to the replay directory
+static const char *
+rel_path(uint64_t hash)
+{
+    const char *path = path_lookup(hash);
+    
+    if (path == NULL) {
+        return NULL;
+    }
+    return path[1] == '\0' ? "." : path + 1;
+}
+
+// Xattr calls have no *at() variants
+static const char *
+full_path(uint64_t hash, char *buf)
+{
+    const char *path = path_lookup(hash);
+    
+    if (path == NULL ||
+        snprintf(buf, MAXPATHLEN, "%s%s", replay.dir, path) >= MAXPATHLEN) {
+        return NULL;
+    }
+    return buf;
+}
+
+static struct handle_entry *
+handle_lookup(uint64_t handle)
+{
+    struct handle_entry *e;
+    
+    for (e = replay.handles[handle % HANDLE_BUCKETS]; e != NULL; e = e->next) {
+        if (e->handle == handle) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void
+handle_insert(uint64_t handle, int fd, DIR *dp)
+{
+    struct handle_entry *e = malloc(sizeof(struct handle_entry));
+    
+    if (e == NULL) {
+        if (dp != NULL) {
+            closedir(dp);
+        } else {
+            close(fd);
+        }
+        return;
+    }
+    
+    e->handle = handle;
+    e->fd = fd;
+    e->dp = dp;
+    e->next = replay.handles[handle % HANDLE_BUCKETS];
+    replay.handles[handle % HANDLE_BUCKETS] = e;
+}
+
+static void
+handle_remove(uint64_t handle)
+{
+    struct handle_entry **pp = &replay.handles[handle % HANDLE_BUCKETS];
+    
+    while (*pp != NULL) {
+        struct handle_entry *e = *pp;
+        
+        if (e->handle == handle) {
+            *pp = e->next;
+            if (e->dp != NULL) {
+                closedir(e->dp);
+            } else {
+                close(e->fd);
+            }
+            free(e);
+            return;
+        }
+        pp = &e->next;
+    }
+}
+
+static int
+handle_fd(uint64_t handle)
+{
+    struct handle_entry *e = handle_lookup(handle);
+    
+    return e != NULL ? e->fd : -1;
+}
+
+static int
+load_trace(const char *file)
+{
+    struct loopback_trace_header header;
+    size_t capacity = 0;
+    FILE *in;
+    
+    in = fopen(file, "r");
+    if (in == NULL) {
+        fprintf(stderr, "loopback_replay: %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+    
+    if (fread(&header, sizeof(header), 1, in) != 1 ||
+        header.magic != LOOPBACK_TRACE_MAGIC ||
+        header.version != LOOPBACK_TRACE_VERSION) {
+        fprintf(stderr, "loopback_replay: %s: not a trace file\n", file);
+        fclose(in);
+        return -1;
+    }
+    
+    if (header.dropped > 0) {
+        fprintf(stderr, "loopback_replay: warning: %llu operations were "
+                "dropped while tracing\n", (unsigned long long)header.dropped);
+    }
+    
+    while (1) {
+        uint8_t type;
+        int c = fgetc(in);
+        
+        if (c == EOF) {
+            break;
+        }
+        type = (uint8_t)c;
+        ungetc(c, in);
+        
+        if (type == LOOPBACK_TRACE_PATH) {
+            struct loopback_trace_path record;
+            struct path_entry *e;
+            
+            if (fread(&record, sizeof(record), 1, in) != 1) {
+                goto truncated;
+            }
+            e = malloc(sizeof(struct path_entry) + record.len + 1);
+            if (e == NULL) {
+                goto nomem;
+            }
+            if (fread(e->path, 1, record.len, in) != record.len) {
+                free(e);
+                goto truncated;
+            }
+            e->path[record.len] = '\0';
+            e->hash = record.hash;
+            e->next = replay.paths[e->hash % PATH_BUCKETS];
+            replay.paths[e->hash % PATH_BUCKETS] = e;
+        } else if (type == LOOPBACK_TRACE_OP) {
+            if (replay.nops == capacity) {
+                struct loopback_trace_op *ops;
+                
+                capacity = capacity ? capacity * 2 : 4096;
+                ops = realloc(replay.ops,
+                              capacity * sizeof(struct loopback_trace_op));
+                if (ops == NULL) {
+                    goto nomem;
+                }
+                replay.ops = ops;
+            }
+            if (fread(&replay.ops[replay.nops], sizeof(struct loopback_trace_op),
+                      1, in) != 1) {
+                goto truncated;
+            }
+            if (replay.ops[replay.nops].op < LOOPBACK_OP_COUNT) {
+                replay.nops++;
+            }
+        } else {
+            fprintf(stderr, "loopback_replay: %s: unknown record type %u\n",
+                    file, type);
+            fclose(in);
+            return -1;
+        }
+    }
+    
+    fclose(in);
+    return 0;
+
+truncated:
+    // The file system may not have been unmounted cleanly
+    fprintf(stderr, "loopback_replay: warning: %s is truncated\n", file);
+    fclose(in);
+    return 0;
+
+nomem:
+    fprintf(stderr, "loopback_replay: out of memory\n");
+    fclose(in);
+    return -1;
+}
+
+static int
+compare_ops(const void *a, const void *b)
+{
+    const struct loopback_trace_op *op1 = a;
+    const struct loopback_trace_op *op2 = b;
+    
+    if (op1->start_ns != op2->start_ns) {
+        return op1->start_ns < op2->start_ns ? -1 : 1;
+    }
+    return (int)op1->thread - (int)op2->thread;
+}
+
+static int
+compare_owners(const void *a, const void *b)
+{
+    const struct handle_owner *o1 = a;
+    const struct handle_owner *o2 = b;
+    
+    if (o1->handle != o2->handle) {
+        return o1->handle < o2->handle ? -1 : 1;
+    }
+    if (o1->end_ns != o2->end_ns) {
+        return o1->end_ns < o2->end_ns ? -1 : 1;
+    }
+    return 0;
+}
+
+static inline bool
+opens_handle(uint8_t op)
+{
+    return op == LOOPBACK_OP_OPEN || op == LOOPBACK_OP_CREATE ||
+           op == LOOPBACK_OP_OPENDIR;
+}
+
+// Replaces the traced handles with one per open, see above
+static int
+assign_handles(void)
+{
+    struct handle_owner *owners;
+    size_t nowners = 0;
+    uint64_t id = 0;
+    size_t i;
+    
+    owners = malloc(MAX(replay.nops, 1) * sizeof(struct handle_owner));
+    if (owners == NULL) {
+        fprintf(stderr, "loopback_replay: out of memory\n");
+        return -1;
+    }
+    
+    for (i = 0; i < replay.nops; i++) {
+        struct loopback_trace_op *r = &replay.ops[i];
+        
+        if (!opens_handle(r->op) || r->handle == 0) {
+            continue;
+        }
+        if (r->result >= 0) {
+            owners[nowners].handle = r->handle;
+            owners[nowners].end_ns = r->start_ns + r->duration_ns;
+            owners[nowners].id = id + 1;
+            nowners++;
+        }
+        r->handle = ++id;
+    }
+    
+    qsort(owners, nowners, sizeof(struct handle_owner), compare_owners);
+    
+    for (i = 0; i < replay.nops; i++) {
+        struct loopback_trace_op *r = &replay.ops[i];
+        size_t lo = 0;
+        size_t hi = nowners;
+        
+        if (opens_handle(r->op) || r->handle == 0) {
+            continue;
+        }
+        
+        // Find the first owner past the handle's last open before r
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            
+            if (owners[mid].handle < r->handle ||
+                (owners[mid].handle == r->handle &&
+                 owners[mid].end_ns <= r->start_ns)) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        
+        // Operations without an open in the trace are skipped
+        if (lo > 0 && owners[lo - 1].handle == r->handle) {
+            r->handle = owners[lo - 1].id;
+        } else {
+            r->handle = 0;
+        }
+    }
+    
+    free(owners);
+    return 0;
+}
+
+static char *
+op_buffer(uint64_t size)
+{
+    if (size > replay.bufsize) {
+        char *buf = realloc(replay.buf, size);
+        
+        if (buf == NULL) {
+            return NULL;
+        }
+        memset(buf + replay.bufsize, 0, size - replay.bufsize);
+        replay.buf = buf;
+        replay.bufsize = size;
+    }
+    return replay.buf;
+}
+
+/*
+ * Issues a single operation. Returns 0 or a negative errno like the file
+ * system does, or 1 if the operation could not be replayed.
+ */
+static int
+replay_op(const struct loopback_trace_op *r)
+{
+    char pathbuf[MAXPATHLEN];
+    const char *path = NULL;
+    const char *path2 = NULL;
+    struct stat st;
+    char *buf;
+    int res = -1;
+    int fd;
+    
+    switch (r->op) {
+        case LOOPBACK_OP_GETATTR:
+        case LOOPBACK_OP_READLINK:
+        case LOOPBACK_OP_OPENDIR:
+        case LOOPBACK_OP_MKNOD:
+        case LOOPBACK_OP_MKDIR:
+        case LOOPBACK_OP_UNLINK:
+        case LOOPBACK_OP_RMDIR:
+        case LOOPBACK_OP_CREATE:
+        case LOOPBACK_OP_OPEN:
+        case LOOPBACK_OP_GETXTIMES:
+        case LOOPBACK_OP_SETATTR_X:
+            path = rel_path(r->path);
+            if (path == NULL) {
+                return 1;
+            }
+            break;
+        case LOOPBACK_OP_RENAME:
+        case LOOPBACK_OP_RENAMEX:
+        case LOOPBACK_OP_LINK:
+            path = rel_path(r->path);
+            path2 = rel_path(r->path2);
+            if (path == NULL || path2 == NULL) {
+                return 1;
+            }
+            break;
+        case LOOPBACK_OP_SYMLINK:
+            path = rel_path(r->path);
+            path2 = path_lookup(r->path2);
+            if (path == NULL || path2 == NULL) {
+                return 1;
+            }
+            break;
+        case LOOPBACK_OP_SETXATTR:
+        case LOOPBACK_OP_GETXATTR:
+        case LOOPBACK_OP_REMOVEXATTR:
+            path2 = path_lookup(r->path2);
+            if (path2 == NULL) {
+                return 1;
+            }
+            // Fall through
+        case LOOPBACK_OP_LISTXATTR:
+            path = full_path(r->path, pathbuf);
+            if (path == NULL) {
+                return 1;
+            }
+            break;
+    }
+    
+    switch (r->op) {
+        case LOOPBACK_OP_GETATTR:
+        case LOOPBACK_OP_SETATTR_X:
+            res = fstatat(replay.dirfd, path, &st, AT_SYMLINK_NOFOLLOW);
+            break;
+        
+        case LOOPBACK_OP_FGETATTR:
+        case LOOPBACK_OP_FSETATTR_X:
+            res = fstat(handle_fd(r->handle), &st);
+            break;
+        
+        case LOOPBACK_OP_READLINK:
+            res = readlinkat(replay.dirfd, path, pathbuf, sizeof(pathbuf));
+            break;
+        
+        case LOOPBACK_OP_OPENDIR: {
+            DIR *dp;
+            
+            fd = openat(replay.dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd == -1) {
+                break;
+            }
+            dp = fdopendir(fd);
+            if (dp == NULL) {
+                close(fd);
+                break;
+            }
+            handle_insert(r->handle, fd, dp);
+            res = 0;
+            break;
+        }
+        
+        case LOOPBACK_OP_READDIR: {
+            struct handle_entry *e = handle_lookup(r->handle);
+            
+            if (e == NULL || e->dp == NULL) {
+                return 1;
+            }
+            
+            // The whole directory is read by the call at offset 0
+            res = 0;
+            if (r->arg1 == 0) {
+                rewinddir(e->dp);
+                while (readdir(e->dp) != NULL) {
+                }
+            }
+            break;
+        }
+        
+        case LOOPBACK_OP_RELEASEDIR:
+        case LOOPBACK_OP_RELEASE:
+            if (handle_lookup(r->handle) == NULL) {
+                return 1;
+            }
+            handle_remove(r->handle);
+            res = 0;
+            break;
+        
+        case LOOPBACK_OP_MKNOD:
+            if (!S_ISFIFO(r->arg1) ||
+                snprintf(pathbuf, sizeof(pathbuf), "%s/%s", replay.dir,
+                         path) >= sizeof(pathbuf)) {
+                return 1;
+            }
+            res = mkfifo(pathbuf, (mode_t)r->arg1);
+            break;
+        
+        case LOOPBACK_OP_MKDIR:
+            res = mkdirat(replay.dirfd, path, (mode_t)r->arg1);
+            break;
+        
+        case LOOPBACK_OP_SYMLINK:
+            res = symlinkat(path2, replay.dirfd, path);
+            break;
+        
+        case LOOPBACK_OP_UNLINK:
+            res = unlinkat(replay.dirfd, path, 0);
+            break;
+        
+        case LOOPBACK_OP_RMDIR:
+            res = unlinkat(replay.dirfd, path, AT_REMOVEDIR);
+            break;
+        
+        case LOOPBACK_OP_RENAME:
+            res = renameat(replay.dirfd, path, replay.dirfd, path2);
+            break;
+        
+        case LOOPBACK_OP_RENAMEX:
+            res = renameatx_np(replay.dirfd, path, replay.dirfd, path2,
+                               (unsigned int)r->arg1);
+            break;
+        
+        case LOOPBACK_OP_LINK:
+            res = linkat(replay.dirfd, path, replay.dirfd, path2, 0);
+            break;
+        
+        case LOOPBACK_OP_CREATE:
+        case LOOPBACK_OP_OPEN:
+            fd = openat(replay.dirfd, path, (int)r->arg1 | O_CLOEXEC |
+                        (r->op == LOOPBACK_OP_CREATE ? O_CREAT : 0),
+                        (mode_t)r->arg2);
+            if (fd == -1) {
+                break;
+            }
+            handle_insert(r->handle, fd, NULL);
+            res = 0;
+            break;
+        
+        case LOOPBACK_OP_READ:
+            buf = op_buffer(r->arg2);
+            if (buf == NULL || handle_lookup(r->handle) == NULL) {
+                return 1;
+            }
+            res = (int)pread(handle_fd(r->handle), buf, r->arg2, r->arg1);
+            break;
+        
+        case LOOPBACK_OP_WRITE:
+            buf = op_buffer(r->arg2);
+            if (buf == NULL || handle_lookup(r->handle) == NULL) {
+                return 1;
+            }
+            res = (int)pwrite(handle_fd(r->handle), buf, r->arg2, r->arg1);
+            break;
+        
+        case LOOPBACK_OP_FLUSH:
+            if (handle_lookup(r->handle) == NULL) {
+                return 1;
+            }
+            res = close(dup(handle_fd(r->handle)));
+            break;
+        
+        case LOOPBACK_OP_FSYNC:
+            if (handle_lookup(r->handle) == NULL) {
+                return 1;
+            }
+            res = fsync(handle_fd(r->handle));
+            break;
+        
+        case LOOPBACK_OP_SETXATTR:
+            buf = op_buffer(r->arg2);
+            if (buf == NULL) {
+                return 1;
+            }
+            res = setxattr(path, path2, buf, r->arg2, 0,
+                           ((int)r->arg1 & ~XATTR_NOSECURITY) |
+                           XATTR_NOFOLLOW);
+            break;
+        
+        case LOOPBACK_OP_GETXATTR:
+            buf = op_buffer(r->arg2);
+            if (r->arg2 > 0 && buf == NULL) {
+                return 1;
+            }
+            res = (int)getxattr(path, path2, r->arg2 ? buf : NULL, r->arg2, 0,
+                                XATTR_NOFOLLOW);
+            break;
+        
+        case LOOPBACK_OP_LISTXATTR:
+            buf = op_buffer(r->arg2);
+            if (r->arg2 > 0 && buf == NULL) {
+                return 1;
+            }
+            res = (int)listxattr(path, r->arg2 ? buf : NULL, r->arg2,
+                                 XATTR_NOFOLLOW);
+            break;
+        
+        case LOOPBACK_OP_REMOVEXATTR:
+            res = removexattr(path, path2, XATTR_NOFOLLOW);
+            break;
+        
+        case LOOPBACK_OP_GETXTIMES: {
+            struct attrlist attributes;
+            struct {
+                uint32_t size;
+                struct timespec xtime;
+            } __attribute__ ((packed)) xbuf;
+            
+            memset(&attributes, 0, sizeof(attributes));
+            attributes.bitmapcount = ATTR_BIT_MAP_COUNT;
+            attributes.commonattr = ATTR_CMN_CRTIME;
+            res = getattrlistat(replay.dirfd, path, &attributes, &xbuf,
+                                sizeof(xbuf), FSOPT_NOFOLLOW);
+            break;
+        }
+        
+        case LOOPBACK_OP_STATFS_X: {
+            struct statfs sfs;
+            
+            res = fstatfs(replay.dirfd, &sfs);
+            break;
+        }
+        
+        default:
+            // exchange, fallocate and setvolname are not replayed
+            return 1;
+    }
+    
+    return res == -1 ? -errno : 0;
+}
+
+static void
+report(uint64_t elapsed_ns)
+{
+    int op;
+    
+    printf("%-12s %10s %8s %9s %8s %12s %12s\n", "operation", "calls",
+           "errors", "diverged", "skipped", "replay_us", "traced_us");
+    
+    for (op = 0; op < LOOPBACK_OP_COUNT; op++) {
+        struct op_stats *s = &replay.stats[op];
+        uint64_t replayed = s->calls - s->skipped;
+        
+        if (s->calls == 0) {
+            continue;
+        }
+        
+        printf("%-12s %10llu %8llu %9llu %8llu %12.1f %12.1f\n", op_names[op],
+               (unsigned long long)s->calls, (unsigned long long)s->errors,
+               (unsigned long long)s->diverged,
+               (unsigned long long)s->skipped,
+               replayed ? s->total_ns / 1000.0 / replayed : 0.0,
+               replayed ? s->traced_ns / 1000.0 / replayed : 0.0);
+    }
+    
+    printf("\n%zu operations in %.3f s\n", replay.nops, elapsed_ns / 1e9);
+}
+
+int
+main(int argc, char *argv[])
+{
+    bool timed = false;
+    double speed = 1.0;
+    uint64_t replay_start;
+    size_t i;
+    int ch;
+    
+    while ((ch = getopt(argc, argv, "ts:")) != -1) {
+        switch (ch) {
+            case 't':
+                timed = true;
+                break;
+            case 's':
+                speed = strtod(optarg, NULL);
+                if (speed <= 0) {
+                    usage();
+                }
+                break;
+            default:
+                usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    
+    if (argc != 2) {
+        usage();
+    }
+    
+    mach_timebase_info(&replay.timebase);
+    
+    if (load_trace(argv[0]) == -1) {
+        return 1;
+    }
+    
+    replay.dir = argv[1];
+    replay.dirfd = open(replay.dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (replay.dirfd == -1) {
+        fprintf(stderr, "loopback_replay: %s: %s\n", replay.dir,
+                strerror(errno));
+        return 1;
+    }
+    
+    qsort(replay.ops, replay.nops, sizeof(struct loopback_trace_op),
+          compare_ops);
+    if (assign_handles() == -1) {
+        return 1;
+    }
+    
+    replay_start = now_ns();
+    
+    for (i = 0; i < replay.nops; i++) {
+        const struct loopback_trace_op *r = &replay.ops[i];
+        struct op_stats *s = &replay.stats[r->op];
+        uint64_t start;
+        int res;
+        
+        if (timed) {
+            uint64_t due = replay_start + (uint64_t)(r->start_ns / speed);
+            uint64_t now = now_ns();
+            
+            if (due > now) {
+                usleep((useconds_t)((due - now) / 1000));
+            }
+        }
+        
+        s->calls++;
+        
+        start = now_ns();
+        res = replay_op(r);
+        if (res == 1) {
+            s->skipped++;
+            continue;
+        }
+        s->total_ns += now_ns() - start;
+        s->traced_ns += r->duration_ns;
+        
+        if (res < 0) {
+            s->errors++;
+        }
+        
+        // Only compare errors, byte counts may differ for good reasons
+        if ((res < 0 || r->result < 0) && res != r->result) {
+            s->diverged++;
+        }
+    }
+    
+    report(now_ns() - replay_start);
+    
+    return 0;
+}
@@ -0,0 +1,129 @@
+/*
+ FUSE: Filesystem in Userspace
+ Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+
+ This program can be distributed under the terms of the GNU GPL.
+ See the file LICENSE.txt.
+
+ */
+
+/*
+ * Trace file format shared by loopback.c, which records traces with the
+ * trace=FILE mount option, and loopback_replay.c, which replays them.
+ *
+ * A trace file starts with a struct loopback_trace_header, followed by
+ * records in host byte order. Every record starts with its type. Path
+ * records map a path hash to the path and always come before the first
+ * operation record that refers to the hash. Operation records of different
+ * threads are not ordered, sort them by start time to get the order in
+ * which the operations began.
+ */
+
+#ifndef LOOPBACK_TRACE_H
+#define LOOPBACK_TRACE_H
+
+#include <stdint.h>
+
+#define LOOPBACK_TRACE_MAGIC   0x5254424c /* "LBTR" */
+#define LOOPBACK_TRACE_VERSION 1
+
+/*
+ * Operations in the order of their codes. Never reorder this list, add new
+ * operations to its end.
+ */
+#define LOOPBACK_OPS(X) \
+    X(GETATTR, "getattr") \
+    X(FGETATTR, "fgetattr") \
+    X(READLINK, "readlink") \
+    X(OPENDIR, "opendir") \
+    X(READDIR, "readdir") \
+    X(RELEASEDIR, "releasedir") \
+    X(MKNOD, "mknod") \
+    X(MKDIR, "mkdir") \
+    X(SYMLINK, "symlink") \
+    X(UNLINK, "unlink") \
+    X(RMDIR, "rmdir") \
+    X(RENAME, "rename") \
+    X(LINK, "link") \
+    X(CREATE, "create") \
+    X(OPEN, "open") \
+    X(READ, "read") \
+    X(WRITE, "write") \
+    X(FLUSH, "flush") \
+    X(RELEASE, "release") \
+    X(FSYNC, "fsync") \
+    X(SETXATTR, "setxattr") \
+    X(GETXATTR, "getxattr") \
+    X(LISTXATTR, "listxattr") \
+    X(REMOVEXATTR, "removexattr") \
+    X(EXCHANGE, "exchange") \
+    X(GETXTIMES, "getxtimes") \
+    X(SETATTR_X, "setattr_x") \
+    X(FSETATTR_X, "fsetattr_x") \
+    X(FALLOCATE, "fallocate") \
+    X(SETVOLNAME, "setvolname") \
+    X(STATFS_X, "statfs_x") \
+    X(RENAMEX, "renamex")
+
+enum {
+#define LOOPBACK_OP_ENUM(op, name) LOOPBACK_OP_##op,
+    LOOPBACK_OPS(LOOPBACK_OP_ENUM)
+#undef LOOPBACK_OP_ENUM
+    LOOPBACK_OP_COUNT
+};
+
+enum {
+    LOOPBACK_TRACE_OP = 1,
+    LOOPBACK_TRACE_PATH = 2
+};
+
+struct loopback_trace_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t start_sec;     // Wall clock time the trace was started at
+    uint64_t records;       // Operation records written
+    uint64_t dropped;       // Operation records lost to full buffers
+};
+
+/*
+ * The meaning of arg1 and arg2 depends on the operation:
+ *
+ *   open, create     open flags, mode
+ *   mkdir, mknod     mode, device
+ *   read, write      offset, size
+ *   readdir          offset, -
+ *   fsync            isdatasync, -
+ *   fallocate        offset, length
+ *   setattr_x        valid bits, size
+ *   getxattr,        -, buffer size
+ *   listxattr,
+ *   setxattr
+ *   renamex          flags, -
+ *
+ * path2 is the hash of the second path of rename, renamex, link and
+ * exchange, of the link target of symlink and of the attribute name of
+ * the xattr operations. handle identifies the open file or directory.
+ */
+struct loopback_trace_op {
+    uint8_t type;
+    uint8_t op;
+    uint16_t thread;
+    int32_t result;
+    uint64_t start_ns;      // Relative to the start of the trace
+    uint64_t duration_ns;
+    uint64_t path;
+    uint64_t path2;
+    uint64_t handle;
+    uint64_t arg1;
+    uint64_t arg2;
+};
+
+struct loopback_trace_path {
+    uint8_t type;
+    uint8_t reserved;
+    uint16_t len;           // Length of the path that follows, without NUL
+    uint32_t reserved2;
+    uint64_t hash;
+};
+
+#endif /* LOOPBACK_TRACE_H */
@@ -24,11 +24,45 @@
 #import <macFUSE/macFUSE.h>
 
 #import <AvailabilityMacros.h>
+#import <sys/mount.h>
 
 #import "LoopbackFS.h"
 
 static NSString *LoopbackMountPath = @"/Volumes/loop";
 
+// Adds the mount options that depend on the backing volume at rootPath. The
+// kernel extension transfers iosize bytes at a time, which is the preferred
+// I/O size of the volume unless -iosize is given. Lookups of missing names on
+// a network volume are remembered for a second. On a local volume, each of
+// them is cheap.
+static void LoopbackAddVolumeOptions(NSString* rootPath,
+                                     NSMutableArray* options) {
+  NSUserDefaults* defaults = [NSUserDefaults standardUserDefaults];
+  struct statfs sfs;
+  if ( statfs([rootPath fileSystemRepresentation], &sfs) != 0 ) {
+    NSLog(@"Cannot get volume statistics of %@: %s", rootPath, strerror(errno));
+    return;
+  }
+
+  NSInteger iosize = [defaults integerForKey:@"iosize"];
+  if ( iosize <= 0 ) {
+    iosize = 4096;
+    while ( iosize < 16 * 1024 * 1024 && iosize * 2 <= sfs.f_iosize ) {
+      iosize *= 2;
+    }
+  }
+  [options addObject:[NSString stringWithFormat:@"iosize=%ld", (long)iosize]];
+
+  BOOL local = (sfs.f_flags & MNT_LOCAL) != 0;
+  if ( !local ) {
+    [options addObject:@"negative_timeout=1"];
+  }
+
+  NSLog(@"Backing volume: %s, %@, preferred I/O size %d, mounting with %@",
+        sfs.f_fstypename, local ? @"local" : @"remote", (int)sfs.f_iosize,
+        [options componentsJoinedByString:@","]);
+}
+
 @implementation AppDelegate
 
 - (void)mountFailed:(NSNotification *)notification {
@@ -51,6 +85,11 @@ static NSString *LoopbackMountPath = @"/Volumes/loop";
 - (void)didMount:(NSNotification *)notification {
   NSLog(@"Got didMount notification.");
 
+  if ([[NSUserDefaults standardUserDefaults] stringForKey:@"rootPath"]) {
+    // Launched by a script, do not open a Finder window
+    return;
+  }
+
   NSString *parentPath = [LoopbackMountPath stringByDeletingLastPathComponent];
   [[NSWorkspace sharedWorkspace] selectFile:LoopbackMountPath
                    inFileViewerRootedAtPath:parentPath];
@@ -65,22 +104,32 @@ static NSString *LoopbackMountPath = @"/Volumes/loop";
 }
 
 - (void)applicationDidFinishLaunching:(NSNotification *)notification {
-  NSOpenPanel* panel = [NSOpenPanel openPanel];
-  [panel setCanChooseFiles:NO];
-  [panel setCanChooseDirectories:YES];
-  [panel setAllowsMultipleSelection:NO];
-  [panel setDirectoryURL:[NSURL fileURLWithPath:@"/tmp"]];
-  NSModalResponse ret = [panel runModal];
-
-  if ( ret == NSModalResponseCancel ) {
-    exit(0);
+  // The paths can be passed on the command line, e.g.
+  // open LoopbackFS.app --args -rootPath /tmp/dir -mountPath /tmp/mnt
+  NSUserDefaults* defaults = [NSUserDefaults standardUserDefaults];
+  NSString* rootPath = [defaults stringForKey:@"rootPath"];
+  NSString* mountPath = [defaults stringForKey:@"mountPath"];
+  if ( mountPath ) {
+    LoopbackMountPath = [mountPath copy];
   }
-  NSArray* paths = [panel URLs];
-  if ( [paths count] != 1 ) {
-    exit(0);
+
+  if ( !rootPath ) {
+    NSOpenPanel* panel = [NSOpenPanel openPanel];
+    [panel setCanChooseFiles:NO];
+    [panel setCanChooseDirectories:YES];
+    [panel setAllowsMultipleSelection:NO];
+    [panel setDirectoryURL:[NSURL fileURLWithPath:@"/tmp"]];
+    NSModalResponse ret = [panel runModal];
+
+    if ( ret == NSModalResponseCancel ) {
+      exit(0);
+    }
+    NSArray* paths = [panel URLs];
+    if ( [paths count] != 1 ) {
+      exit(0);
+    }
+    rootPath = [[paths objectAtIndex:0] path];
   }
-  NSString* rootPath = nil;
-  rootPath = [[paths objectAtIndex:0] path];
 
   NSNotificationCenter* center = [NSNotificationCenter defaultCenter];
   [center addObserver:self selector:@selector(mountFailed:)
@@ -92,6 +141,10 @@ static NSString *LoopbackMountPath = @"/Volumes/loop";
 
   loop_ = [[LoopbackFS alloc] initWithRootPath:rootPath];
 
+  // -cacheExtendedAttributes YES keeps the xattrs of recently seen items.
+  [loop_ setCachesExtendedAttributes:
+         [defaults boolForKey:@"cacheExtendedAttributes"]];
+
   fs_ = [[GMUserFileSystem alloc] initWithDelegate:loop_ isThreadSafe:NO];
 
   NSMutableArray* options = [NSMutableArray array];
@@ -103,6 +156,7 @@ static NSString *LoopbackMountPath = @"/Volumes/loop";
   [options addObject:@"native_xattr"];
 
   [options addObject:@"volname=LoopbackFS"];
+  LoopbackAddVolumeOptions(rootPath, options);
   [fs_ mountAtPath:LoopbackMountPath
        withOptions:options];
 }
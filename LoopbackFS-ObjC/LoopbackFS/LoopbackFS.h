@@ -31,7 +31,23 @@
 
 @interface LoopbackFS : NSObject  {
   NSString* rootPath_;   // The local file-system path to mount.
+  int rootFd_;           // rootPath_, opened for the *at() system calls.
+
+  // Attributes from recent directory listings, by directory path. Every change
+  // bumps generation_, which invalidates them. GMUserFileSystem serializes
+  // the calls of a delegate that is not thread safe, so there is no locking.
+  NSMutableDictionary* listings_;
+  uint64_t generation_;
+
+  // Extended attributes by path, when cachesXattrs_ is set. They are dropped
+  // with the listings.
+  NSMutableDictionary* xattrs_;
+  BOOL cachesXattrs_;
 }
 - (id)initWithRootPath:(NSString *)rootPath;
 
+// Whether to keep the extended attributes of recently listed items. Off by
+// default.
+- (void)setCachesExtendedAttributes:(BOOL)caches;
+
 @end
@@ -31,6 +31,8 @@
 
 #import <macFUSE/macFUSE.h>
 
+#import <pthread.h>
+#import <sys/attr.h>
 #import <sys/stat.h>
 #import <sys/vnode.h>
 #import <sys/xattr.h>
@@ -39,33 +41,428 @@
 
 #define HAVE_EXCHANE 0
 
+static NSDate* LoopbackDateFromTimespec(struct timespec ts) {
+  return [NSDate dateWithTimeIntervalSince1970:ts.tv_sec + ts.tv_nsec / 1e9];
+}
+
+// Builds the attributes that GMUserFileSystem uses straight from a stat
+// structure. The keys are constants and small numbers are tagged pointers, so
+// this allocates little more than the dictionary and the dates.
+static NSDictionary* LoopbackAttributesFromStat(const struct stat* st) {
+  id keys[13];
+  id values[13];
+  NSUInteger count = 0;
+
+  NSString* type;
+  switch ( st->st_mode & S_IFMT ) {
+    case S_IFDIR:  type = NSFileTypeDirectory; break;
+    case S_IFREG:  type = NSFileTypeRegular; break;
+    case S_IFLNK:  type = NSFileTypeSymbolicLink; break;
+    case S_IFCHR:  type = NSFileTypeCharacterSpecial; break;
+    case S_IFBLK:  type = NSFileTypeBlockSpecial; break;
+    case S_IFSOCK: type = NSFileTypeSocket; break;
+    default:       type = NSFileTypeUnknown; break;
+  }
+
+  keys[count] = NSFileType;
+  values[count++] = type;
+  keys[count] = NSFilePosixPermissions;
+  values[count++] = [NSNumber numberWithUnsignedShort:(st->st_mode & ALLPERMS)];
+  keys[count] = NSFileReferenceCount;
+  values[count++] = [NSNumber numberWithUnsignedShort:st->st_nlink];
+  keys[count] = NSFileOwnerAccountID;
+  values[count++] = [NSNumber numberWithUnsignedInt:st->st_uid];
+  keys[count] = NSFileGroupOwnerAccountID;
+  values[count++] = [NSNumber numberWithUnsignedInt:st->st_gid];
+  keys[count] = NSFileSize;
+  values[count++] = [NSNumber numberWithLongLong:st->st_size];
+  keys[count] = NSFileSystemFileNumber;
+  values[count++] = [NSNumber numberWithUnsignedLongLong:st->st_ino];
+  keys[count] = NSFileModificationDate;
+  values[count++] = LoopbackDateFromTimespec(st->st_mtimespec);
+  keys[count] = NSFileCreationDate;
+  values[count++] = LoopbackDateFromTimespec(st->st_birthtimespec);
+  keys[count] = kGMUserFileSystemFileChangeDateKey;
+  values[count++] = LoopbackDateFromTimespec(st->st_ctimespec);
+  keys[count] = kGMUserFileSystemFileAccessDateKey;
+  values[count++] = LoopbackDateFromTimespec(st->st_atimespec);
+  keys[count] = kGMUserFileSystemFileFlagsKey;
+  values[count++] = [NSNumber numberWithUnsignedInt:st->st_flags];
+  if ( S_ISCHR(st->st_mode) || S_ISBLK(st->st_mode) ) {
+    keys[count] = NSFileDeviceIdentifier;
+    values[count++] = [NSNumber numberWithInt:st->st_rdev];
+  } else {
+    keys[count] = kGMUserFileSystemFileSizeInBlocksKey;
+    values[count++] = [NSNumber numberWithLongLong:st->st_blocks];
+  }
+
+  return [NSDictionary dictionaryWithObjects:values forKeys:keys count:count];
+}
+
+#pragma mark Paths and File Handles
+
+// Copies path into buffer, relative to the root, for the *at() system calls.
+// Nothing is allocated. Returns NULL and sets errno if path does not fit.
+static const char* LoopbackRelativePath(NSString* path, char buffer[PATH_MAX]) {
+  if ( ![path getFileSystemRepresentation:buffer maxLength:PATH_MAX] ) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  const char* p = buffer;
+  while ( *p == '/' ) {
+    ++p;
+  }
+  return *p == '\0' ? "." : p;
+}
+
+// An open file. GMUserFileSystem passes it back as the userData of every call
+// on the file, so reads and writes need neither a path nor a boxed descriptor.
+// The access statistics and the dirty flag are kept for read-ahead and
+// write-back; nothing acts on them yet.
+@interface LoopbackFileHandle : NSObject {
+ @public
+  int fd_;
+  off_t nextOffset_;           // Where a sequential read continues
+  uint64_t sequentialReads_;
+  uint64_t randomReads_;
+  BOOL dirty_;                 // Written since it was opened
+}
+- (id)initWithFileDescriptor:(int)fd;
+@end
+
+@implementation LoopbackFileHandle
+
+- (id)initWithFileDescriptor:(int)fd {
+  if ((self = [super init])) {
+    fd_ = fd;
+  }
+  return self;
+}
+
+- (void) dealloc {
+  if ( fd_ >= 0 ) {
+    close(fd_);
+  }
+  [super dealloc];
+}
+
+@end
+
+#pragma mark Bulk Directory Listing
+
+// Attributes fetched with getattrlistbulk(), enough to fill a stat structure.
+#define LOOPBACK_BULK_COMMON_ATTRS (ATTR_CMN_RETURNED_ATTRS | ATTR_CMN_NAME | \
+                                    ATTR_CMN_OBJTYPE | ATTR_CMN_CRTIME | \
+                                    ATTR_CMN_MODTIME | ATTR_CMN_CHGTIME | \
+                                    ATTR_CMN_ACCTIME | ATTR_CMN_OWNERID | \
+                                    ATTR_CMN_GRPID | ATTR_CMN_ACCESSMASK | \
+                                    ATTR_CMN_FLAGS | ATTR_CMN_FILEID | \
+                                    ATTR_CMN_ERROR)
+#define LOOPBACK_BULK_DIR_ATTRS    (ATTR_DIR_LINKCOUNT | ATTR_DIR_ALLOCSIZE | \
+                                    ATTR_DIR_DATALENGTH)
+#define LOOPBACK_BULK_FILE_ATTRS   (ATTR_FILE_LINKCOUNT | ATTR_FILE_DEVTYPE | \
+                                    ATTR_FILE_DATALENGTH | \
+                                    ATTR_FILE_DATAALLOCSIZE)
+
+#define LOOPBACK_BULK_BUFFER_SIZE (128 * 1024)
+
+// Attributes of a listing stay valid for this long, unless something changes.
+#define LOOPBACK_LISTING_LIFETIME 1.0
+#define LOOPBACK_MAX_LISTINGS 16
+
+#define LOOPBACK_BULK_GET(p, value) \
+  do { memcpy(&(value), (p), sizeof(value)); (p) += sizeof(value); } while (0)
+
+// Decodes one getattrlistbulk() entry. Returns NO if attributes are missing.
+static BOOL LoopbackParseBulkEntry(const char* entry, const char** name,
+                                   struct stat* st) {
+  const char* p = entry + sizeof(uint32_t);
+  attribute_set_t returned;
+  attrreference_t nameRef;
+  fsobj_type_t type = VNON;
+  uint32_t error = 0;
+  uint32_t u32;
+  off_t allocSize = 0;
+
+  memset(st, 0, sizeof(*st));
+
+  LOOPBACK_BULK_GET(p, returned);
+  if ( returned.commonattr & ATTR_CMN_ERROR ) {
+    LOOPBACK_BULK_GET(p, error);
+  }
+  LOOPBACK_BULK_GET(p, nameRef);
+  *name = p - sizeof(nameRef) + nameRef.attr_dataoffset;
+  if ( error != 0 ||
+       (returned.commonattr & LOOPBACK_BULK_COMMON_ATTRS & ~ATTR_CMN_ERROR) !=
+       (LOOPBACK_BULK_COMMON_ATTRS & ~ATTR_CMN_ERROR) ) {
+    return NO;
+  }
+
+  LOOPBACK_BULK_GET(p, type);
+  LOOPBACK_BULK_GET(p, st->st_birthtimespec);
+  LOOPBACK_BULK_GET(p, st->st_mtimespec);
+  LOOPBACK_BULK_GET(p, st->st_ctimespec);
+  LOOPBACK_BULK_GET(p, st->st_atimespec);
+  LOOPBACK_BULK_GET(p, st->st_uid);
+  LOOPBACK_BULK_GET(p, st->st_gid);
+  LOOPBACK_BULK_GET(p, u32);
+  st->st_mode = u32 & ~S_IFMT;
+  LOOPBACK_BULK_GET(p, st->st_flags);
+  LOOPBACK_BULK_GET(p, st->st_ino);
+
+  switch ( type ) {
+    case VREG:  st->st_mode |= S_IFREG; break;
+    case VDIR:  st->st_mode |= S_IFDIR; break;
+    case VBLK:  st->st_mode |= S_IFBLK; break;
+    case VCHR:  st->st_mode |= S_IFCHR; break;
+    case VLNK:  st->st_mode |= S_IFLNK; break;
+    case VSOCK: st->st_mode |= S_IFSOCK; break;
+    case VFIFO: st->st_mode |= S_IFIFO; break;
+    default:    return NO;
+  }
+
+  if ( type == VDIR ) {
+    if ( returned.dirattr != LOOPBACK_BULK_DIR_ATTRS ) {
+      return NO;
+    }
+    LOOPBACK_BULK_GET(p, u32);
+    st->st_nlink = u32;
+    LOOPBACK_BULK_GET(p, allocSize);
+    LOOPBACK_BULK_GET(p, st->st_size);
+  } else {
+    if ( returned.fileattr != LOOPBACK_BULK_FILE_ATTRS ) {
+      return NO;
+    }
+    LOOPBACK_BULK_GET(p, u32);
+    st->st_nlink = u32;
+    LOOPBACK_BULK_GET(p, u32);
+    st->st_rdev = u32;
+    LOOPBACK_BULK_GET(p, st->st_size);
+    LOOPBACK_BULK_GET(p, allocSize);
+  }
+  st->st_blocks = allocSize / 512;
+  return YES;
+}
+
+// The attributes of the entries of a directory, as of its last listing.
+@interface LoopbackListing : NSObject {
+ @public
+  NSDictionary* attributes_;   // Entry name -> attributes
+  CFAbsoluteTime expires_;
+  uint64_t generation_;
+}
+@end
+
+@implementation LoopbackListing
+
+- (void) dealloc {
+  [attributes_ release];
+  [super dealloc];
+}
+
+@end
+
+#pragma mark Extended Attribute Buffers
+
+// Every thread keeps a buffer for the xattr calls. A call is tried with it
+// first, so the usual case needs neither a size probe nor an allocation.
+#define LOOPBACK_SCRATCH_SIZE 4096
+
+// Buffers grown beyond this for an unusually large value are given back.
+#define LOOPBACK_SCRATCH_MAX_SIZE (64 * 1024)
+
+typedef struct {
+  char* bytes;
+  size_t capacity;
+} LoopbackScratch;
+
+static pthread_key_t scratchKey;
+static pthread_once_t scratchOnce = PTHREAD_ONCE_INIT;
+
+static void LoopbackScratchFree(void* value) {
+  LoopbackScratch* scratch = (LoopbackScratch *)value;
+  free(scratch->bytes);
+  free(scratch);
+}
+
+static void LoopbackScratchInit(void) {
+  pthread_key_create(&scratchKey, LoopbackScratchFree);
+}
+
+// Returns the buffer of this thread, at least size bytes long, or NULL.
+static LoopbackScratch* LoopbackScratchGet(size_t size) {
+  pthread_once(&scratchOnce, LoopbackScratchInit);
+  LoopbackScratch* scratch = pthread_getspecific(scratchKey);
+  if ( scratch == NULL ) {
+    scratch = calloc(1, sizeof(*scratch));
+    if ( scratch == NULL ) {
+      return NULL;
+    }
+    pthread_setspecific(scratchKey, scratch);
+  }
+  if ( size < LOOPBACK_SCRATCH_SIZE ) {
+    size = LOOPBACK_SCRATCH_SIZE;
+  }
+  if ( scratch->capacity < size ) {
+    free(scratch->bytes);
+    scratch->bytes = malloc(size);
+    scratch->capacity = scratch->bytes ? size : 0;
+    if ( scratch->bytes == NULL ) {
+      return NULL;
+    }
+  }
+  return scratch;
+}
+
+static void LoopbackScratchTrim(LoopbackScratch* scratch) {
+  if ( scratch != NULL && scratch->capacity > LOOPBACK_SCRATCH_MAX_SIZE ) {
+    free(scratch->bytes);
+    scratch->bytes = NULL;
+    scratch->capacity = 0;
+  }
+}
+
+// The extended attributes of an item, kept when cachesXattrs_ is set. values_
+// fills in as they are read.
+@interface LoopbackXattrs : NSObject {
+ @public
+  NSArray* names_;
+  NSMutableDictionary* values_;   // Name -> NSData
+  CFAbsoluteTime expires_;
+  uint64_t generation_;
+}
+@end
+
+@implementation LoopbackXattrs
+
+- (void) dealloc {
+  [names_ release];
+  [values_ release];
+  [super dealloc];
+}
+
+@end
+
+// Extended attributes stay cached for this long, unless something changes.
+#define LOOPBACK_XATTRS_LIFETIME 1.0
+#define LOOPBACK_MAX_XATTRS 64
+
+// Values larger than this are not cached.
+#define LOOPBACK_MAX_CACHED_XATTR_SIZE 4096
+
 @implementation LoopbackFS
 
 - (id)initWithRootPath:(NSString *)rootPath {
   if ((self = [super init])) {
     rootPath_ = [rootPath retain];
+    rootFd_ = open([rootPath fileSystemRepresentation],
+                   O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    listings_ = [[NSMutableDictionary alloc] init];
   }
   return self;
 }
 
 - (void) dealloc {
+  if ( rootFd_ >= 0 ) {
+    close(rootFd_);
+  }
   [rootPath_ release];
+  [listings_ release];
+  [xattrs_ release];
   [super dealloc];
 }
 
+// Returns the attributes of path from a recent listing of its directory.
+- (NSDictionary *)listedAttributesOfItemAtPath:(NSString *)path {
+  if ( [listings_ count] == 0 ) {
+    return nil;
+  }
+  NSString* parent = [path stringByDeletingLastPathComponent];
+  LoopbackListing* listing = [listings_ objectForKey:parent];
+  if ( listing == nil ) {
+    return nil;
+  }
+  if ( listing->generation_ != generation_ ||
+       listing->expires_ < CFAbsoluteTimeGetCurrent() ) {
+    [listings_ removeObjectForKey:parent];
+    return nil;
+  }
+  NSDictionary* attributes =
+    [listing->attributes_ objectForKey:[path lastPathComponent]];
+  return [[attributes retain] autorelease];
+}
+
+- (void)setCachesExtendedAttributes:(BOOL)caches {
+  cachesXattrs_ = caches;
+  if ( caches && xattrs_ == nil ) {
+    xattrs_ = [[NSMutableDictionary alloc] init];
+  }
+}
+
+// Returns the cached extended attributes of path, if they are still valid.
+- (LoopbackXattrs *)cachedXattrsOfItemAtPath:(NSString *)path {
+  if ( !cachesXattrs_ ) {
+    return nil;
+  }
+  LoopbackXattrs* xattrs = [xattrs_ objectForKey:path];
+  if ( xattrs == nil ) {
+    return nil;
+  }
+  if ( xattrs->generation_ != generation_ ||
+       xattrs->expires_ < CFAbsoluteTimeGetCurrent() ) {
+    [xattrs_ removeObjectForKey:path];
+    return nil;
+  }
+  return xattrs;
+}
+
+- (void)rememberXattrNames:(NSArray *)names ofItemAtPath:(NSString *)path {
+  if ( !cachesXattrs_ ) {
+    return;
+  }
+  if ( [xattrs_ count] >= LOOPBACK_MAX_XATTRS ) {
+    [xattrs_ removeAllObjects];
+  }
+  LoopbackXattrs* xattrs = [[LoopbackXattrs alloc] init];
+  xattrs->names_ = [names copy];
+  xattrs->values_ = [[NSMutableDictionary alloc] init];
+  xattrs->expires_ = CFAbsoluteTimeGetCurrent() + LOOPBACK_XATTRS_LIFETIME;
+  xattrs->generation_ = generation_;
+  [xattrs_ setObject:xattrs forKey:path];
+  [xattrs release];
+}
+
+- (void)rememberListing:(NSDictionary *)attributes
+     ofDirectoryAtPath:(NSString *)path {
+  if ( [listings_ count] >= LOOPBACK_MAX_LISTINGS ) {
+    [listings_ removeAllObjects];
+  }
+  LoopbackListing* listing = [[LoopbackListing alloc] init];
+  listing->attributes_ = [attributes retain];
+  listing->expires_ = CFAbsoluteTimeGetCurrent() + LOOPBACK_LISTING_LIFETIME;
+  listing->generation_ = generation_;
+  [listings_ setObject:listing forKey:path];
+  [listing release];
+}
+
 #pragma mark Moving an Item
 
 - (BOOL)moveItemAtPath:(NSString *)source
                 toPath:(NSString *)destination
                options:(GMUserFileSystemMoveOption)options
                  error:(NSError **)error {
+  ++generation_;
   // We use rename directly here since NSFileManager can sometimes fail to
   // rename and return non-posix error codes.
-  NSString* p_src = [rootPath_ stringByAppendingString:source];
-  NSString* p_dst = [rootPath_ stringByAppendingString:destination];
-  int ret = 0;
-  if (options == 0) {
-    ret = rename([p_src UTF8String], [p_dst UTF8String]);
+  char srcBuffer[PATH_MAX];
+  char dstBuffer[PATH_MAX];
+  const char* p_src = LoopbackRelativePath(source, srcBuffer);
+  const char* p_dst = LoopbackRelativePath(destination, dstBuffer);
+  int ret = -1;
+  if ( p_src == NULL || p_dst == NULL ) {
+    // errno is set
+  } else if (options == 0) {
+    ret = renameat(rootFd_, p_src, rootFd_, p_dst);
   } else {
     unsigned int flags = 0;
     if (options & GMUserFileSystemMoveOptionSwap) {
@@ -74,7 +471,7 @@
     if (options & GMUserFileSystemMoveOptionExclusive) {
       flags |= RENAME_EXCL;
     }
-    ret = renamex_np([p_src UTF8String], [p_dst UTF8String], flags);
+    ret = renameatx_np(rootFd_, p_src, rootFd_, p_dst, flags);
   }
   if ( ret < 0 ) {
     if ( error ) {
@@ -88,10 +485,12 @@
 #pragma mark Removing an Item
 
 - (BOOL)removeDirectoryAtPath:(NSString *)path error:(NSError **)error {
+  ++generation_;
   // We need to special-case directories here and use the bsd API since
   // NSFileManager will happily do a recursive remove :-(
-  NSString* p = [rootPath_ stringByAppendingString:path];
-  int ret = rmdir([p UTF8String]);
+  char buffer[PATH_MAX];
+  const char* p = LoopbackRelativePath(path, buffer);
+  int ret = p ? unlinkat(rootFd_, p, AT_REMOVEDIR) : -1;
   if (ret < 0) {
     if ( error ) {
       *error = [NSError errorWithPOSIXCode:errno];
@@ -102,6 +501,7 @@
 }
 
 - (BOOL)removeItemAtPath:(NSString *)path error:(NSError **)error {
+  ++generation_;
   // NOTE: If removeDirectoryAtPath is commented out, then this may be called
   // with a directory, in which case NSFileManager will recursively remove all
   // subdirectories. So be careful!
@@ -114,6 +514,7 @@
 - (BOOL)createDirectoryAtPath:(NSString *)path
                    attributes:(NSDictionary *)attributes
                         error:(NSError **)error {
+  ++generation_;
   NSString* p = [rootPath_ stringByAppendingString:path];
   return [[NSFileManager defaultManager] createDirectoryAtPath:p
                                    withIntermediateDirectories:NO
@@ -126,16 +527,19 @@
                    flags:(int)flags
                 userData:(id *)userData
                    error:(NSError **)error {
-  NSString* p = [rootPath_ stringByAppendingString:path];
+  ++generation_;
+  char buffer[PATH_MAX];
+  const char* p = LoopbackRelativePath(path, buffer);
   mode_t mode = [[attributes objectForKey:NSFilePosixPermissions] longValue];
-  int fd = open([p UTF8String], flags, mode);
+  int fd = p ? openat(rootFd_, p, flags, mode) : -1;
   if ( fd < 0 ) {
     if ( error ) {
       *error = [NSError errorWithPOSIXCode:errno];
     }
     return NO;
   }
-  *userData = [NSNumber numberWithLong:fd];
+  *userData = [[[LoopbackFileHandle alloc] initWithFileDescriptor:fd]
+               autorelease];
   return YES;
 }
 
@@ -144,12 +548,18 @@
 - (BOOL)linkItemAtPath:(NSString *)path
                 toPath:(NSString *)otherPath
                  error:(NSError **)error {
-  NSString* p_path = [rootPath_ stringByAppendingString:path];
-  NSString* p_otherPath = [rootPath_ stringByAppendingString:otherPath];
+  ++generation_;
+  char pathBuffer[PATH_MAX];
+  char otherPathBuffer[PATH_MAX];
+  const char* p_path = LoopbackRelativePath(path, pathBuffer);
+  const char* p_otherPath = LoopbackRelativePath(otherPath, otherPathBuffer);
 
   // We use link rather than the NSFileManager equivalent because it will copy
   // the file rather than hard link if part of the root path is a symlink.
-  int rc = link([p_path UTF8String], [p_otherPath UTF8String]);
+  int rc = -1;
+  if ( p_path != NULL && p_otherPath != NULL ) {
+    rc = linkat(rootFd_, p_path, rootFd_, p_otherPath, 0);
+  }
   if ( rc <  0 ) {
     if ( error ) {
       *error = [NSError errorWithPOSIXCode:errno];
@@ -164,6 +574,7 @@
 - (BOOL)createSymbolicLinkAtPath:(NSString *)path
              withDestinationPath:(NSString *)otherPath
                            error:(NSError **)error {
+  ++generation_;
   NSString* p_src = [rootPath_ stringByAppendingString:path];
   return [[NSFileManager defaultManager] createSymbolicLinkAtPath:p_src
                                               withDestinationPath:otherPath
@@ -172,9 +583,21 @@
 
 - (NSString *)destinationOfSymbolicLinkAtPath:(NSString *)path
                                         error:(NSError **)error {
-  NSString* p = [rootPath_ stringByAppendingString:path];
-  return [[NSFileManager defaultManager] destinationOfSymbolicLinkAtPath:p
-                                                                   error:error];
+  char buffer[PATH_MAX];
+  char destination[PATH_MAX];
+  const char* p = LoopbackRelativePath(path, buffer);
+  ssize_t length = -1;
+  if ( p != NULL ) {
+    length = readlinkat(rootFd_, p, destination, sizeof(destination));
+  }
+  if ( length < 0 ) {
+    if ( error ) {
+      *error = [NSError errorWithPOSIXCode:errno];
+    }
+    return nil;
+  }
+  return [[NSFileManager defaultManager]
+          stringWithFileSystemRepresentation:destination length:length];
 }
 
 #pragma mark File Contents
@@ -183,22 +606,27 @@
                   mode:(int)mode
               userData:(id *)userData
                  error:(NSError **)error {
-  NSString* p = [rootPath_ stringByAppendingString:path];
-  int fd = open([p UTF8String], mode);
+  if ( mode & O_TRUNC ) {
+    ++generation_;
+  }
+  char buffer[PATH_MAX];
+  const char* p = LoopbackRelativePath(path, buffer);
+  int fd = p ? openat(rootFd_, p, mode) : -1;
   if ( fd < 0 ) {
     if ( error ) {
       *error = [NSError errorWithPOSIXCode:errno];
     }
     return NO;
   }
-  *userData = [NSNumber numberWithLong:fd];
+  *userData = [[[LoopbackFileHandle alloc] initWithFileDescriptor:fd]
+               autorelease];
   return YES;
 }
 
 - (void)releaseFileAtPath:(NSString *)path userData:(id)userData {
-  NSNumber* num = (NSNumber *)userData;
-  int fd = [num intValue];
-  close(fd);
+  LoopbackFileHandle* handle = (LoopbackFileHandle *)userData;
+  close(handle->fd_);
+  handle->fd_ = -1;
 }
 
 - (int)readFileAtPath:(NSString *)path
@@ -207,15 +635,20 @@
                  size:(size_t)size
                offset:(off_t)offset
                 error:(NSError **)error {
-  NSNumber* num = (NSNumber *)userData;
-  int fd = [num intValue];
-  size_t ret = pread(fd, buffer, size, offset);
+  LoopbackFileHandle* handle = (LoopbackFileHandle *)userData;
+  ssize_t ret = pread(handle->fd_, buffer, size, offset);
   if ( ret < 0 ) {
     if ( error ) {
       *error = [NSError errorWithPOSIXCode:errno];
     }
     return -1;
   }
+  if ( offset == handle->nextOffset_ ) {
+    ++handle->sequentialReads_;
+  } else {
+    ++handle->randomReads_;
+  }
+  handle->nextOffset_ = offset + ret;
   return (int)ret;
 }
 
@@ -225,15 +658,16 @@
                   size:(size_t)size
                 offset:(off_t)offset
                  error:(NSError **)error {
-  NSNumber* num = (NSNumber *)userData;
-  int fd = [num intValue];
-  size_t ret = pwrite(fd, buffer, size, offset);
+  ++generation_;
+  LoopbackFileHandle* handle = (LoopbackFileHandle *)userData;
+  ssize_t ret = pwrite(handle->fd_, buffer, size, offset);
   if ( ret < 0 ) {
     if ( error ) {
       *error = [NSError errorWithPOSIXCode:errno];
     }
     return -1;
   }
+  handle->dirty_ = YES;
   return (int)ret;
 }
 
@@ -243,8 +677,8 @@
                        offset:(off_t)offset
                        length:(off_t)length
                         error:(NSError **)error {
-  NSNumber* num = (NSNumber *)userData;
-  int fd = [num intValue];
+  ++generation_;
+  LoopbackFileHandle* handle = (LoopbackFileHandle *)userData;
 
   fstore_t fstore;
 
@@ -265,7 +699,7 @@
   fstore.fst_offset = offset;
   fstore.fst_length = length;
 
-  if ( fcntl(fd, F_PREALLOCATE, &fstore) == -1 ) {
+  if ( fcntl(handle->fd_, F_PREALLOCATE, &fstore) == -1 ) {
     *error = [NSError errorWithPOSIXCode:errno];
     return NO;
   }
@@ -277,6 +711,7 @@
 - (BOOL)exchangeDataOfItemAtPath:(NSString *)path1
                   withItemAtPath:(NSString *)path2
                            error:(NSError **)error {
+  ++generation_;
   NSString* p1 = [rootPath_ stringByAppendingString:path1];
   NSString* p2 = [rootPath_ stringByAppendingString:path2];
   int ret = exchangedata([p1 UTF8String], [p2 UTF8String], 0);
@@ -298,15 +733,100 @@
   return [[NSFileManager defaultManager] contentsOfDirectoryAtPath:p error:error];
 }
 
+- (NSArray *)contentsOfDirectoryAtPath:(NSString *)path
+            includingAttributesForKeys:(NSArray *)keys
+                                 error:(NSError **)error {
+  // One getattrlistbulk() pass returns the names and attributes together. The
+  // attributes are kept for the lookups that follow a listing.
+  char pathBuffer[PATH_MAX];
+  const char* p = LoopbackRelativePath(path, pathBuffer);
+  int fd = p ? openat(rootFd_, p, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+  if ( fd < 0 ) {
+    if ( error ) {
+      *error = [NSError errorWithPOSIXCode:errno];
+    }
+    return nil;
+  }
+
+  struct attrlist attrList;
+  memset(&attrList, 0, sizeof(attrList));
+  attrList.bitmapcount = ATTR_BIT_MAP_COUNT;
+  attrList.commonattr = LOOPBACK_BULK_COMMON_ATTRS;
+  attrList.dirattr = LOOPBACK_BULK_DIR_ATTRS;
+  attrList.fileattr = LOOPBACK_BULK_FILE_ATTRS;
+
+  char* buffer = malloc(LOOPBACK_BULK_BUFFER_SIZE);
+  NSMutableArray* contents = [NSMutableArray array];
+  NSMutableDictionary* attributesByName = [NSMutableDictionary dictionary];
+  int count = 0;
+  while ( buffer != NULL &&
+          (count = getattrlistbulk(fd, &attrList, buffer,
+                                   LOOPBACK_BULK_BUFFER_SIZE, 0)) > 0 ) {
+    const char* entry = buffer;
+    for ( int i = 0; i < count; ++i ) {
+      uint32_t length;
+      memcpy(&length, entry, sizeof(length));
+
+      const char* name;
+      struct stat st;
+      BOOL complete = LoopbackParseBulkEntry(entry, &name, &st);
+      entry += length;
+      if ( !complete && fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0 ) {
+        continue;
+      }
+
+      NSString* n = [NSString stringWithUTF8String:name];
+      if ( n == nil ) {
+        continue;
+      }
+      NSDictionary* attributes = LoopbackAttributesFromStat(&st);
+      [contents addObject:[GMDirectoryEntry directoryEntryWithName:n
+                                                        attributes:attributes]];
+      [attributesByName setObject:attributes forKey:n];
+    }
+  }
+  int ret = buffer == NULL ? ENOMEM : (count < 0 ? errno : 0);
+  free(buffer);
+  close(fd);
+  if ( ret != 0 ) {
+    if ( error ) {
+      *error = [NSError errorWithPOSIXCode:ret];
+    }
+    return nil;
+  }
+
+  [self rememberListing:attributesByName ofDirectoryAtPath:path];
+  return contents;
+}
+
 #pragma mark Getting and Setting Attributes
 
 - (NSDictionary *)attributesOfItemAtPath:(NSString *)path
                                 userData:(id)userData
                                    error:(NSError **)error {
-  NSString* p = [rootPath_ stringByAppendingString:path];
-  NSDictionary* attribs =
-    [[NSFileManager defaultManager] attributesOfItemAtPath:p error:error];
-  return attribs;
+  // A single lstat(), or fstat() on an open file. NSFileManager makes several
+  // system calls and boxes every attribute it knows, most of them unused.
+  struct stat st;
+  int ret;
+  if ( userData != nil ) {
+    LoopbackFileHandle* handle = (LoopbackFileHandle *)userData;
+    ret = fstat(handle->fd_, &st);
+  } else {
+    NSDictionary* listed = [self listedAttributesOfItemAtPath:path];
+    if ( listed != nil ) {
+      return listed;
+    }
+    char buffer[PATH_MAX];
+    const char* p = LoopbackRelativePath(path, buffer);
+    ret = p ? fstatat(rootFd_, p, &st, AT_SYMLINK_NOFOLLOW) : -1;
+  }
+  if ( ret < 0 ) {
+    if ( error ) {
+      *error = [NSError errorWithPOSIXCode:errno];
+    }
+    return nil;
+  }
+  return LoopbackAttributesFromStat(&st);
 }
 
 - (NSDictionary *)attributesOfFileSystemForPath:(NSString *)path
@@ -350,13 +870,16 @@
          ofItemAtPath:(NSString *)path
              userData:(id)userData
                 error:(NSError **)error {
+  ++generation_;
   NSString* p = [rootPath_ stringByAppendingString:path];
 
   // TODO: Handle other keys not handled by NSFileManager setAttributes call.
 
   NSNumber* offset = [attributes objectForKey:NSFileSize];
   if ( offset ) {
-    int ret = truncate([p UTF8String], [offset longLongValue]);
+    LoopbackFileHandle* handle = (LoopbackFileHandle *)userData;
+    int ret = handle ? ftruncate(handle->fd_, [offset longLongValue])
+                     : truncate([p UTF8String], [offset longLongValue]);
     if ( ret < 0 ) {
       if ( error ) {
         *error = [NSError errorWithPOSIXCode:errno];
@@ -388,30 +911,58 @@
 #pragma mark Extended Attributes
 
 - (NSArray *)extendedAttributesOfItemAtPath:(NSString *)path error:(NSError **)error {
+  LoopbackXattrs* cached = [self cachedXattrsOfItemAtPath:path];
+  if ( cached != nil ) {
+    return [[cached->names_ retain] autorelease];
+  }
+
   NSString* p = [rootPath_ stringByAppendingString:path];
+  const char* cpath = [p fileSystemRepresentation];
 
-  ssize_t size = listxattr([p UTF8String], nil, 0, XATTR_NOFOLLOW);
-  if ( size < 0 ) {
-    if ( error ) {
-      *error = [NSError errorWithPOSIXCode:errno];
+  // Fetch with the buffer at hand and probe for the size only if it is short.
+  LoopbackScratch* scratch = LoopbackScratchGet(0);
+  ssize_t size = -1;
+  errno = ENOMEM;
+  while ( scratch != NULL ) {
+    size = listxattr(cpath, scratch->bytes, scratch->capacity, XATTR_NOFOLLOW);
+    if ( size >= 0 || errno != ERANGE ) {
+      break;
     }
-    return nil;
+    ssize_t needed = listxattr(cpath, NULL, 0, XATTR_NOFOLLOW);
+    if ( needed < 0 ) {
+      break;
+    }
+    scratch = LoopbackScratchGet(needed);
+    size = -1;
+    errno = ENOMEM;
   }
-  NSMutableData* data = [NSMutableData dataWithLength:size];
-  size = listxattr([p UTF8String], [data mutableBytes], [data length], XATTR_NOFOLLOW);
   if ( size < 0 ) {
     if ( error ) {
       *error = [NSError errorWithPOSIXCode:errno];
     }
+    LoopbackScratchTrim(scratch);
     return nil;
   }
+
+  // The names are NUL-terminated UTF-8, so step over them by their length in
+  // bytes.
   NSMutableArray* contents = [NSMutableArray array];
-  char* ptr = (char *)[data bytes];
-  while ( ptr < ((char *)[data bytes] + size) ) {
-    NSString* s = [NSString stringWithUTF8String:ptr];
-    [contents addObject:s];
-    ptr += ([s length] + 1);
+  const char* ptr = scratch->bytes;
+  const char* end = scratch->bytes + size;
+  while ( ptr < end ) {
+    size_t length = strnlen(ptr, end - ptr);
+    NSString* s = [[NSString alloc] initWithBytes:ptr
+                                           length:length
+                                         encoding:NSUTF8StringEncoding];
+    if ( s != nil ) {
+      [contents addObject:s];
+      [s release];
+    }
+    ptr += length + 1;
   }
+  LoopbackScratchTrim(scratch);
+
+  [self rememberXattrNames:contents ofItemAtPath:path];
   return contents;
 }
 
@@ -419,25 +970,80 @@
                         ofItemAtPath:(NSString *)path
                             position:(off_t)position
                                error:(NSError **)error {
+  // A resource fork is read in pieces, at a position. Values of other
+  // attributes are read whole, with the buffer at hand, and may be cached.
+  BOOL whole = position == 0 &&
+               ![name isEqualToString:@XATTR_RESOURCEFORK_NAME];
+  LoopbackXattrs* cached = whole ? [self cachedXattrsOfItemAtPath:path] : nil;
+  if ( cached != nil ) {
+    NSData* value = [cached->values_ objectForKey:name];
+    if ( value != nil ) {
+      return [[value retain] autorelease];
+    }
+    if ( ![cached->names_ containsObject:name] ) {
+      if ( error ) {
+        *error = [NSError errorWithPOSIXCode:ENOATTR];
+      }
+      return nil;
+    }
+  }
+
   NSString* p = [rootPath_ stringByAppendingString:path];
+  const char* cpath = [p fileSystemRepresentation];
+  const char* cname = [name UTF8String];
 
-  ssize_t size = getxattr([p UTF8String], [name UTF8String], nil, 0,
-                          (uint32_t)position, XATTR_NOFOLLOW);
-  if ( size < 0 ) {
-    if ( error ) {
-      *error = [NSError errorWithPOSIXCode:errno];
+  if ( !whole ) {
+    ssize_t size = getxattr(cpath, cname, nil, 0, (uint32_t)position,
+                            XATTR_NOFOLLOW);
+    if ( size < 0 ) {
+      if ( error ) {
+        *error = [NSError errorWithPOSIXCode:errno];
+      }
+      return nil;
     }
-    return nil;
+    NSMutableData* data = [NSMutableData dataWithLength:size];
+    size = getxattr(cpath, cname, [data mutableBytes], [data length],
+                    (uint32_t)position, XATTR_NOFOLLOW);
+    if ( size < 0 ) {
+      if ( error ) {
+        *error = [NSError errorWithPOSIXCode:errno];
+      }
+      return nil;
+    }
+    [data setLength:size];
+    return data;
+  }
+
+  LoopbackScratch* scratch = LoopbackScratchGet(0);
+  ssize_t size = -1;
+  errno = ENOMEM;
+  while ( scratch != NULL ) {
+    size = getxattr(cpath, cname, scratch->bytes, scratch->capacity, 0,
+                    XATTR_NOFOLLOW);
+    if ( size >= 0 || errno != ERANGE ) {
+      break;
+    }
+    ssize_t needed = getxattr(cpath, cname, NULL, 0, 0, XATTR_NOFOLLOW);
+    if ( needed < 0 ) {
+      break;
+    }
+    scratch = LoopbackScratchGet(needed);
+    size = -1;
+    errno = ENOMEM;
   }
-  NSMutableData* data = [NSMutableData dataWithLength:size];
-  size = getxattr([p UTF8String], [name UTF8String], [data mutableBytes],
-                  [data length], (uint32_t)position, XATTR_NOFOLLOW);
   if ( size < 0 ) {
     if ( error ) {
       *error = [NSError errorWithPOSIXCode:errno];
     }
+    LoopbackScratchTrim(scratch);
     return nil;
   }
+  NSData* data = [NSData dataWithBytes:scratch->bytes length:size];
+  LoopbackScratchTrim(scratch);
+
+  if ( cached != nil && size <= LOOPBACK_MAX_CACHED_XATTR_SIZE ) {
+    [cached->values_ setObject:data forKey:name];
+  }
   return data;
 }
 
@@ -447,6 +1053,7 @@
                     position:(off_t)position
                        options:(int)options
                        error:(NSError **)error {
+  ++generation_;
   // Setting com.apple.FinderInfo happens in the kernel, so security related
   // bits are set in the options. We need to explicitly remove them or the call
   // to setxattr will fail.
@@ -468,6 +1075,7 @@
 - (BOOL)removeExtendedAttribute:(NSString *)name
                    ofItemAtPath:(NSString *)path
                           error:(NSError **)error {
+  ++generation_;
   NSString* p = [rootPath_ stringByAppendingString:path];
   int ret = removexattr([p UTF8String], [name UTF8String], XATTR_NOFOLLOW);
   if ( ret < 0 ) {
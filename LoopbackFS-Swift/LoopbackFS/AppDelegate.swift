@@ -18,27 +18,43 @@ class AppDelegate: NSObject, NSApplicationDelegate {
 
     private var notificationObservers: [NSObjectProtocol] = []
     private var rootPath: String!
+    private var mountPath = loopbackMountPath
     private lazy var loopFileSystem: LoopbackFS = {
-        return LoopbackFS(rootPath: self.rootPath)
+        // -cacheExtendedAttributes YES keeps the xattrs of recently seen items.
+        return LoopbackFS(rootPath: self.rootPath, cachesExtendedAttributes: UserDefaults.standard.bool(forKey: "cacheExtendedAttributes"))
     }()
 
     private var userFileSystem: GMUserFileSystem?
 
     func applicationDidFinishLaunching(_ aNotification: Notification) {        
-        let panel = NSOpenPanel()
-        panel.canChooseFiles = false
-        panel.canChooseDirectories = true
-        panel.allowsMultipleSelection = false
-        panel.directoryURL = URL(fileURLWithPath: "/tmp")
-        let returnValue = panel.runModal()
+        // The paths can be passed on the command line, e.g.
+        // open LoopbackFS.app --args -rootPath /tmp/dir -mountPath /tmp/mnt
+        let defaults = UserDefaults.standard
+        if let mountPath = defaults.string(forKey: "mountPath") {
+            self.mountPath = mountPath
+        }
 
-        guard returnValue.rawValue != NSFileHandlingPanelCancelButton, let rootPath = panel.urls.first?.path else { exit(0) }
+        let rootPath: String
+        if let path = defaults.string(forKey: "rootPath") {
+            rootPath = path
+        } else {
+            let panel = NSOpenPanel()
+            panel.canChooseFiles = false
+            panel.canChooseDirectories = true
+            panel.allowsMultipleSelection = false
+            panel.directoryURL = URL(fileURLWithPath: "/tmp")
+            let returnValue = panel.runModal()
+
+            guard returnValue.rawValue != NSFileHandlingPanelCancelButton, let path = panel.urls.first?.path else { exit(0) }
+            rootPath = path
+        }
 
         addNotifications()
 
         self.rootPath = rootPath
 
         var options: [String] = ["native_xattr", "volname=LoopbackFS"]
+        options += volumeOptions(forRootPath: rootPath)
 
         if let volumeIconPath = Bundle.main.path(forResource: "LoopbackFS", ofType: "icns") {
             options.insert("volicon=\(volumeIconPath)", at: 0)
@@ -50,15 +66,52 @@ class AppDelegate: NSObject, NSApplicationDelegate {
         // file system supports native extended attributes. Typically, the user
         // would be mounting an HFS+ directory through LoopbackFS, so we do want
         // this option in that case.
-        userFileSystem!.mount(atPath: loopbackMountPath, withOptions: options)
+        userFileSystem!.mount(atPath: mountPath, withOptions: options)
+    }
+
+    // The mount options that depend on the backing volume. The kernel extension
+    // transfers iosize bytes at a time, which is the preferred I/O size of the
+    // volume unless -iosize is given. Lookups of missing names on a network
+    // volume are remembered for a second. On a local volume, each of them is
+    // cheap.
+    func volumeOptions(forRootPath rootPath: String) -> [String] {
+        var sfs = statfs()
+        guard statfs((rootPath as NSString).fileSystemRepresentation, &sfs) == 0 else {
+            print("Cannot get volume statistics of \(rootPath): \(String(cString: strerror(errno)))")
+            return []
+        }
+
+        var iosize = UserDefaults.standard.integer(forKey: "iosize")
+        if iosize <= 0 {
+            iosize = 4096
+            while iosize < 16 * 1024 * 1024 && iosize * 2 <= Int(sfs.f_iosize) {
+                iosize *= 2
+            }
+        }
+        var options = ["iosize=\(iosize)"]
+
+        let local = sfs.f_flags & UInt32(MNT_LOCAL) != 0
+        if !local {
+            options.append("negative_timeout=1")
+        }
+
+        let type = withUnsafeBytes(of: sfs.f_fstypename) { String(cString: $0.bindMemory(to: CChar.self).baseAddress!) }
+        print("Backing volume: \(type), \(local ? "local" : "remote"), preferred I/O size \(sfs.f_iosize), adding \(options.joined(separator: ","))")
+        return options
     }
 
     func addNotifications() {
+        let mountPath = self.mountPath
+        let revealInFinder = UserDefaults.standard.string(forKey: "rootPath") == nil
+
         let mountObserver = NotificationCenter.default.addObserver(forName: NSNotification.Name(kGMUserFileSystemDidMount), object: nil, queue: nil) { notification in
             print("Got didMount notification.")
 
-            let parentPath = (loopbackMountPath as NSString).deletingLastPathComponent
-            NSWorkspace.shared.selectFile(loopbackMountPath, inFileViewerRootedAtPath: parentPath)
+            // Launched by a script, do not open a Finder window
+            guard revealInFinder else { return }
+
+            let parentPath = (mountPath as NSString).deletingLastPathComponent
+            NSWorkspace.shared.selectFile(mountPath, inFileViewerRootedAtPath: parentPath)
         }
 
         let failedObserver = NotificationCenter.default.addObserver(forName: NSNotification.Name(kGMUserFileSystemMountFailed), object: nil, queue: .main) { notification in
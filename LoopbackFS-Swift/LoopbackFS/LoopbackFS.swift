@@ -12,20 +12,104 @@ import Foundation
 final class LoopbackFS: NSObject {
 
     let rootPath: String
+
+    // rootPath, opened for the *at() system calls.
+    private let rootDescriptor: Int32
+
+    // Attributes from recent directory listings, by directory path. Every change
+    // bumps generation, which invalidates them. GMUserFileSystem serializes the
+    // calls of a delegate that is not thread safe, so there is no locking.
+    private var listings: [String: Listing] = [:]
+    private var generation: UInt64 = 0
+
+    // Extended attributes by path, when cachesExtendedAttributes is set. They
+    // are dropped with the listings.
+    private let cachesExtendedAttributes: Bool
+    private var extendedAttributes: [String: ExtendedAttributes] = [:]
     
-    init(rootPath: String) {
+    init(rootPath: String, cachesExtendedAttributes: Bool = false) {
         self.rootPath = rootPath
+        self.cachesExtendedAttributes = cachesExtendedAttributes
+        self.rootDescriptor = open((rootPath as NSString).fileSystemRepresentation, O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+    }
+
+    deinit {
+        if rootDescriptor >= 0 {
+            close(rootDescriptor)
+        }
+    }
+
+    // Calls body with path relative to the root, for the *at() system calls.
+    // Native strings are passed on without a copy.
+    private func withRelativePath<Result>(_ path: String, _ body: (UnsafePointer<CChar>) throws -> Result) rethrows -> Result {
+        return try path.withCString { pointer in
+            var relative = pointer
+            while relative.pointee == 0x2F {
+                relative += 1
+            }
+            if relative.pointee == 0 {
+                return try ".".withCString(body)
+            }
+            return try body(relative)
+        }
+    }
+
+    // Returns the attributes of path from a recent listing of its directory.
+    private func listedAttributesOfItem(atPath path: String) -> [AnyHashable : Any]? {
+        if listings.isEmpty {
+            return nil
+        }
+        let parent = (path as NSString).deletingLastPathComponent
+        guard let listing = listings[parent] else {
+            return nil
+        }
+        if listing.generation != generation || listing.expires < CFAbsoluteTimeGetCurrent() {
+            listings.removeValue(forKey: parent)
+            return nil
+        }
+        return listing.attributes[(path as NSString).lastPathComponent]
+    }
+
+    // Returns the cached extended attributes of path, if they are still valid.
+    private func cachedExtendedAttributes(ofItemAtPath path: String) -> ExtendedAttributes? {
+        guard cachesExtendedAttributes, let cached = extendedAttributes[path] else {
+            return nil
+        }
+        if cached.generation != generation || cached.expires < CFAbsoluteTimeGetCurrent() {
+            extendedAttributes.removeValue(forKey: path)
+            return nil
+        }
+        return cached
+    }
+
+    private func rememberExtendedAttributes(_ names: [String], ofItemAtPath path: String) {
+        guard cachesExtendedAttributes else {
+            return
+        }
+        if extendedAttributes.count >= ExtendedAttributes.maxCount {
+            extendedAttributes.removeAll()
+        }
+        extendedAttributes[path] = ExtendedAttributes(names: names, expires: CFAbsoluteTimeGetCurrent() + ExtendedAttributes.lifetime, generation: generation)
+    }
+
+    private func rememberListing(_ attributes: [String: [AnyHashable : Any]], ofDirectoryAtPath path: String) {
+        if listings.count >= Listing.maxCount {
+            listings.removeAll()
+        }
+        listings[path] = Listing(attributes: attributes, expires: CFAbsoluteTimeGetCurrent() + Listing.lifetime, generation: generation)
     }
 
     // MARK: - Moving an Item
 
     override func moveItem(atPath source: String!, toPath destination: String!, options: GMUserFileSystemMoveOption) throws {
-        let sourcePath = (rootPath.appending(source) as NSString).utf8String!
-        let destinationPath = (rootPath.appending(destination) as NSString).utf8String!
-
+        generation += 1
         var returnValue: Int32 = 0
         if options.rawValue == 0 {
-            returnValue = rename(sourcePath, destinationPath)
+            returnValue = withRelativePath(source) { sourcePath in
+                withRelativePath(destination) { destinationPath in
+                    renameat(rootDescriptor, sourcePath, rootDescriptor, destinationPath)
+                }
+            }
         } else {
             if #available(OSX 10.12, *) {
                 var flags: UInt32 = 0;
@@ -35,7 +119,11 @@ final class LoopbackFS: NSObject {
                 if options.rawValue & GMUserFileSystemMoveOption.exclusive.rawValue != 0 {
                   flags |= UInt32(RENAME_EXCL);
                 }
-                returnValue = renamex_np(sourcePath, destinationPath, flags)
+                returnValue = withRelativePath(source) { sourcePath in
+                    withRelativePath(destination) { destinationPath in
+                        renameatx_np(rootDescriptor, sourcePath, rootDescriptor, destinationPath, flags)
+                    }
+                }
             } else {
                 throw NSError(posixErrorCode: ENOTSUP);
             };
@@ -48,18 +136,18 @@ final class LoopbackFS: NSObject {
     // MARK: - Removing an Item
 
     override func removeDirectory(atPath path: String!) throws {
+        generation += 1
         // We need to special-case directories here and use the bsd API since
         // NSFileManager will happily do a recursive remove :-(
 
-        let originalPath = (rootPath.appending(path) as NSString).utf8String!
-
-        let returnValue = rmdir(originalPath)
+        let returnValue = withRelativePath(path) { unlinkat(rootDescriptor, $0, AT_REMOVEDIR) }
         if returnValue < 0 {
             throw NSError(posixErrorCode: errno)
         }
     }
 
     override func removeItem(atPath path: String!) throws {
+        generation += 1
         let originalPath = rootPath.appending(path)
 
         return try FileManager.default.removeItem(atPath: originalPath)
@@ -68,6 +156,7 @@ final class LoopbackFS: NSObject {
     // MARK: - Creating an Item
 
     override func createDirectory(atPath path: String!, attributes: [AnyHashable : Any]! = [:]) throws {
+        generation += 1
         guard let attributes = attributes as? [String: Any] else { throw NSError(posixErrorCode: EPERM) }
 
         let originalPath = rootPath.appending(path)
@@ -76,31 +165,32 @@ final class LoopbackFS: NSObject {
     }
 
     override func createFile(atPath path: String!, attributes: [AnyHashable : Any]! = [:], flags: Int32, userData: AutoreleasingUnsafeMutablePointer<AnyObject?>!) throws {
-
+        generation += 1
         guard let mode = attributes[FileAttributeKey.posixPermissions] as? mode_t else {
             throw NSError(posixErrorCode: EPERM)
         }
 
-        let originalPath = rootPath.appending(path)
-
-        let fileDescriptor = open((originalPath as NSString).utf8String!, flags, mode)
+        let fileDescriptor = withRelativePath(path) { openat(rootDescriptor, $0, flags, mode) }
 
         if fileDescriptor < 0 {
             throw NSError(posixErrorCode: errno)
         }
 
-        userData.pointee = NSNumber(value: fileDescriptor)
+        userData.pointee = LoopbackFileHandle(fileDescriptor: fileDescriptor)
     }
 
     // MARK: - Linking an Item
 
     override func linkItem(atPath path: String!, toPath otherPath: String!) throws {
-        let originalPath = (rootPath.appending(path) as NSString).utf8String!
-        let originalOtherPath = (rootPath.appending(otherPath) as NSString).utf8String!
-
+        generation += 1
         // We use link rather than the NSFileManager equivalent because it will copy
         // the file rather than hard link if part of the root path is a symlink.
-        if link(originalPath, originalOtherPath) < 0 {
+        let returnValue = withRelativePath(path) { originalPath in
+            withRelativePath(otherPath) { originalOtherPath in
+                linkat(rootDescriptor, originalPath, rootDescriptor, originalOtherPath, 0)
+            }
+        }
+        if returnValue < 0 {
             throw NSError(posixErrorCode: errno)
         }
     }
@@ -108,76 +198,87 @@ final class LoopbackFS: NSObject {
     // MARK: - Symbolic Links
 
     override func createSymbolicLink(atPath path: String!, withDestinationPath otherPath: String!) throws {
+        generation += 1
         let sourcePath = rootPath.appending(path)
         try FileManager.default.createSymbolicLink(atPath: sourcePath, withDestinationPath: otherPath)
     }
 
     override func destinationOfSymbolicLink(atPath path: String!) throws -> String {
-        let sourcePath = rootPath.appending(path)
-        return try FileManager.default.destinationOfSymbolicLink(atPath: sourcePath)
+        let capacity = Int(PATH_MAX)
+        var destination = [CChar](repeating: 0, count: capacity)
+        let length = withRelativePath(path) { readlinkat(rootDescriptor, $0, &destination, capacity) }
+        if length < 0 {
+            throw NSError(posixErrorCode: errno)
+        }
+        return FileManager.default.string(withFileSystemRepresentation: destination, length: length)
     }
 
     // MARK: - File Contents
 
     override func openFile(atPath path: String!, mode: Int32, userData: AutoreleasingUnsafeMutablePointer<AnyObject?>!) throws {
-        let originalPath = (rootPath.appending(path) as NSString).utf8String!
-
-        let fileDescriptor = open(originalPath, mode)
+        if mode & O_TRUNC != 0 {
+            generation += 1
+        }
+        let fileDescriptor = withRelativePath(path) { openat(rootDescriptor, $0, mode) }
 
         if fileDescriptor < 0 {
             throw NSError(posixErrorCode: errno)
         }
 
-        userData.pointee = NSNumber(value: fileDescriptor)
+        userData.pointee = LoopbackFileHandle(fileDescriptor: fileDescriptor)
     }
 
     override func releaseFile(atPath path: String!, userData: Any!) {
-        guard let num = userData as? NSNumber else {
+        guard let handle = userData as? LoopbackFileHandle else {
             return
         }
 
-        let fileDescriptor = num.int32Value
-        close(fileDescriptor)
+        handle.close()
     }
 
     override func readFile(atPath path: String!, userData: Any!, buffer: UnsafeMutablePointer<Int8>!, size: Int, offset: off_t, error: NSErrorPointer) -> Int32 {
-        guard let num = userData as? NSNumber else {
+        guard let handle = userData as? LoopbackFileHandle else {
             error?.pointee = NSError(posixErrorCode: EBADF)
             return -1
         }
 
-        let fileDescriptor = num.int32Value
-        let returnValue = Int32(pread(fileDescriptor, buffer, size, offset))
+        let returnValue = pread(handle.fileDescriptor, buffer, size, offset)
 
         if returnValue < 0 {
             error?.pointee = NSError(posixErrorCode: errno)
             return -1
         }
-        return returnValue
+        if offset == handle.nextReadOffset {
+            handle.sequentialReads += 1
+        } else {
+            handle.randomReads += 1
+        }
+        handle.nextReadOffset = offset + off_t(returnValue)
+        return Int32(returnValue)
     }
 
     override func writeFile(atPath path: String!, userData: Any!, buffer: UnsafePointer<Int8>!, size: Int, offset: off_t, error: NSErrorPointer) -> Int32 {
-        guard let num = userData as? NSNumber else {
+        generation += 1
+        guard let handle = userData as? LoopbackFileHandle else {
             error?.pointee = NSError(posixErrorCode: EBADF)
             return -1
         }
 
-        let fileDescriptor = num.int32Value
-
-        let returnValue = pwrite(fileDescriptor, buffer, size, offset)
+        let returnValue = pwrite(handle.fileDescriptor, buffer, size, offset)
         if returnValue < 0 {
             error?.pointee = NSError(posixErrorCode: errno)
+            return -1
         }
+        handle.isDirty = true
         return Int32(returnValue)
     }
 
     override func preallocateFile(atPath path: String!, userData: Any!, options: Int32, offset: off_t, length: off_t) throws {
-        guard let num = userData as? NSNumber else {
+        generation += 1
+        guard let handle = userData as? LoopbackFileHandle else {
             throw NSError(posixErrorCode: EBADF)
         }
 
-        let fileDescriptor = num.int32Value
-
         var fstore = fstore_t()
         if options & ALLOCATECONTIG == 1 {
             fstore.fst_flags = UInt32(F_ALLOCATECONTIG)
@@ -192,12 +293,13 @@ final class LoopbackFS: NSObject {
         }
         fstore.fst_offset = offset
         fstore.fst_length = length
-        if fcntl(fileDescriptor, F_PREALLOCATE, &fstore) == -1 {
+        if fcntl(handle.fileDescriptor, F_PREALLOCATE, &fstore) == -1 {
             throw NSError(posixErrorCode: errno)
         }
     }
 
     public override func exchangeDataOfItem(atPath path1: String!, withItemAtPath path2: String!) throws {
+        generation += 1
         let sourcePath = (rootPath.appending(path1) as NSString).utf8String!
         let destinationPath = (rootPath.appending(path2) as NSString).utf8String!
 
@@ -214,11 +316,73 @@ final class LoopbackFS: NSObject {
         return try FileManager.default.contentsOfDirectory(atPath: originalPath)
     }
 
+    override func contentsOfDirectory(atPath path: String!, includingAttributesForKeys keys: [Any]!) throws -> [Any] {
+        // One getattrlistbulk() pass returns the names and attributes together. The
+        // attributes are kept for the lookups that follow a listing.
+        let directoryDescriptor = withRelativePath(path) { openat(rootDescriptor, $0, O_RDONLY | O_DIRECTORY | O_CLOEXEC) }
+        if directoryDescriptor < 0 {
+            throw NSError(posixErrorCode: errno)
+        }
+        defer { close(directoryDescriptor) }
+
+        var attributeList = attrlist()
+        attributeList.bitmapcount = u_short(ATTR_BIT_MAP_COUNT)
+        attributeList.commonattr = BulkAttributes.common
+        attributeList.dirattr = BulkAttributes.directory
+        attributeList.fileattr = BulkAttributes.file
+
+        let buffer = UnsafeMutableRawPointer.allocate(byteCount: BulkAttributes.bufferSize, alignment: 8)
+        defer { buffer.deallocate() }
+
+        var contents: [GMDirectoryEntry] = []
+        var attributesByName: [String: [AnyHashable : Any]] = [:]
+        while true {
+            let count = getattrlistbulk(directoryDescriptor, &attributeList, buffer, BulkAttributes.bufferSize, 0)
+            if count < 0 {
+                throw NSError(posixErrorCode: errno)
+            }
+            if count == 0 {
+                break
+            }
+
+            var entry = UnsafeRawPointer(buffer)
+            for _ in 0..<count {
+                var st = stat()
+                let (name, complete) = parseBulkEntry(entry, into: &st)
+                entry += Int(entry.load(as: UInt32.self))
+                if !complete && fstatat(directoryDescriptor, name, &st, AT_SYMLINK_NOFOLLOW) < 0 {
+                    continue
+                }
+
+                let entryName = String(cString: name)
+                let attributes = fileAttributes(of: st)
+                contents.append(GMDirectoryEntry(name: entryName, attributes: attributes))
+                attributesByName[entryName] = attributes
+            }
+        }
+
+        rememberListing(attributesByName, ofDirectoryAtPath: path)
+        return contents
+    }
+
     // MARK: - Getting and Setting Attributes
 
     override func attributesOfItem(atPath path: String!, userData: Any!) throws -> [AnyHashable : Any] {
-        let originalPath = rootPath.appending(path)
-        return try FileManager.default.attributesOfItem(atPath: originalPath)
+        // A single lstat(), or fstat() on an open file. FileManager makes several
+        // system calls and boxes every attribute it knows, most of them unused.
+        var st = stat()
+        let returnValue: Int32
+        if let handle = userData as? LoopbackFileHandle {
+            returnValue = fstat(handle.fileDescriptor, &st)
+        } else if let attributes = listedAttributesOfItem(atPath: path) {
+            return attributes
+        } else {
+            returnValue = withRelativePath(path) { fstatat(rootDescriptor, $0, &st, AT_SYMLINK_NOFOLLOW) }
+        }
+        if returnValue < 0 {
+            throw NSError(posixErrorCode: errno)
+        }
+        return fileAttributes(of: st)
     }
 
     override func attributesOfFileSystem(forPath path: String!) throws -> [AnyHashable : Any] {
@@ -243,13 +407,19 @@ final class LoopbackFS: NSObject {
     }
 
     override func setAttributes(_ attributes: [AnyHashable : Any]!, ofItemAtPath path: String!, userData: Any!) throws {
+        generation += 1
         guard let attribs = attributes as? [FileAttributeKey: Any] else { throw NSError(posixErrorCode: EINVAL) }
 
         let originalPath = rootPath.appending(path)
 
         if let pathPointer = (originalPath as NSString).utf8String {
             if let offset = attributes[FileAttributeKey.size.rawValue] as? Int64 {
-                let ret = truncate(pathPointer, offset)
+                let ret: Int32
+                if let handle = userData as? LoopbackFileHandle {
+                    ret = ftruncate(handle.fileDescriptor, offset)
+                } else {
+                    ret = truncate(pathPointer, offset)
+                }
                 if ret < 0 {
                     throw NSError(posixErrorCode: errno)
                 }
@@ -277,57 +447,107 @@ final class LoopbackFS: NSObject {
             throw NSError(posixErrorCode: ENODEV)
         }
 
-        let originalUrl = URL(fileURLWithPath: rootPath.appending(path))
-
-        return try originalUrl.withUnsafeFileSystemRepresentation { fileSystemPath -> [String] in
-            let length = listxattr(fileSystemPath, nil, 0, 0)
-            guard length >= 0 else { throw NSError(posixErrorCode: errno) }
+        if let cached = cachedExtendedAttributes(ofItemAtPath: path) {
+            return cached.names
+        }
 
-            // Create buffer with required size:
-            var data = Data(count: length)
+        let originalUrl = URL(fileURLWithPath: rootPath.appending(path))
 
-            // Retrieve attribute list:
-            let count = data.count
-            let result = data.withUnsafeMutableBytes {
-                listxattr(fileSystemPath, $0.baseAddress?.assumingMemoryBound(to: Int8.self), count, XATTR_NOFOLLOW)
+        let names = try originalUrl.withUnsafeFileSystemRepresentation { fileSystemPath -> [String] in
+            // Fetch with the buffer at hand and probe for the size only if it is short.
+            let scratch = ScratchBuffer.current
+            defer { scratch.trim() }
+
+            var length = listxattr(fileSystemPath, scratch.bytes, scratch.capacity, XATTR_NOFOLLOW)
+            while length < 0 && errno == ERANGE {
+                let needed = listxattr(fileSystemPath, nil, 0, XATTR_NOFOLLOW)
+                guard needed >= 0 else { break }
+                scratch.reserve(needed)
+                length = listxattr(fileSystemPath, scratch.bytes, scratch.capacity, XATTR_NOFOLLOW)
             }
-            guard result >= 0 else { throw NSError(posixErrorCode: errno) }
+            guard length >= 0 else { throw NSError(posixErrorCode: errno) }
 
-            // Extract attribute names:
-            let list = data.split(separator: 0).compactMap {
-                String(data: Data($0), encoding: .utf8)
+            // The names are NUL-terminated UTF-8, so step over them by their length in bytes.
+            var names: [String] = []
+            var offset = 0
+            while offset < length {
+                let name = scratch.bytes + offset
+                let nameLength = strnlen(name, length - offset)
+                if let string = String(bytes: UnsafeRawBufferPointer(start: name, count: nameLength), encoding: .utf8) {
+                    names.append(string)
+                }
+                offset += nameLength + 1
             }
-            return list
+            return names
         }
+
+        rememberExtendedAttributes(names, ofItemAtPath: path)
+        return names
     }
 
     public override func value(ofExtendedAttribute name: String!, ofItemAtPath path: String!, position: off_t) throws -> Data {
+        // A resource fork is read in pieces, at a position. Values of other
+        // attributes are read whole, with the buffer at hand, and may be cached.
+        let whole = position == 0 && name != XATTR_RESOURCEFORK_NAME
+        let cached = whole ? cachedExtendedAttributes(ofItemAtPath: path) : nil
+        if let cached = cached {
+            if let value = cached.values[name] {
+                return value
+            }
+            if !cached.names.contains(name) {
+                throw NSError(posixErrorCode: ENOATTR)
+            }
+        }
+
         let originalUrl = URL(fileURLWithPath: rootPath.appending(path))
 
-        return try originalUrl.withUnsafeFileSystemRepresentation { fileSystemPath -> Data in
+        let value = try originalUrl.withUnsafeFileSystemRepresentation { fileSystemPath -> Data in
+            if !whole {
+                // Determine attribute size:
+                let length = getxattr(fileSystemPath, name, nil, 0, UInt32(position), XATTR_NOFOLLOW)
+                guard length >= 0 else {
+                    throw NSError(posixErrorCode: errno)
+                }
 
-            // Determine attribute size:
-            let length = getxattr(fileSystemPath, name, nil, 0, UInt32(position), XATTR_NOFOLLOW)
-            guard length >= 0 else {
-                throw NSError(posixErrorCode: errno)
+                // Create buffer with required size:
+                var data = Data(count: length)
+
+                // Retrieve attribute:
+                let count = data.count
+                let result = data.withUnsafeMutableBytes {
+                    getxattr(fileSystemPath, name, $0.baseAddress?.assumingMemoryBound(to: Int8.self), count, UInt32(position), XATTR_NOFOLLOW)
+                }
+                guard result >= 0 else {
+                    throw NSError(posixErrorCode: errno)
+                }
+                data.count = result
+                return data
             }
 
-            // Create buffer with required size:
-            var data = Data(count: length)
+            let scratch = ScratchBuffer.current
+            defer { scratch.trim() }
 
-            // Retrieve attribute:
-            let count = data.count
-            let result = data.withUnsafeMutableBytes {
-                getxattr(fileSystemPath, name, $0.baseAddress?.assumingMemoryBound(to: Int8.self), count, UInt32(position), XATTR_NOFOLLOW)
+            var length = getxattr(fileSystemPath, name, scratch.bytes, scratch.capacity, 0, XATTR_NOFOLLOW)
+            while length < 0 && errno == ERANGE {
+                let needed = getxattr(fileSystemPath, name, nil, 0, 0, XATTR_NOFOLLOW)
+                guard needed >= 0 else { break }
+                scratch.reserve(needed)
+                length = getxattr(fileSystemPath, name, scratch.bytes, scratch.capacity, 0, XATTR_NOFOLLOW)
             }
-            guard result >= 0 else {
+            guard length >= 0 else {
                 throw NSError(posixErrorCode: errno)
             }
-            return data
+            return Data(bytes: scratch.bytes, count: length)
+        }
+
+        if let cached = cached, value.count <= ExtendedAttributes.maxValueSize {
+            cached.values[name] = value
         }
+        return value
     }
 
     public override func setExtendedAttribute(_ name: String!, ofItemAtPath path: String!, value: Data!, position: off_t, options: Int32) throws {
+        generation += 1
         let originalUrl = URL(fileURLWithPath: rootPath.appending(path))
 
         try originalUrl.withUnsafeFileSystemRepresentation { fileSystemPath in
@@ -345,6 +565,7 @@ final class LoopbackFS: NSObject {
     }
 
     public override func removeExtendedAttribute(_ name: String!, ofItemAtPath path: String!) throws {
+        generation += 1
         let originalUrl = URL(fileURLWithPath: rootPath.appending(path))
 
         try originalUrl.withUnsafeFileSystemRepresentation { fileSystemPath in
@@ -354,6 +575,271 @@ final class LoopbackFS: NSObject {
     }
 }
 
+// The attribute keys of GMUserFileSystem, created once.
+fileprivate enum UserFileSystemKey {
+    static let changeDate = FileAttributeKey(rawValue: kGMUserFileSystemFileChangeDateKey)
+    static let accessDate = FileAttributeKey(rawValue: kGMUserFileSystemFileAccessDateKey)
+    static let flags = FileAttributeKey(rawValue: kGMUserFileSystemFileFlagsKey)
+    static let sizeInBlocks = FileAttributeKey(rawValue: kGMUserFileSystemFileSizeInBlocksKey)
+}
+
+fileprivate func date(of time: timespec) -> Date {
+    return Date(timeIntervalSince1970: TimeInterval(time.tv_sec) + TimeInterval(time.tv_nsec) / 1e9)
+}
+
+// Builds the attributes that GMUserFileSystem uses straight from a stat structure.
+fileprivate func fileAttributes(of st: stat) -> [AnyHashable : Any] {
+    let type: FileAttributeType
+    switch st.st_mode & S_IFMT {
+    case S_IFDIR: type = .typeDirectory
+    case S_IFREG: type = .typeRegular
+    case S_IFLNK: type = .typeSymbolicLink
+    case S_IFCHR: type = .typeCharacterSpecial
+    case S_IFBLK: type = .typeBlockSpecial
+    case S_IFSOCK: type = .typeSocket
+    default: type = .typeUnknown
+    }
+
+    var attributes = [AnyHashable : Any](minimumCapacity: 13)
+    attributes[FileAttributeKey.type] = type
+    attributes[FileAttributeKey.posixPermissions] = NSNumber(value: st.st_mode & 0o7777)
+    attributes[FileAttributeKey.referenceCount] = NSNumber(value: st.st_nlink)
+    attributes[FileAttributeKey.ownerAccountID] = NSNumber(value: st.st_uid)
+    attributes[FileAttributeKey.groupOwnerAccountID] = NSNumber(value: st.st_gid)
+    attributes[FileAttributeKey.size] = NSNumber(value: st.st_size)
+    attributes[FileAttributeKey.systemFileNumber] = NSNumber(value: st.st_ino)
+    attributes[FileAttributeKey.modificationDate] = date(of: st.st_mtimespec)
+    attributes[FileAttributeKey.creationDate] = date(of: st.st_birthtimespec)
+    attributes[UserFileSystemKey.changeDate] = date(of: st.st_ctimespec)
+    attributes[UserFileSystemKey.accessDate] = date(of: st.st_atimespec)
+    attributes[UserFileSystemKey.flags] = NSNumber(value: st.st_flags)
+    if type == .typeCharacterSpecial || type == .typeBlockSpecial {
+        attributes[FileAttributeKey.deviceIdentifier] = NSNumber(value: st.st_rdev)
+    } else {
+        attributes[UserFileSystemKey.sizeInBlocks] = NSNumber(value: st.st_blocks)
+    }
+    return attributes
+}
+
+// An open file. GMUserFileSystem passes it back as the userData of every call
+// on the file, so reads and writes need neither a path nor a boxed descriptor.
+// The access statistics and the dirty flag are kept for read-ahead and
+// write-back; nothing acts on them yet.
+fileprivate final class LoopbackFileHandle {
+    private(set) var fileDescriptor: Int32
+
+    // Where a sequential read continues.
+    var nextReadOffset: off_t = 0
+    var sequentialReads: UInt64 = 0
+    var randomReads: UInt64 = 0
+
+    // Written since it was opened.
+    var isDirty = false
+
+    init(fileDescriptor: Int32) {
+        self.fileDescriptor = fileDescriptor
+    }
+
+    deinit {
+        close()
+    }
+
+    func close() {
+        if fileDescriptor >= 0 {
+            Darwin.close(fileDescriptor)
+            fileDescriptor = -1
+        }
+    }
+}
+
+// The extended attributes of an item, kept when cachesExtendedAttributes is
+// set. values fills in as they are read.
+fileprivate final class ExtendedAttributes {
+    static let lifetime: CFTimeInterval = 1.0
+    static let maxCount = 64
+
+    // Values larger than this are not cached.
+    static let maxValueSize = 4096
+
+    let names: [String]
+    var values: [String: Data] = [:]
+    let expires: CFAbsoluteTime
+    let generation: UInt64
+
+    init(names: [String], expires: CFAbsoluteTime, generation: UInt64) {
+        self.names = names
+        self.expires = expires
+        self.generation = generation
+    }
+}
+
+// Every thread keeps a buffer for the xattr calls. A call is tried with it
+// first, so the usual case needs neither a size probe nor an allocation.
+fileprivate final class ScratchBuffer {
+    static let initialCapacity = 4096
+
+    // Buffers grown beyond this for an unusually large value are given back.
+    static let maxCapacity = 64 * 1024
+
+    private static let key: pthread_key_t = {
+        var key = pthread_key_t()
+        pthread_key_create(&key) { Unmanaged<ScratchBuffer>.fromOpaque($0).release() }
+        return key
+    }()
+
+    static var current: ScratchBuffer {
+        if let pointer = pthread_getspecific(key) {
+            return Unmanaged<ScratchBuffer>.fromOpaque(pointer).takeUnretainedValue()
+        }
+        let buffer = ScratchBuffer()
+        pthread_setspecific(key, Unmanaged.passRetained(buffer).toOpaque())
+        return buffer
+    }
+
+    private(set) var bytes: UnsafeMutablePointer<CChar>
+    private(set) var capacity: Int
+
+    private init() {
+        capacity = ScratchBuffer.initialCapacity
+        bytes = .allocate(capacity: capacity)
+    }
+
+    deinit {
+        bytes.deallocate()
+    }
+
+    func reserve(_ size: Int) {
+        if size > capacity {
+            bytes.deallocate()
+            capacity = size
+            bytes = .allocate(capacity: capacity)
+        }
+    }
+
+    func trim() {
+        if capacity > ScratchBuffer.maxCapacity {
+            bytes.deallocate()
+            capacity = ScratchBuffer.initialCapacity
+            bytes = .allocate(capacity: capacity)
+        }
+    }
+}
+
+// The attributes of the entries of a directory, as of its last listing.
+fileprivate struct Listing {
+    static let lifetime: CFTimeInterval = 1.0
+    static let maxCount = 16
+
+    let attributes: [String: [AnyHashable : Any]]
+    let expires: CFAbsoluteTime
+    let generation: UInt64
+}
+
+// Attributes fetched with getattrlistbulk(), enough to fill a stat structure.
+fileprivate enum BulkAttributes {
+    static let common = attrgroup_t(ATTR_CMN_RETURNED_ATTRS) | attrgroup_t(ATTR_CMN_NAME) |
+        attrgroup_t(ATTR_CMN_OBJTYPE) | attrgroup_t(ATTR_CMN_CRTIME) |
+        attrgroup_t(ATTR_CMN_MODTIME) | attrgroup_t(ATTR_CMN_CHGTIME) |
+        attrgroup_t(ATTR_CMN_ACCTIME) | attrgroup_t(ATTR_CMN_OWNERID) |
+        attrgroup_t(ATTR_CMN_GRPID) | attrgroup_t(ATTR_CMN_ACCESSMASK) |
+        attrgroup_t(ATTR_CMN_FLAGS) | attrgroup_t(ATTR_CMN_FILEID) |
+        attrgroup_t(ATTR_CMN_ERROR)
+    static let directory = attrgroup_t(ATTR_DIR_LINKCOUNT) | attrgroup_t(ATTR_DIR_ALLOCSIZE) |
+        attrgroup_t(ATTR_DIR_DATALENGTH)
+    static let file = attrgroup_t(ATTR_FILE_LINKCOUNT) | attrgroup_t(ATTR_FILE_DEVTYPE) |
+        attrgroup_t(ATTR_FILE_DATALENGTH) | attrgroup_t(ATTR_FILE_DATAALLOCSIZE)
+    static let bufferSize = 128 * 1024
+}
+
+// Reads the attributes of a getattrlistbulk() entry in order. They are packed
+// without regard to their alignment.
+fileprivate struct BulkEntryReader {
+    private(set) var position: UnsafeRawPointer
+
+    init(_ position: UnsafeRawPointer) {
+        self.position = position
+    }
+
+    mutating func read<T>(into value: inout T) {
+        let source = position
+        withUnsafeMutableBytes(of: &value) { bytes in
+            bytes.copyMemory(from: UnsafeRawBufferPointer(start: source, count: bytes.count))
+        }
+        position += MemoryLayout<T>.size
+    }
+}
+
+// Decodes one getattrlistbulk() entry. complete is false if attributes are missing.
+fileprivate func parseBulkEntry(_ entry: UnsafeRawPointer, into st: inout stat) -> (name: UnsafePointer<CChar>, complete: Bool) {
+    var reader = BulkEntryReader(entry + MemoryLayout<UInt32>.size)
+
+    var returned = attribute_set_t()
+    reader.read(into: &returned)
+    var error: UInt32 = 0
+    if returned.commonattr & attrgroup_t(ATTR_CMN_ERROR) != 0 {
+        reader.read(into: &error)
+    }
+    let nameReferencePosition = reader.position
+    var nameReference = attrreference_t()
+    reader.read(into: &nameReference)
+    let name = (nameReferencePosition + Int(nameReference.attr_dataoffset)).assumingMemoryBound(to: CChar.self)
+
+    let required = BulkAttributes.common & ~attrgroup_t(ATTR_CMN_ERROR)
+    guard error == 0, returned.commonattr & required == required else {
+        return (name, false)
+    }
+
+    var type: fsobj_type_t = 0
+    var accessMask: UInt32 = 0
+    reader.read(into: &type)
+    reader.read(into: &st.st_birthtimespec)
+    reader.read(into: &st.st_mtimespec)
+    reader.read(into: &st.st_ctimespec)
+    reader.read(into: &st.st_atimespec)
+    reader.read(into: &st.st_uid)
+    reader.read(into: &st.st_gid)
+    reader.read(into: &accessMask)
+    reader.read(into: &st.st_flags)
+    reader.read(into: &st.st_ino)
+
+    let fileType: mode_t
+    switch type {
+    case VREG.rawValue: fileType = S_IFREG
+    case VDIR.rawValue: fileType = S_IFDIR
+    case VBLK.rawValue: fileType = S_IFBLK
+    case VCHR.rawValue: fileType = S_IFCHR
+    case VLNK.rawValue: fileType = S_IFLNK
+    case VSOCK.rawValue: fileType = S_IFSOCK
+    case VFIFO.rawValue: fileType = S_IFIFO
+    default: return (name, false)
+    }
+    st.st_mode = mode_t(truncatingIfNeeded: accessMask) & ~S_IFMT | fileType
+
+    var linkCount: UInt32 = 0
+    var allocationSize: off_t = 0
+    if type == VDIR.rawValue {
+        guard returned.dirattr == BulkAttributes.directory else {
+            return (name, false)
+        }
+        reader.read(into: &linkCount)
+        reader.read(into: &allocationSize)
+        reader.read(into: &st.st_size)
+    } else {
+        guard returned.fileattr == BulkAttributes.file else {
+            return (name, false)
+        }
+        var deviceType: UInt32 = 0
+        reader.read(into: &linkCount)
+        reader.read(into: &deviceType)
+        reader.read(into: &st.st_size)
+        reader.read(into: &allocationSize)
+        st.st_rdev = dev_t(bitPattern: deviceType)
+    }
+    st.st_nlink = nlink_t(truncatingIfNeeded: linkCount)
+    st.st_blocks = blkcnt_t(allocationSize / 512)
+    return (name, true)
+}
+
 // Helper function inserted by Swift 4.2 migrator.
 fileprivate func convertToOptionalFileAttributeKeyDictionary(_ input: [String: Any]?) -> [FileAttributeKey: Any]? {
 	guard let input = input else { return nil }